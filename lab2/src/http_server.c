@@ -4,6 +4,7 @@
 #include "file_handler.h"
 #include "mime_types.h"
 #include "thread_pool.h"
+#include "request_trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -94,6 +95,7 @@ int http_server_start(HttpServer *server)
             if (client_data)
             {
                 client_data->client_sock = client_sock;
+                client_data->accepted_at = trace_now();
                 strncpy(client_data->root_dir, server->root_dir, sizeof(client_data->root_dir) - 1);
                 client_data->root_dir[sizeof(client_data->root_dir) - 1] = '\0';
 
@@ -151,30 +153,37 @@ int http_handle_request(SOCKET client_sock, const char *root_dir)
     }
 
     buffer[bytes_received] = '\0';
+    request_trace_mark(TRACE_PHASE_RECEIVED);
     printf("Received request:\n%s\n", buffer);
 
     HttpRequest req;
     if (parse_http_request(buffer, bytes_received, &req) != 0)
     {
         printf("Failed to parse HTTP request\n");
+        request_trace_set_status(400);
         const char *response = "HTTP/1.1 400 Bad Request\r\n"
                                "Content-Type: text/plain\r\n"
                                "Content-Length: 11\r\n"
                                "\r\n"
                                "Bad Request";
         send(client_sock, response, (int)strlen(response), 0);
+        request_trace_mark(TRACE_PHASE_SENT);
         return -1;
     }
 
+    request_trace_set_uri(req.uri);
+
     if (strcmp(req.method, "GET") != 0)
     {
         printf("Unsupported HTTP method: %s\n", req.method);
+        request_trace_set_status(405);
         const char *response = "HTTP/1.1 405 Method Not Allowed\r\n"
                                "Content-Type: text/plain\r\n"
                                "Content-Length: 18\r\n"
                                "\r\n"
                                "Method Not Allowed";
         send(client_sock, response, (int)strlen(response), 0);
+        request_trace_mark(TRACE_PHASE_SENT);
         return -1;
     }
 
@@ -182,15 +191,18 @@ int http_handle_request(SOCKET client_sock, const char *root_dir)
     if (extract_filename_from_uri(req.uri, filename, sizeof(filename)) != 0)
     {
         printf("Failed to extract filename from URI: %s\n", req.uri);
+        request_trace_set_status(400);
         const char *response = "HTTP/1.1 400 Bad Request\r\n"
                                "Content-Type: text/plain\r\n"
                                "Content-Length: 11\r\n"
                                "\r\n"
                                "Bad Request";
         send(client_sock, response, (int)strlen(response), 0);
+        request_trace_mark(TRACE_PHASE_SENT);
         return -1;
     }
 
+    request_trace_mark(TRACE_PHASE_PARSED);
     printf("Requested URI: %s, Extracted filename: '%s'\n", req.uri, filename);
 
     if (strcmp(filename, "") == 0 || strcmp(filename, "/") == 0)
@@ -205,12 +217,14 @@ int http_handle_request(SOCKET client_sock, const char *root_dir)
     if (resolve_filepath(root_dir, filename, resolved_path, sizeof(resolved_path)) != 0)
     {
         printf("Failed to resolve file path for: %s\n", filename);
+        request_trace_set_status(404);
         const char *response = "HTTP/1.1 404 Not Found\r\n"
                                "Content-Type: text/plain\r\n"
                                "Content-Length: 14\r\n"
                                "\r\n"
                                "File Not Found";
         send(client_sock, response, (int)strlen(response), 0);
+        request_trace_mark(TRACE_PHASE_SENT);
         return -1;
     }
 
@@ -221,12 +235,14 @@ int http_handle_request(SOCKET client_sock, const char *root_dir)
     if (get_file_info(resolved_path, &file_info) != 0 || !file_info.exists)
     {
         printf("File not found: %s\n", resolved_path);
+        request_trace_set_status(404);
         const char *response = "HTTP/1.1 404 Not Found\r\n"
                                "Content-Type: text/plain\r\n"
                                "Content-Length: 14\r\n"
                                "\r\n"
                                "File Not Found";
         send(client_sock, response, (int)strlen(response), 0);
+        request_trace_mark(TRACE_PHASE_SENT);
         return -1;
     }
 
@@ -235,29 +251,37 @@ int http_handle_request(SOCKET client_sock, const char *root_dir)
     if (!is_safe_path(root_dir, resolved_path))
     {
         printf("Unsafe file path access attempt: %s\n", resolved_path);
+        request_trace_set_status(403);
         const char *response = "HTTP/1.1 403 Forbidden\r\n"
                                "Content-Type: text/plain\r\n"
                                "Content-Length: 9\r\n"
                                "\r\n"
                                "Forbidden";
         send(client_sock, response, (int)strlen(response), 0);
+        request_trace_mark(TRACE_PHASE_SENT);
         return -1;
     }
 
+    request_trace_mark(TRACE_PHASE_RESOLVED);
+
     char *file_content = NULL;
     size_t file_size = 0;
     if (read_file_content(resolved_path, &file_content, &file_size) != 0)
     {
         printf("Failed to read file: %s\n", resolved_path);
+        request_trace_set_status(500);
         const char *response = "HTTP/1.1 500 Internal Server Error\r\n"
                                "Content-Type: text/plain\r\n"
                                "Content-Length: 21\r\n"
                                "\r\n"
                                "Internal Server Error";
         send(client_sock, response, (int)strlen(response), 0);
+        request_trace_mark(TRACE_PHASE_SENT);
         return -1;
     }
 
+    request_trace_mark(TRACE_PHASE_FILE_READ);
+
     const char *mime_type = get_mime_type(resolved_path);
 
     char header[512];
@@ -272,7 +296,9 @@ int http_handle_request(SOCKET client_sock, const char *root_dir)
     {
         send(client_sock, header, header_len, 0);
         send(client_sock, file_content, (int)file_size, 0);
+        request_trace_set_status(200);
     }
+    request_trace_mark(TRACE_PHASE_SENT);
 
     free(file_content);
 
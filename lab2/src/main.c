@@ -3,16 +3,44 @@
 #include <string.h>
 #include "socket.h"
 #include "http_server.h"
+#include "request_trace.h"
 #include <direct.h>
 #define getcwd _getcwd
 
-static int parse_args(int argc, char **argv, int *port, char *root_dir, size_t root_dir_size)
+#define DEFAULT_SLOW_THRESHOLD_MS 50.0
+#define DEFAULT_SLOW_LOG "slow_requests.log"
+
+static int parse_args(int argc, char **argv, int *port, char *root_dir, size_t root_dir_size,
+                      double *slow_threshold_ms, const char **slow_log_path, int *slow_sample_every)
 {
-    if (argc != 3)
+    if (argc < 3 || argc > 6)
     {
         return 0;
     }
 
+    if (argc >= 4)
+    {
+        *slow_threshold_ms = atof(argv[3]);
+        if (*slow_threshold_ms < 0.0)
+        {
+            printf("Slow request threshold must be non-negative\n");
+            return 0;
+        }
+    }
+    if (argc >= 5)
+    {
+        *slow_log_path = argv[4];
+    }
+    if (argc == 6)
+    {
+        *slow_sample_every = atoi(argv[5]);
+        if (*slow_sample_every <= 0)
+        {
+            printf("Slow request sample rate must be positive\n");
+            return 0;
+        }
+    }
+
     *port = atoi(argv[1]);
     if (*port <= 1023)
     {
@@ -49,11 +77,15 @@ int main(int argc, char **argv)
 {
     int port = 0;
     char root_dir[256] = {0};
+    double slow_threshold_ms = DEFAULT_SLOW_THRESHOLD_MS;
+    const char *slow_log_path = DEFAULT_SLOW_LOG;
+    int slow_sample_every = 1;
 
-    if (!parse_args(argc, argv, &port, root_dir, sizeof(root_dir)))
+    if (!parse_args(argc, argv, &port, root_dir, sizeof(root_dir),
+                    &slow_threshold_ms, &slow_log_path, &slow_sample_every))
     {
-        printf("Usage: %s <port> <root_directory>\n", argv[0]);
-        printf("Example: %s 8080 ./www\n", argv[0]);
+        printf("Usage: %s <port> <root_directory> [slow_threshold_ms] [slow_log_file] [sample_every]\n", argv[0]);
+        printf("Example: %s 8080 ./www 50 slow_requests.log 1\n", argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -71,6 +103,8 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    request_trace_init(slow_log_path, slow_threshold_ms, slow_sample_every);
+
     printf("Starting HTTP server on port %d, serving directory: %s\n", port, root_dir);
     printf("Press Ctrl+C to stop server\n");
 
@@ -78,11 +112,13 @@ int main(int argc, char **argv)
     {
         printf("Failed to start HTTP server\n");
         http_server_close(&server);
+        request_trace_shutdown();
         socket_cleanup();
         return EXIT_FAILURE;
     }
 
     http_server_close(&server);
+    request_trace_shutdown();
     socket_cleanup();
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "request_trace.h"
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#include <x86intrin.h>
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+static const char *phase_names[TRACE_PHASE_COUNT] = {
+    "accept",
+    "queue",
+    "recv",
+    "parse",
+    "resolve",
+    "file_io",
+    "send",
+};
+
+static FILE *slow_log = NULL;
+static CRITICAL_SECTION slow_log_lock;
+static double ticks_per_ms = 0.0;
+static unsigned long long threshold_ticks = 0;
+static LONG sample_every = 1;
+static volatile LONG slow_seen = 0;
+
+// Each worker owns its trace buffer, so marking a phase never takes a lock.
+static TRACE_THREAD_LOCAL RequestTrace current_trace;
+static TRACE_THREAD_LOCAL int trace_active = 0;
+
+unsigned long long trace_now(void)
+{
+    return __rdtsc();
+}
+
+static double calibrate_ticks_per_ms(void)
+{
+    LARGE_INTEGER freq, qpc_start, qpc_end;
+    if (!QueryPerformanceFrequency(&freq) || freq.QuadPart == 0)
+        return 0.0;
+
+    QueryPerformanceCounter(&qpc_start);
+    unsigned long long tsc_start = __rdtsc();
+    Sleep(20);
+    QueryPerformanceCounter(&qpc_end);
+    unsigned long long tsc_end = __rdtsc();
+
+    double elapsed_ms = (double)(qpc_end.QuadPart - qpc_start.QuadPart) * 1000.0 / (double)freq.QuadPart;
+    if (elapsed_ms <= 0.0)
+        return 0.0;
+
+    return (double)(tsc_end - tsc_start) / elapsed_ms;
+}
+
+int request_trace_init(const char *slow_log_path, double threshold_ms, int every)
+{
+    if (!slow_log_path || threshold_ms < 0.0)
+        return -1;
+
+    ticks_per_ms = calibrate_ticks_per_ms();
+    if (ticks_per_ms <= 0.0)
+    {
+        printf("Failed to calibrate TSC clock, request tracing disabled\n");
+        return -1;
+    }
+
+    slow_log = fopen(slow_log_path, "a");
+    if (!slow_log)
+    {
+        printf("Failed to open slow request log: %s\n", slow_log_path);
+        return -1;
+    }
+
+    InitializeCriticalSection(&slow_log_lock);
+    threshold_ticks = (unsigned long long)(threshold_ms * ticks_per_ms);
+    sample_every = every > 0 ? every : 1;
+
+    printf("Request tracing enabled: threshold %.1f ms, 1 of %ld slow requests logged to %s\n",
+           threshold_ms, (long)sample_every, slow_log_path);
+    return 0;
+}
+
+void request_trace_shutdown(void)
+{
+    if (!slow_log)
+        return;
+
+    EnterCriticalSection(&slow_log_lock);
+    fclose(slow_log);
+    slow_log = NULL;
+    LeaveCriticalSection(&slow_log_lock);
+    DeleteCriticalSection(&slow_log_lock);
+}
+
+void request_trace_begin(unsigned long long accepted_at)
+{
+    memset(&current_trace, 0, sizeof(current_trace));
+    current_trace.stamps[TRACE_PHASE_DEQUEUED] = trace_now();
+    current_trace.stamps[TRACE_PHASE_ACCEPTED] = accepted_at ? accepted_at : current_trace.stamps[TRACE_PHASE_DEQUEUED];
+    trace_active = 1;
+}
+
+void request_trace_mark(TracePhase phase)
+{
+    if (trace_active && phase < TRACE_PHASE_COUNT)
+        current_trace.stamps[phase] = trace_now();
+}
+
+void request_trace_set_uri(const char *uri)
+{
+    if (!trace_active || !uri)
+        return;
+
+    strncpy(current_trace.uri, uri, sizeof(current_trace.uri) - 1);
+    current_trace.uri[sizeof(current_trace.uri) - 1] = '\0';
+}
+
+void request_trace_set_status(int status_code)
+{
+    if (trace_active)
+        current_trace.status_code = status_code;
+}
+
+static void write_slow_entry(const RequestTrace *trace, unsigned long long end)
+{
+    char line[1024];
+    int len = 0;
+
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+    len += snprintf(line + len, sizeof(line) - len,
+                    "%04d-%02d-%02d %02d:%02d:%02d.%03d total=%.3fms",
+                    now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond,
+                    now.wMilliseconds,
+                    (double)(end - trace->stamps[TRACE_PHASE_ACCEPTED]) / ticks_per_ms);
+
+    // A phase that was never reached (error path) is printed as '-'.
+    unsigned long long prev = trace->stamps[TRACE_PHASE_ACCEPTED];
+    for (int i = TRACE_PHASE_DEQUEUED; i < TRACE_PHASE_COUNT && len < (int)sizeof(line); i++)
+    {
+        if (trace->stamps[i] == 0)
+        {
+            len += snprintf(line + len, sizeof(line) - len, " %s=-", phase_names[i]);
+            continue;
+        }
+        len += snprintf(line + len, sizeof(line) - len, " %s=%.3fms",
+                        phase_names[i], (double)(trace->stamps[i] - prev) / ticks_per_ms);
+        prev = trace->stamps[i];
+    }
+
+    if (len < (int)sizeof(line))
+    {
+        snprintf(line + len, sizeof(line) - len, " status=%d uri=%s\n",
+                 trace->status_code, trace->uri[0] ? trace->uri : "-");
+    }
+
+    EnterCriticalSection(&slow_log_lock);
+    if (slow_log)
+    {
+        fputs(line, slow_log);
+        fflush(slow_log);
+    }
+    LeaveCriticalSection(&slow_log_lock);
+}
+
+void request_trace_end(void)
+{
+    if (!trace_active)
+        return;
+    trace_active = 0;
+
+    if (!slow_log)
+        return;
+
+    unsigned long long end = trace_now();
+    if (end - current_trace.stamps[TRACE_PHASE_ACCEPTED] < threshold_ticks)
+        return;
+
+    if (InterlockedIncrement(&slow_seen) % sample_every != 0)
+        return;
+
+    write_slow_entry(&current_trace, end);
+}
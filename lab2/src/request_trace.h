@@ -0,0 +1,36 @@
+#ifndef REQUEST_TRACE_H
+#define REQUEST_TRACE_H
+
+// Phase stamps are raw TSC ticks; they are converted to milliseconds only
+// when a slow request is dumped, so marking a phase costs one rdtsc.
+typedef enum TracePhase
+{
+    TRACE_PHASE_ACCEPTED = 0, // accept() returned, task queued to ThreadPool
+    TRACE_PHASE_DEQUEUED,     // worker picked the task up
+    TRACE_PHASE_RECEIVED,     // request bytes received
+    TRACE_PHASE_PARSED,       // request line parsed, filename extracted
+    TRACE_PHASE_RESOLVED,     // path resolved, file stat'ed and checked
+    TRACE_PHASE_FILE_READ,    // file content loaded into memory
+    TRACE_PHASE_SENT,         // response written to the socket
+    TRACE_PHASE_COUNT
+} TracePhase;
+
+typedef struct RequestTrace
+{
+    unsigned long long stamps[TRACE_PHASE_COUNT];
+    int status_code;
+    char uri[128];
+} RequestTrace;
+
+unsigned long long trace_now(void);
+
+int request_trace_init(const char *slow_log_path, double threshold_ms, int sample_every);
+void request_trace_shutdown(void);
+
+void request_trace_begin(unsigned long long accepted_at);
+void request_trace_mark(TracePhase phase);
+void request_trace_set_uri(const char *uri);
+void request_trace_set_status(int status_code);
+void request_trace_end(void);
+
+#endif // REQUEST_TRACE_H
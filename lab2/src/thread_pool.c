@@ -1,5 +1,6 @@
 #include "thread_pool.h"
 #include "http_server.h"
+#include "request_trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -164,8 +165,12 @@ void handle_client(void *arg)
 
     if (client_data)
     {
+        request_trace_begin(client_data->accepted_at);
+
         http_handle_request(client_data->client_sock, client_data->root_dir);
 
+        request_trace_end();
+
         closesocket(client_data->client_sock);
 
         free(client_data);
@@ -27,6 +27,7 @@ typedef struct ClientData
 {
     SOCKET client_sock;
     char root_dir[256];
+    unsigned long long accepted_at;
 } ClientData;
 
 ThreadPool *thread_pool_create(int thread_count);
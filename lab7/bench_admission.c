@@ -0,0 +1,222 @@
+/*
+ * Воспроизведение трассы запросов на модели дискового кэша: тот же индекс с
+ * GDSF и то же вытеснение пачками от EVICT_HIGH_PERCENT до
+ * EVICT_LOW_PERCENT, что у вытеснителя, с допуском всех объектов и с
+ * TinyLFU. Без файла трасса синтетическая: популярные объекты по закону
+ * Ципфа вперемешку с одноразовыми URL (обход краулера).
+ *
+ *   make bench && ./bench_admission [трасса] [объём кэша, МБ]
+ *
+ * Строка трассы: ключ и, через пробел, размер объекта в байтах.
+ */
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache_admission.h"
+#include "cache_evictor.h"
+#include "cache_index.h"
+
+#define SYNTH_REQUESTS 2000000
+#define SYNTH_POPULAR 200000
+#define SYNTH_ZIPF 0.9
+#define SYNTH_ONE_HIT_PERCENT 30
+#define DEFAULT_CAPACITY_MB 512
+#define VICTIM_SAMPLES 8
+
+typedef struct {
+    uint64_t hash;
+    long long size;
+} trace_entry_t;
+
+typedef struct {
+    const char *name;
+    unsigned long long hits;
+    unsigned long long hit_bytes;
+    unsigned long long request_bytes;
+    unsigned long long writes;
+    unsigned long long written_bytes;
+    unsigned long long rejected;
+} replay_result_t;
+
+static uint64_t fnv1a(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double rng_unit(void) {
+    return (double)(rng_next() >> 11) / 9007199254740992.0;
+}
+
+/* Размер от 1 КБ до 256 КБ, равномерно по логарифму; у ключа всегда один. */
+static long long size_of_key(uint64_t key) {
+    double u = (double)((key * 0x9e3779b97f4a7c15ULL) >> 11) / 9007199254740992.0;
+    return (long long)(1024.0 * pow(256.0, u));
+}
+
+static trace_entry_t *synth_trace(size_t *count) {
+    double *cdf = (double *)malloc(SYNTH_POPULAR * sizeof(double));
+    trace_entry_t *t = (trace_entry_t *)malloc(SYNTH_REQUESTS * sizeof(trace_entry_t));
+    if (!cdf || !t) {
+        free(cdf);
+        free(t);
+        return NULL;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < SYNTH_POPULAR; i++) {
+        sum += 1.0 / pow((double)(i + 1), SYNTH_ZIPF);
+        cdf[i] = sum;
+    }
+    uint64_t unique = 0;
+    for (size_t i = 0; i < SYNTH_REQUESTS; i++) {
+        uint64_t key;
+        if (rng_next() % 100 < SYNTH_ONE_HIT_PERCENT) {
+            key = (1ULL << 40) + unique++;
+        } else {
+            double x = rng_unit() * sum;
+            size_t lo = 0;
+            size_t hi = SYNTH_POPULAR - 1;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (cdf[mid] < x) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            key = lo + 1;
+        }
+        t[i].hash = key * 0xff51afd7ed558ccdULL;
+        t[i].size = size_of_key(key);
+    }
+    free(cdf);
+    *count = SYNTH_REQUESTS;
+    return t;
+}
+
+static trace_entry_t *load_trace(const char *path, size_t *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return NULL;
+    }
+    size_t cap = 1024;
+    size_t n = 0;
+    trace_entry_t *t = (trace_entry_t *)malloc(cap * sizeof(*t));
+    char line[8192];
+    while (t && fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, " \t\r\n");
+        if (len == 0) {
+            continue;
+        }
+        long long size = atoll(line + len);
+        if (n == cap) {
+            cap *= 2;
+            trace_entry_t *nt = (trace_entry_t *)realloc(t, cap * sizeof(*t));
+            if (!nt) {
+                break;
+            }
+            t = nt;
+        }
+        t[n].hash = fnv1a(line, len);
+        t[n].size = size > 0 ? size : 8192;
+        n++;
+    }
+    fclose(f);
+    *count = n;
+    return t;
+}
+
+static int victim_cmp(const void *a, const void *b) {
+    const cache_index_victim_t *x = (const cache_index_victim_t *)a;
+    const cache_index_victim_t *y = (const cache_index_victim_t *)b;
+    return (x->priority > y->priority) - (x->priority < y->priority);
+}
+
+/* Вытеснение как у cache_evictor: при переходе верхней границы — до нижней по возрастанию приоритета. */
+static void evict(cache_index_t *index, long long low) {
+    cache_index_victim_t *victims = NULL;
+    size_t n = cache_index_snapshot(index, 1, NULL, NULL, &victims);
+    qsort(victims, n, sizeof(*victims), victim_cmp);
+    for (size_t i = 0; i < n && cache_index_bytes(index) > low; i++) {
+        cache_index_evict(index, victims[i].hash, victims[i].stored_at, 1, NULL, NULL);
+    }
+    free(victims);
+}
+
+static void replay(const trace_entry_t *t, size_t count, long long capacity, int tinylfu, replay_result_t *r) {
+    cache_index_t *index = cache_index_create();
+    cache_admission_t *admission = tinylfu ? cache_admission_create((size_t)(capacity / 32768)) : NULL;
+    long long high = capacity / 100 * EVICT_HIGH_PERCENT;
+    long long low = capacity / 100 * EVICT_LOW_PERCENT;
+    cache_meta_t meta;
+    memset(&meta, 0, sizeof(meta));
+    meta.stored_at = 1;
+
+    for (size_t i = 0; i < count; i++) {
+        r->request_bytes += (unsigned long long)t[i].size;
+        cache_admission_record(admission, t[i].hash);
+        if (cache_index_get(index, t[i].hash, &meta, NULL, NULL) == 0) {
+            r->hits++;
+            r->hit_bytes += (unsigned long long)t[i].size;
+            continue;
+        }
+        uint64_t victim;
+        if (admission && cache_index_bytes(index) > low &&
+            cache_index_sample(index, t[i].hash ^ i, VICTIM_SAMPLES, &victim) == 0 &&
+            !cache_admission_admit(admission, t[i].hash, victim)) {
+            r->rejected++;
+            continue;
+        }
+        cache_index_put(index, t[i].hash, &meta, (off_t)t[i].size, NULL);
+        r->writes++;
+        r->written_bytes += (unsigned long long)t[i].size;
+        if (cache_index_bytes(index) > high) {
+            evict(index, low);
+        }
+    }
+    cache_admission_destroy(admission);
+    cache_index_destroy(index);
+}
+
+static void print_result(const replay_result_t *r, size_t count) {
+    printf("%-10s %9.2f%% %9.2f%% %12.1f %12.2f %12llu\n", r->name, 100.0 * (double)r->hits / (double)count,
+           100.0 * (double)r->hit_bytes / (double)r->request_bytes, (double)r->written_bytes / 1048576.0,
+           r->hit_bytes ? (double)r->written_bytes / (double)r->hit_bytes : 0.0, r->rejected);
+}
+
+int main(int argc, char **argv) {
+    size_t count = 0;
+    trace_entry_t *trace = argc > 1 ? load_trace(argv[1], &count) : synth_trace(&count);
+    if (!trace || count == 0) {
+        fprintf(stderr, "Не удалось прочитать трассу\n");
+        return 1;
+    }
+    long long capacity = (argc > 2 ? atoll(argv[2]) : DEFAULT_CAPACITY_MB) * 1024LL * 1024LL;
+    printf("Запросов: %zu, объём кэша: %lld МБ\n", count, capacity / 1048576);
+    /* Ширина полей printf считается в байтах, поэтому заголовок выровнен вручную. */
+    printf("допуск      попадания  по байтам  записано МБ запись/попад    отклонено\n");
+
+    replay_result_t all = {"all", 0, 0, 0, 0, 0, 0};
+    replay_result_t lfu = {"tinylfu", 0, 0, 0, 0, 0, 0};
+    replay(trace, count, capacity, 0, &all);
+    print_result(&all, count);
+    replay(trace, count, capacity, 1, &lfu);
+    print_result(&lfu, count);
+    free(trace);
+    return 0;
+}
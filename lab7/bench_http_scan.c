@@ -0,0 +1,187 @@
+/*
+ * Микробенчмарк приёма заголовков: прежний путь (поиск \r\n\r\n с начала
+ * буфера после каждой порции и разбор с копированием строк) против
+ * http_scan (поиск с места остановки и разбор одним проходом). Порции
+ * имитируют медленно приходящие заголовки.
+ *
+ *   make bench && ./bench_http_scan
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "http_scan.h"
+
+#define MAX_LINE 4096
+
+/* Результат разбора сохраняется, чтобы компилятор не выбросил сам разбор. */
+static volatile size_t bench_sink;
+
+static int old_find_header_end(const char *buf, size_t len) {
+    for (size_t i = 0; i + 3 < len; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') {
+            return (int)(i + 4);
+        }
+    }
+    return -1;
+}
+
+static void trim(char *s) {
+    size_t len = strlen(s);
+    size_t start = 0;
+    while (start < len && isspace((unsigned char)s[start])) {
+        start++;
+    }
+    size_t end = len;
+    while (end > start && isspace((unsigned char)s[end - 1])) {
+        end--;
+    }
+    if (start > 0) {
+        memmove(s, s + start, end - start);
+    }
+    s[end - start] = '\0';
+}
+
+static size_t old_parse(const char *buf, size_t header_len) {
+    const char *p = buf;
+    const char *end = buf + header_len;
+    char line[MAX_LINE];
+    size_t sum = 0;
+    const char *eol = strstr(p, "\r\n");
+    p = eol + 2;
+    while (p < end) {
+        eol = strstr(p, "\r\n");
+        if (!eol || eol == p) {
+            break;
+        }
+        size_t len = (size_t)(eol - p);
+        memcpy(line, p, len);
+        line[len] = '\0';
+        char *colon = strchr(line, ':');
+        if (colon) {
+            *colon = '\0';
+            trim(line);
+            trim(colon + 1);
+            sum += strlen(line) + strlen(colon + 1);
+        }
+        p = eol + 2;
+    }
+    return sum;
+}
+
+static size_t new_parse(const char *buf, size_t header_len) {
+    const char *p = buf;
+    const char *end = buf + header_len;
+    const char *line;
+    size_t line_len;
+    size_t sum = 0;
+    http_first_line(&p, end, &line, &line_len);
+    http_field_t f;
+    while (http_next_field(&p, end, &f) > 0) {
+        sum += f.name_len + f.value_len;
+    }
+    return sum;
+}
+
+/* Приём по порциям chunk байт; возвращает длину заголовков и добавляет сумму разбора в *sink. */
+static size_t receive_old(const char *msg, size_t len, size_t chunk, char *buf, size_t *sink) {
+    for (size_t have = 0; have < len;) {
+        size_t n = len - have < chunk ? len - have : chunk;
+        memcpy(buf + have, msg + have, n);
+        have += n;
+        buf[have] = '\0';
+        int idx = old_find_header_end(buf, have);
+        if (idx >= 0) {
+            *sink += old_parse(buf, (size_t)idx);
+            return (size_t)idx;
+        }
+    }
+    return 0;
+}
+
+static size_t receive_new(const char *msg, size_t len, size_t chunk, char *buf, size_t *sink) {
+    header_scan_t scan;
+    header_scan_reset(&scan);
+    for (size_t have = 0; have < len;) {
+        size_t n = len - have < chunk ? len - have : chunk;
+        memcpy(buf + have, msg + have, n);
+        have += n;
+        buf[have] = '\0';
+        ssize_t idx = header_scan(&scan, buf, have);
+        if (idx >= 0) {
+            *sink += new_parse(buf, (size_t)idx);
+            return (size_t)idx;
+        }
+    }
+    return 0;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static char *make_message(const char *first_line, int fields, size_t *out_len) {
+    size_t cap = 256 + (size_t)fields * 96;
+    char *msg = (char *)malloc(cap);
+    size_t len = (size_t)snprintf(msg, cap, "%s\r\n", first_line);
+    for (int i = 0; i < fields; i++) {
+        len += (size_t)snprintf(msg + len, cap - len, "X-Header-%d:  value-%d; some=parameter, other=\"%08x\"\r\n",
+                                i, i, (unsigned)(i * 2654435761u));
+    }
+    len += (size_t)snprintf(msg + len, cap - len, "\r\nBODY");
+    *out_len = len;
+    return msg;
+}
+
+static void run(const char *what, const char *first_line, int fields, size_t chunk) {
+    size_t len;
+    char *msg = make_message(first_line, fields, &len);
+    char *buf = (char *)malloc(len + 1);
+    size_t sink = 0;
+    int rounds = 1;
+    double t_old;
+    double t_new;
+    /* Число повторов подбирается так, чтобы прежний путь шёл не меньше 0,2 с. */
+    while (1) {
+        double t0 = now_sec();
+        for (int i = 0; i < rounds; i++) {
+            receive_old(msg, len, chunk, buf, &sink);
+        }
+        t_old = now_sec() - t0;
+        if (t_old >= 0.2) {
+            break;
+        }
+        rounds *= 2;
+    }
+    double t0 = now_sec();
+    for (int i = 0; i < rounds; i++) {
+        receive_new(msg, len, chunk, buf, &sink);
+    }
+    t_new = now_sec() - t0;
+    size_t header_old = receive_old(msg, len, chunk, buf, &sink);
+    size_t header_new = receive_new(msg, len, chunk, buf, &sink);
+    printf("%-9s %4d полей %6zu Б, порции %5zu Б: было %9.2f мкс, стало %8.2f мкс, x%.1f%s\n", what, fields,
+           header_new, chunk, t_old / rounds * 1e6, t_new / rounds * 1e6, t_old / t_new,
+           header_old == header_new ? "" : "  РАСХОЖДЕНИЕ");
+    bench_sink += sink;
+    free(buf);
+    free(msg);
+}
+
+int main(void) {
+    static const size_t chunks[] = {1, 64, 1460, 65536};
+    static const int sizes[] = {12, 100, 600};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+            run("запрос", "GET http://example.com/index.html HTTP/1.1", sizes[s], chunks[c]);
+            run("ответ", "HTTP/1.1 200 OK", sizes[s], chunks[c]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "cache_admission.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Строки sketch берут разные 16-битные части перемешанного хеша (splitmix64). */
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static size_t slot_of(const cache_admission_t *a, uint64_t h, int row) {
+    uint64_t part = mix(h + (uint64_t)row * 0x9e3779b97f4a7c15ULL);
+    return (size_t)row * a->width + (size_t)(part & (a->width - 1));
+}
+
+static int door_test_and_set(cache_admission_t *a, uint64_t h, int set) {
+    uint64_t m = mix(h ^ 0x5851f42d4c957f2dULL);
+    size_t b1 = (size_t)(m % a->door_bits);
+    size_t b2 = (size_t)((m >> 32) % a->door_bits);
+    int present = (a->door[b1 / 64] >> (b1 % 64) & 1) && (a->door[b2 / 64] >> (b2 % 64) & 1);
+    if (set) {
+        a->door[b1 / 64] |= 1ULL << (b1 % 64);
+        a->door[b2 / 64] |= 1ULL << (b2 % 64);
+    }
+    return present;
+}
+
+static unsigned sketch_min(const cache_admission_t *a, uint64_t h) {
+    unsigned min = ADMISSION_COUNTER_MAX;
+    for (int row = 0; row < ADMISSION_ROWS; row++) {
+        unsigned v = a->counters[slot_of(a, h, row)];
+        if (v < min) {
+            min = v;
+        }
+    }
+    return min;
+}
+
+static void sketch_reset(cache_admission_t *a) {
+    for (size_t i = 0; i < (size_t)ADMISSION_ROWS * a->width; i++) {
+        a->counters[i] >>= 1;
+    }
+    memset(a->door, 0, a->door_bits / 8);
+    a->additions /= 2;
+    a->resets++;
+}
+
+/* expected — сколько объектов примерно помещается в кэш. */
+cache_admission_t *cache_admission_create(size_t expected) {
+    cache_admission_t *a = (cache_admission_t *)calloc(1, sizeof(*a));
+    if (!a) {
+        return NULL;
+    }
+    a->width = ADMISSION_MIN_WIDTH;
+    while (a->width < expected) {
+        a->width *= 2;
+    }
+    a->door_bits = a->width * 8;
+    a->sample_size = (unsigned long long)a->width * ADMISSION_SAMPLE_FACTOR;
+    a->counters = (uint8_t *)calloc((size_t)ADMISSION_ROWS * a->width, 1);
+    a->door = (uint64_t *)calloc(a->door_bits / 64, sizeof(uint64_t));
+    if (!a->counters || !a->door) {
+        free(a->counters);
+        free(a->door);
+        free(a);
+        return NULL;
+    }
+    pthread_mutex_init(&a->mutex, NULL);
+    return a;
+}
+
+/*
+ * Отмечает запрос ключа. Увеличиваются только счётчики, равные минимуму
+ * (conservative update): так меньше завышаются частоты из-за коллизий.
+ */
+void cache_admission_record(cache_admission_t *a, uint64_t hash) {
+    if (!a) {
+        return;
+    }
+    pthread_mutex_lock(&a->mutex);
+    if (door_test_and_set(a, hash, 1)) {
+        unsigned min = sketch_min(a, hash);
+        if (min < ADMISSION_COUNTER_MAX) {
+            for (int row = 0; row < ADMISSION_ROWS; row++) {
+                uint8_t *c = &a->counters[slot_of(a, hash, row)];
+                if (*c == min) {
+                    (*c)++;
+                }
+            }
+        }
+    }
+    if (++a->additions >= a->sample_size) {
+        sketch_reset(a);
+    }
+    pthread_mutex_unlock(&a->mutex);
+}
+
+unsigned cache_admission_estimate(cache_admission_t *a, uint64_t hash) {
+    pthread_mutex_lock(&a->mutex);
+    unsigned v = sketch_min(a, hash) + (unsigned)door_test_and_set(a, hash, 0);
+    pthread_mutex_unlock(&a->mutex);
+    return v;
+}
+
+/* 1 — кандидат запрашивается чаще жертвы и стоит её места. */
+int cache_admission_admit(cache_admission_t *a, uint64_t candidate, uint64_t victim) {
+    int admit = cache_admission_estimate(a, candidate) > cache_admission_estimate(a, victim);
+    pthread_mutex_lock(&a->mutex);
+    if (admit) {
+        a->admitted++;
+    } else {
+        a->rejected++;
+    }
+    pthread_mutex_unlock(&a->mutex);
+    return admit;
+}
+
+void cache_admission_destroy(cache_admission_t *a) {
+    if (!a) {
+        return;
+    }
+    pthread_mutex_destroy(&a->mutex);
+    free(a->counters);
+    free(a->door);
+    free(a);
+}
@@ -0,0 +1,44 @@
+#ifndef CACHE_ADMISSION_H
+#define CACHE_ADMISSION_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ADMISSION_ROWS 4
+#define ADMISSION_COUNTER_MAX 15
+#define ADMISSION_MIN_WIDTH 1024
+#define ADMISSION_SAMPLE_FACTOR 10
+
+/*
+ * Допуск в кэш по TinyLFU. Частоты запросов по ключам хранятся приближённо в
+ * count-min sketch: ADMISSION_ROWS строк по width счётчиков до
+ * ADMISSION_COUNTER_MAX, оценка — минимум по строкам. Первый запрос ключа
+ * только отмечается в doorkeeper (битовой карте), поэтому ключи, которые
+ * запросили один раз, не засоряют счётчики. После sample_size отметок
+ * счётчики делятся пополам, а doorkeeper очищается, так что частоты
+ * отражают недавние запросы, а не всю историю.
+ *
+ * Новый объект допускается, если его частота больше частоты объекта,
+ * который пришлось бы вытеснить ради него.
+ */
+typedef struct {
+    uint8_t *counters;
+    uint64_t *door;
+    size_t width;
+    size_t door_bits;
+    unsigned long long additions;
+    unsigned long long sample_size;
+    pthread_mutex_t mutex;
+    unsigned long long admitted;
+    unsigned long long rejected;
+    unsigned long long resets;
+} cache_admission_t;
+
+cache_admission_t *cache_admission_create(size_t expected);
+void cache_admission_record(cache_admission_t *a, uint64_t hash);
+unsigned cache_admission_estimate(cache_admission_t *a, uint64_t hash);
+int cache_admission_admit(cache_admission_t *a, uint64_t candidate, uint64_t victim);
+void cache_admission_destroy(cache_admission_t *a);
+
+#endif
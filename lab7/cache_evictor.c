@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include "cache_evictor.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int over_high(cache_evictor_t *ev) {
+    return (ev->max_bytes > 0 && cache_index_bytes(ev->index) > ev->high_bytes) ||
+           (ev->max_objects > 0 && (long long)cache_index_count(ev->index) > ev->high_objects);
+}
+
+static int over_low(cache_evictor_t *ev) {
+    return (ev->max_bytes > 0 && cache_index_bytes(ev->index) > ev->low_bytes) ||
+           (ev->max_objects > 0 && (long long)cache_index_count(ev->index) > ev->low_objects);
+}
+
+/*
+ * Устаревший объект без ETag и Last-Modified нельзя проверить условным
+ * запросом. Пока не прошли окна stale-while-revalidate и stale-if-error, он
+ * ещё может быть отдан, поэтому остаётся.
+ */
+static int is_useless(const cache_meta_t *meta, void *arg) {
+    time_t now = *(const time_t *)arg;
+    int window = meta->stale_while_revalidate > meta->stale_if_error ? meta->stale_while_revalidate
+                                                                     : meta->stale_if_error;
+    int stale = meta->must_revalidate || meta->expires == 0 || now >= meta->expires + window;
+    return stale && meta->etag[0] == '\0' && meta->last_modified[0] == '\0';
+}
+
+static int victim_cmp(const void *a, const void *b) {
+    const cache_index_victim_t *x = (const cache_index_victim_t *)a;
+    const cache_index_victim_t *y = (const cache_index_victim_t *)b;
+    if (x->useless != y->useless) {
+        return y->useless - x->useless;
+    }
+    if (x->priority < y->priority) {
+        return -1;
+    }
+    return x->priority > y->priority;
+}
+
+/*
+ * Записи уже убраны из индекса, поэтому новые запросы идут мимо этих файлов;
+ * тот, кто успел открыть файл, дочитает его. Удаление сначала пишется в
+ * журнал: после сбоя останется разве что тело без записи, его уберёт
+ * следующий запуск.
+ */
+static void unlink_batch(cache_evictor_t *ev, const uint64_t *hashes, const cache_loc_t *locs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        char key[32];
+        char name[64];
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)hashes[i]);
+        hot_cache_remove(ev->hot, key);
+        if (locs[i].segment >= 0) {
+            slab_store_delete(ev->slab, hashes[i], &locs[i]);
+            continue;
+        }
+        cache_journal_del(ev->journal, hashes[i]);
+        snprintf(name, sizeof(name), "%.2s/%s.cache", key, key);
+        unlinkat(ev->dir_fd, name, 0);
+    }
+}
+
+static int parse_key(const char *name, uint64_t *hash) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(name, &end, 16);
+    if (errno != 0 || end != name + 16) {
+        return -1;
+    }
+    *hash = (uint64_t)v;
+    return 0;
+}
+
+/*
+ * Лишние файлы одного каталога. Трогаются только файлы старше запуска, чтобы
+ * не задеть загрузки, которые идут прямо сейчас.
+ */
+static void sweep_dir(cache_evictor_t *ev, int dir_fd) {
+    int fd = dup(dir_fd);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        size_t len = strlen(name);
+        uint64_t hash = 0;
+        cache_loc_t loc;
+        int orphan = 0;
+        if (len > 16 && parse_key(name, &hash) == 0) {
+            if (strstr(name + 16, ".tmp.") || strcmp(name + 16, ".meta") == 0) {
+                orphan = 1;
+            } else if (strcmp(name + 16, ".cache") == 0) {
+                orphan = cache_index_locate(ev->index, hash, &loc) != 0 || loc.segment >= 0;
+            }
+        }
+        struct stat st;
+        if (!orphan || fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || st.st_mtime >= ev->started) {
+            continue;
+        }
+        if (unlinkat(dir_fd, name, 0) == 0) {
+            ev->orphans++;
+        }
+    }
+    closedir(dir);
+}
+
+/* Корень (.meta прежнего формата) и все подкаталоги объектов. */
+static void sweep_orphans(cache_evictor_t *ev) {
+    sweep_dir(ev, ev->dir_fd);
+    for (int i = 0; i < CACHE_SUBDIRS; i++) {
+        char sub[8];
+        snprintf(sub, sizeof(sub), "%02x", i);
+        int fd = openat(ev->dir_fd, sub, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            sweep_dir(ev, fd);
+            close(fd);
+        }
+    }
+}
+
+static void evictor_run(cache_evictor_t *ev, int pressure) {
+    time_t now = time(NULL);
+    cache_index_victim_t *victims = NULL;
+    size_t n = cache_index_snapshot(ev->index, pressure, is_useless, &now, &victims);
+    if (n == 0) {
+        free(victims);
+        return;
+    }
+    if (pressure) {
+        qsort(victims, n, sizeof(*victims), victim_cmp);
+    }
+
+    uint64_t batch[EVICT_BATCH];
+    cache_loc_t batch_locs[EVICT_BATCH];
+    size_t batch_len = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!victims[i].useless && !over_low(ev)) {
+            break;
+        }
+        off_t charge = 0;
+        if (cache_index_evict(ev->index, victims[i].hash, victims[i].stored_at, !victims[i].useless, &charge,
+                              &batch_locs[batch_len]) != 0) {
+            continue;
+        }
+        if (victims[i].useless) {
+            ev->expired++;
+        } else {
+            ev->evicted++;
+        }
+        ev->evicted_bytes += (unsigned long long)charge;
+        batch[batch_len++] = victims[i].hash;
+        if (batch_len == EVICT_BATCH) {
+            unlink_batch(ev, batch, batch_locs, batch_len);
+            batch_len = 0;
+        }
+    }
+    unlink_batch(ev, batch, batch_locs, batch_len);
+    free(victims);
+}
+
+static void *evictor_main(void *arg) {
+    cache_evictor_t *ev = (cache_evictor_t *)arg;
+    sweep_orphans(ev);
+    pthread_mutex_lock(&ev->mutex);
+    while (!ev->stop) {
+        if (!ev->pending) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += EVICT_SWEEP_INTERVAL;
+            pthread_cond_timedwait(&ev->wake, &ev->mutex, &deadline);
+            if (ev->stop) {
+                break;
+            }
+        }
+        ev->pending = 0;
+        pthread_mutex_unlock(&ev->mutex);
+
+        evictor_run(ev, over_high(ev));
+        ev->runs++;
+
+        pthread_mutex_lock(&ev->mutex);
+    }
+    pthread_mutex_unlock(&ev->mutex);
+    return NULL;
+}
+
+/* max_bytes и max_objects равны 0, если соответствующего ограничения нет. */
+cache_evictor_t *cache_evictor_create(cache_index_t *index, hot_cache_t *hot, slab_store_t *slab,
+                                      cache_journal_t *journal, const char *cache_dir, long long max_bytes,
+                                      long long max_objects) {
+    cache_evictor_t *ev = (cache_evictor_t *)calloc(1, sizeof(cache_evictor_t));
+    if (!ev) {
+        return NULL;
+    }
+    ev->dir_fd = open(cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ev->dir_fd < 0) {
+        free(ev);
+        return NULL;
+    }
+    ev->index = index;
+    ev->hot = hot;
+    ev->slab = slab;
+    ev->journal = journal;
+    ev->started = time(NULL);
+    ev->max_bytes = max_bytes;
+    ev->max_objects = max_objects;
+    ev->high_bytes = max_bytes / 100 * EVICT_HIGH_PERCENT;
+    ev->low_bytes = max_bytes / 100 * EVICT_LOW_PERCENT;
+    ev->high_objects = max_objects * EVICT_HIGH_PERCENT / 100;
+    ev->low_objects = max_objects * EVICT_LOW_PERCENT / 100;
+    ev->pending = 1;
+    pthread_mutex_init(&ev->mutex, NULL);
+    pthread_cond_init(&ev->wake, NULL);
+    if (pthread_create(&ev->thread, NULL, evictor_main, ev) != 0) {
+        pthread_mutex_destroy(&ev->mutex);
+        pthread_cond_destroy(&ev->wake);
+        close(ev->dir_fd);
+        free(ev);
+        return NULL;
+    }
+    return ev;
+}
+
+/*
+ * Вызывается после каждой записи в кэш. Пока объём ниже верхней границы,
+ * проверка обходится двумя атомарными чтениями, без мьютекса.
+ */
+void cache_evictor_poke(cache_evictor_t *ev) {
+    if (!ev || !over_high(ev)) {
+        return;
+    }
+    pthread_mutex_lock(&ev->mutex);
+    ev->pending = 1;
+    pthread_cond_signal(&ev->wake);
+    pthread_mutex_unlock(&ev->mutex);
+}
+
+/* 1 — кэш выше нижней границы, и каждый новый объект вытеснит какой-то из старых. */
+int cache_evictor_pressure(cache_evictor_t *ev) {
+    return ev && over_low(ev);
+}
+
+void cache_evictor_destroy(cache_evictor_t *ev) {
+    if (!ev) {
+        return;
+    }
+    pthread_mutex_lock(&ev->mutex);
+    ev->stop = 1;
+    pthread_cond_signal(&ev->wake);
+    pthread_mutex_unlock(&ev->mutex);
+    pthread_join(ev->thread, NULL);
+    pthread_mutex_destroy(&ev->mutex);
+    pthread_cond_destroy(&ev->wake);
+    close(ev->dir_fd);
+    free(ev);
+}
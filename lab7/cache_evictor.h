@@ -0,0 +1,62 @@
+#ifndef CACHE_EVICTOR_H
+#define CACHE_EVICTOR_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#include "cache_index.h"
+#include "cache_journal.h"
+#include "hot_cache.h"
+#include "slab_store.h"
+
+#define EVICT_HIGH_PERCENT 95
+#define EVICT_LOW_PERCENT 90
+#define EVICT_BATCH 64
+#define EVICT_SWEEP_INTERVAL 60
+#define CACHE_SUBDIRS 256
+
+/*
+ * Фоновый поток, который держит каталог кэша в пределах бюджета. Когда объём
+ * или число объектов превышают верхнюю границу, объекты с наименьшим
+ * приоритетом GDSF удаляются до нижней границы. Раз в EVICT_SWEEP_INTERVAL
+ * секунд удаляются устаревшие объекты без валидаторов: их всё равно придётся
+ * загружать заново. Файлы <ключ>.cache лежат в подкаталогах по первым двум
+ * символам ключа и удаляются пачками вне блокировок индекса; для
+ * объектов в сегментах вместо этого дописывается надгробие. При первом
+ * проходе из каталога убираются файлы, которых нет в индексе: тела без
+ * записи в журнале, недописанные временные файлы и .meta прежнего формата.
+ */
+typedef struct {
+    cache_index_t *index;
+    hot_cache_t *hot;
+    slab_store_t *slab;
+    cache_journal_t *journal;
+    int dir_fd;
+    time_t started;
+    long long max_bytes;
+    long long max_objects;
+    long long high_bytes;
+    long long low_bytes;
+    long long high_objects;
+    long long low_objects;
+    int stop;
+    int pending;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    unsigned long long runs;
+    unsigned long long evicted;
+    unsigned long long expired;
+    unsigned long long evicted_bytes;
+    unsigned long long orphans;
+} cache_evictor_t;
+
+cache_evictor_t *cache_evictor_create(cache_index_t *index, hot_cache_t *hot, slab_store_t *slab,
+                                      cache_journal_t *journal, const char *cache_dir, long long max_bytes,
+                                      long long max_objects);
+void cache_evictor_poke(cache_evictor_t *ev);
+int cache_evictor_pressure(cache_evictor_t *ev);
+void cache_evictor_destroy(cache_evictor_t *ev);
+
+#endif
@@ -0,0 +1,381 @@
+#include "cache_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static off_t charge_of(off_t size, const cache_loc_t *loc) {
+    if (loc->segment >= 0) {
+        return (off_t)loc->length;
+    }
+    return (size + CACHE_INDEX_BLOCK - 1) / CACHE_INDEX_BLOCK * CACHE_INDEX_BLOCK + CACHE_INDEX_BLOCK;
+}
+
+static double gdsf_priority(cache_index_t *index, unsigned hits, off_t charge) {
+    double clock;
+    __atomic_load(&index->clock, &clock, __ATOMIC_RELAXED);
+    return clock + (double)hits * CACHE_INDEX_BLOCK / (double)charge;
+}
+
+static cache_stripe_t *stripe_of(cache_index_t *index, uint64_t hash) {
+    return &index->stripes[hash % CACHE_INDEX_STRIPES];
+}
+
+static size_t bucket_of(const cache_stripe_t *stripe, uint64_t hash) {
+    return (size_t)((hash / CACHE_INDEX_STRIPES) % stripe->bucket_count);
+}
+
+static cache_index_entry_t *stripe_find(cache_stripe_t *stripe, uint64_t hash) {
+    for (cache_index_entry_t *e = stripe->buckets[bucket_of(stripe, hash)]; e; e = e->next) {
+        if (e->hash == hash) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Таблица полосы удваивается, когда цепочки становятся длиннее двух записей в среднем. */
+static void stripe_grow(cache_stripe_t *stripe) {
+    size_t new_count = stripe->bucket_count * 2;
+    cache_index_entry_t **nb = (cache_index_entry_t **)calloc(new_count, sizeof(*nb));
+    if (!nb) {
+        return;
+    }
+    cache_index_entry_t **old = stripe->buckets;
+    size_t old_count = stripe->bucket_count;
+    stripe->buckets = nb;
+    stripe->bucket_count = new_count;
+    for (size_t i = 0; i < old_count; i++) {
+        cache_index_entry_t *e = old[i];
+        while (e) {
+            cache_index_entry_t *next = e->next;
+            size_t b = bucket_of(stripe, e->hash);
+            e->next = nb[b];
+            nb[b] = e;
+            e = next;
+        }
+    }
+    free(old);
+}
+
+cache_index_t *cache_index_create(void) {
+    cache_index_t *index = (cache_index_t *)calloc(1, sizeof(cache_index_t));
+    if (!index) {
+        return NULL;
+    }
+    for (int i = 0; i < CACHE_INDEX_STRIPES; i++) {
+        cache_stripe_t *stripe = &index->stripes[i];
+        pthread_mutex_init(&stripe->mutex, NULL);
+        stripe->bucket_count = CACHE_INDEX_INITIAL_BUCKETS;
+        stripe->buckets = (cache_index_entry_t **)calloc(stripe->bucket_count, sizeof(cache_index_entry_t *));
+        if (!stripe->buckets) {
+            cache_index_destroy(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+static const cache_loc_t file_loc = {-1, 0, 0};
+
+static int same_loc(const cache_loc_t *a, const cache_loc_t *b) {
+    return a->segment == b->segment && a->offset == b->offset;
+}
+
+int cache_index_get(cache_index_t *index, uint64_t hash, cache_meta_t *meta, off_t *size, cache_loc_t *loc) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_find(stripe, hash);
+    if (e) {
+        *meta = e->meta;
+        if (size) {
+            *size = e->size;
+        }
+        if (loc) {
+            *loc = e->loc;
+        }
+        e->hits++;
+        e->last_access = time(NULL);
+        e->priority = gdsf_priority(index, e->hits, e->charge);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    return e ? 0 : -1;
+}
+
+int cache_index_put(cache_index_t *index, uint64_t hash, const cache_meta_t *meta, off_t size,
+                    const cache_loc_t *loc) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    cache_index_entry_t *fresh = (cache_index_entry_t *)malloc(sizeof(cache_index_entry_t));
+    if (!fresh) {
+        return -1;
+    }
+
+    if (!loc) {
+        loc = &file_loc;
+    }
+    off_t charge = charge_of(size, loc);
+
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_find(stripe, hash);
+    if (e) {
+        __atomic_add_fetch(&index->bytes, (long long)(charge - e->charge), __ATOMIC_RELAXED);
+        e->meta = *meta;
+        e->loc = *loc;
+        e->size = size;
+        e->charge = charge;
+        e->priority = gdsf_priority(index, e->hits, charge);
+        pthread_mutex_unlock(&stripe->mutex);
+        free(fresh);
+        return 0;
+    }
+    if (stripe->count >= stripe->bucket_count * 2) {
+        stripe_grow(stripe);
+    }
+    fresh->hash = hash;
+    fresh->meta = *meta;
+    fresh->loc = *loc;
+    fresh->size = size;
+    fresh->charge = charge;
+    fresh->hits = 1;
+    fresh->last_access = time(NULL);
+    fresh->priority = gdsf_priority(index, 1, charge);
+    size_t b = bucket_of(stripe, hash);
+    fresh->next = stripe->buckets[b];
+    stripe->buckets[b] = fresh;
+    stripe->count++;
+    __atomic_add_fetch(&index->bytes, (long long)charge, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&index->count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&stripe->mutex);
+    return 0;
+}
+
+int cache_index_locate(cache_index_t *index, uint64_t hash, cache_loc_t *loc) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_find(stripe, hash);
+    if (e) {
+        *loc = e->loc;
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    return e ? 0 : -1;
+}
+
+/* Переносит запись в другое место, если она всё ещё лежит там, откуда её копировали. */
+int cache_index_relocate(cache_index_t *index, uint64_t hash, const cache_loc_t *from, const cache_loc_t *to) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_find(stripe, hash);
+    int moved = e && same_loc(&e->loc, from);
+    if (moved) {
+        e->loc = *to;
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    return moved ? 0 : -1;
+}
+
+/* Попадание, обслуженное из памяти, тоже учитывается в приоритете вытеснения. */
+void cache_index_touch(cache_index_t *index, uint64_t hash) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_find(stripe, hash);
+    if (e) {
+        e->hits++;
+        e->last_access = time(NULL);
+        e->priority = gdsf_priority(index, e->hits, e->charge);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+/* Счётчики из снимка, сохранённого при прошлом запуске. */
+void cache_index_restore(cache_index_t *index, uint64_t hash, unsigned hits, time_t last_access) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_find(stripe, hash);
+    if (e) {
+        e->hits = hits ? hits : 1;
+        e->last_access = last_access;
+        e->priority = gdsf_priority(index, e->hits, e->charge);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+int cache_index_update_meta(cache_index_t *index, uint64_t hash, const cache_meta_t *meta) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_find(stripe, hash);
+    if (e) {
+        e->meta = *meta;
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    return e ? 0 : -1;
+}
+
+/* Вызывается под мьютексом полосы. */
+static cache_index_entry_t *stripe_unlink(cache_index_t *index, cache_stripe_t *stripe, uint64_t hash,
+                                          const time_t *stored_at) {
+    cache_index_entry_t **pp = &stripe->buckets[bucket_of(stripe, hash)];
+    while (*pp && (*pp)->hash != hash) {
+        pp = &(*pp)->next;
+    }
+    cache_index_entry_t *e = *pp;
+    if (!e || (stored_at && e->meta.stored_at != *stored_at)) {
+        return NULL;
+    }
+    *pp = e->next;
+    stripe->count--;
+    __atomic_sub_fetch(&index->bytes, (long long)e->charge, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&index->count, 1, __ATOMIC_RELAXED);
+    return e;
+}
+
+int cache_index_remove(cache_index_t *index, uint64_t hash) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_unlink(index, stripe, hash, NULL);
+    pthread_mutex_unlock(&stripe->mutex);
+    free(e);
+    return e ? 0 : -1;
+}
+
+size_t cache_index_count(cache_index_t *index) {
+    return (size_t)__atomic_load_n(&index->count, __ATOMIC_RELAXED);
+}
+
+long long cache_index_bytes(cache_index_t *index) {
+    return __atomic_load_n(&index->bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Копирует записи в массив для выбора жертв. При all = 0 берутся только
+ * бесполезные записи (по фильтру), иначе все. Каждая полоса блокируется
+ * отдельно и ненадолго, поэтому обход не мешает попаданиям.
+ */
+size_t cache_index_snapshot(cache_index_t *index, int all, cache_index_filter_t useless, void *arg,
+                            cache_index_victim_t **out) {
+    size_t cap = 0;
+    size_t n = 0;
+    cache_index_victim_t *v = NULL;
+    for (int i = 0; i < CACHE_INDEX_STRIPES; i++) {
+        cache_stripe_t *stripe = &index->stripes[i];
+        pthread_mutex_lock(&stripe->mutex);
+        for (size_t b = 0; b < stripe->bucket_count; b++) {
+            for (cache_index_entry_t *e = stripe->buckets[b]; e; e = e->next) {
+                int is_useless = useless && useless(&e->meta, arg);
+                if (!all && !is_useless) {
+                    continue;
+                }
+                if (n == cap) {
+                    size_t new_cap = cap ? cap * 2 : 1024;
+                    cache_index_victim_t *nv = (cache_index_victim_t *)realloc(v, new_cap * sizeof(*nv));
+                    if (!nv) {
+                        break;
+                    }
+                    v = nv;
+                    cap = new_cap;
+                }
+                v[n].hash = e->hash;
+                v[n].stored_at = e->meta.stored_at;
+                v[n].charge = e->charge;
+                v[n].priority = e->priority;
+                v[n].useless = is_useless;
+                n++;
+            }
+        }
+        pthread_mutex_unlock(&stripe->mutex);
+    }
+    *out = v;
+    return n;
+}
+
+/*
+ * Примерная жертва вытеснения: запись с наименьшим приоритетом в samples
+ * случайных цепочках. Точные жертвы выбирает вытеснитель по полному
+ * снимку; допуску в кэш хватает выборки, и она не обходит весь индекс.
+ */
+int cache_index_sample(cache_index_t *index, uint64_t seed, int samples, uint64_t *hash) {
+    int found = 0;
+    double best = 0;
+    for (int i = 0; i < samples; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        cache_stripe_t *stripe = &index->stripes[(seed >> 33) % CACHE_INDEX_STRIPES];
+        pthread_mutex_lock(&stripe->mutex);
+        size_t start = (size_t)((seed >> 17) % stripe->bucket_count);
+        for (size_t k = 0; k < stripe->bucket_count && stripe->count > 0; k++) {
+            cache_index_entry_t *e = stripe->buckets[(start + k) % stripe->bucket_count];
+            if (!e) {
+                continue;
+            }
+            for (; e; e = e->next) {
+                if (!found || e->priority < best) {
+                    best = e->priority;
+                    *hash = e->hash;
+                    found = 1;
+                }
+            }
+            break;
+        }
+        pthread_mutex_unlock(&stripe->mutex);
+    }
+    return found ? 0 : -1;
+}
+
+/* Обходит все записи; visit вызывается под мьютексом полосы и должен быть коротким. */
+void cache_index_foreach(cache_index_t *index, cache_index_visit_t visit, void *arg) {
+    for (int i = 0; i < CACHE_INDEX_STRIPES; i++) {
+        cache_stripe_t *stripe = &index->stripes[i];
+        pthread_mutex_lock(&stripe->mutex);
+        for (size_t b = 0; b < stripe->bucket_count; b++) {
+            for (cache_index_entry_t *e = stripe->buckets[b]; e; e = e->next) {
+                visit(e, arg);
+            }
+        }
+        pthread_mutex_unlock(&stripe->mutex);
+    }
+}
+
+/*
+ * Удаляет запись, если она не была заменена после снимка. При вытеснении по
+ * объёму (age = 1) часы GDSF поднимаются до приоритета вытесненного объекта.
+ */
+int cache_index_evict(cache_index_t *index, uint64_t hash, time_t stored_at, int age, off_t *charge,
+                      cache_loc_t *loc) {
+    cache_stripe_t *stripe = stripe_of(index, hash);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_index_entry_t *e = stripe_unlink(index, stripe, hash, &stored_at);
+    pthread_mutex_unlock(&stripe->mutex);
+    if (!e) {
+        return -1;
+    }
+    double clock;
+    __atomic_load(&index->clock, &clock, __ATOMIC_RELAXED);
+    if (age && e->priority > clock) {
+        __atomic_store(&index->clock, &e->priority, __ATOMIC_RELAXED);
+    }
+    if (charge) {
+        *charge = e->charge;
+    }
+    if (loc) {
+        *loc = e->loc;
+    }
+    free(e);
+    return 0;
+}
+
+void cache_index_destroy(cache_index_t *index) {
+    if (!index) {
+        return;
+    }
+    for (int i = 0; i < CACHE_INDEX_STRIPES; i++) {
+        cache_stripe_t *stripe = &index->stripes[i];
+        for (size_t b = 0; stripe->buckets && b < stripe->bucket_count; b++) {
+            cache_index_entry_t *e = stripe->buckets[b];
+            while (e) {
+                cache_index_entry_t *next = e->next;
+                free(e);
+                e = next;
+            }
+        }
+        free(stripe->buckets);
+        pthread_mutex_destroy(&stripe->mutex);
+    }
+    free(index);
+}
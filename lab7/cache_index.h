@@ -0,0 +1,112 @@
+#ifndef CACHE_INDEX_H
+#define CACHE_INDEX_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define CACHE_INDEX_STRIPES 64
+#define CACHE_INDEX_INITIAL_BUCKETS 256
+#define CACHE_INDEX_BLOCK 4096
+
+/*
+ * validated_at — когда объект последний раз получен или подтверждён сервером.
+ * stale_while_revalidate и stale_if_error — окна RFC 5861 в секундах после
+ * expires, когда объект можно отдавать устаревшим.
+ */
+typedef struct {
+    time_t stored_at;
+    time_t validated_at;
+    time_t expires;
+    int must_revalidate;
+    int stale_while_revalidate;
+    int stale_if_error;
+    char last_modified[128];
+    char etag[128];
+    size_t header_len;
+} cache_meta_t;
+
+/*
+ * Где лежит объект: segment < 0 — в файле <hash>.cache, иначе
+ * запись длиной length по смещению offset в сегменте (slab_store.c).
+ */
+typedef struct {
+    int segment;
+    uint32_t length;
+    off_t offset;
+} cache_loc_t;
+
+typedef struct cache_index_entry {
+    uint64_t hash;
+    cache_meta_t meta;
+    cache_loc_t loc;
+    off_t size;
+    off_t charge;
+    unsigned hits;
+    time_t last_access;
+    double priority;
+    struct cache_index_entry *next;
+} cache_index_entry_t;
+
+/*
+ * Каждая полоса — отдельная хеш-таблица со своим мьютексом; полоса выбирается
+ * по младшим битам хеша URL. Под мьютексом только поиск и копирование
+ * метаданных, файловые операции выполняются без блокировок.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    cache_index_entry_t **buckets;
+    size_t bucket_count;
+    size_t count;
+} cache_stripe_t;
+
+/*
+ * Объём считается по записям индекса, без обхода каталога: charge — размер
+ * файла, округлённый до блока, плюс блок на метаданные, или длина записи в
+ * сегменте. Приоритет вытеснения считается по GDSF: clock + hits / charge,
+ * где clock — приоритет последнего вытесненного объекта. Так давно не
+ * запрашиваемые объекты со временем уступают новым, а крупные уходят раньше
+ * мелких с тем же числом попаданий.
+ */
+typedef struct {
+    cache_stripe_t stripes[CACHE_INDEX_STRIPES];
+    long long bytes;
+    long long count;
+    double clock;
+} cache_index_t;
+
+/* Снимок записи для вытеснителя; stored_at отличает запись от её замены. */
+typedef struct {
+    uint64_t hash;
+    time_t stored_at;
+    off_t charge;
+    double priority;
+    int useless;
+} cache_index_victim_t;
+
+typedef int (*cache_index_filter_t)(const cache_meta_t *meta, void *arg);
+typedef void (*cache_index_visit_t)(const cache_index_entry_t *entry, void *arg);
+
+cache_index_t *cache_index_create(void);
+int cache_index_get(cache_index_t *index, uint64_t hash, cache_meta_t *meta, off_t *size, cache_loc_t *loc);
+int cache_index_put(cache_index_t *index, uint64_t hash, const cache_meta_t *meta, off_t size,
+                    const cache_loc_t *loc);
+int cache_index_locate(cache_index_t *index, uint64_t hash, cache_loc_t *loc);
+int cache_index_relocate(cache_index_t *index, uint64_t hash, const cache_loc_t *from, const cache_loc_t *to);
+void cache_index_touch(cache_index_t *index, uint64_t hash);
+void cache_index_restore(cache_index_t *index, uint64_t hash, unsigned hits, time_t last_access);
+int cache_index_update_meta(cache_index_t *index, uint64_t hash, const cache_meta_t *meta);
+int cache_index_remove(cache_index_t *index, uint64_t hash);
+size_t cache_index_count(cache_index_t *index);
+long long cache_index_bytes(cache_index_t *index);
+size_t cache_index_snapshot(cache_index_t *index, int all, cache_index_filter_t useless, void *arg,
+                            cache_index_victim_t **out);
+int cache_index_sample(cache_index_t *index, uint64_t seed, int samples, uint64_t *hash);
+void cache_index_foreach(cache_index_t *index, cache_index_visit_t visit, void *arg);
+int cache_index_evict(cache_index_t *index, uint64_t hash, time_t stored_at, int age, off_t *charge,
+                      cache_loc_t *loc);
+void cache_index_destroy(cache_index_t *index);
+
+#endif
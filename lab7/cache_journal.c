@@ -0,0 +1,444 @@
+#include "cache_journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_RECORD_MAX (sizeof(journal_record_t) + 2 * 128 + 8)
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    uint64_t count;
+    int failed;
+} snapshot_buf_t;
+
+static size_t record_length(size_t last_modified_len, size_t etag_len) {
+    return (sizeof(journal_record_t) + last_modified_len + etag_len + 7) / 8 * 8;
+}
+
+static uint32_t checksum_update(uint32_t h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Контрольная сумма всей записи, кроме самого поля checksum. */
+static uint32_t record_checksum(const char *p, size_t len) {
+    size_t at = offsetof(journal_record_t, checksum);
+    uint32_t h = checksum_update(2166136261u, p, at);
+    return checksum_update(h, p + at + sizeof(uint32_t), len - at - sizeof(uint32_t));
+}
+
+static size_t encode_record(char *out, int type, uint64_t hash, const cache_meta_t *meta, off_t size,
+                            unsigned hits, time_t last_access) {
+    size_t lm = meta ? strnlen(meta->last_modified, sizeof(meta->last_modified) - 1) : 0;
+    size_t etag = meta ? strnlen(meta->etag, sizeof(meta->etag) - 1) : 0;
+    size_t len = record_length(lm, etag);
+    memset(out, 0, len);
+
+    journal_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = JOURNAL_RECORD_MAGIC;
+    rec.type = (uint8_t)type;
+    rec.hash = hash;
+    rec.size = (int64_t)size;
+    rec.hits = hits;
+    rec.last_access = (int64_t)last_access;
+    if (meta) {
+        rec.must_revalidate = (uint8_t)(meta->must_revalidate != 0);
+        rec.last_modified_len = (uint8_t)lm;
+        rec.etag_len = (uint8_t)etag;
+        rec.stored_at = (int64_t)meta->stored_at;
+        rec.validated_at = (int64_t)meta->validated_at;
+        rec.expires = (int64_t)meta->expires;
+        rec.stale_while_revalidate = (uint32_t)meta->stale_while_revalidate;
+        rec.stale_if_error = (uint32_t)meta->stale_if_error;
+        rec.header_len = (uint32_t)meta->header_len;
+        memcpy(out + sizeof(rec), meta->last_modified, lm);
+        memcpy(out + sizeof(rec) + lm, meta->etag, etag);
+    }
+    memcpy(out, &rec, sizeof(rec));
+    rec.checksum = record_checksum(out, len);
+    memcpy(out, &rec, sizeof(rec));
+    return len;
+}
+
+/* Возвращает длину записи или 0, если запись неполная или повреждена. */
+static size_t decode_record(const char *p, size_t avail, journal_record_t *rec, cache_meta_t *meta) {
+    if (avail < sizeof(*rec)) {
+        return 0;
+    }
+    memcpy(rec, p, sizeof(*rec));
+    if (rec->magic != JOURNAL_RECORD_MAGIC ||
+        rec->last_modified_len >= sizeof(meta->last_modified) || rec->etag_len >= sizeof(meta->etag)) {
+        return 0;
+    }
+    size_t len = record_length(rec->last_modified_len, rec->etag_len);
+    if (avail < len || record_checksum(p, len) != rec->checksum) {
+        return 0;
+    }
+    memset(meta, 0, sizeof(*meta));
+    meta->stored_at = (time_t)rec->stored_at;
+    meta->validated_at = (time_t)rec->validated_at;
+    meta->expires = (time_t)rec->expires;
+    meta->stale_while_revalidate = (int)rec->stale_while_revalidate;
+    meta->stale_if_error = (int)rec->stale_if_error;
+    meta->must_revalidate = rec->must_revalidate;
+    meta->header_len = rec->header_len;
+    memcpy(meta->last_modified, p + sizeof(*rec), rec->last_modified_len);
+    memcpy(meta->etag, p + sizeof(*rec) + rec->last_modified_len, rec->etag_len);
+    return len;
+}
+
+static void apply_record(cache_journal_t *j, const journal_record_t *rec, const cache_meta_t *meta,
+                         cache_journal_resolve_t resolve, void *arg) {
+    cache_loc_t loc;
+    int exists = cache_index_locate(j->index, rec->hash, &loc) == 0;
+    switch (rec->type) {
+    case JOURNAL_PUT:
+        if (exists && loc.segment >= 0 && !(resolve && resolve(rec->hash, meta, arg))) {
+            return;
+        }
+        cache_index_put(j->index, rec->hash, meta, (off_t)rec->size, NULL);
+        if (rec->hits) {
+            cache_index_restore(j->index, rec->hash, rec->hits, (time_t)rec->last_access);
+        }
+        break;
+    case JOURNAL_DEL:
+        if (exists && loc.segment < 0) {
+            cache_index_remove(j->index, rec->hash);
+        }
+        break;
+    case JOURNAL_STATS:
+        if (exists && loc.segment >= 0) {
+            cache_index_restore(j->index, rec->hash, rec->hits, (time_t)rec->last_access);
+        }
+        break;
+    }
+}
+
+/*
+ * Читает снимок или журнал целиком и применяет записи до первой повреждённой
+ * (хвост, недописанный при сбое). Возвращает -1, если файла нет или у него
+ * чужой заголовок.
+ */
+static int load_file(cache_journal_t *j, const char *path, uint32_t magic, cache_journal_resolve_t resolve,
+                     void *arg) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    journal_header_t hdr;
+    if (fstat(fd, &st) != 0 || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != magic || hdr.version != JOURNAL_VERSION) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size - sizeof(hdr);
+    char *data = (char *)malloc(size ? size : 1);
+    if (!data || pread(fd, data, size, sizeof(hdr)) != (ssize_t)size) {
+        free(data);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    size_t off = 0;
+    while (off < size) {
+        journal_record_t rec;
+        cache_meta_t meta;
+        size_t len = decode_record(data + off, size - off, &rec, &meta);
+        if (len == 0) {
+            break;
+        }
+        apply_record(j, &rec, &meta, resolve, arg);
+        off += len;
+    }
+    free(data);
+    return 0;
+}
+
+static void snapshot_visit(const cache_index_entry_t *e, void *arg) {
+    snapshot_buf_t *sb = (snapshot_buf_t *)arg;
+    if (sb->failed) {
+        return;
+    }
+    if (sb->len + JOURNAL_RECORD_MAX > sb->cap) {
+        size_t cap = sb->cap * 2;
+        char *nb = (char *)realloc(sb->buf, cap);
+        if (!nb) {
+            sb->failed = 1;
+            return;
+        }
+        sb->buf = nb;
+        sb->cap = cap;
+    }
+    if (e->loc.segment >= 0) {
+        sb->len += encode_record(sb->buf + sb->len, JOURNAL_STATS, e->hash, NULL, 0, e->hits, e->last_access);
+    } else {
+        sb->len += encode_record(sb->buf + sb->len, JOURNAL_PUT, e->hash, &e->meta, e->size, e->hits,
+                                 e->last_access);
+    }
+    sb->count++;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Снимок пишется во временный файл и заменяет прежний переименованием. */
+static int write_snapshot(cache_journal_t *j) {
+    snapshot_buf_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.cap = 64 * 1024;
+    sb.buf = (char *)malloc(sb.cap);
+    if (!sb.buf) {
+        return -1;
+    }
+    sb.len = sizeof(journal_header_t);
+    cache_index_foreach(j->index, snapshot_visit, &sb);
+    if (sb.failed) {
+        free(sb.buf);
+        return -1;
+    }
+    journal_header_t hdr = {JOURNAL_SNAPSHOT_MAGIC, JOURNAL_VERSION, sb.count};
+    memcpy(sb.buf, &hdr, sizeof(hdr));
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", j->snapshot_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int rc = -1;
+    if (fd >= 0) {
+        rc = write_all(fd, sb.buf, sb.len);
+        if (rc == 0) {
+            rc = fdatasync(fd);
+        }
+        close(fd);
+        if (rc == 0) {
+            rc = rename(tmp, j->snapshot_path);
+        }
+        if (rc != 0) {
+            unlink(tmp);
+        }
+    }
+    if (rc == 0) {
+        __atomic_store_n(&j->snapshot_bytes, (long long)sb.len, __ATOMIC_RELAXED);
+        j->snapshots++;
+    }
+    free(sb.buf);
+    return rc;
+}
+
+static int open_log(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    journal_header_t hdr = {JOURNAL_LOG_MAGIC, JOURNAL_VERSION, 0};
+    if (write_all(fd, (const char *)&hdr, sizeof(hdr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Запись в журнал после изменения индекса. Если снимок начали писать раньше
+ * и изменение в него не попало, оно окажется уже в новом журнале.
+ */
+static int append_record(cache_journal_t *j, const char *buf, size_t len) {
+    pthread_rwlock_rdlock(&j->lock);
+    ssize_t n = j->fd >= 0 ? write(j->fd, buf, len) : -1;
+    pthread_rwlock_unlock(&j->lock);
+    if (n != (ssize_t)len) {
+        return -1;
+    }
+    __atomic_add_fetch(&j->journal_bytes, (long long)len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&j->appended, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int cache_journal_put(cache_journal_t *j, uint64_t hash, const cache_meta_t *meta, off_t size) {
+    if (!j) {
+        return 0;
+    }
+    char buf[JOURNAL_RECORD_MAX];
+    size_t len = encode_record(buf, JOURNAL_PUT, hash, meta, size, 0, time(NULL));
+    return append_record(j, buf, len);
+}
+
+int cache_journal_del(cache_journal_t *j, uint64_t hash) {
+    if (!j) {
+        return 0;
+    }
+    char buf[JOURNAL_RECORD_MAX];
+    size_t len = encode_record(buf, JOURNAL_DEL, hash, NULL, 0, 0, 0);
+    return append_record(j, buf, len);
+}
+
+/*
+ * Журнал подменяется пустым под блокировкой записи, снимок пишется уже без
+ * неё. Если снимок записать не удалось, index.journal.old остаётся, и
+ * следующая попытка только повторяет запись снимка.
+ */
+int cache_journal_checkpoint(cache_journal_t *j) {
+    if (!j) {
+        return 0;
+    }
+    pthread_mutex_lock(&j->checkpoint_mutex);
+    int rc = 0;
+    if (access(j->old_path, F_OK) != 0) {
+        pthread_rwlock_wrlock(&j->lock);
+        if (rename(j->journal_path, j->old_path) == 0) {
+            int fd = open_log(j->journal_path);
+            if (fd >= 0) {
+                close(j->fd);
+                j->fd = fd;
+                __atomic_store_n(&j->journal_bytes, (long long)sizeof(journal_header_t), __ATOMIC_RELAXED);
+            } else {
+                rename(j->old_path, j->journal_path);
+                rc = -1;
+            }
+        } else {
+            rc = -1;
+        }
+        pthread_rwlock_unlock(&j->lock);
+    }
+    if (rc == 0) {
+        rc = write_snapshot(j);
+    }
+    if (rc == 0) {
+        unlink(j->old_path);
+    }
+    pthread_mutex_unlock(&j->checkpoint_mutex);
+    return rc;
+}
+
+static void *journal_main(void *arg) {
+    cache_journal_t *j = (cache_journal_t *)arg;
+    pthread_mutex_lock(&j->mutex);
+    while (!j->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += JOURNAL_COMPACT_INTERVAL;
+        pthread_cond_timedwait(&j->wake, &j->mutex, &deadline);
+        if (j->stop) {
+            break;
+        }
+        long long bytes = __atomic_load_n(&j->journal_bytes, __ATOMIC_RELAXED);
+        long long snap = __atomic_load_n(&j->snapshot_bytes, __ATOMIC_RELAXED);
+        if (bytes < JOURNAL_COMPACT_BYTES || bytes < snap) {
+            continue;
+        }
+        pthread_mutex_unlock(&j->mutex);
+        cache_journal_checkpoint(j);
+        pthread_mutex_lock(&j->mutex);
+    }
+    pthread_mutex_unlock(&j->mutex);
+    return NULL;
+}
+
+static void count_files(const cache_index_entry_t *e, void *arg) {
+    if (e->loc.segment < 0) {
+        (*(size_t *)arg)++;
+    }
+}
+
+/*
+ * Загружает снимок и журналы в индекс (после сегментов) и сразу пишет новый
+ * снимок, чтобы следующий запуск читал один файл, а журнал начинался с
+ * целой записи. fresh = 1, если ни снимка, ни журнала не было.
+ */
+cache_journal_t *cache_journal_open(const char *cache_dir, cache_index_t *index, cache_journal_resolve_t resolve,
+                                    void *arg) {
+    cache_journal_t *j = (cache_journal_t *)calloc(1, sizeof(cache_journal_t));
+    if (!j) {
+        return NULL;
+    }
+    if (snprintf(j->snapshot_path, sizeof(j->snapshot_path), "%s/index.snap", cache_dir) >=
+            (int)sizeof(j->snapshot_path) ||
+        snprintf(j->journal_path, sizeof(j->journal_path), "%s/index.journal", cache_dir) >=
+            (int)sizeof(j->journal_path) ||
+        snprintf(j->old_path, sizeof(j->old_path), "%s/index.journal.old", cache_dir) >= (int)sizeof(j->old_path)) {
+        free(j);
+        return NULL;
+    }
+    j->index = index;
+    j->fd = -1;
+
+    int found = 0;
+    found |= load_file(j, j->snapshot_path, JOURNAL_SNAPSHOT_MAGIC, resolve, arg) == 0;
+    found |= load_file(j, j->old_path, JOURNAL_LOG_MAGIC, resolve, arg) == 0;
+    found |= load_file(j, j->journal_path, JOURNAL_LOG_MAGIC, resolve, arg) == 0;
+    j->fresh = !found;
+    cache_index_foreach(index, count_files, &j->loaded);
+
+    if (write_snapshot(j) != 0) {
+        free(j);
+        return NULL;
+    }
+    unlink(j->old_path);
+    j->fd = open_log(j->journal_path);
+    if (j->fd < 0) {
+        free(j);
+        return NULL;
+    }
+    j->journal_bytes = sizeof(journal_header_t);
+
+    pthread_rwlock_init(&j->lock, NULL);
+    pthread_mutex_init(&j->checkpoint_mutex, NULL);
+    pthread_mutex_init(&j->mutex, NULL);
+    pthread_cond_init(&j->wake, NULL);
+    if (pthread_create(&j->thread, NULL, journal_main, j) != 0) {
+        pthread_rwlock_destroy(&j->lock);
+        pthread_mutex_destroy(&j->checkpoint_mutex);
+        pthread_mutex_destroy(&j->mutex);
+        pthread_cond_destroy(&j->wake);
+        close(j->fd);
+        free(j);
+        return NULL;
+    }
+    return j;
+}
+
+/* При остановке пишется последний снимок: следующий запуск обойдётся без журнала. */
+void cache_journal_close(cache_journal_t *j) {
+    if (!j) {
+        return;
+    }
+    pthread_mutex_lock(&j->mutex);
+    j->stop = 1;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->mutex);
+    pthread_join(j->thread, NULL);
+    cache_journal_checkpoint(j);
+    pthread_rwlock_destroy(&j->lock);
+    pthread_mutex_destroy(&j->checkpoint_mutex);
+    pthread_mutex_destroy(&j->mutex);
+    pthread_cond_destroy(&j->wake);
+    close(j->fd);
+    free(j);
+}
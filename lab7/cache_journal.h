@@ -0,0 +1,101 @@
+#ifndef CACHE_JOURNAL_H
+#define CACHE_JOURNAL_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "cache_index.h"
+
+#define JOURNAL_SNAPSHOT_MAGIC 0x50414e53u
+#define JOURNAL_LOG_MAGIC 0x4c4e524au
+#define JOURNAL_RECORD_MAGIC 0x3143524du
+#define JOURNAL_VERSION 2
+#define JOURNAL_COMPACT_BYTES (4 * 1024 * 1024)
+#define JOURNAL_COMPACT_INTERVAL 10
+
+enum {
+    JOURNAL_PUT = 1,
+    JOURNAL_DEL = 2,
+    JOURNAL_STATS = 3
+};
+
+/* Заголовок снимка и журнала; файл другой версии при загрузке не читается. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+} journal_header_t;
+
+/*
+ * Запись о файле <hash>.cache. За ней идут last_modified_len байт Last-Modified
+ * и etag_len байт ETag без завершающих нулей, выровненные до 8 байт. В
+ * журнале hits = 0; в снимке записи JOURNAL_STATS хранят только счётчики
+ * объектов из сегментов, метаданные которых лежат в самих сегментах.
+ */
+typedef struct {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t must_revalidate;
+    uint8_t last_modified_len;
+    uint8_t etag_len;
+    uint64_t hash;
+    int64_t stored_at;
+    int64_t validated_at;
+    int64_t expires;
+    int64_t size;
+    int64_t last_access;
+    uint32_t header_len;
+    uint32_t hits;
+    uint32_t stale_while_revalidate;
+    uint32_t stale_if_error;
+    uint32_t checksum;
+    uint32_t reserved;
+} journal_record_t;
+
+/*
+ * Вызывается при загрузке, если для ключа из журнала в индексе уже есть
+ * версия из сегмента. Возвращает 1, если версия из файла новее и должна её
+ * заменить.
+ */
+typedef int (*cache_journal_resolve_t)(uint64_t hash, const cache_meta_t *meta, void *arg);
+
+/*
+ * Метаданные объектов в отдельных файлах: двоичный снимок индекса
+ * (index.snap) и журнал изменений после него (index.journal). Изменения
+ * дописываются в журнал одним write с O_APPEND. Когда журнал вырастает,
+ * фоновый поток переименовывает его в index.journal.old, пишет новый снимок
+ * по индексу в памяти и удаляет старый журнал. При загрузке читаются снимок и
+ * оба журнала по порядку; записи полные, поэтому повтор уже учтённых
+ * изменений безопасен.
+ */
+typedef struct {
+    char snapshot_path[PATH_MAX];
+    char journal_path[PATH_MAX];
+    char old_path[PATH_MAX];
+    cache_index_t *index;
+    int fd;
+    int fresh;
+    size_t loaded;
+    long long journal_bytes;
+    long long snapshot_bytes;
+    pthread_rwlock_t lock;
+    pthread_mutex_t checkpoint_mutex;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int stop;
+    unsigned long long appended;
+    unsigned long long snapshots;
+} cache_journal_t;
+
+cache_journal_t *cache_journal_open(const char *cache_dir, cache_index_t *index, cache_journal_resolve_t resolve,
+                                    void *arg);
+int cache_journal_put(cache_journal_t *j, uint64_t hash, const cache_meta_t *meta, off_t size);
+int cache_journal_del(cache_journal_t *j, uint64_t hash);
+int cache_journal_checkpoint(cache_journal_t *j);
+void cache_journal_close(cache_journal_t *j);
+
+#endif
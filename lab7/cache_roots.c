@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include "cache_roots.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t fnv1a(const char *s, uint64_t h) {
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int point_cmp(const void *a, const void *b) {
+    const cache_ring_point_t *x = (const cache_ring_point_t *)a;
+    const cache_ring_point_t *y = (const cache_ring_point_t *)b;
+    if (x->point != y->point) {
+        return x->point < y->point ? -1 : 1;
+    }
+    return x->root - y->root;
+}
+
+/*
+ * Точки корня зависят только от его пути и номера точки, поэтому порядок
+ * -cache_dir в командной строке на размещение не влияет.
+ */
+static int build_ring(cache_roots_t *roots) {
+    long long smallest = 0;
+    for (int i = 0; i < roots->count; i++) {
+        long long b = roots->roots[i].max_bytes;
+        if (b > 0 && (smallest == 0 || b < smallest)) {
+            smallest = b;
+        }
+    }
+    size_t points[CACHE_ROOTS_MAX];
+    size_t total = 0;
+    for (int i = 0; i < roots->count; i++) {
+        long long b = roots->roots[i].max_bytes;
+        long long n = CACHE_RING_POINTS;
+        if (b > 0 && smallest > 0) {
+            n = CACHE_RING_POINTS * b / smallest;
+            if (n > CACHE_RING_POINTS * 64) {
+                n = CACHE_RING_POINTS * 64;
+            }
+        }
+        points[i] = (size_t)n;
+        total += points[i];
+    }
+    roots->ring = (cache_ring_point_t *)calloc(total, sizeof(cache_ring_point_t));
+    if (!roots->ring) {
+        return -1;
+    }
+    size_t k = 0;
+    for (int i = 0; i < roots->count; i++) {
+        uint64_t base = fnv1a(roots->roots[i].dir, 0xcbf29ce484222325ULL);
+        for (size_t j = 0; j < points[i]; j++) {
+            roots->ring[k].point = mix64(base + j * 0x9e3779b97f4a7c15ULL);
+            roots->ring[k].root = i;
+            k++;
+        }
+    }
+    qsort(roots->ring, total, sizeof(cache_ring_point_t), point_cmp);
+    roots->ring_len = total;
+    return 0;
+}
+
+/* max_bytes[i] равно 0, если у корня нет ограничения; slow_ms и queue_limit 0 — проверка выключена. */
+cache_roots_t *cache_roots_create(int count, char dirs[][PATH_MAX], const long long *max_bytes, int slow_ms,
+                                  int queue_limit, cache_root_down_t on_down, void *arg) {
+    if (count <= 0 || count > CACHE_ROOTS_MAX) {
+        return NULL;
+    }
+    cache_roots_t *roots = (cache_roots_t *)calloc(1, sizeof(cache_roots_t));
+    if (!roots) {
+        return NULL;
+    }
+    roots->count = count;
+    roots->slow_ms = slow_ms;
+    roots->queue_limit = queue_limit;
+    roots->on_down = on_down;
+    roots->arg = arg;
+    for (int i = 0; i < count; i++) {
+        char *dir = roots->roots[i].dir;
+        snprintf(dir, sizeof(roots->roots[i].dir), "%s", dirs[i]);
+        size_t len = strlen(dir);
+        while (len > 1 && dir[len - 1] == '/') {
+            dir[--len] = '\0';
+        }
+        roots->roots[i].max_bytes = max_bytes[i];
+    }
+    if (build_ring(roots) != 0) {
+        free(roots);
+        return NULL;
+    }
+    return roots;
+}
+
+/*
+ * Создаёт подкаталоги 00..ff и переносит в них файлы <ключ>.cache, оставшиеся
+ * в корне от прежней плоской раскладки. Возвращает число перенесённых файлов.
+ */
+int cache_root_prepare(const char *dir) {
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    for (int i = 0; i < CACHE_SUBDIRS; i++) {
+        char sub[8];
+        snprintf(sub, sizeof(sub), "%02x", i);
+        if (mkdirat(dir_fd, sub, 0755) != 0 && errno != EEXIST) {
+            close(dir_fd);
+            return -1;
+        }
+    }
+    int fd = dup(dir_fd);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        close(dir_fd);
+        return -1;
+    }
+    int moved = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        if (strlen(name) != 16 + 6 || strcmp(name + 16, ".cache") != 0 ||
+            strspn(name, "0123456789abcdef") != 16) {
+            continue;
+        }
+        char to[64];
+        snprintf(to, sizeof(to), "%.2s/%s", name, name);
+        if (renameat(dir_fd, name, dir_fd, to) == 0) {
+            moved++;
+        }
+    }
+    closedir(d);
+    close(dir_fd);
+    return moved;
+}
+
+int cache_root_usable(const cache_root_t *root, time_t now) {
+    return __atomic_load_n(&root->down_until, __ATOMIC_RELAXED) <= now;
+}
+
+/*
+ * Владелец ключа на кольце. Если все корни выведены из работы, ключ остаётся
+ * у своего владельца: запрос к диску всё равно лучше, чем отказ от кэша.
+ */
+cache_root_t *cache_roots_pick(cache_roots_t *roots, uint64_t hash) {
+    if (roots->count == 1) {
+        return &roots->roots[0];
+    }
+    uint64_t point = mix64(hash);
+    size_t lo = 0;
+    size_t hi = roots->ring_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (roots->ring[mid].point < point) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    time_t now = time(NULL);
+    int owner = -1;
+    for (size_t i = 0; i < roots->ring_len; i++) {
+        int r = roots->ring[(lo + i) % roots->ring_len].root;
+        if (owner < 0) {
+            owner = r;
+        }
+        if (cache_root_usable(&roots->roots[r], now)) {
+            return &roots->roots[r];
+        }
+    }
+    return &roots->roots[owner];
+}
+
+/*
+ * Корень, в котором лежит путь. Запрос выбирает корень один раз, когда
+ * строит путь объекта, и дальше находит его по пути: если корень тем временем
+ * выведут из работы, файл и запись индекса всё равно окажутся в одном месте.
+ */
+cache_root_t *cache_roots_find(cache_roots_t *roots, const char *path) {
+    cache_root_t *best = NULL;
+    size_t best_len = 0;
+    for (int i = 0; i < roots->count; i++) {
+        size_t len = strlen(roots->roots[i].dir);
+        if (len > best_len && strncmp(path, roots->roots[i].dir, len) == 0 && path[len] == '/') {
+            best = &roots->roots[i];
+            best_len = len;
+        }
+    }
+    return best ? best : &roots->roots[0];
+}
+
+/* Путь объекта: <корень>/<первые два символа ключа>/<ключ><suffix>. */
+int cache_root_path(const cache_root_t *root, const char *key, const char *suffix, char *out, size_t out_sz) {
+    int n = snprintf(out, out_sz, "%s/%.2s/%s%s", root->dir, key, key, suffix);
+    return n < 0 || (size_t)n >= out_sz ? -1 : 0;
+}
+
+static void take_down(cache_roots_t *roots, cache_root_t *root, int reason) {
+    time_t now = time(NULL);
+    time_t until = __atomic_load_n(&root->down_until, __ATOMIC_RELAXED);
+    if (until > now) {
+        return;
+    }
+    /* Из нескольких потоков, заметивших сбой одновременно, выводит корень один. */
+    if (!__atomic_compare_exchange_n(&root->down_until, &until, now + CACHE_ROOT_RETRY, 0, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_store_n(&root->state, reason, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&root->outages, 1, __ATOMIC_RELAXED);
+    if (roots->on_down) {
+        roots->on_down(root, reason, roots->arg);
+    }
+}
+
+/* Начало дисковой операции; возвращает время начала для cache_root_io_end. */
+long long cache_root_io_begin(cache_roots_t *roots, cache_root_t *root) {
+    int depth = __atomic_add_fetch(&root->pending, 1, __ATOMIC_RELAXED);
+    int seen = __atomic_load_n(&root->max_pending, __ATOMIC_RELAXED);
+    while (depth > seen &&
+           !__atomic_compare_exchange_n(&root->max_pending, &seen, depth, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    if (roots->queue_limit > 0 && roots->count > 1 && depth > roots->queue_limit) {
+        take_down(roots, root, CACHE_ROOT_BUSY);
+    }
+    return now_ms();
+}
+
+/*
+ * Конец дисковой операции. С единственным корнем выводить некуда, поэтому
+ * тогда только считается статистика.
+ */
+void cache_root_io_end(cache_roots_t *roots, cache_root_t *root, long long started, int failed) {
+    long long elapsed = now_ms() - started;
+    __atomic_sub_fetch(&root->pending, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&root->ops, 1, __ATOMIC_RELAXED);
+    int reason = CACHE_ROOT_UP;
+    if (failed) {
+        __atomic_add_fetch(&root->errors, 1, __ATOMIC_RELAXED);
+        reason = CACHE_ROOT_FAILED;
+    } else if (roots->slow_ms > 0 && elapsed > roots->slow_ms) {
+        __atomic_add_fetch(&root->slow, 1, __ATOMIC_RELAXED);
+        reason = CACHE_ROOT_SLOW;
+    }
+    if (reason != CACHE_ROOT_UP && roots->count > 1) {
+        take_down(roots, root, reason);
+    }
+}
+
+/* Ошибка, замеченная уже после операции (например, при записи тела в файл). */
+void cache_root_error(cache_roots_t *roots, cache_root_t *root) {
+    __atomic_add_fetch(&root->errors, 1, __ATOMIC_RELAXED);
+    if (roots->count > 1) {
+        take_down(roots, root, CACHE_ROOT_FAILED);
+    }
+}
+
+void cache_roots_destroy(cache_roots_t *roots) {
+    if (!roots) {
+        return;
+    }
+    for (int i = 0; i < roots->count; i++) {
+        cache_root_t *root = &roots->roots[i];
+        cache_evictor_destroy(root->evictor);
+        cache_journal_close(root->journal);
+        slab_store_close(root->slab);
+        cache_index_destroy(root->index);
+    }
+    free(roots->ring);
+    free(roots);
+}
@@ -0,0 +1,89 @@
+#ifndef CACHE_ROOTS_H
+#define CACHE_ROOTS_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "cache_evictor.h"
+#include "cache_index.h"
+#include "cache_journal.h"
+#include "slab_store.h"
+
+#define CACHE_ROOTS_MAX 16
+#define CACHE_RING_POINTS 128
+#define CACHE_ROOT_RETRY 30
+
+enum {
+    CACHE_ROOT_UP = 0,
+    CACHE_ROOT_FAILED = 1,
+    CACHE_ROOT_SLOW = 2,
+    CACHE_ROOT_BUSY = 3
+};
+
+/*
+ * Корень кэша на отдельном диске: свой индекс, сегменты, журнал и поток
+ * вытеснения. pending — число дисковых операций, которые идут прямо сейчас
+ * (глубина очереди к диску). Ошибка ввода-вывода, слишком медленная операция
+ * или переполненная очередь выводят корень из работы на CACHE_ROOT_RETRY
+ * секунд; после этого он снова получает запросы, и первая же неудача выводит
+ * его опять.
+ */
+typedef struct {
+    char dir[PATH_MAX];
+    long long max_bytes;
+    long long max_objects;
+    cache_index_t *index;
+    slab_store_t *slab;
+    cache_journal_t *journal;
+    cache_evictor_t *evictor;
+    int pending;
+    int max_pending;
+    int state;
+    time_t down_until;
+    unsigned long long ops;
+    unsigned long long errors;
+    unsigned long long slow;
+    unsigned long long outages;
+} cache_root_t;
+
+typedef struct {
+    uint64_t point;
+    int root;
+} cache_ring_point_t;
+
+/* Вызывается, когда корень выводится из работы; reason — CACHE_ROOT_FAILED и т.д. */
+typedef void (*cache_root_down_t)(const cache_root_t *root, int reason, void *arg);
+
+/*
+ * Корни кэша и кольцо согласованного хеширования над ними. У каждого корня
+ * CACHE_RING_POINTS точек на каждую долю ёмкости, поэтому диск вдвое больше
+ * получает вдвое больше объектов, а добавление диска переносит только его
+ * долю ключей. Ключ принадлежит первой точке по часовой стрелке; выведенные
+ * из работы корни пропускаются, и их ключи временно уходят соседям.
+ */
+typedef struct {
+    cache_root_t roots[CACHE_ROOTS_MAX];
+    int count;
+    cache_ring_point_t *ring;
+    size_t ring_len;
+    int slow_ms;
+    int queue_limit;
+    cache_root_down_t on_down;
+    void *arg;
+} cache_roots_t;
+
+cache_roots_t *cache_roots_create(int count, char dirs[][PATH_MAX], const long long *max_bytes, int slow_ms,
+                                  int queue_limit, cache_root_down_t on_down, void *arg);
+int cache_root_prepare(const char *dir);
+cache_root_t *cache_roots_pick(cache_roots_t *roots, uint64_t hash);
+cache_root_t *cache_roots_find(cache_roots_t *roots, const char *path);
+int cache_root_path(const cache_root_t *root, const char *key, const char *suffix, char *out, size_t out_sz);
+long long cache_root_io_begin(cache_roots_t *roots, cache_root_t *root);
+void cache_root_io_end(cache_roots_t *roots, cache_root_t *root, long long started, int failed);
+void cache_root_error(cache_roots_t *roots, cache_root_t *root);
+int cache_root_usable(const cache_root_t *root, time_t now);
+void cache_roots_destroy(cache_roots_t *roots);
+
+#endif
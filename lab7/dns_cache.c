@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include "dns_cache.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DNS_NEGATIVE_TTL 10
+#define DNS_STALE_TTL 30
+#define DNS_RESOLVE_TIMEOUT 10
+#define DNS_MAX_ENTRIES_PER_SHARD 256
+#define DNS_ANSWER_SIZE 4096
+
+/* Состояние резолвера своё у каждого потока пула. */
+static __thread struct __res_state resolver_state;
+static __thread int res_ready = 0;
+
+static unsigned hash_host(const char *host) {
+    uint32_t h = 2166136261u;
+    for (const char *p = host; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void add_addr(dns_addrs_t *out, const void *sa, socklen_t len) {
+    if (out->count >= DNS_MAX_ADDRS || len > sizeof(struct sockaddr_storage)) {
+        return;
+    }
+    memcpy(&out->addrs[out->count], sa, len);
+    out->lens[out->count] = len;
+    out->count++;
+}
+
+static int parse_literal(const char *host, dns_addrs_t *out) {
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+    memset(&sin, 0, sizeof(sin));
+    memset(&sin6, 0, sizeof(sin6));
+    if (inet_pton(AF_INET, host, &sin.sin_addr) == 1) {
+        sin.sin_family = AF_INET;
+        add_addr(out, &sin, sizeof(sin));
+        return 1;
+    }
+    if (inet_pton(AF_INET6, host, &sin6.sin6_addr) == 1) {
+        sin6.sin6_family = AF_INET6;
+        add_addr(out, &sin6, sizeof(sin6));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Запрос записей одного типа через res_nsearch: в отличие от getaddrinfo он
+ * отдаёт TTL. Возвращает минимальный TTL среди ответов или -1.
+ */
+static long query_records(const char *host, int type, dns_addrs_t *out) {
+    unsigned char answer[DNS_ANSWER_SIZE];
+    int len = res_nsearch(&resolver_state, host, ns_c_in, type, answer, sizeof(answer));
+    if (len < 0) {
+        return -1;
+    }
+    if (len > (int)sizeof(answer)) {
+        len = (int)sizeof(answer);
+    }
+
+    ns_msg msg;
+    if (ns_initparse(answer, len, &msg) != 0) {
+        return -1;
+    }
+
+    long ttl = -1;
+    int found = 0;
+    int count = ns_msg_count(msg, ns_s_an);
+    for (int i = 0; i < count; i++) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, i, &rr) != 0) {
+            break;
+        }
+        long rr_ttl = (long)ns_rr_ttl(rr);
+        if (ttl < 0 || rr_ttl < ttl) {
+            ttl = rr_ttl;
+        }
+        if (ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == 4) {
+            struct sockaddr_in sin;
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET;
+            memcpy(&sin.sin_addr, ns_rr_rdata(rr), 4);
+            add_addr(out, &sin, sizeof(sin));
+            found = 1;
+        } else if (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == 16) {
+            struct sockaddr_in6 sin6;
+            memset(&sin6, 0, sizeof(sin6));
+            sin6.sin6_family = AF_INET6;
+            memcpy(&sin6.sin6_addr, ns_rr_rdata(rr), 16);
+            add_addr(out, &sin6, sizeof(sin6));
+            found = 1;
+        }
+    }
+    return found ? ttl : -1;
+}
+
+/*
+ * Сначала DNS (A и AAAA) — ради TTL записей. Если DNS ничего не дал (имя из
+ * /etc/hosts, локальная сеть без сервера имён), используется getaddrinfo,
+ * а время жизни берётся равным max_ttl. Возвращает 0 или код EAI_*.
+ */
+static int resolve_host(const char *host, int max_ttl, dns_addrs_t *out, long *ttl) {
+    memset(out, 0, sizeof(*out));
+
+    if (!res_ready && res_ninit(&resolver_state) == 0) {
+        res_ready = 1;
+    }
+    if (res_ready) {
+        long ttl_a = query_records(host, ns_t_a, out);
+        long ttl_aaaa = query_records(host, ns_t_aaaa, out);
+        if (out->count > 0) {
+            *ttl = ttl_a;
+            if (*ttl < 0 || (ttl_aaaa >= 0 && ttl_aaaa < *ttl)) {
+                *ttl = ttl_aaaa;
+            }
+            return 0;
+        }
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(host, NULL, &hints, &res);
+    if (rc != 0) {
+        return rc;
+    }
+    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+        add_addr(out, p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(res);
+    if (out->count == 0) {
+        return EAI_NONAME;
+    }
+    *ttl = max_ttl;
+    return 0;
+}
+
+/* Удаляет записи, которые уже нельзя отдать даже устаревшими. */
+static void shard_sweep(dns_shard_t *shard, time_t now) {
+    for (int b = 0; b < DNS_BUCKETS_PER_SHARD; b++) {
+        dns_entry_t **pp = &shard->buckets[b];
+        while (*pp) {
+            dns_entry_t *e = *pp;
+            if (!e->resolving && e->waiters == 0 && e->stale_until <= now && e->expires <= now) {
+                *pp = e->next;
+                free(e);
+                shard->count--;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+}
+
+static dns_entry_t *shard_find(dns_cache_t *cache, dns_shard_t *shard, unsigned shard_idx,
+                               unsigned h, const char *host) {
+    unsigned b = (h / DNS_SHARDS) % DNS_BUCKETS_PER_SHARD;
+    for (dns_entry_t *e = shard->buckets[b]; e; e = e->next) {
+        if (strcmp(e->host, host) == 0) {
+            return e;
+        }
+    }
+
+    if (shard->count >= DNS_MAX_ENTRIES_PER_SHARD) {
+        shard_sweep(shard, time(NULL));
+    }
+    dns_entry_t *e = (dns_entry_t *)calloc(1, sizeof(dns_entry_t));
+    if (!e) {
+        return NULL;
+    }
+    snprintf(e->host, sizeof(e->host), "%s", host);
+    e->shard = shard_idx;
+    e->cache = cache;
+    e->next = shard->buckets[b];
+    shard->buckets[b] = e;
+    shard->count++;
+    return e;
+}
+
+static void resolve_job(work_item_t *item) {
+    dns_entry_t *e = container_of(item, dns_entry_t, work);
+    dns_cache_t *cache = e->cache;
+    dns_shard_t *shard = &cache->shards[e->shard];
+
+    /* host записи не меняется после создания, читать его можно без блокировки. */
+    dns_addrs_t addrs;
+    long ttl = 0;
+    int rc = resolve_host(e->host, cache->max_ttl, &addrs, &ttl);
+
+    time_t now = time(NULL);
+    if (ttl > cache->max_ttl) {
+        ttl = cache->max_ttl;
+    }
+    if (ttl < 1 && cache->max_ttl > 0) {
+        ttl = 1;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    if (rc == 0) {
+        e->result = addrs;
+        e->has_result = 1;
+        e->last_error = 0;
+        e->expires = now + ttl;
+        e->stale_until = cache->max_ttl > 0 ? e->expires + DNS_STALE_TTL : e->expires;
+    } else if (e->has_result && now < e->stale_until) {
+        /* Сервер имён недоступен: старые адреса остаются в ходу до конца окна. */
+        e->expires = now + (cache->max_ttl > 0 ? DNS_NEGATIVE_TTL : 0);
+        if (e->expires > e->stale_until) {
+            e->expires = e->stale_until;
+        }
+    } else {
+        e->has_result = 0;
+        e->last_error = rc;
+        e->expires = now + (cache->max_ttl > 0 ? DNS_NEGATIVE_TTL : 0);
+        e->stale_until = e->expires;
+    }
+    e->resolving = 0;
+    e->generation++;
+    pthread_cond_broadcast(&shard->resolved);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static void start_resolve(dns_cache_t *cache, dns_entry_t *e) {
+    e->resolving = 1;
+    e->work.fn = resolve_job;
+    work_pool_submit(cache->resolvers, &e->work);
+}
+
+static int copy_result(const dns_entry_t *e, dns_addrs_t *out, char *err, size_t errsz) {
+    if (!e->has_result) {
+        snprintf(err, errsz, "DNS: %s", gai_strerror(e->last_error));
+        return -1;
+    }
+    *out = e->result;
+    return 0;
+}
+
+dns_cache_t *dns_cache_create(int resolver_threads, int max_ttl) {
+    dns_cache_t *cache = (dns_cache_t *)calloc(1, sizeof(dns_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    cache->max_ttl = max_ttl;
+    for (int i = 0; i < DNS_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].mutex, NULL);
+        pthread_cond_init(&cache->shards[i].resolved, NULL);
+    }
+    cache->resolvers = work_pool_create(resolver_threads);
+    if (!cache->resolvers) {
+        dns_cache_destroy(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/*
+ * Разрешение имени идёт в пуле резолверов. Одновременные запросы одного имени
+ * ждут одно и то же разрешение; недавно истёкшая запись отдаётся сразу, а
+ * обновляется в фоне.
+ */
+int dns_cache_lookup(dns_cache_t *cache, const char *host, dns_addrs_t *out, char *err, size_t errsz) {
+    memset(out, 0, sizeof(*out));
+    if (parse_literal(host, out)) {
+        return 0;
+    }
+
+    char key[256];
+    size_t i = 0;
+    for (; host[i] && i + 1 < sizeof(key); i++) {
+        key[i] = (char)tolower((unsigned char)host[i]);
+    }
+    key[i] = '\0';
+
+    unsigned h = hash_host(key);
+    unsigned shard_idx = h % DNS_SHARDS;
+    dns_shard_t *shard = &cache->shards[shard_idx];
+
+    pthread_mutex_lock(&shard->mutex);
+    dns_entry_t *e = shard_find(cache, shard, shard_idx, h, key);
+    if (!e) {
+        pthread_mutex_unlock(&shard->mutex);
+        snprintf(err, errsz, "DNS: недостаточно памяти");
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    if (e->generation > 0 && now < e->expires) {
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+        int rc = copy_result(e, out, err, errsz);
+        pthread_mutex_unlock(&shard->mutex);
+        return rc;
+    }
+    if (e->has_result && now < e->stale_until) {
+        __atomic_add_fetch(&cache->stale_hits, 1, __ATOMIC_RELAXED);
+        if (!e->resolving) {
+            start_resolve(cache, e);
+        }
+        *out = e->result;
+        pthread_mutex_unlock(&shard->mutex);
+        return 0;
+    }
+
+    if (e->resolving) {
+        __atomic_add_fetch(&cache->coalesced, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        start_resolve(cache, e);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DNS_RESOLVE_TIMEOUT;
+
+    unsigned long gen = e->generation;
+    e->waiters++;
+    while (e->generation == gen) {
+        if (pthread_cond_timedwait(&shard->resolved, &shard->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    e->waiters--;
+
+    int rc;
+    if (e->generation == gen) {
+        snprintf(err, errsz, "DNS: истекло время разрешения %s", host);
+        rc = -1;
+    } else {
+        rc = copy_result(e, out, err, errsz);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return rc;
+}
+
+void dns_cache_destroy(dns_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    work_pool_destroy(cache->resolvers);
+    for (int i = 0; i < DNS_SHARDS; i++) {
+        dns_shard_t *shard = &cache->shards[i];
+        for (int b = 0; b < DNS_BUCKETS_PER_SHARD; b++) {
+            dns_entry_t *e = shard->buckets[b];
+            while (e) {
+                dns_entry_t *next = e->next;
+                free(e);
+                e = next;
+            }
+        }
+        pthread_mutex_destroy(&shard->mutex);
+        pthread_cond_destroy(&shard->resolved);
+    }
+    free(cache);
+}
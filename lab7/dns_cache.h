@@ -0,0 +1,65 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "work_pool.h"
+
+#define DNS_MAX_ADDRS 8
+#define DNS_SHARDS 16
+#define DNS_BUCKETS_PER_SHARD 64
+
+typedef struct {
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+    socklen_t lens[DNS_MAX_ADDRS];
+    int count;
+} dns_addrs_t;
+
+struct dns_cache;
+
+/*
+ * Запись кэша живёт, пока по ней идёт разрешение (resolving) или её ждут
+ * обработчики (waiters); generation растёт после каждого завершённого
+ * разрешения, по ней ожидающие узнают, что результат готов.
+ */
+typedef struct dns_entry {
+    char host[256];
+    unsigned shard;
+    dns_addrs_t result;
+    int has_result;
+    int last_error;
+    time_t expires;
+    time_t stale_until;
+    int resolving;
+    int waiters;
+    unsigned long generation;
+    struct dns_cache *cache;
+    struct dns_entry *next;
+    work_item_t work;
+} dns_entry_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t resolved;
+    dns_entry_t *buckets[DNS_BUCKETS_PER_SHARD];
+    size_t count;
+} dns_shard_t;
+
+typedef struct dns_cache {
+    dns_shard_t shards[DNS_SHARDS];
+    work_pool_t *resolvers;
+    int max_ttl;
+    unsigned long long hits;
+    unsigned long long stale_hits;
+    unsigned long long misses;
+    unsigned long long coalesced;
+} dns_cache_t;
+
+dns_cache_t *dns_cache_create(int resolver_threads, int max_ttl);
+int dns_cache_lookup(dns_cache_t *cache, const char *host, dns_addrs_t *out, char *err, size_t errsz);
+void dns_cache_destroy(dns_cache_t *cache);
+
+#endif
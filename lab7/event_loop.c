@@ -0,0 +1,831 @@
+#define _GNU_SOURCE
+#include "event_loop.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define CONN_BUF_INITIAL 4096
+#define LOOP_MAX_EVENTS 256
+#define LOOP_TICK_MS 1000
+#define TUNNEL_CHUNK (64 * 1024)
+#define TUNNEL_BUDGET (1024 * 1024)
+
+/* Список соединений, упорядоченный по last_active: в хвосте — последнее активное. */
+typedef struct {
+    conn_t *head;
+    conn_t *tail;
+} conn_list_t;
+
+/*
+ * Одно направление туннеля: байты из сокета-источника переносятся splice в
+ * канал, а из канала в сокет-приёмник, не попадая в память процесса. eof —
+ * источник закрыл передачу; когда канал опустел, приёмнику делается
+ * shutdown(SHUT_WR) (shut).
+ */
+typedef struct {
+    int pipe_r;
+    int pipe_w;
+    size_t in_pipe;
+    int eof;
+    int shut;
+    unsigned long long bytes;
+} tunnel_dir_t;
+
+struct tunnel {
+    int server_fd;
+    tunnel_dir_t up;
+    tunnel_dir_t down;
+    time_t started;
+    char target[256];
+};
+
+struct event_loop {
+    pthread_t thread;
+    int epfd;
+    int wake_fd;
+    int listen_tag;
+    int wake_tag;
+    conn_list_t idle;
+    conn_list_t tunnels;
+    conn_list_t feeds;
+    size_t conns;
+    pthread_mutex_t release_mutex;
+    conn_t *released;
+    conn_t *closed;
+};
+
+static event_loop_config_t loop_cfg;
+static event_loop_t *loops = NULL;
+static int loops_started = 0;
+
+static int set_nonblocking(int fd, int enable) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/* 0 секунд — без таймаута. */
+static void set_timeout(int fd, int optname, int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof(tv));
+}
+
+static void list_unlink(conn_list_t *list, conn_t *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else if (list->head == c) {
+        list->head = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else if (list->tail == c) {
+        list->tail = c->prev;
+    }
+    c->prev = NULL;
+    c->next = NULL;
+}
+
+static void list_touch(conn_list_t *list, conn_t *c) {
+    list_unlink(list, c);
+    c->last_active = time(NULL);
+    c->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = c;
+    } else {
+        list->head = c;
+    }
+    list->tail = c;
+}
+
+static void conn_free(conn_t *c) {
+    close(c->fd);
+    free(c->buf);
+    __atomic_sub_fetch(&c->loop->conns, 1, __ATOMIC_RELAXED);
+    free(c);
+}
+
+static void loop_drop(event_loop_t *loop, conn_t *c) {
+    list_unlink(&loop->idle, c);
+    conn_free(c);
+}
+
+static void loop_reject(event_loop_t *loop, conn_t *c, const char *reason) {
+    char resp[256];
+    int n = snprintf(resp, sizeof(resp),
+                     "HTTP/1.0 400 Bad Request\r\n"
+                     "Content-Type: text/plain; charset=utf-8\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n"
+                     "\r\n"
+                     "%s",
+                     strlen(reason), reason);
+    if (n > 0 && (size_t)n < sizeof(resp)) {
+        send(c->fd, resp, (size_t)n, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    loop_drop(loop, c);
+}
+
+/*
+ * В обработчике сокет клиента блокирующий, поэтому каждое чтение и запись
+ * ограничены таймаутом: клиент, который перестал слать тело запроса или
+ * забирать ответ, не держит обработчик вечно.
+ */
+static void conn_dispatch(work_item_t *item) {
+    conn_t *c = container_of(item, conn_t, work);
+    set_nonblocking(c->fd, 0);
+    set_timeout(c->fd, SO_RCVTIMEO, loop_cfg.client_recv_timeout);
+    set_timeout(c->fd, SO_SNDTIMEO, loop_cfg.client_send_timeout);
+    loop_cfg.handler(c, loop_cfg.handler_arg);
+}
+
+static int loop_arm(event_loop_t *loop, conn_t *c, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    return epoll_ctl(loop->epfd, op, c->fd, &ev);
+}
+
+static void loop_dispatch(conn_t *c) {
+    c->work.fn = conn_dispatch;
+    work_pool_submit(loop_cfg.pool, &c->work);
+}
+
+static void tunnel_dir_close(tunnel_dir_t *d) {
+    if (d->pipe_r >= 0) {
+        close(d->pipe_r);
+    }
+    if (d->pipe_w >= 0) {
+        close(d->pipe_w);
+    }
+}
+
+static void tunnel_free(tunnel_t *t) {
+    tunnel_dir_close(&t->up);
+    tunnel_dir_close(&t->down);
+    free(t);
+}
+
+/* Закрытое соединение освобождается после разбора пачки событий. */
+static void loop_retire(event_loop_t *loop, conn_t *c) {
+    c->closed = 1;
+    c->next = loop->closed;
+    loop->closed = c;
+}
+
+static void tunnel_close(event_loop_t *loop, conn_t *c, int timed_out) {
+    tunnel_t *t = c->tunnel;
+    list_unlink(&loop->tunnels, c);
+    if (loop_cfg.tunnel_done) {
+        tunnel_stats_t stats;
+        stats.target = t->target;
+        stats.client_bytes = t->up.bytes;
+        stats.server_bytes = t->down.bytes;
+        stats.started = t->started;
+        stats.timed_out = timed_out;
+        loop_cfg.tunnel_done(&stats, loop_cfg.handler_arg);
+    }
+    close(t->server_fd);
+    tunnel_free(t);
+    c->tunnel = NULL;
+    loop_retire(loop, c);
+}
+
+/*
+ * Оба сокета туннеля приходят с одним указателем, и событие второго может
+ * лежать в той же пачке, что и событие, закрывшее туннель. Поэтому закрытые
+ * туннели освобождаются только после разбора пачки.
+ */
+static void loop_free_closed(event_loop_t *loop) {
+    while (loop->closed) {
+        conn_t *c = loop->closed;
+        loop->closed = c->next;
+        conn_free(c);
+    }
+}
+
+/*
+ * Переносит в одну сторону всё, что можно без ожидания, но не больше
+ * TUNNEL_BUDGET за раз, чтобы быстрый туннель не занимал цикл. Возвращает
+ * -1, если сокет сломан и туннель пора закрыть.
+ */
+static int tunnel_flow(tunnel_dir_t *d, int from, int to) {
+    size_t moved = 0;
+    while (moved < TUNNEL_BUDGET) {
+        if (d->in_pipe > 0) {
+            ssize_t n = splice(d->pipe_r, NULL, to, NULL, d->in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN ? 0 : -1;
+            }
+            d->in_pipe -= (size_t)n;
+            d->bytes += (unsigned long long)n;
+            moved += (size_t)n;
+            continue;
+        }
+        if (d->eof) {
+            if (!d->shut) {
+                shutdown(to, SHUT_WR);
+                d->shut = 1;
+            }
+            return 0;
+        }
+        ssize_t n = splice(from, NULL, d->pipe_w, NULL, TUNNEL_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            d->eof = 1;
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+        d->in_pipe += (size_t)n;
+    }
+    return 0;
+}
+
+/* События сокета, из которого читает out и в который пишет in. */
+static uint32_t tunnel_events(const tunnel_dir_t *out, const tunnel_dir_t *in) {
+    uint32_t events = 0;
+    if (!out->eof && out->in_pipe == 0) {
+        events |= EPOLLIN;
+    }
+    if (in->in_pipe > 0) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+/*
+ * Взводит fd с указателем на соединение и EPOLLONESHOT; оба сокета туннеля
+ * зарегистрированы с указателем на одно соединение. Сокет, которому сейчас
+ * нечего ждать, не взводится вовсе, иначе EPOLLHUP полузакрытого сокета
+ * будил бы цикл без конца.
+ */
+static int loop_arm_fd(event_loop_t *loop, conn_t *c, int fd, uint32_t events, int op) {
+    if (events == 0 && op == EPOLL_CTL_MOD) {
+        return 0;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = c;
+    return epoll_ctl(loop->epfd, op, fd, &ev);
+}
+
+static void loop_on_tunnel(event_loop_t *loop, conn_t *c) {
+    tunnel_t *t = c->tunnel;
+    unsigned long long before = t->up.bytes + t->down.bytes;
+    if (tunnel_flow(&t->up, c->fd, t->server_fd) != 0 ||
+        tunnel_flow(&t->down, t->server_fd, c->fd) != 0 ||
+        (t->up.shut && t->down.shut)) {
+        tunnel_close(loop, c, 0);
+        return;
+    }
+    if (t->up.bytes + t->down.bytes != before) {
+        list_touch(&loop->tunnels, c);
+    }
+    if (loop_arm_fd(loop, c, c->fd, tunnel_events(&t->up, &t->down), EPOLL_CTL_MOD) != 0 ||
+        loop_arm_fd(loop, c, t->server_fd, tunnel_events(&t->down, &t->up), EPOLL_CTL_MOD) != 0) {
+        tunnel_close(loop, c, 0);
+    }
+}
+
+static void tunnel_start(event_loop_t *loop, conn_t *c) {
+    tunnel_t *t = c->tunnel;
+    t->started = time(NULL);
+    list_touch(&loop->tunnels, c);
+    if (loop_arm_fd(loop, c, c->fd, EPOLLIN, EPOLL_CTL_MOD) != 0 ||
+        loop_arm_fd(loop, c, t->server_fd, EPOLLIN, EPOLL_CTL_ADD) != 0) {
+        tunnel_close(loop, c, 0);
+    }
+}
+
+static void feed_free(event_loop_t *loop, conn_t *c) {
+    list_unlink(&loop->feeds, c);
+    if (c->feed->file_fd >= 0) {
+        close(c->feed->file_fd);
+    }
+    free(c->feed);
+    c->feed = NULL;
+}
+
+static void feed_close(event_loop_t *loop, conn_t *c) {
+    feed_free(loop, c);
+    loop_retire(loop, c);
+}
+
+/*
+ * Отдаёт части остатка по порядку, пока сокет принимает, но не больше
+ * TUNNEL_BUDGET за раз. 1 — отдано всё, 0 — ждать EPOLLOUT, -1 — клиент
+ * отключился или файл оказался короче обещанного.
+ */
+static int feed_flow(conn_t *c, size_t *moved) {
+    conn_feed_t *f = c->feed;
+    while (f->cur < f->count) {
+        if (*moved >= TUNNEL_BUDGET) {
+            return 0;
+        }
+        conn_feed_part_t *p = &f->parts[f->cur];
+        off_t part_len = p->bytes_len > 0 ? (off_t)p->bytes_len : p->len;
+        ssize_t n;
+        if (p->bytes_len > 0) {
+            n = send(c->fd, p->bytes + f->done, (size_t)(part_len - f->done), MSG_DONTWAIT | MSG_NOSIGNAL);
+        } else {
+            off_t off = p->offset + f->done;
+            size_t want = (size_t)(part_len - f->done);
+            n = sendfile(c->fd, f->file_fd, &off, want < TUNNEL_BUDGET ? want : TUNNEL_BUDGET);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        f->done += n;
+        *moved += (size_t)n;
+        if (f->done == part_len) {
+            f->cur++;
+            f->done = 0;
+        }
+    }
+    return 1;
+}
+
+/* Соединение без туннеля и отдачи ждёт следующего запроса. */
+static void loop_resume(event_loop_t *loop, conn_t *c) {
+    if (conn_next_request(c)) {
+        loop_dispatch(c);
+        return;
+    }
+    list_touch(&loop->idle, c);
+    if (loop_arm(loop, c, EPOLL_CTL_MOD) != 0) {
+        loop_drop(loop, c);
+    }
+}
+
+static void loop_on_feed(event_loop_t *loop, conn_t *c) {
+    size_t moved = 0;
+    int rc = feed_flow(c, &moved);
+    if (rc < 0 || (rc > 0 && !c->feed->keep_alive)) {
+        feed_close(loop, c);
+        return;
+    }
+    if (rc > 0) {
+        feed_free(loop, c);
+        loop_resume(loop, c);
+        return;
+    }
+    if (moved > 0) {
+        list_touch(&loop->feeds, c);
+    }
+    if (loop_arm_fd(loop, c, c->fd, EPOLLOUT, EPOLL_CTL_MOD) != 0) {
+        feed_close(loop, c);
+    }
+}
+
+static void loop_on_readable(event_loop_t *loop, conn_t *c) {
+    while (1) {
+        if (c->len + 1 >= c->cap) {
+            size_t new_cap = c->cap ? c->cap * 2 : CONN_BUF_INITIAL;
+            if (new_cap > loop_cfg.max_header_size + 1) {
+                new_cap = loop_cfg.max_header_size + 1;
+            }
+            if (new_cap <= c->cap) {
+                loop_reject(loop, c, "Слишком большие заголовки\n");
+                return;
+            }
+            char *tmp = (char *)realloc(c->buf, new_cap);
+            if (!tmp) {
+                loop_drop(loop, c);
+                return;
+            }
+            c->buf = tmp;
+            c->cap = new_cap;
+        }
+
+        ssize_t n = recv(c->fd, c->buf + c->len, c->cap - c->len - 1, 0);
+        if (n == 0) {
+            loop_drop(loop, c);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            loop_drop(loop, c);
+            return;
+        }
+        c->len += (size_t)n;
+        c->buf[c->len] = '\0';
+
+        if (conn_next_request(c)) {
+            list_unlink(&loop->idle, c);
+            loop_dispatch(c);
+            return;
+        }
+    }
+
+    list_touch(&loop->idle, c);
+    if (loop_arm(loop, c, EPOLL_CTL_MOD) != 0) {
+        loop_drop(loop, c);
+    }
+}
+
+static void loop_accept(event_loop_t *loop) {
+    while (1) {
+        int fd = accept4(loop_cfg.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+
+        conn_t *c = (conn_t *)calloc(1, sizeof(conn_t));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->loop = loop;
+        __atomic_add_fetch(&loop->conns, 1, __ATOMIC_RELAXED);
+
+        list_touch(&loop->idle, c);
+        if (loop_arm(loop, c, EPOLL_CTL_ADD) != 0) {
+            loop_drop(loop, c);
+        }
+    }
+}
+
+/*
+ * Соединения, вернувшиеся из обработчиков: после keep-alive ответа, туннели
+ * и отдачи остатка тела. Если в буфере уже лежит следующий запрос, он сразу
+ * уходит в пул.
+ */
+static void loop_take_released(event_loop_t *loop) {
+    uint64_t v;
+    while (read(loop->wake_fd, &v, sizeof(v)) < 0 && errno == EINTR) {
+    }
+
+    pthread_mutex_lock(&loop->release_mutex);
+    conn_t *c = loop->released;
+    loop->released = NULL;
+    pthread_mutex_unlock(&loop->release_mutex);
+
+    while (c) {
+        conn_t *next = c->release_next;
+        c->release_next = NULL;
+        if (c->tunnel) {
+            tunnel_start(loop, c);
+        } else if (c->feed) {
+            list_touch(&loop->feeds, c);
+            loop_on_feed(loop, c);
+        } else {
+            loop_resume(loop, c);
+        }
+        c = next;
+    }
+}
+
+static void loop_sweep(event_loop_t *loop) {
+    time_t deadline = time(NULL) - loop_cfg.idle_timeout;
+    while (loop->idle.head && loop->idle.head->last_active <= deadline) {
+        loop_drop(loop, loop->idle.head);
+    }
+    if (loop_cfg.tunnel_idle_timeout > 0) {
+        deadline = time(NULL) - loop_cfg.tunnel_idle_timeout;
+        while (loop->tunnels.head && loop->tunnels.head->last_active <= deadline) {
+            tunnel_close(loop, loop->tunnels.head, 1);
+        }
+    }
+    if (loop_cfg.client_send_timeout > 0) {
+        deadline = time(NULL) - loop_cfg.client_send_timeout;
+        while (loop->feeds.head && loop->feeds.head->last_active <= deadline) {
+            feed_close(loop, loop->feeds.head);
+        }
+    }
+}
+
+static void *loop_main(void *arg) {
+    event_loop_t *loop = (event_loop_t *)arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, LOOP_TICK_MS);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &loop->listen_tag) {
+                loop_accept(loop);
+            } else if (events[i].data.ptr == &loop->wake_tag) {
+                loop_take_released(loop);
+            } else {
+                conn_t *c = (conn_t *)events[i].data.ptr;
+                if (c->closed) {
+                    continue;
+                }
+                if (c->tunnel) {
+                    loop_on_tunnel(loop, c);
+                } else if (c->feed) {
+                    loop_on_feed(loop, c);
+                } else {
+                    loop_on_readable(loop, c);
+                }
+            }
+        }
+
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            loop_sweep(loop);
+            last_sweep = now;
+        }
+        loop_free_closed(loop);
+    }
+    return NULL;
+}
+
+int event_loops_start(const event_loop_config_t *cfg) {
+    if (cfg->loop_count <= 0 || !cfg->pool || !cfg->handler) {
+        return -1;
+    }
+    loop_cfg = *cfg;
+    if (set_nonblocking(cfg->listen_fd, 1) != 0) {
+        return -1;
+    }
+
+    loops = (event_loop_t *)calloc((size_t)cfg->loop_count, sizeof(event_loop_t));
+    if (!loops) {
+        return -1;
+    }
+
+    for (int i = 0; i < cfg->loop_count; i++) {
+        event_loop_t *loop = &loops[i];
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->epfd < 0 || loop->wake_fd < 0) {
+            return -1;
+        }
+        pthread_mutex_init(&loop->release_mutex, NULL);
+
+        /* EPOLLEXCLUSIVE: новое подключение будит только один из циклов. */
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &loop->listen_tag;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, cfg->listen_fd, &ev) != 0) {
+            return -1;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->wake_tag;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) != 0) {
+            return -1;
+        }
+
+        if (pthread_create(&loop->thread, NULL, loop_main, loop) != 0) {
+            return -1;
+        }
+        loops_started++;
+    }
+    return 0;
+}
+
+void event_loops_wait(void) {
+    for (int i = 0; i < loops_started; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+}
+
+size_t event_loops_conn_count(void) {
+    size_t total = 0;
+    for (int i = 0; i < loops_started; i++) {
+        total += __atomic_load_n(&loops[i].conns, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+void conn_consume(conn_t *conn, size_t n) {
+    if (n >= conn->len) {
+        conn->len = 0;
+    } else {
+        memmove(conn->buf, conn->buf + n, conn->len - n);
+        conn->len -= n;
+    }
+    if (conn->buf) {
+        conn->buf[conn->len] = '\0';
+    }
+    header_scan_reset(&conn->scan);
+}
+
+/* Возвращает в начало буфера байты, прочитанные из сокета сверх нужного. */
+int conn_unread(conn_t *conn, const void *data, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    if (conn->len + n + 1 > conn->cap) {
+        char *tmp = (char *)realloc(conn->buf, conn->len + n + 1);
+        if (!tmp) {
+            return -1;
+        }
+        conn->buf = tmp;
+        conn->cap = conn->len + n + 1;
+    }
+    memmove(conn->buf + n, conn->buf, conn->len);
+    memcpy(conn->buf, data, n);
+    conn->len += n;
+    conn->buf[conn->len] = '\0';
+    header_scan_reset(&conn->scan);
+    return 0;
+}
+
+int conn_next_request(conn_t *conn) {
+    if (conn->len == 0) {
+        return 0;
+    }
+    ssize_t idx = header_scan(&conn->scan, conn->buf, conn->len);
+    if (idx < 0) {
+        return 0;
+    }
+    conn->header_len = (size_t)idx;
+    return 1;
+}
+
+static void loop_hand_back(conn_t *conn) {
+    event_loop_t *loop = conn->loop;
+    pthread_mutex_lock(&loop->release_mutex);
+    conn->release_next = loop->released;
+    loop->released = conn;
+    pthread_mutex_unlock(&loop->release_mutex);
+
+    uint64_t one = 1;
+    while (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+/* Возвращает соединение в его цикл ждать следующего запроса; вызывается обработчиком. */
+void conn_release(conn_t *conn) {
+    conn->header_len = 0;
+    if (conn->len == 0) {
+        free(conn->buf);
+        conn->buf = NULL;
+        conn->cap = 0;
+    }
+    if (set_nonblocking(conn->fd, 1) != 0) {
+        conn_free(conn);
+        return;
+    }
+    loop_hand_back(conn);
+}
+
+/*
+ * Превращает соединение в туннель к server_fd и отдаёт его циклу; дальше
+ * байты в обе стороны переносит цикл, без потока на туннель. Байты, которые
+ * клиент прислал сразу за заголовками CONNECT, отправляются серверу здесь
+ * же. При ошибке соединение остаётся у обработчика, а server_fd — у
+ * вызывающего.
+ */
+int conn_tunnel(conn_t *conn, int server_fd, const char *target) {
+    tunnel_t *t = (tunnel_t *)calloc(1, sizeof(tunnel_t));
+    if (!t) {
+        return -1;
+    }
+    int up[2] = {-1, -1};
+    int down[2] = {-1, -1};
+    if (pipe2(up, O_NONBLOCK | O_CLOEXEC) != 0 || pipe2(down, O_NONBLOCK | O_CLOEXEC) != 0) {
+        if (up[0] >= 0) {
+            close(up[0]);
+            close(up[1]);
+        }
+        free(t);
+        return -1;
+    }
+    t->server_fd = server_fd;
+    t->up.pipe_r = up[0];
+    t->up.pipe_w = up[1];
+    t->down.pipe_r = down[0];
+    t->down.pipe_w = down[1];
+    snprintf(t->target, sizeof(t->target), "%s", target);
+
+    size_t off = 0;
+    while (off < conn->len) {
+        ssize_t n = send(server_fd, conn->buf + off, conn->len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            tunnel_free(t);
+            return -1;
+        }
+        off += (size_t)n;
+        t->up.bytes += (unsigned long long)n;
+    }
+    if (set_nonblocking(server_fd, 1) != 0 || set_nonblocking(conn->fd, 1) != 0) {
+        tunnel_free(t);
+        return -1;
+    }
+
+    free(conn->buf);
+    conn->buf = NULL;
+    conn->len = 0;
+    conn->cap = 0;
+    conn->header_len = 0;
+    conn->tunnel = t;
+    loop_hand_back(conn);
+    return 0;
+}
+
+void conn_feed_init(conn_feed_t *feed, int file_fd) {
+    memset(feed, 0, sizeof(*feed));
+    feed->file_fd = file_fd;
+}
+
+int conn_feed_bytes(conn_feed_t *feed, const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (feed->count == CONN_FEED_PARTS || len > sizeof(feed->parts[0].bytes)) {
+        return -1;
+    }
+    conn_feed_part_t *p = &feed->parts[feed->count++];
+    memcpy(p->bytes, data, len);
+    p->bytes_len = len;
+    return 0;
+}
+
+int conn_feed_file(conn_feed_t *feed, off_t offset, off_t len) {
+    if (len <= 0) {
+        return 0;
+    }
+    if (feed->count == CONN_FEED_PARTS) {
+        return -1;
+    }
+    conn_feed_part_t *p = &feed->parts[feed->count++];
+    p->offset = offset;
+    p->len = len;
+    return 0;
+}
+
+/*
+ * Отдаёт циклу остаток ответа, описанный feed: цикл отправляет его
+ * неблокирующим sendfile по EPOLLOUT, и обработчик свободен, сколько бы ни
+ * читал клиент. Клиент, который дольше client_send_timeout ничего не забрал,
+ * отключается. После остатка соединение ждёт следующего запроса, если
+ * keep_alive, иначе закрывается. При успехе file_fd закрывает цикл; при
+ * ошибке соединение и file_fd остаются у вызывающего.
+ */
+int conn_feed(conn_t *conn, const conn_feed_t *feed, int keep_alive) {
+    conn_feed_t *f = (conn_feed_t *)malloc(sizeof(conn_feed_t));
+    if (!f) {
+        return -1;
+    }
+    if (set_nonblocking(conn->fd, 1) != 0) {
+        free(f);
+        return -1;
+    }
+    *f = *feed;
+    f->cur = 0;
+    f->done = 0;
+    f->keep_alive = keep_alive;
+    conn->header_len = 0;
+    if (conn->len == 0) {
+        free(conn->buf);
+        conn->buf = NULL;
+        conn->cap = 0;
+    }
+    conn->feed = f;
+    loop_hand_back(conn);
+    return 0;
+}
+
+void conn_close(conn_t *conn) {
+    conn_free(conn);
+}
@@ -0,0 +1,106 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "http_scan.h"
+#include "work_pool.h"
+
+typedef struct event_loop event_loop_t;
+typedef struct tunnel tunnel_t;
+
+#define CONN_FEED_PARTS 8
+
+/* Часть остатка ответа: байты разметки (bytes_len > 0) или диапазон файла. */
+typedef struct {
+    char bytes[32];
+    size_t bytes_len;
+    off_t offset;
+    off_t len;
+} conn_feed_part_t;
+
+/*
+ * Остаток ответа, который отдаёт цикл событий: части по порядку, файловые —
+ * из file_fd. cur, done и keep_alive заполняет conn_feed().
+ */
+typedef struct {
+    int file_fd;
+    int count;
+    conn_feed_part_t parts[CONN_FEED_PARTS];
+    int cur;
+    off_t done;
+    int keep_alive;
+} conn_feed_t;
+
+/*
+ * Клиентское соединение. Пока заголовки не получены целиком, соединение
+ * принадлежит циклу событий и стоит в неблокирующем режиме; после этого оно
+ * передаётся в пул обработчиков, который владеет им до conn_close() или до
+ * возврата в цикл через conn_release() (keep-alive) или conn_tunnel()
+ * (CONNECT), или conn_feed() (остаток тела из файла). У туннеля tunnel не
+ * NULL, у отдачи из файла — feed. closed — соединение закрыто, память
+ * освободится после разбора текущей пачки событий.
+ */
+typedef struct conn {
+    int fd;
+    event_loop_t *loop;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t header_len;
+    header_scan_t scan;
+    time_t last_active;
+    struct conn *prev;
+    struct conn *next;
+    struct conn *release_next;
+    tunnel_t *tunnel;
+    conn_feed_t *feed;
+    int closed;
+    work_item_t work;
+} conn_t;
+
+typedef void (*conn_handler_fn)(conn_t *conn, void *arg);
+
+/* Итог туннеля: client_bytes ушло серверу, server_bytes — клиенту. */
+typedef struct {
+    const char *target;
+    unsigned long long client_bytes;
+    unsigned long long server_bytes;
+    time_t started;
+    int timed_out;
+} tunnel_stats_t;
+
+typedef void (*tunnel_done_fn)(const tunnel_stats_t *stats, void *arg);
+
+typedef struct {
+    int listen_fd;
+    int loop_count;
+    int idle_timeout;
+    int tunnel_idle_timeout;
+    int client_recv_timeout;
+    int client_send_timeout;
+    size_t max_header_size;
+    work_pool_t *pool;
+    conn_handler_fn handler;
+    void *handler_arg;
+    tunnel_done_fn tunnel_done;
+} event_loop_config_t;
+
+int event_loops_start(const event_loop_config_t *cfg);
+void event_loops_wait(void);
+size_t event_loops_conn_count(void);
+
+void conn_consume(conn_t *conn, size_t n);
+int conn_unread(conn_t *conn, const void *data, size_t n);
+int conn_next_request(conn_t *conn);
+void conn_release(conn_t *conn);
+int conn_tunnel(conn_t *conn, int server_fd, const char *target);
+void conn_feed_init(conn_feed_t *feed, int file_fd);
+int conn_feed_bytes(conn_feed_t *feed, const char *data, size_t len);
+int conn_feed_file(conn_feed_t *feed, off_t offset, off_t len);
+int conn_feed(conn_t *conn, const conn_feed_t *feed, int keep_alive);
+void conn_close(conn_t *conn);
+
+#endif
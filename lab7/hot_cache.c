@@ -0,0 +1,216 @@
+#include "hot_cache.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const char *p = key; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static hot_shard_t *shard_of(hot_cache_t *cache, const char *key) {
+    return &cache->shards[hash_key(key) % HOT_CACHE_SHARDS];
+}
+
+static unsigned bucket_of(const char *key) {
+    return (hash_key(key) / HOT_CACHE_SHARDS) % HOT_CACHE_BUCKETS;
+}
+
+static void object_unref(hot_object_t *obj) {
+    if (__atomic_sub_fetch(&obj->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(obj);
+    }
+}
+
+static hot_object_t *table_find(hot_shard_t *shard, const char *key, hot_object_t ***link) {
+    hot_object_t **pp = &shard->buckets[bucket_of(key)];
+    while (*pp) {
+        if (strcmp((*pp)->key, key) == 0) {
+            if (link) {
+                *link = pp;
+            }
+            return *pp;
+        }
+        pp = &(*pp)->hnext;
+    }
+    return NULL;
+}
+
+static void lru_unlink(hot_shard_t *shard, hot_object_t *obj) {
+    if (obj->prev) {
+        obj->prev->next = obj->next;
+    } else {
+        shard->lru_head = obj->next;
+    }
+    if (obj->next) {
+        obj->next->prev = obj->prev;
+    } else {
+        shard->lru_tail = obj->prev;
+    }
+    obj->prev = NULL;
+    obj->next = NULL;
+}
+
+static void lru_push_front(hot_shard_t *shard, hot_object_t *obj) {
+    obj->prev = NULL;
+    obj->next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->prev = obj;
+    } else {
+        shard->lru_tail = obj;
+    }
+    shard->lru_head = obj;
+}
+
+/* Убирает объект из таблицы; память освобождается, когда отпустят все ссылки. */
+static void shard_remove(hot_shard_t *shard, hot_object_t *obj) {
+    hot_object_t **link = NULL;
+    if (table_find(shard, obj->key, &link) != obj) {
+        return;
+    }
+    *link = obj->hnext;
+    lru_unlink(shard, obj);
+    shard->bytes -= obj->charge;
+    shard->count--;
+    object_unref(obj);
+}
+
+hot_cache_t *hot_cache_create(size_t capacity, size_t max_object) {
+    hot_cache_t *cache = (hot_cache_t *)calloc(1, sizeof(hot_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    size_t per_shard = capacity / HOT_CACHE_SHARDS;
+    cache->capacity = capacity;
+    cache->max_object = max_object < per_shard ? max_object : per_shard;
+    for (int i = 0; i < HOT_CACHE_SHARDS; i++) {
+        cache->shards[i].capacity = per_shard;
+        pthread_mutex_init(&cache->shards[i].mutex, NULL);
+    }
+    return cache;
+}
+
+int hot_cache_fits(const hot_cache_t *cache, size_t size) {
+    return cache && cache->max_object > 0 && size <= cache->max_object;
+}
+
+hot_object_t *hot_cache_get(hot_cache_t *cache, const char *key, cache_meta_t *meta) {
+    if (!cache || cache->max_object == 0) {
+        return NULL;
+    }
+    hot_shard_t *shard = shard_of(cache, key);
+    pthread_mutex_lock(&shard->mutex);
+    hot_object_t *obj = table_find(shard, key, NULL);
+    if (obj) {
+        __atomic_add_fetch(&obj->refs, 1, __ATOMIC_RELAXED);
+        lru_unlink(shard, obj);
+        lru_push_front(shard, obj);
+        *meta = obj->meta;
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return obj;
+}
+
+/*
+ * Вставляет объект (заменяя прежний с тем же ключом) и возвращает его с
+ * ссылкой для вызывающего. Из хвоста LRU вытесняются объекты, пока не хватит
+ * места; на диске они остаются.
+ */
+hot_object_t *hot_cache_put(hot_cache_t *cache, const char *key, const char *url, const cache_meta_t *meta,
+                            const char *head, size_t head_len, const char *body, size_t body_len) {
+    if (!hot_cache_fits(cache, head_len + body_len)) {
+        return NULL;
+    }
+    size_t url_len = strlen(url) + 1;
+    hot_object_t *obj = (hot_object_t *)malloc(sizeof(hot_object_t) + head_len + body_len + url_len);
+    if (!obj) {
+        return NULL;
+    }
+    memset(obj, 0, sizeof(*obj));
+    snprintf(obj->key, sizeof(obj->key), "%s", key);
+    obj->meta = *meta;
+    obj->data = (char *)(obj + 1);
+    memcpy(obj->data, head, head_len);
+    memcpy(obj->data + head_len, body, body_len);
+    obj->url = obj->data + head_len + body_len;
+    memcpy(obj->url, url, url_len);
+    obj->head_len = head_len;
+    obj->body_len = body_len;
+    obj->charge = sizeof(hot_object_t) + head_len + body_len + url_len;
+    obj->refs = 2;
+
+    hot_shard_t *shard = shard_of(cache, key);
+    pthread_mutex_lock(&shard->mutex);
+    hot_object_t *old = table_find(shard, key, NULL);
+    if (old) {
+        shard_remove(shard, old);
+    }
+    while (shard->lru_tail && shard->bytes + obj->charge > shard->capacity) {
+        shard_remove(shard, shard->lru_tail);
+        shard->evictions++;
+    }
+    unsigned b = bucket_of(key);
+    obj->hnext = shard->buckets[b];
+    shard->buckets[b] = obj;
+    lru_push_front(shard, obj);
+    shard->bytes += obj->charge;
+    shard->count++;
+    pthread_mutex_unlock(&shard->mutex);
+    return obj;
+}
+
+void hot_cache_update_meta(hot_cache_t *cache, const char *key, const cache_meta_t *meta) {
+    if (!cache || cache->max_object == 0) {
+        return;
+    }
+    hot_shard_t *shard = shard_of(cache, key);
+    pthread_mutex_lock(&shard->mutex);
+    hot_object_t *obj = table_find(shard, key, NULL);
+    if (obj) {
+        obj->meta = *meta;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void hot_cache_remove(hot_cache_t *cache, const char *key) {
+    if (!cache || cache->max_object == 0) {
+        return;
+    }
+    hot_shard_t *shard = shard_of(cache, key);
+    pthread_mutex_lock(&shard->mutex);
+    hot_object_t *obj = table_find(shard, key, NULL);
+    if (obj) {
+        shard_remove(shard, obj);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void hot_cache_release(hot_cache_t *cache, hot_object_t *obj) {
+    (void)cache;
+    if (obj) {
+        object_unref(obj);
+    }
+}
+
+void hot_cache_destroy(hot_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < HOT_CACHE_SHARDS; i++) {
+        hot_shard_t *shard = &cache->shards[i];
+        while (shard->lru_head) {
+            shard_remove(shard, shard->lru_head);
+        }
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(cache);
+}
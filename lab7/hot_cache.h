@@ -0,0 +1,63 @@
+#ifndef HOT_CACHE_H
+#define HOT_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "cache_index.h"
+
+#define HOT_CACHE_SHARDS 16
+#define HOT_CACHE_BUCKETS 1024
+
+/*
+ * Объект в памяти: готовые заголовки ответа клиенту (без Connection и
+ * завершающей пустой строки), тело сразу за ними и полный ключ объекта,
+ * по которому сверяются совпадения хешей. Данные не меняются после
+ * вставки, поэтому отправлять их можно без блокировки, удерживая ссылку.
+ */
+typedef struct hot_object {
+    char key[32];
+    char *url;
+    cache_meta_t meta;
+    char *data;
+    size_t head_len;
+    size_t body_len;
+    size_t charge;
+    int refs;
+    struct hot_object *hnext;
+    struct hot_object *prev;
+    struct hot_object *next;
+} hot_object_t;
+
+/* Вытеснение идёт внутри части: у каждой свой LRU, объём и мьютекс. */
+typedef struct {
+    hot_object_t *buckets[HOT_CACHE_BUCKETS];
+    hot_object_t *lru_head;
+    hot_object_t *lru_tail;
+    size_t bytes;
+    size_t capacity;
+    size_t count;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    pthread_mutex_t mutex;
+} hot_shard_t;
+
+typedef struct {
+    hot_shard_t shards[HOT_CACHE_SHARDS];
+    size_t capacity;
+    size_t max_object;
+} hot_cache_t;
+
+hot_cache_t *hot_cache_create(size_t capacity, size_t max_object);
+int hot_cache_fits(const hot_cache_t *cache, size_t size);
+hot_object_t *hot_cache_get(hot_cache_t *cache, const char *key, cache_meta_t *meta);
+hot_object_t *hot_cache_put(hot_cache_t *cache, const char *key, const char *url, const cache_meta_t *meta,
+                            const char *head, size_t head_len, const char *body, size_t body_len);
+void hot_cache_update_meta(hot_cache_t *cache, const char *key, const cache_meta_t *meta);
+void hot_cache_remove(hot_cache_t *cache, const char *key);
+void hot_cache_release(hot_cache_t *cache, hot_object_t *obj);
+void hot_cache_destroy(hot_cache_t *cache);
+
+#endif
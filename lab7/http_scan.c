@@ -0,0 +1,134 @@
+#include "http_scan.h"
+
+#include <string.h>
+#include <strings.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void header_scan_reset(header_scan_t *scan) {
+    scan->pos = 0;
+}
+
+/*
+ * Длина заголовков вместе с \r\n\r\n или -1, если конца ещё нет. С SSE2
+ * проверяется 16 позиций за раз: четыре сдвинутые загрузки сравниваются с
+ * \r, \n, \r, \n, и совпадение всех четырёх даёт бит в маске.
+ */
+ssize_t header_scan(header_scan_t *scan, const char *buf, size_t len) {
+    size_t i = scan->pos;
+#if defined(__SSE2__)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (i + 16 + 3 <= len) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), cr);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 1)), lf);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 2)), cr);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 3)), lf);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d)));
+        if (mask) {
+            return (ssize_t)(i + (size_t)__builtin_ctz(mask) + 4);
+        }
+        i += 16;
+    }
+#endif
+    for (; i + 4 <= len; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') {
+            return (ssize_t)(i + 4);
+        }
+    }
+    scan->pos = i;
+    return -1;
+}
+
+ssize_t http_header_end(const char *buf, size_t len) {
+    header_scan_t scan = {0};
+    return header_scan(&scan, buf, len);
+}
+
+/* Первая строка блока (строка запроса или статуса): 0 — найдена, -1 — нет конца строки. */
+int http_first_line(const char **p, const char *end, const char **line, size_t *len) {
+    const char *eol = (const char *)memchr(*p, '\n', (size_t)(end - *p));
+    if (!eol) {
+        return -1;
+    }
+    *line = *p;
+    *len = (size_t)(eol - *p);
+    if (*len > 0 && eol[-1] == '\r') {
+        (*len)--;
+    }
+    *p = eol + 1;
+    return 0;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/*
+ * Очередное поле за один проход: имя читается до двоеточия, остаток строки
+ * находит memchr. 1 — поле, 0 — пустая строка или конец блока, -1 — строка
+ * без конца. Строки без двоеточия пропускаются.
+ */
+int http_next_field(const char **p, const char *end, http_field_t *field) {
+    const char *q = *p;
+    while (q < end) {
+        const char *line = q;
+        while (q < end && *q != ':' && *q != '\n') {
+            q++;
+        }
+        if (q == end) {
+            return -1;
+        }
+        if (*q == '\n') {
+            size_t len = (size_t)(q - line);
+            q++;
+            if (len == 0 || (len == 1 && line[0] == '\r')) {
+                *p = q;
+                return 0;
+            }
+            continue;
+        }
+
+        const char *colon = q;
+        const char *eol = (const char *)memchr(colon + 1, '\n', (size_t)(end - colon - 1));
+        if (!eol) {
+            return -1;
+        }
+        const char *line_end = eol[-1] == '\r' ? eol - 1 : eol;
+
+        const char *name = line;
+        const char *name_end = colon;
+        while (name < name_end && is_space(*name)) {
+            name++;
+        }
+        while (name_end > name && is_space(name_end[-1])) {
+            name_end--;
+        }
+        const char *value = colon + 1;
+        const char *value_end = line_end;
+        while (value < value_end && is_space(*value)) {
+            value++;
+        }
+        while (value_end > value && is_space(value_end[-1])) {
+            value_end--;
+        }
+
+        field->line = line;
+        field->line_len = (size_t)(line_end - line);
+        field->name = name;
+        field->name_len = (size_t)(name_end - name);
+        field->value = value;
+        field->value_len = (size_t)(value_end - value);
+        *p = eol + 1;
+        return 1;
+    }
+    *p = q;
+    return 0;
+}
+
+int http_field_is(const http_field_t *field, const char *name) {
+    size_t len = strlen(name);
+    return field->name_len == len && strncasecmp(field->name, name, len) == 0;
+}
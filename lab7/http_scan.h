@@ -0,0 +1,38 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Поиск конца заголовков (\r\n\r\n) в буфере, который дописывается по мере
+ * приёма. pos помнит, докуда буфер уже просмотрен, поэтому каждый байт
+ * проверяется один раз, как бы мелко ни приходили данные. После сдвига или
+ * замены буфера состояние сбрасывается.
+ */
+typedef struct {
+    size_t pos;
+} header_scan_t;
+
+/*
+ * Поле заголовка: указатели в исходный буфер, пробелы по краям имени и
+ * значения отрезаны; line — вся строка без \r\n.
+ */
+typedef struct {
+    const char *line;
+    size_t line_len;
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} http_field_t;
+
+void header_scan_reset(header_scan_t *scan);
+ssize_t header_scan(header_scan_t *scan, const char *buf, size_t len);
+ssize_t http_header_end(const char *buf, size_t len);
+
+int http_first_line(const char **p, const char *end, const char **line, size_t *len);
+int http_next_field(const char **p, const char *end, http_field_t *field);
+int http_field_is(const http_field_t *field, const char *name);
+
+#endif
@@ -0,0 +1,191 @@
+#include "inflight.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned bucket_of(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const char *p = key; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h % INFLIGHT_BUCKETS;
+}
+
+static void flight_free(inflight_t *f) {
+    free(f->stored_header);
+    pthread_mutex_destroy(&f->mutex);
+    pthread_cond_destroy(&f->changed);
+    free(f);
+}
+
+static void table_unlink(inflight_table_t *table, inflight_t *f) {
+    if (!f->linked) {
+        return;
+    }
+    inflight_t **pp = &table->buckets[bucket_of(f->key)];
+    while (*pp && *pp != f) {
+        pp = &(*pp)->next;
+    }
+    if (*pp) {
+        *pp = f->next;
+    }
+    f->linked = 0;
+    table->active--;
+}
+
+inflight_table_t *inflight_table_create(void) {
+    inflight_table_t *table = (inflight_table_t *)calloc(1, sizeof(inflight_table_t));
+    if (!table) {
+        return NULL;
+    }
+    pthread_mutex_init(&table->mutex, NULL);
+    return table;
+}
+
+/* Возвращает загрузку по ключу; *leader = 1, если её только что создали и вести её вызывающему. */
+inflight_t *inflight_join(inflight_table_t *table, const char *key, int *leader) {
+    *leader = 0;
+    if (!table) {
+        return NULL;
+    }
+    unsigned b = bucket_of(key);
+    pthread_mutex_lock(&table->mutex);
+    for (inflight_t *f = table->buckets[b]; f; f = f->next) {
+        if (strcmp(f->key, key) == 0) {
+            f->refs++;
+            table->followers++;
+            pthread_mutex_unlock(&table->mutex);
+            return f;
+        }
+    }
+
+    inflight_t *f = (inflight_t *)calloc(1, sizeof(inflight_t));
+    if (!f) {
+        pthread_mutex_unlock(&table->mutex);
+        return NULL;
+    }
+    snprintf(f->key, sizeof(f->key), "%s", key);
+    f->state = FLIGHT_FETCHING;
+    f->body_length = -1;
+    f->refs = 1;
+    f->linked = 1;
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init(&f->changed, NULL);
+    f->next = table->buckets[b];
+    table->buckets[b] = f;
+    table->leaders++;
+    table->active++;
+    *leader = 1;
+    pthread_mutex_unlock(&table->mutex);
+    return f;
+}
+
+/* Заголовки записаны во временный файл: ожидающие могут начинать отдачу. */
+int inflight_publish_header(inflight_t *f, const char *tmp_path, const char *stored_header,
+                            size_t stored_header_len, long long body_length) {
+    if (!f) {
+        return 0;
+    }
+    char *copy = (char *)malloc(stored_header_len);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, stored_header, stored_header_len);
+
+    pthread_mutex_lock(&f->mutex);
+    snprintf(f->tmp_path, sizeof(f->tmp_path), "%s", tmp_path);
+    f->stored_header = copy;
+    f->stored_header_len = stored_header_len;
+    f->body_length = body_length;
+    f->header_ready = 1;
+    pthread_cond_broadcast(&f->changed);
+    pthread_mutex_unlock(&f->mutex);
+    return 0;
+}
+
+void inflight_progress(inflight_t *f, off_t written) {
+    if (!f) {
+        return;
+    }
+    pthread_mutex_lock(&f->mutex);
+    f->written = written;
+    pthread_cond_broadcast(&f->changed);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/*
+ * Загрузка завершена: она убирается из таблицы, чтобы следующие запросы шли
+ * в кэш, а не к ней. Повторный вызов ничего не меняет.
+ */
+void inflight_finish(inflight_table_t *table, inflight_t *f, flight_state_t state) {
+    if (!f) {
+        return;
+    }
+    pthread_mutex_lock(&table->mutex);
+    table_unlink(table, f);
+    pthread_mutex_unlock(&table->mutex);
+
+    pthread_mutex_lock(&f->mutex);
+    if (f->state == FLIGHT_FETCHING) {
+        f->state = state;
+    }
+    pthread_cond_broadcast(&f->changed);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/* Ждёт заголовков или завершения; FLIGHT_FETCHING означает, что заголовки готовы. */
+flight_state_t inflight_wait_header(inflight_t *f) {
+    pthread_mutex_lock(&f->mutex);
+    while (f->state == FLIGHT_FETCHING && !f->header_ready) {
+        pthread_cond_wait(&f->changed, &f->mutex);
+    }
+    flight_state_t state = f->state;
+    pthread_mutex_unlock(&f->mutex);
+    return state;
+}
+
+/* Ждёт, пока записанное тело не станет длиннее seen или загрузка не закончится. */
+flight_state_t inflight_wait_data(inflight_t *f, off_t seen, off_t *written) {
+    pthread_mutex_lock(&f->mutex);
+    while (f->state == FLIGHT_FETCHING && f->written <= seen) {
+        pthread_cond_wait(&f->changed, &f->mutex);
+    }
+    flight_state_t state = f->state;
+    *written = f->written;
+    pthread_mutex_unlock(&f->mutex);
+    return state;
+}
+
+void inflight_leave(inflight_table_t *table, inflight_t *f) {
+    if (!f) {
+        return;
+    }
+    pthread_mutex_lock(&table->mutex);
+    int last = --f->refs == 0;
+    if (last) {
+        table_unlink(table, f);
+    }
+    pthread_mutex_unlock(&table->mutex);
+    if (last) {
+        flight_free(f);
+    }
+}
+
+void inflight_table_destroy(inflight_table_t *table) {
+    if (!table) {
+        return;
+    }
+    for (int b = 0; b < INFLIGHT_BUCKETS; b++) {
+        inflight_t *f = table->buckets[b];
+        while (f) {
+            inflight_t *next = f->next;
+            flight_free(f);
+            f = next;
+        }
+    }
+    pthread_mutex_destroy(&table->mutex);
+    free(table);
+}
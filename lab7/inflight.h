@@ -0,0 +1,62 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define INFLIGHT_BUCKETS 1024
+
+typedef enum {
+    FLIGHT_FETCHING,
+    FLIGHT_DONE,
+    FLIGHT_REVALIDATED,
+    FLIGHT_STALE,
+    FLIGHT_UNCACHEABLE,
+    FLIGHT_UPSTREAM_ERROR,
+    FLIGHT_FAILED
+} flight_state_t;
+
+/*
+ * Загрузка объекта с сервера, которую ждут несколько клиентов. Ведущий
+ * (первый промах) пишет объект во временный файл и сообщает, сколько байт
+ * тела уже записано; остальные читают файл по мере роста. После завершения
+ * загрузка убирается из таблицы, запись освобождается с последней ссылкой.
+ */
+typedef struct inflight {
+    char key[32];
+    flight_state_t state;
+    int header_ready;
+    char tmp_path[PATH_MAX];
+    char *stored_header;
+    size_t stored_header_len;
+    long long body_length;
+    off_t written;
+    int refs;
+    int linked;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    struct inflight *next;
+} inflight_t;
+
+typedef struct {
+    inflight_t *buckets[INFLIGHT_BUCKETS];
+    unsigned long long leaders;
+    unsigned long long followers;
+    size_t active;
+    pthread_mutex_t mutex;
+} inflight_table_t;
+
+inflight_table_t *inflight_table_create(void);
+inflight_t *inflight_join(inflight_table_t *table, const char *key, int *leader);
+int inflight_publish_header(inflight_t *f, const char *tmp_path, const char *stored_header,
+                            size_t stored_header_len, long long body_length);
+void inflight_progress(inflight_t *f, off_t written);
+void inflight_finish(inflight_table_t *table, inflight_t *f, flight_state_t state);
+flight_state_t inflight_wait_header(inflight_t *f);
+flight_state_t inflight_wait_data(inflight_t *f, off_t seen, off_t *written);
+void inflight_leave(inflight_table_t *table, inflight_t *f);
+void inflight_table_destroy(inflight_table_t *table);
+
+#endif
@@ -0,0 +1,94 @@
+#include "metrics.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Верхние границы корзин в микросекундах: от 100 мкс до 10 с. */
+static const long long bucket_bounds[METRICS_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+static const char *const phase_names[TIMING_PHASES] = {
+    "dns", "connect", "ttfb", "transfer", "cache_read", "cache_write", "client_send", "total",
+};
+
+static const char *const outcome_names[OUTCOME_KINDS] = {
+    "hit", "miss", "revalidated", "error",
+};
+
+long long metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void req_timing_start(req_timing_t *timing) {
+    memset(timing, 0, sizeof(*timing));
+    timing->started = metrics_now_us();
+    timing->outcome = OUTCOME_MISS;
+}
+
+void req_timing_add(req_timing_t *timing, int phase, long long started_us) {
+    long long elapsed = metrics_now_us() - started_us;
+    timing->us[phase] += elapsed > 0 ? elapsed : 0;
+    timing->seen |= 1u << phase;
+}
+
+static void hist_add(metrics_hist_t *hist, long long us) {
+    int b = 0;
+    while (b < METRICS_BUCKETS && us > bucket_bounds[b]) {
+        b++;
+    }
+    __atomic_add_fetch(&hist->buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum_us, (unsigned long long)us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+/* Закрывает замер запроса: общее время считается от req_timing_start. */
+void metrics_record(metrics_t *metrics, req_timing_t *timing) {
+    req_timing_add(timing, TIMING_TOTAL, timing->started);
+    metrics_hist_t *row = metrics->hist[timing->outcome];
+    for (int phase = 0; phase < TIMING_PHASES; phase++) {
+        if (timing->seen & (1u << phase)) {
+            hist_add(&row[phase], timing->us[phase]);
+        }
+    }
+}
+
+/*
+ * Число запросов по исходам и гистограммы в текстовом формате Prometheus.
+ * Пустые пары исход/этап (например, DNS у попадания) не выводятся. _count
+ * берётся из суммы корзин, чтобы он совпадал с корзиной +Inf, даже если
+ * запрос записывается прямо сейчас.
+ */
+void metrics_write(const metrics_t *metrics, FILE *out) {
+    fprintf(out, "# HELP proxy_requests_total Запросы по исходу.\n# TYPE proxy_requests_total counter\n");
+    for (int outcome = 0; outcome < OUTCOME_KINDS; outcome++) {
+        fprintf(out, "proxy_requests_total{outcome=\"%s\"} %llu\n", outcome_names[outcome],
+                __atomic_load_n(&metrics->hist[outcome][TIMING_TOTAL].count, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# HELP proxy_request_phase_seconds Время этапов запроса по исходу.\n"
+                 "# TYPE proxy_request_phase_seconds histogram\n");
+    for (int outcome = 0; outcome < OUTCOME_KINDS; outcome++) {
+        for (int phase = 0; phase < TIMING_PHASES; phase++) {
+            const metrics_hist_t *hist = &metrics->hist[outcome][phase];
+            if (__atomic_load_n(&hist->count, __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+            const char *o = outcome_names[outcome];
+            const char *p = phase_names[phase];
+            unsigned long long total = 0;
+            for (int b = 0; b < METRICS_BUCKETS; b++) {
+                total += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+                fprintf(out, "proxy_request_phase_seconds_bucket{outcome=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n", o, p,
+                        (double)bucket_bounds[b] / 1e6, total);
+            }
+            total += __atomic_load_n(&hist->buckets[METRICS_BUCKETS], __ATOMIC_RELAXED);
+            fprintf(out, "proxy_request_phase_seconds_bucket{outcome=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n", o, p,
+                    total);
+            fprintf(out, "proxy_request_phase_seconds_sum{outcome=\"%s\",phase=\"%s\"} %.6f\n", o, p,
+                    (double)__atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED) / 1e6);
+            fprintf(out, "proxy_request_phase_seconds_count{outcome=\"%s\",phase=\"%s\"} %llu\n", o, p, total);
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+/* Этапы запроса. TIMING_TRANSFER — передача тела от сервера целиком, включая запись в кэш и отдачу клиенту. */
+enum {
+    TIMING_DNS,
+    TIMING_CONNECT,
+    TIMING_TTFB,
+    TIMING_TRANSFER,
+    TIMING_CACHE_READ,
+    TIMING_CACHE_WRITE,
+    TIMING_CLIENT_SEND,
+    TIMING_TOTAL,
+    TIMING_PHASES
+};
+
+/* Исход запроса: отдан из кэша, загружен, подтверждён ответом 304 или завершился ошибкой. */
+enum {
+    OUTCOME_HIT,
+    OUTCOME_MISS,
+    OUTCOME_REVALIDATED,
+    OUTCOME_ERROR,
+    OUTCOME_KINDS
+};
+
+#define METRICS_BUCKETS 16
+
+/*
+ * Времена этапов одного запроса в микросекундах. Этап может встретиться
+ * несколько раз (повтор подключения, несколько чтений с диска), времена
+ * складываются; этап, которого не было, в гистограмму не попадает.
+ */
+typedef struct {
+    long long started;
+    long long us[TIMING_PHASES];
+    unsigned seen;
+    int outcome;
+} req_timing_t;
+
+/* Корзины не накопительные, накопление делается при выводе. Последняя — всё, что дольше верхней границы. */
+typedef struct {
+    unsigned long long buckets[METRICS_BUCKETS + 1];
+    unsigned long long count;
+    unsigned long long sum_us;
+} metrics_hist_t;
+
+/* Гистограммы этапов по исходам; счётчики меняются атомарно, без блокировки. */
+typedef struct {
+    metrics_hist_t hist[OUTCOME_KINDS][TIMING_PHASES];
+} metrics_t;
+
+long long metrics_now_us(void);
+void req_timing_start(req_timing_t *timing);
+void req_timing_add(req_timing_t *timing, int phase, long long started_us);
+void metrics_record(metrics_t *metrics, req_timing_t *timing);
+void metrics_write(const metrics_t *metrics, FILE *out);
+
+#endif
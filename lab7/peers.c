@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+#include "peers.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "http_scan.h"
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t fnv1a(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int peer_digest_init(peer_digest_t *digest, size_t keys) {
+    size_t nbits = PEER_DIGEST_MIN_BITS;
+    while (nbits < keys * PEER_DIGEST_BITS_PER_KEY && nbits < (size_t)PEER_DIGEST_MAX_BYTES * 8) {
+        nbits <<= 1;
+    }
+    digest->bits = (uint64_t *)calloc(nbits / 64, sizeof(uint64_t));
+    digest->nbits = digest->bits ? nbits : 0;
+    return digest->bits ? 0 : -1;
+}
+
+void peer_digest_add(peer_digest_t *digest, uint64_t hash) {
+    uint64_t h2 = mix64(hash) | 1;
+    for (int i = 0; i < PEER_DIGEST_HASHES; i++) {
+        size_t bit = (size_t)((hash + (uint64_t)i * h2) & (digest->nbits - 1));
+        digest->bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+int peer_digest_test(const peer_digest_t *digest, uint64_t hash) {
+    if (!digest->bits) {
+        return 0;
+    }
+    uint64_t h2 = mix64(hash) | 1;
+    for (int i = 0; i < PEER_DIGEST_HASHES; i++) {
+        size_t bit = (size_t)((hash + (uint64_t)i * h2) & (digest->nbits - 1));
+        if (!(digest->bits[bit / 64] & (1ULL << (bit % 64)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void peer_digest_free(peer_digest_t *digest) {
+    free(digest->bits);
+    digest->bits = NULL;
+    digest->nbits = 0;
+}
+
+static int split_name(const char *name, char *host, size_t host_sz, int *port) {
+    const char *colon = strrchr(name, ':');
+    if (!colon || colon == name || (size_t)(colon - name) >= host_sz) {
+        return -1;
+    }
+    int p = atoi(colon + 1);
+    if (p <= 0 || p > 65535) {
+        return -1;
+    }
+    memcpy(host, name, (size_t)(colon - name));
+    host[colon - name] = '\0';
+    *port = p;
+    return 0;
+}
+
+static void set_up(peers_t *peers, peer_t *peer, int up) {
+    int was = __atomic_exchange_n(&peer->up, up, __ATOMIC_RELAXED);
+    if (was != up && peers->on_change) {
+        peers->on_change(peer, up, peers->arg);
+    }
+}
+
+static int dial(const peer_t *peer) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", peer->port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(peer->host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        struct timeval tv = {PEER_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Один условный запрос дайджеста по постоянному соединению. 0 — дайджест
+ * получен или не изменился, -1 — соединение надо закрыть, а соседа считать
+ * выпавшим.
+ */
+static int poll_peer(peers_t *peers, peer_t *peer) {
+    char req[1024];
+    int n = snprintf(req, sizeof(req),
+                     "GET %s HTTP/1.1\r\nHost: %s\r\n%s: %s\r\n%s%s%sConnection: keep-alive\r\n\r\n",
+                     PEER_DIGEST_PATH, peer->name, PEER_HEADER, peers->self, peer->etag[0] ? "If-None-Match: " : "",
+                     peer->etag, peer->etag[0] ? "\r\n" : "");
+    if (n < 0 || (size_t)n >= sizeof(req) || send_all(peer->fd, req, (size_t)n) != 0) {
+        return -1;
+    }
+
+    char head[4096];
+    size_t len = 0;
+    header_scan_t scan;
+    header_scan_reset(&scan);
+    ssize_t end = -1;
+    while (end < 0) {
+        if (len == sizeof(head)) {
+            return -1;
+        }
+        ssize_t got = recv(peer->fd, head + len, sizeof(head) - len, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        len += (size_t)got;
+        end = header_scan(&scan, head, len);
+    }
+
+    const char *p = head;
+    const char *stop = head + end;
+    const char *line = NULL;
+    size_t line_len = 0;
+    int status = 0;
+    if (http_first_line(&p, stop, &line, &line_len) != 0 || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+        return -1;
+    }
+    long long body_len = -1;
+    int close_after = 0;
+    char etag[32] = "";
+    http_field_t f;
+    while (http_next_field(&p, stop, &f) == 1) {
+        if (http_field_is(&f, "Content-Length")) {
+            body_len = strtoll(f.value, NULL, 10);
+        } else if (http_field_is(&f, "ETag") && f.value_len < sizeof(etag)) {
+            memcpy(etag, f.value, f.value_len);
+            etag[f.value_len] = '\0';
+        } else if (http_field_is(&f, "Connection") && f.value_len == 5 && strncasecmp(f.value, "close", 5) == 0) {
+            close_after = 1;
+        }
+    }
+
+    size_t extra = len - (size_t)end;
+    if (status == 304) {
+        __atomic_add_fetch(&peer->digest_unchanged, 1, __ATOMIC_RELAXED);
+        return extra == 0 && !close_after ? 0 : 1;
+    }
+    /* Размер дайджеста — степень двойки в битах, не меньше PEER_DIGEST_MIN_BITS. */
+    if (status != 200 || body_len < PEER_DIGEST_MIN_BITS / 8 || body_len > PEER_DIGEST_MAX_BYTES ||
+        (body_len & (body_len - 1)) != 0 || (long long)extra > body_len) {
+        return -1;
+    }
+    peer_digest_t digest;
+    digest.nbits = (size_t)body_len * 8;
+    digest.bits = (uint64_t *)malloc((size_t)body_len);
+    if (!digest.bits) {
+        return -1;
+    }
+    memcpy(digest.bits, head + end, extra);
+    if (recv_all(peer->fd, (char *)digest.bits + extra, (size_t)body_len - extra) != 0) {
+        free(digest.bits);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&peer->lock);
+    peer_digest_t old = peer->digest;
+    peer->digest = digest;
+    snprintf(peer->etag, sizeof(peer->etag), "%s", etag);
+    pthread_rwlock_unlock(&peer->lock);
+    peer_digest_free(&old);
+    __atomic_add_fetch(&peer->digest_updates, 1, __ATOMIC_RELAXED);
+    return close_after ? 1 : 0;
+}
+
+static void rebuild_local(peers_t *peers) {
+    peer_digest_t digest;
+    memset(&digest, 0, sizeof(digest));
+    if (!peers->collect || peers->collect(&digest, peers->arg) != 0) {
+        peer_digest_free(&digest);
+        return;
+    }
+    char etag[32];
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)fnv1a(digest.bits, digest.nbits / 8));
+    pthread_rwlock_wrlock(&peers->local_lock);
+    peer_digest_t old = peers->local;
+    peers->local = digest;
+    snprintf(peers->local_etag, sizeof(peers->local_etag), "%s", etag);
+    pthread_rwlock_unlock(&peers->local_lock);
+    peer_digest_free(&old);
+}
+
+static void *peers_main(void *arg) {
+    peers_t *peers = (peers_t *)arg;
+    pthread_mutex_lock(&peers->mutex);
+    while (!peers->stop) {
+        pthread_mutex_unlock(&peers->mutex);
+        rebuild_local(peers);
+        for (int i = 0; i < peers->count; i++) {
+            peer_t *peer = &peers->peers[i];
+            if (peer->fd < 0) {
+                peer->fd = dial(peer);
+            }
+            int rc = peer->fd >= 0 ? poll_peer(peers, peer) : -1;
+            if (rc != 0 && peer->fd >= 0) {
+                close(peer->fd);
+                peer->fd = -1;
+            }
+            set_up(peers, peer, rc >= 0);
+        }
+        pthread_mutex_lock(&peers->mutex);
+        if (peers->stop) {
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PEER_DIGEST_INTERVAL;
+        pthread_cond_timedwait(&peers->wake, &peers->mutex, &deadline);
+    }
+    pthread_mutex_unlock(&peers->mutex);
+    return NULL;
+}
+
+/*
+ * self — имя этого прокси (host:port), list — соседи через запятую в том же
+ * виде. Запись, совпадающая с self, пропускается, поэтому на всех узлах можно
+ * задавать один и тот же список.
+ */
+peers_t *peers_create(const char *self, const char *list, peers_collect_t collect, peers_change_t on_change,
+                      void *arg) {
+    peers_t *peers = (peers_t *)calloc(1, sizeof(peers_t));
+    if (!peers) {
+        return NULL;
+    }
+    snprintf(peers->self, sizeof(peers->self), "%s", self);
+    peers->self_id = fnv1a(self, strlen(self));
+    peers->collect = collect;
+    peers->on_change = on_change;
+    peers->arg = arg;
+
+    const char *p = list;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        if (len > 0 && len < PEER_NAME_MAX && !(strlen(self) == len && strncmp(p, self, len) == 0)) {
+            if (peers->count == PEERS_MAX) {
+                free(peers);
+                return NULL;
+            }
+            peer_t *peer = &peers->peers[peers->count];
+            memcpy(peer->name, p, len);
+            peer->name[len] = '\0';
+            if (split_name(peer->name, peer->host, sizeof(peer->host), &peer->port) != 0) {
+                free(peers);
+                return NULL;
+            }
+            peer->id = fnv1a(peer->name, len);
+            peer->fd = -1;
+            pthread_rwlock_init(&peer->lock, NULL);
+            peers->count++;
+        } else if (len >= PEER_NAME_MAX) {
+            free(peers);
+            return NULL;
+        }
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    pthread_rwlock_init(&peers->local_lock, NULL);
+    pthread_mutex_init(&peers->mutex, NULL);
+    pthread_cond_init(&peers->wake, NULL);
+    if (pthread_create(&peers->thread, NULL, peers_main, peers) != 0) {
+        pthread_mutex_destroy(&peers->mutex);
+        pthread_cond_destroy(&peers->wake);
+        pthread_rwlock_destroy(&peers->local_lock);
+        for (int i = 0; i < peers->count; i++) {
+            pthread_rwlock_destroy(&peers->peers[i].lock);
+        }
+        free(peers);
+        return NULL;
+    }
+    return peers;
+}
+
+/* Владелец ключа среди работающих узлов; NULL — владелец этот прокси. */
+peer_t *peers_owner(peers_t *peers, uint64_t hash) {
+    peer_t *best = NULL;
+    uint64_t best_score = mix64(peers->self_id ^ hash);
+    for (int i = 0; i < peers->count; i++) {
+        peer_t *peer = &peers->peers[i];
+        if (!__atomic_load_n(&peer->up, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        uint64_t score = mix64(peer->id ^ hash);
+        if (score > best_score) {
+            best = peer;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+/* Работающий сосед, в дайджесте которого, вероятно, есть ключ. */
+peer_t *peers_holder(peers_t *peers, uint64_t hash) {
+    for (int i = 0; i < peers->count; i++) {
+        peer_t *peer = &peers->peers[i];
+        if (!__atomic_load_n(&peer->up, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        pthread_rwlock_rdlock(&peer->lock);
+        int has = peer_digest_test(&peer->digest, hash);
+        pthread_rwlock_unlock(&peer->lock);
+        if (has) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+/* Загрузка у соседа не удалась: до следующего удачного опроса к нему не ходят. */
+void peers_failed(peers_t *peers, peer_t *peer) {
+    __atomic_add_fetch(&peer->failures, 1, __ATOMIC_RELAXED);
+    set_up(peers, peer, 0);
+}
+
+/* Копия своего дайджеста для отдачи соседу; -1 — дайджест ещё не построен. */
+int peers_local_digest(peers_t *peers, char **buf, size_t *len, char *etag, size_t etag_sz) {
+    int rc = -1;
+    pthread_rwlock_rdlock(&peers->local_lock);
+    if (peers->local.bits) {
+        *len = peers->local.nbits / 8;
+        *buf = (char *)malloc(*len);
+        if (*buf) {
+            memcpy(*buf, peers->local.bits, *len);
+            snprintf(etag, etag_sz, "%s", peers->local_etag);
+            rc = 0;
+        }
+    }
+    pthread_rwlock_unlock(&peers->local_lock);
+    return rc;
+}
+
+void peers_destroy(peers_t *peers) {
+    if (!peers) {
+        return;
+    }
+    pthread_mutex_lock(&peers->mutex);
+    peers->stop = 1;
+    pthread_cond_signal(&peers->wake);
+    pthread_mutex_unlock(&peers->mutex);
+    pthread_join(peers->thread, NULL);
+    for (int i = 0; i < peers->count; i++) {
+        peer_t *peer = &peers->peers[i];
+        if (peer->fd >= 0) {
+            close(peer->fd);
+        }
+        peer_digest_free(&peer->digest);
+        pthread_rwlock_destroy(&peer->lock);
+    }
+    peer_digest_free(&peers->local);
+    pthread_rwlock_destroy(&peers->local_lock);
+    pthread_mutex_destroy(&peers->mutex);
+    pthread_cond_destroy(&peers->wake);
+    free(peers);
+}
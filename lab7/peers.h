@@ -0,0 +1,95 @@
+#ifndef PEERS_H
+#define PEERS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PEERS_MAX 16
+#define PEER_NAME_MAX 272
+#define PEER_HEADER "X-Proxy-Peer"
+#define PEER_DIGEST_PATH "/proxy-peer-digest"
+#define PEER_DIGEST_INTERVAL 10
+#define PEER_DIGEST_HASHES 4
+#define PEER_DIGEST_BITS_PER_KEY 10
+#define PEER_DIGEST_MIN_BITS 8192
+#define PEER_DIGEST_MAX_BYTES (64 * 1024 * 1024)
+#define PEER_TIMEOUT 2
+
+/*
+ * Фильтр Блума по хешам ключей кэша: PEER_DIGEST_HASHES бит на ключ, биты
+ * берутся двойным хешированием из 64-битного хеша. nbits — степень двойки.
+ */
+typedef struct {
+    uint64_t *bits;
+    size_t nbits;
+} peer_digest_t;
+
+/*
+ * Сосед по кластеру. up — удался последний опрос дайджеста; загрузка у
+ * соседа, которая не удалась, тоже сбрасывает up до следующего удачного
+ * опроса. fd — постоянное соединение потока опроса.
+ */
+typedef struct {
+    char name[PEER_NAME_MAX];
+    char host[256];
+    int port;
+    uint64_t id;
+    int fd;
+    int up;
+    pthread_rwlock_t lock;
+    peer_digest_t digest;
+    char etag[32];
+    unsigned long long fetches;
+    unsigned long long failures;
+    unsigned long long digest_updates;
+    unsigned long long digest_unchanged;
+} peer_t;
+
+/* Заполняет дайджест ключами своего кэша; 0 — удалось. */
+typedef int (*peers_collect_t)(peer_digest_t *digest, void *arg);
+/* Вызывается, когда сосед входит в работу (up = 1) или выпадает из неё. */
+typedef void (*peers_change_t)(const peer_t *peer, int up, void *arg);
+
+/*
+ * Кластер соседних прокси со статическим списком. Ключ принадлежит узлу с
+ * наибольшим весом mix(id узла, хеш ключа) среди работающих (rendezvous
+ * hashing): все узлы с одинаковым списком считают владельцем одного и того
+ * же, а выпавший узел отдаёт свои ключи поровну остальным. Фоновый поток раз
+ * в PEER_DIGEST_INTERVAL секунд строит дайджест своего кэша и забирает
+ * дайджесты соседей условным запросом (If-None-Match), так что неизменный
+ * дайджест стоит одного ответа 304. Опрос заодно проверяет, жив ли сосед.
+ */
+typedef struct {
+    peer_t peers[PEERS_MAX];
+    int count;
+    char self[PEER_NAME_MAX];
+    uint64_t self_id;
+    peers_collect_t collect;
+    peers_change_t on_change;
+    void *arg;
+    pthread_rwlock_t local_lock;
+    peer_digest_t local;
+    char local_etag[32];
+    size_t local_keys;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    int stop;
+} peers_t;
+
+int peer_digest_init(peer_digest_t *digest, size_t keys);
+void peer_digest_add(peer_digest_t *digest, uint64_t hash);
+int peer_digest_test(const peer_digest_t *digest, uint64_t hash);
+void peer_digest_free(peer_digest_t *digest);
+
+peers_t *peers_create(const char *self, const char *list, peers_collect_t collect, peers_change_t on_change,
+                      void *arg);
+peer_t *peers_owner(peers_t *peers, uint64_t hash);
+peer_t *peers_holder(peers_t *peers, uint64_t hash);
+void peers_failed(peers_t *peers, peer_t *peer);
+int peers_local_digest(peers_t *peers, char **buf, size_t *len, char *etag, size_t etag_sz);
+void peers_destroy(peers_t *peers);
+
+#endif
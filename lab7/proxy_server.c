@@ -1,45 +1,113 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cache_admission.h"
+#include "cache_evictor.h"
+#include "cache_index.h"
+#include "cache_journal.h"
+#include "cache_roots.h"
+#include "dns_cache.h"
+#include "event_loop.h"
+#include "hot_cache.h"
+#include "http_scan.h"
+#include "inflight.h"
+#include "metrics.h"
+#include "peers.h"
+#include "slab_store.h"
+#include "upstream_connect.h"
+#include "upstream_pool.h"
+#include "vary_table.h"
+#include "work_pool.h"
+
 #define MAX_HEADER_SIZE (64 * 1024)
 #define MAX_HEADERS 128
+#define HEADER_INDEX_SIZE 256
+#define MAX_URL_SIZE 2048
 #define MAX_LINE 4096
-#define MAX_BODY_SIZE (10 * 1024 * 1024)
+#define DEFAULT_MAX_BODY_MB 10
+#define DEFAULT_SPILL_MB 16
+#define DEFAULT_TUNNEL_IDLE 300
+#define DEFAULT_TUNNEL_PORTS "443"
+#define DEFAULT_SLICE_MB 0
+#define DEFAULT_DISK_SLOW_MS 2000
+#define DEFAULT_DISK_QUEUE 64
+#define PROXY_STATUS_PATH "/proxy-status"
 #define IO_BUF_SIZE 4096
-
+#define RELAY_PIPE_SIZE (256 * 1024)
+#define DEFAULT_WORKERS 64
+#define DEFAULT_CLIENT_IDLE_TIMEOUT 15
+#define DEFAULT_UPSTREAM_MAX_IDLE 8
+#define DEFAULT_UPSTREAM_IDLE_TIMEOUT 30
+#define DEFAULT_DNS_THREADS 4
+#define DEFAULT_DNS_TTL 300
+#define DEFAULT_CONNECT_TIMEOUT 10
+#define DEFAULT_FIRST_BYTE_TIMEOUT 30
+#define DEFAULT_READ_TIMEOUT 60
+#define DEFAULT_MEM_CACHE_MB 64
+#define DEFAULT_MEM_OBJECT_KB 512
+#define DEFAULT_CACHE_SIZE_MB 1024
+#define DEFAULT_CACHE_OBJECTS 0
+#define DEFAULT_SLAB_OBJECT_KB 64
+#define DEFAULT_REFRESH_THREADS 4
+#define DEFAULT_PREFETCH_PERCENT 10
+#define DEFAULT_ADMISSION 1
+#define ADMISSION_AVG_OBJECT (32 * 1024)
+#define ADMISSION_VICTIM_SAMPLES 8
+#define CACHE_REPORT_INTERVAL 60
+#define CACHE_KEY_HEADER "X-Cache-Key"
+#define HEURISTIC_PERCENT 10
+#define HEURISTIC_MAX_AGE (24 * 60 * 60)
+
+/* Смещения имени и значения заголовка в арене запроса. */
 typedef struct {
-    char name[128];
-    char value[2048];
+    uint32_t name;
+    uint32_t value;
 } header_t;
 
+/*
+ * Строка запроса и заголовки лежат в арене — копии принятого блока
+ * заголовков, разрезанной на месте на строки с завершающим нулём; url, path
+ * и заголовки указывают в неё. index — открытая адресация по имени без учёта
+ * регистра, в ячейке номер заголовка + 1.
+ */
 typedef struct {
+    char *arena;
+    size_t arena_len;
     char method[8];
-    char url[2048];
     char version[16];
     char host[256];
     int port;
-    char path[2048];
+    const char *url;
+    const char *path;
     header_t headers[MAX_HEADERS];
     int header_count;
-    int content_length;
-    char *body;
-    size_t body_len;
+    uint8_t index[HEADER_INDEX_SIZE];
+    long long content_length;
+    int chunked;
+    int expect_continue;
 } http_request_t;
 
 typedef struct {
@@ -51,31 +119,161 @@ typedef struct {
     int no_store;
     int no_cache;
     int must_revalidate;
+    int has_stale_while_revalidate;
+    int stale_while_revalidate;
+    int has_stale_if_error;
+    int stale_if_error;
     int has_last_modified;
     char last_modified[128];
     int has_etag;
     char etag[128];
+    int http_minor;
+    int conn_close;
+    int conn_keep_alive;
+    int chunked;
+    int has_content_length;
+    long long content_length;
+    int has_vary;
+    char vary[256];
 } http_response_info_t;
 
+typedef enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE
+} body_mode_t;
+
 typedef struct {
-    time_t stored_at;
-    time_t expires;
-    int must_revalidate;
-    char last_modified[128];
-    char etag[128];
-} cache_meta_t;
+    int fd;
+    body_mode_t mode;
+    const char *pending;
+    size_t pending_len;
+    char raw[IO_BUF_SIZE];
+    size_t raw_pos;
+    size_t raw_len;
+    long long remaining;
+    long long received;
+    int need_crlf;
+    int done;
+} body_reader_t;
+
+/*
+ * Диапазон из Range: bytes=first-last (last = -1 — до конца) или
+ * bytes=-suffix (first = -1). if_range — значение If-Range или NULL.
+ */
+typedef struct {
+    long long first;
+    long long last;
+    long long suffix;
+    const char *if_range;
+} byte_range_t;
+
+/*
+ * range — диапазон, который клиент просит из объекта; pass_range — Range
+ * передаётся серверу как есть. partial — код ответа на диапазон (206 или
+ * 416, 0 — тело целиком): тогда из тела пропускается skip байт и отдаётся
+ * не больше left. handed_off — остаток ответа отдаёт цикл событий, и
+ * соединение обработчику больше не принадлежит.
+ */
+typedef struct {
+    int fd;
+    int keep_alive;
+    int http11;
+    int chunked;
+    conn_t *conn;
+    const byte_range_t *range;
+    int pass_range;
+    int partial;
+    long long skip;
+    long long left;
+    int handed_off;
+} client_t;
 
 typedef struct {
-    char cache_dir[PATH_MAX];
+    char cache_dirs[CACHE_ROOTS_MAX][PATH_MAX];
+    long long cache_dir_mb[CACHE_ROOTS_MAX];
+    int cache_dir_count;
     int debug;
+    int loop_threads;
+    int worker_threads;
+    int upstream_max_idle;
+    int upstream_idle_timeout;
+    int client_idle_timeout;
+    int dns_threads;
+    int dns_ttl;
+    int connect_timeout;
+    int first_byte_timeout;
+    int read_timeout;
+    int mem_cache_mb;
+    int mem_object_kb;
+    long long cache_size_mb;
+    long long cache_objects;
+    int slab_object_kb;
+    int refresh_threads;
+    int prefetch_percent;
+    long long max_body_mb;
+    long long spill_mb;
+    int tunnel_idle_timeout;
+    char tunnel_ports[256];
+    long long slice_mb;
+    int admission;
+    int disk_slow_ms;
+    int disk_queue;
+    char peers[1024];
+    char peer_name[PEER_NAME_MAX];
 } proxy_config_t;
 
+/*
+ * Счётчики эффективности кэша с запуска, раз в CACHE_REPORT_INTERVAL секунд
+ * пишутся в лог. Запись на байт попаданий — сколько байт записано в кэш на
+ * каждый байт, отданный из него. miss_bytes — байты ответов, полученных с
+ * сервера или от соседа; active — запросы GET, которые обрабатываются сейчас.
+ */
 typedef struct {
-    int client_fd;
-    proxy_config_t *config;
-} client_ctx_t;
+    unsigned long long lookups;
+    unsigned long long hits;
+    unsigned long long hit_bytes;
+    unsigned long long miss_bytes;
+    unsigned long long writes;
+    unsigned long long written_bytes;
+    int active;
+    time_t next_report;
+} cache_stats_t;
+
+static cache_roots_t *cache_roots = NULL;
+static cache_admission_t *cache_admission = NULL;
+static cache_stats_t cache_stats;
+static metrics_t metrics;
+static upstream_pool_t *upstream_pool = NULL;
+static dns_cache_t *dns_cache = NULL;
+static addr_health_t *addr_health = NULL;
+static hot_cache_t *hot_cache = NULL;
+static inflight_table_t *inflight_table = NULL;
+static peers_t *peers = NULL;
+static vary_table_t *vary_table = NULL;
+static work_pool_t *worker_pool = NULL;
+static work_pool_t *refresh_pool = NULL;
+static int discard_fd = -1;
+
+/* Замер запроса, который обрабатывает этот поток; NULL у фоновых обновлений и служебных запросов. */
+static __thread req_timing_t *req_timing;
+
+static long long timing_begin(void) {
+    return req_timing ? metrics_now_us() : 0;
+}
+
+static void timing_end(int phase, long long started) {
+    if (req_timing) {
+        req_timing_add(req_timing, phase, started);
+    }
+}
 
-static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void timing_outcome(int outcome) {
+    if (req_timing) {
+        req_timing->outcome = outcome;
+    }
+}
 
 static void log_msg(const proxy_config_t *cfg, const char *level, const char *fmt, ...) {
     if (strcmp(level, "DEBUG") == 0 && !cfg->debug) {
@@ -97,14 +295,14 @@ static void log_msg(const proxy_config_t *cfg, const char *level, const char *fm
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Использование: %s <порт> [-cache_dir путь] [-d]\n", prog);
+    fprintf(stderr, "Использование: %s <порт> [-cache_dir путь[:МБ]] [-loops N] [-workers N] [-upstream_max N] [-upstream_idle сек] [-client_idle сек] [-dns_threads N] [-dns_ttl сек] [-connect_timeout сек] [-first_byte_timeout сек] [-read_timeout сек] [-mem_cache МБ] [-mem_object КБ] [-cache_size МБ] [-cache_objects N] [-slab_object КБ] [-refresh_threads N] [-prefetch процент] [-max_body МБ] [-spill МБ] [-tunnel_idle сек] [-tunnel_ports список] [-slice МБ] [-admission tinylfu|all] [-disk_slow мс] [-disk_queue N] [-peers список] [-peer_name хост:порт] [-d]\n", prog);
 }
 
 static int send_all(int fd, const void *buf, size_t len) {
     const char *p = (const char *)buf;
     size_t sent = 0;
     while (sent < len) {
-        ssize_t n = send(fd, p + sent, len - sent, 0);
+        ssize_t n = write(fd, p + sent, len - sent);
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
@@ -134,18 +332,15 @@ static void send_simple_response(int fd, int status, const char *reason, const c
     }
 }
 
-static int find_header_end(const char *buf, size_t len) {
-    for (size_t i = 0; i + 3 < len; i++) {
-        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') {
-            return (int)(i + 4);
-        }
-    }
-    return -1;
-}
-
+/*
+ * Поиск конца заголовков продолжается с места, где остановился, а не с начала
+ * буфера. -2 — истёк таймаут чтения сокета.
+ */
 static int recv_header(int fd, char **out_buf, size_t *out_len, size_t *header_len, char *err, size_t errsz) {
     size_t cap = 8192;
     size_t len = 0;
+    header_scan_t scan;
+    header_scan_reset(&scan);
     char *buf = (char *)malloc(cap);
     if (!buf) {
         snprintf(err, errsz, "нет памяти");
@@ -180,12 +375,16 @@ static int recv_header(int fd, char **out_buf, size_t *out_len, size_t *header_l
                 continue;
             }
             free(buf);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                snprintf(err, errsz, "сервер не ответил вовремя");
+                return -2;
+            }
             snprintf(err, errsz, "ошибка чтения: %s", strerror(errno));
             return -1;
         }
         len += (size_t)n;
 
-        int idx = find_header_end(buf, len);
+        ssize_t idx = header_scan(&scan, buf, len);
         if (idx >= 0) {
             *out_buf = buf;
             *out_len = len;
@@ -229,13 +428,13 @@ static void copy_str(char *dst, size_t dst_sz, const char *src) {
     dst[len] = '\0';
 }
 
-static int parse_request_line(const char *line, http_request_t *req, char *err, size_t errsz) {
-    const char *sp1 = strchr(line, ' ');
+static int parse_request_line(char *line, http_request_t *req, char *err, size_t errsz) {
+    char *sp1 = strchr(line, ' ');
     if (!sp1) {
         snprintf(err, errsz, "некорректная строка запроса");
         return -1;
     }
-    const char *sp2 = strchr(sp1 + 1, ' ');
+    char *sp2 = strchr(sp1 + 1, ' ');
     if (!sp2) {
         snprintf(err, errsz, "некорректная строка запроса");
         return -1;
@@ -245,86 +444,137 @@ static int parse_request_line(const char *line, http_request_t *req, char *err,
     size_t ulen = (size_t)(sp2 - (sp1 + 1));
     size_t vlen = strlen(sp2 + 1);
 
-    if (mlen >= sizeof(req->method) || ulen >= sizeof(req->url) || vlen >= sizeof(req->version)) {
+    if (mlen >= sizeof(req->method) || ulen >= MAX_URL_SIZE || vlen >= sizeof(req->version)) {
         snprintf(err, errsz, "слишком длинная строка запроса");
         return -1;
     }
 
     memcpy(req->method, line, mlen);
     req->method[mlen] = '\0';
-    memcpy(req->url, sp1 + 1, ulen);
-    req->url[ulen] = '\0';
     memcpy(req->version, sp2 + 1, vlen);
     req->version[vlen] = '\0';
+    *sp2 = '\0';
+    req->url = sp1 + 1;
 
     return 0;
 }
 
-static int parse_headers(const char *buf, size_t header_len, http_request_t *req) {
-    const char *p = buf;
-    const char *end = buf + header_len;
+static uint32_t header_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (uint32_t)tolower((unsigned char)*name);
+        h *= 16777619u;
+    }
+    return h;
+}
 
-    const char *line_end = strstr(p, "\r\n");
-    if (!line_end) {
-        return -1;
+static const char *header_name(const http_request_t *req, int i) {
+    return req->arena + req->headers[i].name;
+}
+
+static const char *header_value(const http_request_t *req, int i) {
+    return req->arena + req->headers[i].value;
+}
+
+/*
+ * Номер заголовка с таким именем или -1; *slot — ячейка, где он лежит или
+ * куда его класть. Заголовков не больше половины ячеек, так что пустая
+ * ячейка всегда найдётся.
+ */
+static int header_index_find(const http_request_t *req, const char *name, uint32_t *slot) {
+    uint32_t i = header_name_hash(name) & (HEADER_INDEX_SIZE - 1);
+    while (req->index[i] != 0) {
+        int h = req->index[i] - 1;
+        if (strcasecmp(header_name(req, h), name) == 0) {
+            *slot = i;
+            return h;
+        }
+        i = (i + 1) & (HEADER_INDEX_SIZE - 1);
     }
+    *slot = i;
+    return -1;
+}
 
-    char line[MAX_LINE];
-    size_t line_len = (size_t)(line_end - p);
-    if (line_len >= sizeof(line)) {
+/*
+ * Копирует блок заголовков в арену и режет его на месте за один проход:
+ * после строки запроса, имени и значения каждого поля ставится нуль, в
+ * запросе остаются только смещения. Из повторяющихся заголовков в индекс
+ * попадает первый.
+ */
+static int parse_headers(const char *buf, size_t header_len, http_request_t *req) {
+    req->arena = (char *)malloc(header_len + 1);
+    if (!req->arena) {
         return -1;
     }
-    memcpy(line, p, line_len);
-    line[line_len] = '\0';
+    memcpy(req->arena, buf, header_len);
+    req->arena[header_len] = '\0';
+    req->arena_len = header_len;
+
+    const char *p = req->arena;
+    const char *end = req->arena + header_len;
+    const char *line;
+    size_t line_len;
+    if (http_first_line(&p, end, &line, &line_len) != 0) {
+        return -1;
+    }
+    char *request_line = req->arena + (line - req->arena);
+    request_line[line_len] = '\0';
 
     char err[128];
-    if (parse_request_line(line, req, err, sizeof(err)) != 0) {
+    if (parse_request_line(request_line, req, err, sizeof(err)) != 0) {
         return -1;
     }
 
-    p = line_end + 2;
-    while (p < end) {
-        const char *eol = strstr(p, "\r\n");
-        if (!eol) {
-            break;
-        }
-        if (eol == p) {
-            break;
+    http_field_t f;
+    while (http_next_field(&p, end, &f) > 0) {
+        if (req->header_count >= MAX_HEADERS) {
+            continue;
         }
-
-        size_t len = (size_t)(eol - p);
-        if (len >= sizeof(line)) {
-            return -1;
+        uint32_t name = (uint32_t)(f.name - req->arena);
+        uint32_t value = (uint32_t)(f.value - req->arena);
+        req->arena[name + f.name_len] = '\0';
+        req->arena[value + f.value_len] = '\0';
+        int h = req->header_count++;
+        req->headers[h].name = name;
+        req->headers[h].value = value;
+        uint32_t slot;
+        if (header_index_find(req, req->arena + name, &slot) < 0) {
+            req->index[slot] = (uint8_t)(h + 1);
         }
-        memcpy(line, p, len);
-        line[len] = '\0';
+    }
 
-        char *colon = strchr(line, ':');
-        if (colon && req->header_count < MAX_HEADERS) {
-            *colon = '\0';
-            char *name = line;
-            char *value = colon + 1;
-            trim(name);
-            trim(value);
+    return 0;
+}
 
-            copy_str(req->headers[req->header_count].name, sizeof(req->headers[req->header_count].name), name);
-            copy_str(req->headers[req->header_count].value, sizeof(req->headers[req->header_count].value), value);
-            req->header_count++;
-        }
+static const char *find_header_value(const http_request_t *req, const char *name) {
+    uint32_t slot;
+    int h = header_index_find(req, name, &slot);
+    return h >= 0 ? header_value(req, h) : NULL;
+}
 
-        p = eol + 2;
+static const char *request_rebase(const http_request_t *src, char *arena, const char *p) {
+    if (p >= src->arena && p <= src->arena + src->arena_len) {
+        return arena + (p - src->arena);
     }
+    return p;
+}
 
+/* Копия запроса со своей ареной — для работы, которая переживёт исходный запрос. */
+static int request_clone(http_request_t *dst, const http_request_t *src) {
+    *dst = *src;
+    dst->arena = (char *)malloc(src->arena_len + 1);
+    if (!dst->arena) {
+        return -1;
+    }
+    memcpy(dst->arena, src->arena, src->arena_len + 1);
+    dst->url = request_rebase(src, dst->arena, src->url);
+    dst->path = request_rebase(src, dst->arena, src->path);
     return 0;
 }
 
-static const char *find_header_value(const http_request_t *req, const char *name) {
-    for (int i = 0; i < req->header_count; i++) {
-        if (strcasecmp(req->headers[i].name, name) == 0) {
-            return req->headers[i].value;
-        }
-    }
-    return NULL;
+static void request_free(http_request_t *req) {
+    free(req->arena);
+    req->arena = NULL;
 }
 
 static int parse_host_port(const char *hostport, char *host, size_t hostsz, int *port) {
@@ -354,6 +604,15 @@ static int parse_host_port(const char *hostport, char *host, size_t hostsz, int
 
 static int parse_url(http_request_t *req, char *err, size_t errsz) {
     const char *url = req->url;
+    /* У CONNECT вместо URL — host:port, порт обязателен. */
+    if (strcasecmp(req->method, "CONNECT") == 0) {
+        if (!strchr(url, ':') || parse_host_port(url, req->host, sizeof(req->host), &req->port) != 0) {
+            snprintf(err, errsz, "некорректная цель CONNECT");
+            return -1;
+        }
+        req->path = "";
+        return 0;
+    }
     if (strncmp(url, "/http://", 8) == 0) {
         url++;
     }
@@ -371,12 +630,11 @@ static int parse_url(http_request_t *req, char *err, size_t errsz) {
             }
             memcpy(hostport, host_start, hlen);
             hostport[hlen] = '\0';
-            strncpy(req->path, path_start, sizeof(req->path) - 1);
-            req->path[sizeof(req->path) - 1] = '\0';
+            req->path = path_start;
         } else {
             strncpy(hostport, host_start, sizeof(hostport) - 1);
             hostport[sizeof(hostport) - 1] = '\0';
-            strcpy(req->path, "/");
+            req->path = "/";
         }
 
         if (parse_host_port(hostport, req->host, sizeof(req->host), &req->port) != 0) {
@@ -401,8 +659,7 @@ static int parse_url(http_request_t *req, char *err, size_t errsz) {
             snprintf(err, errsz, "некорректный Host");
             return -1;
         }
-        strncpy(req->path, url, sizeof(req->path) - 1);
-        req->path[sizeof(req->path) - 1] = '\0';
+        req->path = url;
         return 0;
     }
 
@@ -410,63 +667,42 @@ static int parse_url(http_request_t *req, char *err, size_t errsz) {
     return -1;
 }
 
-static int read_request(int fd, http_request_t *req, char *err, size_t errsz) {
-    memset(req, 0, sizeof(*req));
-
-    char *buf = NULL;
-    size_t total_len = 0;
-    size_t header_len = 0;
+/* Запрос целиком не обнуляется: массив заголовков заполняется при разборе. */
+static int read_request(conn_t *conn, http_request_t *req, char *err, size_t errsz) {
+    req->arena = NULL;
+    req->header_count = 0;
+    req->content_length = 0;
+    req->chunked = 0;
+    req->expect_continue = 0;
+    memset(req->index, 0, sizeof(req->index));
 
-    if (recv_header(fd, &buf, &total_len, &header_len, err, errsz) != 0) {
+    if (parse_headers(conn->buf, conn->header_len, req) != 0) {
+        snprintf(err, errsz, "ошибка разбора заголовков");
         return -1;
     }
-
-    if (parse_headers(buf, header_len, req) != 0) {
-        free(buf);
-        snprintf(err, errsz, "ошибка разбора заголовков");
+    conn_consume(conn, conn->header_len);
+
+    /* Тело здесь не читается: оно передаётся на сервер по мере поступления. */
+    const char *te = find_header_value(req, "Transfer-Encoding");
+    if (te && strcasecmp(te, "chunked") == 0) {
+        req->chunked = 1;
+    } else if (te && strcasecmp(te, "identity") != 0) {
+        snprintf(err, errsz, "Transfer-Encoding в запросе не поддерживается");
         return -1;
     }
 
     const char *cl = find_header_value(req, "Content-Length");
-    if (cl) {
-        req->content_length = atoi(cl);
-        if (req->content_length < 0 || req->content_length > MAX_BODY_SIZE) {
-            free(buf);
-            snprintf(err, errsz, "слишком большое тело запроса");
-            return -1;
-        }
-    }
-
-    if (strcasecmp(req->method, "POST") == 0 && req->content_length > 0) {
-        req->body_len = (size_t)req->content_length;
-        req->body = (char *)malloc(req->body_len);
-        if (!req->body) {
-            free(buf);
-            snprintf(err, errsz, "нет памяти");
+    if (cl && !req->chunked) {
+        char *endp = NULL;
+        req->content_length = strtoll(cl, &endp, 10);
+        if (endp == cl || *endp != '\0' || req->content_length < 0) {
+            snprintf(err, errsz, "некорректный Content-Length");
             return -1;
         }
-        size_t have = total_len > header_len ? total_len - header_len : 0;
-        if (have > req->body_len) {
-            have = req->body_len;
-        }
-        if (have > 0) {
-            memcpy(req->body, buf + header_len, have);
-        }
-        size_t remaining = req->body_len - have;
-        size_t offset = have;
-        while (remaining > 0) {
-            ssize_t n = recv(fd, req->body + offset, remaining, 0);
-            if (n <= 0) {
-                free(buf);
-                snprintf(err, errsz, "ошибка чтения тела запроса");
-                return -1;
-            }
-            offset += (size_t)n;
-            remaining -= (size_t)n;
-        }
     }
 
-    free(buf);
+    const char *expect = find_header_value(req, "Expect");
+    req->expect_continue = expect && strcasecmp(expect, "100-continue") == 0;
 
     if (parse_url(req, err, errsz) != 0) {
         return -1;
@@ -485,8 +721,7 @@ static bool is_hop_by_hop_header(const char *name) {
            strcasecmp(name, "Upgrade") == 0;
 }
 
-static int append_str(char **buf, size_t *len, size_t *cap, const char *s) {
-    size_t slen = strlen(s);
+static int append_mem(char **buf, size_t *len, size_t *cap, const char *s, size_t slen) {
     if (*len + slen + 1 > *cap) {
         size_t new_cap = (*cap) * 2 + slen + 1;
         char *tmp = (char *)realloc(*buf, new_cap);
@@ -502,6 +737,10 @@ static int append_str(char **buf, size_t *len, size_t *cap, const char *s) {
     return 0;
 }
 
+static int append_str(char **buf, size_t *len, size_t *cap, const char *s) {
+    return append_mem(buf, len, cap, s, strlen(s));
+}
+
 static int append_fmt(char **buf, size_t *len, size_t *cap, const char *fmt, ...) {
     char tmp[2048];
     va_list ap;
@@ -517,8 +756,14 @@ static int append_fmt(char **buf, size_t *len, size_t *cap, const char *fmt, ...
     return append_str(buf, len, cap, tmp);
 }
 
-static int build_forward_request(const http_request_t *req, const char *cond_headers,
-                                 char **out_buf, size_t *out_len) {
+/*
+ * Range и If-Range клиента передаются, только если keep_range: прокси
+ * загружает объект целиком или своими кусками и вырезает диапазон сам.
+ * target — цель в строке запроса вместо пути (абсолютный URL для соседа),
+ * NULL — путь.
+ */
+static int build_forward_request(const http_request_t *req, const char *target, const char *cond_headers,
+                                 int keep_range, char **out_buf, size_t *out_len) {
     size_t cap = 4096;
     size_t len = 0;
     char *buf = (char *)malloc(cap);
@@ -527,7 +772,7 @@ static int build_forward_request(const http_request_t *req, const char *cond_hea
     }
     buf[0] = '\0';
 
-    if (append_fmt(&buf, &len, &cap, "%s %s HTTP/1.0\r\n", req->method, req->path) != 0) {
+    if (append_fmt(&buf, &len, &cap, "%s %s HTTP/1.1\r\n", req->method, target ? target : req->path) != 0) {
         free(buf);
         return -1;
     }
@@ -537,11 +782,10 @@ static int build_forward_request(const http_request_t *req, const char *cond_hea
     }
 
     bool has_user_agent = false;
-    bool has_content_length = false;
 
     for (int i = 0; i < req->header_count; i++) {
-        const char *name = req->headers[i].name;
-        const char *value = req->headers[i].value;
+        const char *name = header_name(req, i);
+        const char *value = header_value(req, i);
 
         if (strcasecmp(name, "Host") == 0) {
             continue;
@@ -550,11 +794,17 @@ static int build_forward_request(const http_request_t *req, const char *cond_hea
             has_user_agent = true;
         }
         if (strcasecmp(name, "Content-Length") == 0) {
-            has_content_length = true;
+            continue;
         }
         if (strcasecmp(name, "If-Modified-Since") == 0 || strcasecmp(name, "If-None-Match") == 0) {
             continue;
         }
+        if (strcasecmp(name, "Expect") == 0 || strcasecmp(name, PEER_HEADER) == 0) {
+            continue;
+        }
+        if (!keep_range && (strcasecmp(name, "Range") == 0 || strcasecmp(name, "If-Range") == 0)) {
+            continue;
+        }
         if (is_hop_by_hop_header(name)) {
             continue;
         }
@@ -572,8 +822,11 @@ static int build_forward_request(const http_request_t *req, const char *cond_hea
         }
     }
 
-    if (strcasecmp(req->method, "POST") == 0 && !has_content_length) {
-        if (append_fmt(&buf, &len, &cap, "Content-Length: %zu\r\n", req->body_len) != 0) {
+    /* Разметка тела своя: chunked передаётся дальше как chunked, без сборки целиком. */
+    if (strcasecmp(req->method, "POST") == 0) {
+        int rc = req->chunked ? append_str(&buf, &len, &cap, "Transfer-Encoding: chunked\r\n")
+                              : append_fmt(&buf, &len, &cap, "Content-Length: %lld\r\n", req->content_length);
+        if (rc != 0) {
             free(buf);
             return -1;
         }
@@ -586,7 +839,7 @@ static int build_forward_request(const http_request_t *req, const char *cond_hea
         }
     }
 
-    if (append_str(&buf, &len, &cap, "Connection: close\r\n\r\n") != 0) {
+    if (append_str(&buf, &len, &cap, "Connection: keep-alive\r\n\r\n") != 0) {
         free(buf);
         return -1;
     }
@@ -596,39 +849,32 @@ static int build_forward_request(const http_request_t *req, const char *cond_hea
     return 0;
 }
 
-static int connect_to_host(const char *host, int port, char *err, size_t errsz) {
-    struct addrinfo hints;
-    struct addrinfo *res = NULL;
-    char port_str[16];
-    snprintf(port_str, sizeof(port_str), "%d", port);
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    int rc = getaddrinfo(host, port_str, &hints, &res);
-    if (rc != 0) {
-        snprintf(err, errsz, "getaddrinfo: %s", gai_strerror(rc));
-        return -1;
+static int connect_to_host(const proxy_config_t *cfg, const char *host, int port, char *err, size_t errsz) {
+    dns_addrs_t addrs;
+    long long started = timing_begin();
+    int resolved = dns_cache_lookup(dns_cache, host, &addrs, err, errsz) == 0;
+    timing_end(TIMING_DNS, started);
+    if (!resolved) {
+        return CONNECT_FAILED;
     }
 
-    int fd = -1;
-    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
-        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (fd < 0) {
-            continue;
-        }
-        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
-            freeaddrinfo(res);
-            return fd;
-        }
-        close(fd);
-        fd = -1;
+    started = timing_begin();
+    int fd = upstream_connect(addr_health, &addrs, port, cfg->connect_timeout * 1000);
+    timing_end(TIMING_CONNECT, started);
+    if (fd == CONNECT_TIMEOUT) {
+        snprintf(err, errsz, "таймаут подключения к %s:%d", host, port);
+    } else if (fd < 0) {
+        snprintf(err, errsz, "не удалось подключиться к %s:%d: %s", host, port, strerror(errno));
     }
+    return fd;
+}
 
-    freeaddrinfo(res);
-    snprintf(err, errsz, "не удалось подключиться к %s:%d", host, port);
-    return -1;
+/* 0 секунд — без таймаута. */
+static void set_socket_timeout(int fd, int optname, int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof(tv));
 }
 
 static time_t timegm_compat(struct tm *tm) {
@@ -691,6 +937,51 @@ static void parse_cache_control(const char *value, http_response_info_t *info) {
             info->max_age = max_age;
         }
     }
+
+    p = strstr(buf, "stale-while-revalidate=");
+    if (p && atoi(p + 23) > 0) {
+        info->has_stale_while_revalidate = 1;
+        info->stale_while_revalidate = atoi(p + 23);
+    }
+    p = strstr(buf, "stale-if-error=");
+    if (p && atoi(p + 15) > 0) {
+        info->has_stale_if_error = 1;
+        info->stale_if_error = atoi(p + 15);
+    }
+}
+
+typedef enum {
+    RESP_FIELD_OTHER,
+    RESP_FIELD_CACHE_CONTROL,
+    RESP_FIELD_EXPIRES,
+    RESP_FIELD_LAST_MODIFIED,
+    RESP_FIELD_ETAG,
+    RESP_FIELD_CONNECTION,
+    RESP_FIELD_TRANSFER_ENCODING,
+    RESP_FIELD_CONTENT_LENGTH,
+    RESP_FIELD_VARY
+} response_field_t;
+
+static response_field_t response_field_kind(const http_field_t *f) {
+    static const struct {
+        const char *name;
+        response_field_t kind;
+    } known[] = {
+        {"Cache-Control", RESP_FIELD_CACHE_CONTROL},
+        {"Expires", RESP_FIELD_EXPIRES},
+        {"Last-Modified", RESP_FIELD_LAST_MODIFIED},
+        {"ETag", RESP_FIELD_ETAG},
+        {"Connection", RESP_FIELD_CONNECTION},
+        {"Transfer-Encoding", RESP_FIELD_TRANSFER_ENCODING},
+        {"Content-Length", RESP_FIELD_CONTENT_LENGTH},
+        {"Vary", RESP_FIELD_VARY},
+    };
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+        if (http_field_is(f, known[i].name)) {
+            return known[i].kind;
+        }
+    }
+    return RESP_FIELD_OTHER;
 }
 
 static int parse_response_info(const char *buf, size_t header_len, http_response_info_t *info) {
@@ -698,382 +989,3493 @@ static int parse_response_info(const char *buf, size_t header_len, http_response
 
     const char *p = buf;
     const char *end = buf + header_len;
-    const char *line_end = strstr(p, "\r\n");
-    if (!line_end) {
-        return -1;
-    }
+    const char *status;
+    size_t status_len;
     char line[MAX_LINE];
-    size_t line_len = (size_t)(line_end - p);
-    if (line_len >= sizeof(line)) {
+    if (http_first_line(&p, end, &status, &status_len) != 0 || status_len >= sizeof(line)) {
         return -1;
     }
-    memcpy(line, p, line_len);
-    line[line_len] = '\0';
+    memcpy(line, status, status_len);
+    line[status_len] = '\0';
 
+    int major = 0;
+    int minor = 0;
     int code = 0;
-    if (sscanf(line, "HTTP/%*s %d", &code) != 1) {
+    if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &code) != 3) {
         return -1;
     }
     info->status_code = code;
+    info->http_minor = major > 1 ? 1 : minor;
 
-    p = line_end + 2;
-    while (p < end) {
-        const char *eol = strstr(p, "\r\n");
-        if (!eol || eol == p) {
-            break;
+    /* Значение копируется (ради завершающего нуля) только у полей, которые нужны. */
+    http_field_t f;
+    while (http_next_field(&p, end, &f) > 0) {
+        response_field_t kind = response_field_kind(&f);
+        if (kind == RESP_FIELD_OTHER) {
+            continue;
         }
-        size_t len = (size_t)(eol - p);
-        if (len >= sizeof(line)) {
+        if (f.value_len >= sizeof(line)) {
             return -1;
         }
-        memcpy(line, p, len);
-        line[len] = '\0';
-        char *colon = strchr(line, ':');
-        if (colon) {
-            *colon = '\0';
-            char *name = line;
-            char *value = colon + 1;
-            trim(name);
-            trim(value);
-
-            if (strcasecmp(name, "Cache-Control") == 0) {
-                parse_cache_control(value, info);
-            } else if (strcasecmp(name, "Expires") == 0) {
-                time_t t;
-                if (parse_http_date(value, &t) == 0) {
-                    info->has_expires = 1;
-                    info->expires = t;
-                }
-            } else if (strcasecmp(name, "Last-Modified") == 0) {
-                info->has_last_modified = 1;
-                copy_str(info->last_modified, sizeof(info->last_modified), value);
-            } else if (strcasecmp(name, "ETag") == 0) {
-                info->has_etag = 1;
-                copy_str(info->etag, sizeof(info->etag), value);
+        memcpy(line, f.value, f.value_len);
+        line[f.value_len] = '\0';
+        char *value = line;
+
+        switch (kind) {
+        case RESP_FIELD_CACHE_CONTROL:
+            parse_cache_control(value, info);
+            break;
+        case RESP_FIELD_EXPIRES: {
+            time_t t;
+            if (parse_http_date(value, &t) == 0) {
+                info->has_expires = 1;
+                info->expires = t;
+            }
+            break;
+        }
+        case RESP_FIELD_LAST_MODIFIED:
+            info->has_last_modified = 1;
+            copy_str(info->last_modified, sizeof(info->last_modified), value);
+            break;
+        case RESP_FIELD_ETAG:
+            info->has_etag = 1;
+            copy_str(info->etag, sizeof(info->etag), value);
+            break;
+        case RESP_FIELD_CONNECTION:
+            if (strcasestr(value, "close")) {
+                info->conn_close = 1;
             }
+            if (strcasestr(value, "keep-alive")) {
+                info->conn_keep_alive = 1;
+            }
+            break;
+        case RESP_FIELD_TRANSFER_ENCODING:
+            if (strcasestr(value, "chunked")) {
+                info->chunked = 1;
+            }
+            break;
+        case RESP_FIELD_CONTENT_LENGTH: {
+            char *endp = NULL;
+            long long cl = strtoll(value, &endp, 10);
+            if (endp != value && cl >= 0) {
+                info->has_content_length = 1;
+                info->content_length = cl;
+            }
+            break;
+        }
+        case RESP_FIELD_VARY: {
+            /* Несколько строк Vary складываются в один список. */
+            size_t used = strlen(info->vary);
+            snprintf(info->vary + used, sizeof(info->vary) - used, "%s%s", info->has_vary ? "," : "", value);
+            info->has_vary = 1;
+            break;
+        }
+        default:
+            break;
         }
-        p = eol + 2;
     }
 
     return 0;
 }
 
-static uint64_t fnv1a_hash(const char *s) {
-    uint64_t hash = 1469598103934665603ULL;
-    while (*s) {
-        hash ^= (unsigned char)(*s);
-        hash *= 1099511628211ULL;
-        s++;
+static body_mode_t response_body_mode(const http_response_info_t *info) {
+    if ((info->status_code >= 100 && info->status_code < 200) ||
+        info->status_code == 204 || info->status_code == 304) {
+        return BODY_NONE;
     }
-    return hash;
-}
-
-static void cache_key_for_url(const char *url, char *out, size_t out_sz) {
-    uint64_t h = fnv1a_hash(url);
-    snprintf(out, out_sz, "%016llx", (unsigned long long)h);
+    if (info->chunked) {
+        return BODY_CHUNKED;
+    }
+    if (info->has_content_length) {
+        return info->content_length > 0 ? BODY_LENGTH : BODY_NONE;
+    }
+    return BODY_UNTIL_CLOSE;
 }
 
-static int cache_meta_read(const char *path, cache_meta_t *meta) {
-    FILE *f = fopen(path, "r");
-    if (!f) {
-        return -1;
+static int response_keeps_alive(const http_response_info_t *info) {
+    if (info->conn_close) {
+        return 0;
     }
-    memset(meta, 0, sizeof(*meta));
-
-    char line[512];
-    while (fgets(line, sizeof(line), f)) {
-        char *eq = strchr(line, '=');
-        if (!eq) {
-            continue;
-        }
-        *eq = '\0';
-        char *key = line;
-        char *val = eq + 1;
-        trim(key);
-        trim(val);
+    return info->http_minor >= 1 || info->conn_keep_alive;
+}
 
-        if (strcmp(key, "stored_at") == 0) {
-            meta->stored_at = (time_t)atoll(val);
-        } else if (strcmp(key, "expires") == 0) {
-            meta->expires = (time_t)atoll(val);
-        } else if (strcmp(key, "must_revalidate") == 0) {
-            meta->must_revalidate = atoi(val);
-        } else if (strcmp(key, "last_modified") == 0) {
-            strncpy(meta->last_modified, val, sizeof(meta->last_modified) - 1);
-            meta->last_modified[sizeof(meta->last_modified) - 1] = '\0';
-        } else if (strcmp(key, "etag") == 0) {
-            strncpy(meta->etag, val, sizeof(meta->etag) - 1);
-            meta->etag[sizeof(meta->etag) - 1] = '\0';
-        }
+static void body_reader_init(body_reader_t *br, int fd, const http_response_info_t *info,
+                             const char *pending, size_t pending_len) {
+    memset(br, 0, sizeof(*br));
+    br->fd = fd;
+    br->mode = response_body_mode(info);
+    br->pending = pending;
+    br->pending_len = pending_len;
+    if (br->mode == BODY_LENGTH) {
+        br->remaining = info->content_length;
     }
-
-    fclose(f);
-    return 0;
 }
 
-static int cache_meta_write(const char *path, const cache_meta_t *meta) {
-    char tmp_path[PATH_MAX];
-    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
-
-    FILE *f = fopen(tmp_path, "w");
-    if (!f) {
-        return -1;
+static int br_avail(body_reader_t *br, const char **p, size_t *n) {
+    if (br->pending_len > 0) {
+        *p = br->pending;
+        *n = br->pending_len;
+        return 1;
     }
-
-    fprintf(f, "stored_at=%lld\n", (long long)meta->stored_at);
-    fprintf(f, "expires=%lld\n", (long long)meta->expires);
-    fprintf(f, "must_revalidate=%d\n", meta->must_revalidate);
-    if (meta->last_modified[0]) {
-        fprintf(f, "last_modified=%s\n", meta->last_modified);
+    if (br->raw_pos < br->raw_len) {
+        *p = br->raw + br->raw_pos;
+        *n = br->raw_len - br->raw_pos;
+        return 1;
     }
-    if (meta->etag[0]) {
-        fprintf(f, "etag=%s\n", meta->etag);
+    /* Тело известной длины не дочитывается дальше конца: за ним может идти следующий запрос. */
+    size_t want = sizeof(br->raw);
+    if (br->mode == BODY_LENGTH && br->remaining > 0 && (long long)want > br->remaining) {
+        want = (size_t)br->remaining;
     }
-
-    fclose(f);
-    if (rename(tmp_path, path) != 0) {
-        unlink(tmp_path);
-        return -1;
+    ssize_t r;
+    do {
+        r = recv(br->fd, br->raw, want, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0) {
+        return r == 0 ? 0 : -1;
     }
-    return 0;
+    br->raw_pos = 0;
+    br->raw_len = (size_t)r;
+    *p = br->raw;
+    *n = (size_t)r;
+    return 1;
 }
 
-static int send_file(int fd, const char *path) {
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        return -1;
+static void br_advance(body_reader_t *br, size_t n) {
+    if (br->pending_len > 0) {
+        br->pending += n;
+        br->pending_len -= n;
+    } else {
+        br->raw_pos += n;
     }
-    char buf[IO_BUF_SIZE];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
-        if (send_all(fd, buf, n) != 0) {
-            fclose(f);
+}
+
+static int br_read_line(body_reader_t *br, char *line, size_t cap) {
+    size_t len = 0;
+    while (1) {
+        const char *p;
+        size_t n;
+        if (br_avail(br, &p, &n) <= 0) {
             return -1;
         }
+        const char *nl = (const char *)memchr(p, '\n', n);
+        size_t take = nl ? (size_t)(nl - p) + 1 : n;
+        if (len + take >= cap) {
+            return -1;
+        }
+        memcpy(line + len, p, take);
+        len += take;
+        br_advance(br, take);
+        if (nl) {
+            line[len] = '\0';
+            trim(line);
+            return (int)strlen(line);
+        }
     }
-    fclose(f);
-    return 0;
-}
-
-static int recv_response_header(int fd, char **out_buf, size_t *out_len, size_t *header_len, char *err, size_t errsz) {
-    return recv_header(fd, out_buf, out_len, header_len, err, errsz);
 }
 
-static int ensure_cache_dir(const char *path) {
-    struct stat st;
-    if (stat(path, &st) == 0) {
-        if (S_ISDIR(st.st_mode)) {
-            return 0;
-        }
-        return -1;
+/*
+ * Если в буфере ничего не осталось и задан канал pipe_w, данные переносятся
+ * из сокета сервера прямо в канал (splice) без копирования; *spliced = 1.
+ */
+static ssize_t br_splice_data(body_reader_t *br, int pipe_w, size_t cap, int eof_ok) {
+    size_t take = cap;
+    if (br->mode != BODY_UNTIL_CLOSE && (long long)take > br->remaining) {
+        take = (size_t)br->remaining;
     }
-    if (mkdir(path, 0755) != 0) {
+    ssize_t n;
+    do {
+        n = splice(br->fd, NULL, pipe_w, NULL, take, SPLICE_F_MOVE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
         return -1;
     }
-    return 0;
-}
-
-static int join_path(char *out, size_t out_sz, const char *dir, const char *name, const char *suffix) {
-    size_t dir_len = strlen(dir);
-    size_t name_len = strlen(name);
-    size_t suffix_len = strlen(suffix);
-    size_t need = dir_len + 1 + name_len + suffix_len + 1;
-    if (need > out_sz) {
+    if (n == 0) {
+        if (eof_ok) {
+            br->done = 1;
+            return 0;
+        }
         return -1;
     }
-
-    size_t pos = 0;
-    memcpy(out + pos, dir, dir_len);
-    pos += dir_len;
-    if (pos == 0 || out[pos - 1] != '/') {
-        out[pos++] = '/';
-    }
-    memcpy(out + pos, name, name_len);
-    pos += name_len;
-    memcpy(out + pos, suffix, suffix_len);
-    pos += suffix_len;
-    out[pos] = '\0';
-    return 0;
+    br->remaining -= n;
+    br->received += n;
+    return n;
 }
 
-static int build_cache_paths(const proxy_config_t *cfg, const char *url,
-                             char *cache_path, size_t cache_sz,
-                             char *meta_path, size_t meta_sz,
-                             char *key_out, size_t key_sz) {
-    cache_key_for_url(url, key_out, key_sz);
-    if (join_path(cache_path, cache_sz, cfg->cache_dir, key_out, ".cache") != 0) {
+static ssize_t br_read_data(body_reader_t *br, char *out, size_t cap, int pipe_w, size_t pipe_cap,
+                            int *spliced, int eof_ok) {
+    if (pipe_w >= 0 && br->pending_len == 0 && br->raw_pos == br->raw_len) {
+        *spliced = 1;
+        return br_splice_data(br, pipe_w, pipe_cap, eof_ok);
+    }
+    const char *p;
+    size_t n;
+    int rc = br_avail(br, &p, &n);
+    if (rc < 0) {
         return -1;
     }
-    if (join_path(meta_path, meta_sz, cfg->cache_dir, key_out, ".meta") != 0) {
+    if (rc == 0) {
+        if (eof_ok) {
+            br->done = 1;
+            return 0;
+        }
         return -1;
     }
-    return 0;
+    size_t take = n < cap ? n : cap;
+    if (br->mode != BODY_UNTIL_CLOSE && (long long)take > br->remaining) {
+        take = (size_t)br->remaining;
+    }
+    memcpy(out, p, take);
+    br_advance(br, take);
+    br->remaining -= (long long)take;
+    br->received += (long long)take;
+    return (ssize_t)take;
 }
 
-static int cache_is_fresh(const cache_meta_t *meta, time_t now) {
-    if (meta->must_revalidate) {
-        return 0;
-    }
-    if (meta->expires == 0) {
-        return 0;
+/*
+ * Возвращает очередную порцию тела ответа без транспортного кодирования:
+ * chunked-кодирование снимается, чтобы клиенту и в кэш попадало само тело.
+ * Порция кладётся в out либо, при pipe_w >= 0, может быть перенесена в канал
+ * (тогда *spliced = 1). 0 — тело прочитано целиком, -1 — ошибка или обрыв.
+ */
+static ssize_t body_read(body_reader_t *br, char *out, size_t cap, int pipe_w, size_t pipe_cap,
+                              int *spliced) {
+    char line[MAX_LINE];
+    *spliced = 0;
+    while (!br->done) {
+        switch (br->mode) {
+        case BODY_NONE:
+            br->done = 1;
+            return 0;
+        case BODY_UNTIL_CLOSE:
+            return br_read_data(br, out, cap, pipe_w, pipe_cap, spliced, 1);
+        case BODY_LENGTH:
+            if (br->remaining == 0) {
+                br->done = 1;
+                return 0;
+            }
+            return br_read_data(br, out, cap, pipe_w, pipe_cap, spliced, 0);
+        case BODY_CHUNKED:
+            if (br->remaining > 0) {
+                ssize_t n = br_read_data(br, out, cap, pipe_w, pipe_cap, spliced, 0);
+                if (n > 0 && br->remaining == 0) {
+                    br->need_crlf = 1;
+                }
+                return n;
+            }
+            if (br->need_crlf) {
+                if (br_read_line(br, line, sizeof(line)) != 0) {
+                    return -1;
+                }
+                br->need_crlf = 0;
+            }
+            if (br_read_line(br, line, sizeof(line)) < 0) {
+                return -1;
+            }
+            char *endp = NULL;
+            long long size = strtoll(line, &endp, 16);
+            if (endp == line || size < 0) {
+                return -1;
+            }
+            if (size == 0) {
+                int tlen;
+                while ((tlen = br_read_line(br, line, sizeof(line))) > 0) {
+                }
+                if (tlen < 0) {
+                    return -1;
+                }
+                br->done = 1;
+                return 0;
+            }
+            br->remaining = size;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Тело запроса читается тем же способом; его начало уже может лежать в буфере соединения. */
+static void request_body_init(body_reader_t *br, conn_t *conn, const http_request_t *req) {
+    memset(br, 0, sizeof(*br));
+    br->fd = conn->fd;
+    if (req->chunked) {
+        br->mode = BODY_CHUNKED;
+    } else {
+        br->mode = req->content_length > 0 ? BODY_LENGTH : BODY_NONE;
+        br->remaining = req->content_length;
+    }
+    br->pending = conn->buf;
+    br->pending_len = conn->len;
+}
+
+/* Прочитанное из буфера соединения снимается, а прочитанное сверх тела возвращается в него. */
+static int request_body_finish(body_reader_t *br, conn_t *conn) {
+    conn_consume(conn, conn->len - br->pending_len);
+    return conn_unread(conn, br->raw + br->raw_pos, br->raw_len - br->raw_pos);
+}
+
+static int body_reader_reusable(const body_reader_t *br) {
+    return br->done && br->mode != BODY_UNTIL_CLOSE &&
+           br->pending_len == 0 && br->raw_pos == br->raw_len;
+}
+
+/*
+ * Переписывает заголовки ответа: hop-by-hop заголовки отбрасываются (тело уже
+ * без chunked), вместо них дописываются extra — заголовки разметки ответа для
+ * клиента (Content-Length/Transfer-Encoding/Connection) или ничего для кэша.
+ */
+static int build_client_response_header(const char *buf, size_t header_len, int drop_content_length,
+                                        const char *extra, char **out_buf, size_t *out_len) {
+    size_t cap = header_len + 64;
+    size_t len = 0;
+    char *out = (char *)malloc(cap);
+    if (!out) {
+        return -1;
+    }
+    out[0] = '\0';
+
+    const char *p = buf;
+    const char *end = buf + header_len;
+    const char *status;
+    size_t status_len;
+    if (http_first_line(&p, end, &status, &status_len) != 0 ||
+        append_mem(&out, &len, &cap, status, status_len) != 0 || append_str(&out, &len, &cap, "\r\n") != 0) {
+        free(out);
+        return -1;
+    }
+
+    http_field_t f;
+    while (http_next_field(&p, end, &f) > 0) {
+        if (f.name_len < 128) {
+            char name[128];
+            memcpy(name, f.name, f.name_len);
+            name[f.name_len] = '\0';
+            if (is_hop_by_hop_header(name) || strcasecmp(name, CACHE_KEY_HEADER) == 0 ||
+                (drop_content_length && strcasecmp(name, "Content-Length") == 0)) {
+                continue;
+            }
+        }
+        if (append_mem(&out, &len, &cap, f.line, f.line_len) != 0 || append_str(&out, &len, &cap, "\r\n") != 0) {
+            free(out);
+            return -1;
+        }
+    }
+
+    if (append_str(&out, &len, &cap, extra) != 0 || append_str(&out, &len, &cap, "\r\n") != 0) {
+        free(out);
+        return -1;
+    }
+    *out_buf = out;
+    *out_len = len;
+    return 0;
+}
+
+static int client_wants_keep_alive(const http_request_t *req) {
+    const char *conn = find_header_value(req, "Connection");
+    if (!conn) {
+        conn = find_header_value(req, "Proxy-Connection");
+    }
+    if (conn && strcasestr(conn, "close")) {
+        return 0;
+    }
+    if (strcasecmp(req->version, "HTTP/1.1") == 0) {
+        return 1;
+    }
+    return conn && strcasestr(conn, "keep-alive");
+}
+
+/*
+ * Чтобы оставить соединение с клиентом открытым, у ответа должна быть
+ * граница. Content-Length сервера передаётся как есть; тело без длины
+ * (chunked или до закрытия) перекодируется в chunked для HTTP/1.1 клиентов,
+ * а HTTP/1.0 клиенту отдаётся с закрытием соединения.
+ */
+static void client_choose_framing(client_t *cl, const http_response_info_t *info, char *out, size_t out_sz) {
+    body_mode_t mode = response_body_mode(info);
+    cl->chunked = 0;
+    if (mode == BODY_CHUNKED || mode == BODY_UNTIL_CLOSE) {
+        if (cl->keep_alive && cl->http11) {
+            cl->chunked = 1;
+        } else {
+            cl->keep_alive = 0;
+        }
+    }
+    snprintf(out, out_sz, "%s%s",
+             cl->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+             cl->keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+}
+
+static int client_send_body(client_t *cl, const char *buf, size_t len) {
+    if (cl->partial) {
+        if ((unsigned long long)cl->skip >= len) {
+            cl->skip -= (long long)len;
+            return 0;
+        }
+        buf += cl->skip;
+        len -= (size_t)cl->skip;
+        cl->skip = 0;
+        if ((unsigned long long)cl->left < len) {
+            len = (size_t)cl->left;
+        }
+        cl->left -= (long long)len;
+        if (len == 0) {
+            return 0;
+        }
+    }
+    long long started = timing_begin();
+    int rc = 0;
+    if (!cl->chunked) {
+        rc = send_all(cl->fd, buf, len);
+    } else {
+        char size_line[32];
+        int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+        if (send_all(cl->fd, size_line, (size_t)n) != 0 ||
+            send_all(cl->fd, buf, len) != 0 ||
+            send_all(cl->fd, "\r\n", 2) != 0) {
+            rc = -1;
+        }
+    }
+    timing_end(TIMING_CLIENT_SEND, started);
+    return rc;
+}
+
+/* Поддерживается один диапазон; несколько или неизвестные единицы — Range игнорируется. */
+static int parse_range(const char *value, byte_range_t *r) {
+    if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',')) {
+        return -1;
+    }
+    const char *p = value + 6;
+    while (*p == ' ') {
+        p++;
+    }
+    char *endp = NULL;
+    r->first = -1;
+    r->last = -1;
+    r->suffix = 0;
+    r->if_range = NULL;
+    if (*p == '-') {
+        r->suffix = strtoll(p + 1, &endp, 10);
+        return endp == p + 1 || *endp != '\0' || r->suffix < 0 ? -1 : 0;
+    }
+    r->first = strtoll(p, &endp, 10);
+    if (endp == p || *endp != '-' || r->first < 0) {
+        return -1;
+    }
+    p = endp + 1;
+    if (*p == '\0') {
+        return 0;
+    }
+    r->last = strtoll(p, &endp, 10);
+    return endp == p || *endp != '\0' || r->last < r->first ? -1 : 0;
+}
+
+/*
+ * If-Range (RFC 9110, 13.1.5): диапазон отдаётся, только если объект не
+ * изменился. ETag сравнивается строго, слабый никогда не совпадает; дата —
+ * с Last-Modified побайтно.
+ */
+static int range_applies(const byte_range_t *r, const char *etag, const char *last_modified) {
+    const char *v = r->if_range;
+    if (!v) {
+        return 1;
+    }
+    if (v[0] == '"') {
+        return etag[0] == '"' && strcmp(v, etag) == 0;
+    }
+    if (strncmp(v, "W/", 2) == 0) {
+        return 0;
+    }
+    return last_modified[0] && strcmp(v, last_modified) == 0;
+}
+
+/*
+ * Решает, как ответить на Range для тела размером size: 206 с вырезкой,
+ * 416, если диапазон начинается за концом, или 0 — тело целиком (Range нет
+ * или If-Range не совпал).
+ */
+static int client_plan_range(client_t *cl, const char *etag, const char *last_modified, long long size) {
+    cl->partial = 0;
+    const byte_range_t *r = cl->range;
+    if (!r || !range_applies(r, etag, last_modified)) {
+        return 0;
+    }
+    long long first = r->first;
+    long long len;
+    if (first < 0) {
+        len = r->suffix < size ? r->suffix : size;
+        first = size - len;
+    } else {
+        long long last = r->last < 0 || r->last >= size ? size - 1 : r->last;
+        len = last - first + 1;
+    }
+    if (first >= size || len <= 0) {
+        cl->partial = 416;
+        cl->skip = 0;
+        cl->left = 0;
+        return cl->partial;
+    }
+    cl->partial = 206;
+    cl->skip = first;
+    cl->left = len;
+    return cl->partial;
+}
+
+/*
+ * Заголовки ответа 206 из заголовков целого объекта (или другого куска):
+ * строка статуса, Content-Length и Content-Range заменяются. Для 416
+ * заголовки объекта не нужны. Вызывается до отдачи тела, пока skip и left —
+ * начало и длина диапазона.
+ */
+static int build_range_header(const client_t *cl, const char *head, size_t head_len, long long size,
+                              char **out_buf, size_t *out_len) {
+    const char *conn = cl->keep_alive ? "keep-alive" : "close";
+    size_t cap = head_len + 256;
+    size_t len = 0;
+    char *out = (char *)malloc(cap);
+    if (!out) {
+        return -1;
+    }
+    out[0] = '\0';
+    if (cl->partial == 416) {
+        if (append_fmt(&out, &len, &cap,
+                       "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\n"
+                       "Content-Length: 0\r\nConnection: %s\r\n\r\n",
+                       size, conn) != 0) {
+            free(out);
+            return -1;
+        }
+        *out_buf = out;
+        *out_len = len;
+        return 0;
+    }
+
+    const char *p = head;
+    const char *end = head + head_len;
+    const char *status;
+    size_t status_len;
+    if (http_first_line(&p, end, &status, &status_len) != 0 ||
+        append_str(&out, &len, &cap, "HTTP/1.1 206 Partial Content\r\n") != 0) {
+        free(out);
+        return -1;
+    }
+    http_field_t f;
+    while (http_next_field(&p, end, &f) > 0) {
+        if (http_field_is(&f, "Content-Length") || http_field_is(&f, "Content-Range") ||
+            http_field_is(&f, CACHE_KEY_HEADER)) {
+            continue;
+        }
+        if (f.name_len < 128) {
+            char name[128];
+            memcpy(name, f.name, f.name_len);
+            name[f.name_len] = '\0';
+            if (is_hop_by_hop_header(name)) {
+                continue;
+            }
+        }
+        if (append_mem(&out, &len, &cap, f.line, f.line_len) != 0 || append_str(&out, &len, &cap, "\r\n") != 0) {
+            free(out);
+            return -1;
+        }
+    }
+    if (append_fmt(&out, &len, &cap, "Content-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n"
+                                     "Connection: %s\r\n\r\n",
+                   cl->skip, cl->skip + cl->left - 1, size, cl->left, conn) != 0) {
+        free(out);
+        return -1;
+    }
+    *out_buf = out;
+    *out_len = len;
+    return 0;
+}
+
+static int client_end_body(client_t *cl) {
+    if (!cl->chunked) {
+        return 0;
+    }
+    long long started = timing_begin();
+    int rc = send_all(cl->fd, "0\r\n\r\n", 5);
+    timing_end(TIMING_CLIENT_SEND, started);
+    return rc;
+}
+
+static int set_client_nonblocking(int fd, int enable) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/* Диапазон файла одним куском тела, с разметкой chunked, если она нужна. */
+static int client_feed_range(const client_t *cl, conn_feed_t *plan, off_t offset, off_t len) {
+    if (len <= 0 || !cl->chunked) {
+        return conn_feed_file(plan, offset, len);
+    }
+    char size_line[32];
+    int n = snprintf(size_line, sizeof(size_line), "%llx\r\n", (long long)len);
+    if (conn_feed_bytes(plan, size_line, (size_t)n) != 0 || conn_feed_file(plan, offset, len) != 0) {
+        return -1;
+    }
+    return conn_feed_bytes(plan, "\r\n", 2);
+}
+
+/*
+ * Отдаёт циклу событий остаток тела по plan вместе с его концом; обработчик
+ * после этого свободен, а соединение принадлежит циклу. Клиента без
+ * соединения (фоновое обновление) отдать некому.
+ */
+static int client_hand_off(client_t *cl, conn_feed_t *plan) {
+    if (!cl->conn || (cl->chunked && conn_feed_bytes(plan, "0\r\n\r\n", 5) != 0) ||
+        conn_feed(cl->conn, plan, cl->keep_alive) != 0) {
+        return -1;
+    }
+    cl->handed_off = 1;
+    return 0;
+}
+
+/*
+ * Последний кусок тела из файла [off, end) и конец тела. Сколько сокет
+ * принимает сразу, уходит здесь же; если клиент не успевает, остаток
+ * отдаёт цикл событий из копии fd, и медленный клиент не держит обработчик.
+ * fd остаётся у вызывающего. -1 — клиент отключился.
+ */
+static int client_send_rest(client_t *cl, int fd, off_t off, off_t end) {
+    long long started = timing_begin();
+    int rc = 0;
+    if (cl->chunked && end > off) {
+        char size_line[32];
+        int n = snprintf(size_line, sizeof(size_line), "%llx\r\n", (long long)(end - off));
+        rc = send_all(cl->fd, size_line, (size_t)n);
+    }
+    int nonblocking = rc == 0 && cl->conn && set_client_nonblocking(cl->fd, 1) == 0;
+    int chunk = end > off;
+    while (rc == 0 && off < end) {
+        ssize_t n = sendfile(cl->fd, fd, &off, (size_t)(end - off));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn_feed_t plan;
+            conn_feed_init(&plan, dup(fd));
+            if (plan.file_fd >= 0 && conn_feed_file(&plan, off, end - off) == 0 &&
+                (!cl->chunked || conn_feed_bytes(&plan, "\r\n", 2) == 0) && client_hand_off(cl, &plan) == 0) {
+                timing_end(TIMING_CLIENT_SEND, started);
+                return 0;
+            }
+            if (plan.file_fd >= 0) {
+                close(plan.file_fd);
+            }
+            set_client_nonblocking(cl->fd, 0);
+            nonblocking = 0;
+            continue;
+        }
+        if (n <= 0) {
+            rc = -1;
+        }
+    }
+    if (nonblocking) {
+        set_client_nonblocking(cl->fd, 0);
+    }
+    if (rc == 0 && cl->chunked && chunk) {
+        rc = send_all(cl->fd, "\r\n", 2);
+    }
+    timing_end(TIMING_CLIENT_SEND, started);
+    return rc == 0 ? client_end_body(cl) : -1;
+}
+
+static void send_error_response(client_t *cl, int status, const char *reason, const char *body) {
+    timing_outcome(OUTCOME_ERROR);
+    cl->keep_alive = 0;
+    send_simple_response(cl->fd, status, reason, body);
+}
+
+static uint64_t fnv1a_hash(const char *s) {
+    uint64_t hash = 1469598103934665603ULL;
+    while (*s) {
+        hash ^= (unsigned char)(*s);
+        hash *= 1099511628211ULL;
+        s++;
+    }
+    return hash;
+}
+
+static void cache_key_for_url(const char *url, char *out, size_t out_sz) {
+    uint64_t h = fnv1a_hash(url);
+    snprintf(out, out_sz, "%016llx", (unsigned long long)h);
+}
+
+/* Ключ кэша — шестнадцатеричная запись хеша URL; индекс хранит сам хеш. */
+static uint64_t cache_key_hash(const char *key) {
+    return (uint64_t)strtoull(key, NULL, 16);
+}
+
+/*
+ * Нормализация URL перед хешированием, чтобы равнозначные записи попадали в
+ * один объект: имя хоста в нижнем регистре, порт 80 не пишется, в
+ * %-последовательностях шестнадцатеричные цифры заглавные, а незарезервированные
+ * символы (буквы, цифры, -._~) раскодированы. Параметры запроса
+ * сортируются, пустые отбрасываются.
+ */
+static int is_unreserved(unsigned char c) {
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+static int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = (unsigned char)tolower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+static int normalize_escapes(const char *s, size_t len, char *out, size_t *pos, size_t cap) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (*pos + 4 > cap) {
+            return -1;
+        }
+        int hi = c == '%' && i + 2 < len ? hex_value((unsigned char)s[i + 1]) : -1;
+        int lo = hi >= 0 ? hex_value((unsigned char)s[i + 2]) : -1;
+        if (hi >= 0 && lo >= 0) {
+            unsigned char d = (unsigned char)(hi * 16 + lo);
+            if (is_unreserved(d)) {
+                out[(*pos)++] = (char)d;
+            } else {
+                out[(*pos)++] = '%';
+                out[(*pos)++] = hex[hi];
+                out[(*pos)++] = hex[lo];
+            }
+            i += 2;
+        } else {
+            out[(*pos)++] = (char)c;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *p;
+    size_t len;
+} query_param_t;
+
+static int query_param_cmp(const void *a, const void *b) {
+    const query_param_t *x = (const query_param_t *)a;
+    const query_param_t *y = (const query_param_t *)b;
+    int c = memcmp(x->p, y->p, x->len < y->len ? x->len : y->len);
+    return c != 0 ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+static int normalize_url(const http_request_t *req, char *out, size_t out_sz) {
+    size_t pos = 0;
+    int n = snprintf(out, out_sz, "http://");
+    pos = (size_t)n;
+    for (const char *h = req->host; *h; h++) {
+        if (pos + 1 >= out_sz) {
+            return -1;
+        }
+        out[pos++] = (char)tolower((unsigned char)*h);
+    }
+    if (req->port != 80) {
+        n = snprintf(out + pos, out_sz - pos, ":%d", req->port);
+        if (n < 0 || (size_t)n >= out_sz - pos) {
+            return -1;
+        }
+        pos += (size_t)n;
+    }
+
+    const char *path = req->path;
+    size_t path_len = strcspn(path, "?#");
+    if (path_len == 0) {
+        path = "/";
+        path_len = 1;
+    }
+    if (normalize_escapes(path, path_len, out, &pos, out_sz) != 0) {
+        return -1;
+    }
+
+    if (req->path[path_len] == '?') {
+        const char *query = req->path + path_len + 1;
+        size_t query_len = strcspn(query, "#");
+        query_param_t params[64];
+        size_t count = 0;
+        for (size_t i = 0; i < query_len;) {
+            size_t len = strcspn(query + i, "&");
+            if (len > query_len - i) {
+                len = query_len - i;
+            }
+            if (len > 0) {
+                if (count == sizeof(params) / sizeof(params[0])) {
+                    return -1;
+                }
+                params[count].p = query + i;
+                params[count].len = len;
+                count++;
+            }
+            i += len + 1;
+        }
+        qsort(params, count, sizeof(params[0]), query_param_cmp);
+        for (size_t i = 0; i < count; i++) {
+            if (pos + 1 >= out_sz) {
+                return -1;
+            }
+            out[pos++] = i == 0 ? '?' : '&';
+            if (normalize_escapes(params[i].p, params[i].len, out, &pos, out_sz) != 0) {
+                return -1;
+            }
+        }
+    }
+    out[pos] = '\0';
+    return 0;
+}
+
+/*
+ * Имена заголовков из Vary: в нижнем регистре, без повторов, по алфавиту,
+ * через запятую. -1 — Vary: * (ответ нельзя использовать повторно) или
+ * слишком длинный список.
+ */
+static int vary_names(const char *vary, char *out, size_t out_sz) {
+    char names[16][64];
+    size_t count = 0;
+    const char *p = vary;
+    while (*p) {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, " \t,");
+        if (len == 0) {
+            break;
+        }
+        if (len == 1 && p[0] == '*') {
+            return -1;
+        }
+        if (len >= sizeof(names[0]) || count == sizeof(names) / sizeof(names[0])) {
+            return -1;
+        }
+        for (size_t i = 0; i < len; i++) {
+            names[count][i] = (char)tolower((unsigned char)p[i]);
+        }
+        names[count][len] = '\0';
+        int dup = 0;
+        for (size_t i = 0; i < count; i++) {
+            dup |= strcmp(names[i], names[count]) == 0;
+        }
+        count += !dup;
+        p += len;
+    }
+    qsort(names, count, sizeof(names[0]), (int (*)(const void *, const void *))strcmp);
+    size_t pos = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        int n = snprintf(out + pos, out_sz - pos, "%s%s", i ? "," : "", names[i]);
+        if (n < 0 || (size_t)n >= out_sz - pos) {
+            return -1;
+        }
+        pos += (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Значение заголовка для ключа варианта. Accept-Encoding сводится к
+ * отсортированному списку допустимых кодировок (q=0 отбрасывается), чтобы
+ * "gzip, br" и "br,gzip;q=1.0" давали один вариант; у остальных
+ * заголовков схлопываются пробелы.
+ */
+static void vary_value(const char *name, const char *value, char *out, size_t out_sz) {
+    out[0] = '\0';
+    if (!value) {
+        return;
+    }
+    if (strcmp(name, "accept-encoding") != 0) {
+        size_t pos = 0;
+        int space = 0;
+        for (const char *p = value; *p && pos + 1 < out_sz; p++) {
+            if (*p == ' ' || *p == '\t') {
+                space = pos > 0;
+                continue;
+            }
+            if (space && pos + 2 < out_sz) {
+                out[pos++] = ' ';
+            }
+            space = 0;
+            out[pos++] = *p;
+        }
+        out[pos] = '\0';
+        return;
+    }
+
+    char codings[16][32];
+    size_t count = 0;
+    const char *p = value;
+    while (*p && count < sizeof(codings) / sizeof(codings[0])) {
+        size_t len = strcspn(p, ",");
+        const char *item = p;
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+        while (len > 0 && (*item == ' ' || *item == '\t')) {
+            item++;
+            len--;
+        }
+        size_t token = strcspn(item, " \t;,");
+        if (token > len) {
+            token = len;
+        }
+        if (token == 0 || token >= sizeof(codings[0])) {
+            continue;
+        }
+        const char *semi = memchr(item, ';', len);
+        if (semi) {
+            const char *q = semi + 1 + strspn(semi + 1, " \t");
+            if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=' && strtod(q + 2, NULL) == 0.0) {
+                continue;
+            }
+        }
+        for (size_t i = 0; i < token; i++) {
+            codings[count][i] = (char)tolower((unsigned char)item[i]);
+        }
+        codings[count][token] = '\0';
+        count++;
+    }
+    qsort(codings, count, sizeof(codings[0]), (int (*)(const void *, const void *))strcmp);
+    size_t pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && strcmp(codings[i], codings[i - 1]) == 0) {
+            continue;
+        }
+        int n = snprintf(out + pos, out_sz - pos, "%s%s", pos ? "," : "", codings[i]);
+        if (n < 0 || (size_t)n >= out_sz - pos) {
+            break;
+        }
+        pos += (size_t)n;
+    }
+}
+
+/*
+ * Полный ключ объекта: нормализованный URL, а для ответов с Vary — ещё
+ * " имя=значение" по каждому заголовку из Vary. vary = NULL — имена берутся
+ * из таблицы (при поиске), иначе они запоминаются (по ответу сервера).
+ */
+static int cache_url_for_request(const http_request_t *req, const char *vary, char *out, size_t out_sz) {
+    if (normalize_url(req, out, out_sz) != 0) {
+        return -1;
+    }
+    uint64_t base = fnv1a_hash(out);
+    char names[VARY_NAMES_MAX];
+    if (vary) {
+        copy_str(names, sizeof(names), vary);
+        vary_table_remember(vary_table, base, names);
+    } else if (!vary_table_lookup(vary_table, base, names, sizeof(names))) {
+        return 0;
+    }
+
+    size_t pos = strlen(out);
+    for (const char *p = names; *p;) {
+        size_t len = strcspn(p, ",");
+        char name[64];
+        char value[512];
+        if (len >= sizeof(name)) {
+            return -1;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len + (p[len] == ',');
+        vary_value(name, find_header_value(req, name), value, sizeof(value));
+        int n = snprintf(out + pos, out_sz - pos, " %s=%s", name, value);
+        if (n < 0 || (size_t)n >= out_sz - pos) {
+            return -1;
+        }
+        pos += (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Ключ объекта хранится в его заголовках строкой X-Cache-Key (клиенту она не
+ * уходит). Совпадение 64-битных хешей разных ключей так не приводит к
+ * отдаче чужого объекта: он считается промахом и заменяется.
+ */
+static int stored_key_matches(const char *head, size_t head_len, const char *url) {
+    const char *p = head;
+    const char *end = head + head_len;
+    const char *status;
+    size_t status_len;
+    if (http_first_line(&p, end, &status, &status_len) != 0) {
+        return 0;
+    }
+    http_field_t f;
+    while (http_next_field(&p, end, &f) > 0) {
+        if (http_field_is(&f, CACHE_KEY_HEADER)) {
+            return f.value_len == strlen(url) && memcmp(f.value, url, f.value_len) == 0;
+        }
+    }
+    return 0;
+}
+
+/* Файл .meta прежнего формата (key=value); читается только при переходе на журнал. */
+static int cache_meta_read(const char *path, cache_meta_t *meta) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    memset(meta, 0, sizeof(*meta));
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char *eq = strchr(line, '=');
+        if (!eq) {
+            continue;
+        }
+        *eq = '\0';
+        char *key = line;
+        char *val = eq + 1;
+        trim(key);
+        trim(val);
+
+        if (strcmp(key, "stored_at") == 0) {
+            meta->stored_at = (time_t)atoll(val);
+            meta->validated_at = meta->stored_at;
+        } else if (strcmp(key, "expires") == 0) {
+            meta->expires = (time_t)atoll(val);
+        } else if (strcmp(key, "must_revalidate") == 0) {
+            meta->must_revalidate = atoi(val);
+        } else if (strcmp(key, "last_modified") == 0) {
+            strncpy(meta->last_modified, val, sizeof(meta->last_modified) - 1);
+            meta->last_modified[sizeof(meta->last_modified) - 1] = '\0';
+        } else if (strcmp(key, "etag") == 0) {
+            strncpy(meta->etag, val, sizeof(meta->etag) - 1);
+            meta->etag[sizeof(meta->etag) - 1] = '\0';
+        } else if (strcmp(key, "header_len") == 0) {
+            meta->header_len = (size_t)atoll(val);
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Объект кэша на диске: отдельный файл или запись в сегменте. */
+typedef struct {
+    int fd;
+    off_t base;
+    off_t size;
+    slab_segment_t *segment;
+    cache_root_t *root;
+} disk_object_t;
+
+/* Корень кэша, в котором лежит объект с этим путём. */
+static cache_root_t *root_for(const char *cache_path) {
+    return cache_roots_find(cache_roots, cache_path);
+}
+
+/* -2 — файла или сегмента уже нет, либо размер не совпадает с индексом. */
+static int disk_object_open(cache_root_t *root, const char *path, const cache_loc_t *loc, off_t expected_size,
+                            disk_object_t *obj) {
+    memset(obj, 0, sizeof(*obj));
+    obj->root = root;
+    if (loc->segment >= 0) {
+        obj->segment = slab_store_acquire(root->slab, loc);
+        if (!obj->segment) {
+            return -2;
+        }
+        obj->fd = obj->segment->fd;
+        obj->base = slab_data_offset(loc);
+        obj->size = expected_size;
+        return 0;
+    }
+    long long timed = timing_begin();
+    long long started = cache_root_io_begin(cache_roots, root);
+    obj->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (obj->fd < 0) {
+        cache_root_io_end(cache_roots, root, started, errno != ENOENT);
+        timing_end(TIMING_CACHE_READ, timed);
+        return -2;
+    }
+    struct stat st;
+    int failed = fstat(obj->fd, &st) != 0;
+    cache_root_io_end(cache_roots, root, started, failed);
+    timing_end(TIMING_CACHE_READ, timed);
+    if (failed || (expected_size >= 0 && st.st_size != expected_size)) {
+        close(obj->fd);
+        return -2;
+    }
+    obj->size = st.st_size;
+    return 0;
+}
+
+static void disk_object_close(disk_object_t *obj) {
+    if (obj->segment) {
+        slab_store_release(obj->root->slab, obj->segment);
+    } else {
+        close(obj->fd);
+    }
+}
+
+static int disk_object_read(const disk_object_t *obj, char *buf, size_t len, off_t off) {
+    long long timed = timing_begin();
+    long long started = cache_root_io_begin(cache_roots, obj->root);
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(obj->fd, buf + got, len - got, obj->base + off + (off_t)got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            cache_root_io_end(cache_roots, obj->root, started, n < 0);
+            timing_end(TIMING_CACHE_READ, timed);
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    cache_root_io_end(cache_roots, obj->root, started, 0);
+    timing_end(TIMING_CACHE_READ, timed);
+    return 0;
+}
+
+/*
+ * Отдаёт объект из кэша. В объекте лежат заголовки без разметки и само тело,
+ * поэтому Content-Length вычисляется из его размера. header_len берётся из
+ * метаданных; для старых записей без него граница ищется в начале файла.
+ * Диапазон отдаётся тем же sendfile со смещением. -4 — в файле объект
+ * другого ключа, клиенту ничего не отправлено.
+ */
+static int send_cached_response(client_t *cl, const disk_object_t *obj, const cache_meta_t *meta, const char *url) {
+    size_t header_len = meta->header_len;
+    size_t want = header_len;
+    if (want == 0) {
+        want = (size_t)obj->size < MAX_HEADER_SIZE ? (size_t)obj->size : MAX_HEADER_SIZE;
+    }
+    char *hdr = (char *)malloc(want + 1);
+    if (!hdr || disk_object_read(obj, hdr, want, 0) != 0) {
+        free(hdr);
+        cl->keep_alive = 0;
+        return -1;
+    }
+    if (header_len == 0) {
+        ssize_t idx = http_header_end(hdr, want);
+        if (idx < 0) {
+            free(hdr);
+            cl->keep_alive = 0;
+            return -1;
+        }
+        header_len = (size_t)idx;
+    }
+    if (!stored_key_matches(hdr, header_len, url)) {
+        free(hdr);
+        return -4;
+    }
+
+    long long body_size = (long long)obj->size - (long long)header_len;
+    char framing[128];
+    snprintf(framing, sizeof(framing), "Content-Length: %lld\r\nConnection: %s\r\n",
+             body_size, cl->keep_alive ? "keep-alive" : "close");
+    char *out = NULL;
+    size_t out_len = 0;
+    int rc = client_plan_range(cl, meta->etag, meta->last_modified, body_size)
+                 ? build_range_header(cl, hdr, header_len, body_size, &out, &out_len)
+                 : build_client_response_header(hdr, header_len, 1, framing, &out, &out_len);
+    free(hdr);
+    long long started = timing_begin();
+    if (rc != 0 || send_all(cl->fd, out, out_len) != 0) {
+        free(out);
+        cl->keep_alive = 0;
+        return -1;
+    }
+    free(out);
+
+    timing_end(TIMING_CLIENT_SEND, started);
+
+    /*
+     * Тело уходит из файла в сокет ядром, минуя буфер процесса; время чтения с
+     * диска входит в отдачу. Сегмент, который сборщик удалит, пока клиент
+     * читает, остаётся доступен через копию дескриптора.
+     */
+    off_t off = obj->base + (off_t)header_len;
+    off_t end = obj->base + obj->size;
+    if (cl->partial) {
+        off += (off_t)cl->skip;
+        end = off + (off_t)cl->left;
+    }
+    if (client_send_rest(cl, obj->fd, off, end) != 0) {
+        cl->keep_alive = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static int send_iov(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/* Ответ из памяти: заголовки уже готовы, остаётся дописать Connection. */
+static int send_hot_response(client_t *cl, const hot_object_t *obj) {
+    if (client_plan_range(cl, obj->meta.etag, obj->meta.last_modified, (long long)obj->body_len)) {
+        char *head = NULL;
+        size_t head_len = 0;
+        if (build_range_header(cl, obj->data, obj->head_len, (long long)obj->body_len, &head, &head_len) != 0) {
+            cl->keep_alive = 0;
+            return -1;
+        }
+        struct iovec iov[2] = {{head, head_len}, {obj->data + obj->head_len + cl->skip, (size_t)cl->left}};
+        long long started = timing_begin();
+        int rc = send_iov(cl->fd, iov, 2);
+        timing_end(TIMING_CLIENT_SEND, started);
+        free(head);
+        if (rc != 0) {
+            cl->keep_alive = 0;
+        }
+        return rc;
+    }
+    const char *conn_line = cl->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    struct iovec iov[3];
+    iov[0].iov_base = obj->data;
+    iov[0].iov_len = obj->head_len;
+    iov[1].iov_base = (void *)conn_line;
+    iov[1].iov_len = strlen(conn_line);
+    iov[2].iov_base = obj->data + obj->head_len;
+    iov[2].iov_len = obj->body_len;
+    long long started = timing_begin();
+    int rc = send_iov(cl->fd, iov, 3);
+    timing_end(TIMING_CLIENT_SEND, started);
+    if (rc != 0) {
+        cl->keep_alive = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* stored_header — заголовки в том виде, в каком они лежат в файле кэша. */
+static hot_object_t *hot_admit(const char *key, const char *url, const cache_meta_t *meta,
+                               const char *stored_header, size_t stored_header_len, const char *body,
+                               size_t body_len) {
+    if (!hot_cache_fits(hot_cache, stored_header_len + body_len)) {
+        return NULL;
+    }
+    char framing[64];
+    snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", body_len);
+    char *head = NULL;
+    size_t head_len = 0;
+    if (build_client_response_header(stored_header, stored_header_len, 1, framing, &head, &head_len) != 0) {
+        return NULL;
+    }
+    hot_object_t *obj = hot_cache_put(hot_cache, key, url, meta, head, head_len - 2, body, body_len);
+    free(head);
+    return obj;
+}
+
+/* Поднимает небольшой объект с диска в память; NULL, если он не помещается. */
+static hot_object_t *promote_from_disk(const char *key, const char *url, const disk_object_t *disk,
+                                       const cache_meta_t *meta) {
+    if (!hot_cache_fits(hot_cache, (size_t)disk->size)) {
+        return NULL;
+    }
+    size_t size = (size_t)disk->size;
+    char *buf = (char *)malloc(size + 1);
+    if (!buf || disk_object_read(disk, buf, size, 0) != 0) {
+        free(buf);
+        return NULL;
+    }
+
+    size_t header_len = meta->header_len;
+    if (header_len == 0) {
+        ssize_t idx = http_header_end(buf, size);
+        header_len = idx < 0 ? 0 : (size_t)idx;
+    }
+    hot_object_t *obj = NULL;
+    if (header_len > 0 && header_len <= size && stored_key_matches(buf, header_len, url)) {
+        obj = hot_admit(key, url, meta, buf, header_len, buf + header_len, size - header_len);
+    }
+    free(buf);
+    return obj;
+}
+
+/*
+ * Отдаёт объект из памяти, а если его там нет — с диска, заодно поднимая в
+ * память. -2 — объекта на диске нет, -4 — под этим хешем лежит объект
+ * другого ключа; в обоих случаях клиенту ничего не отправлено.
+ */
+static int serve_cached_object(client_t *cl, const char *key, const char *url, const char *cache_path,
+                               const cache_meta_t *meta, off_t size, const cache_loc_t *loc) {
+    cache_meta_t hot_meta;
+    hot_object_t *obj = hot_cache_get(hot_cache, key, &hot_meta);
+    if (obj && strcmp(obj->url, url) != 0) {
+        hot_cache_release(hot_cache, obj);
+        return -4;
+    }
+    if (!obj) {
+        disk_object_t disk;
+        if (disk_object_open(root_for(cache_path), cache_path, loc, size, &disk) != 0) {
+            return -2;
+        }
+        obj = promote_from_disk(key, url, &disk, meta);
+        if (!obj) {
+            int rc = send_cached_response(cl, &disk, meta, url);
+            disk_object_close(&disk);
+            return rc;
+        }
+        disk_object_close(&disk);
+    }
+    int rc = send_hot_response(cl, obj);
+    hot_cache_release(hot_cache, obj);
+    return rc;
+}
+
+/* Проверка ключа объекта на диске без его отдачи. */
+static int disk_key_matches(const char *cache_path, const cache_loc_t *loc, off_t size, const cache_meta_t *meta,
+                            const char *url) {
+    disk_object_t disk;
+    if (meta->header_len == 0 || disk_object_open(root_for(cache_path), cache_path, loc, size, &disk) != 0) {
+        return 0;
+    }
+    char *head = (char *)malloc(meta->header_len);
+    int ok = head && disk_object_read(&disk, head, meta->header_len, 0) == 0 &&
+             stored_key_matches(head, meta->header_len, url);
+    free(head);
+    disk_object_close(&disk);
+    return ok;
+}
+
+/*
+ * Отдаёт объект по индексу. Сборщик сегментов мог перенести запись между
+ * чтением индекса и открытием сегмента: тогда индекс читается ещё раз.
+ * -3 — объекта нет в индексе, -2 — он пропал с диска, -4 — это объект
+ * другого ключа.
+ */
+static int serve_indexed(client_t *cl, const char *key, const char *url, const char *cache_path) {
+    cache_index_t *index = root_for(cache_path)->index;
+    uint64_t hash = cache_key_hash(key);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        cache_meta_t meta;
+        off_t size = 0;
+        cache_loc_t loc;
+        if (cache_index_get(index, hash, &meta, &size, &loc) != 0) {
+            return -3;
+        }
+        int rc = serve_cached_object(cl, key, url, cache_path, &meta, size, &loc);
+        cache_loc_t cur;
+        if (rc != -2 || cache_index_locate(index, hash, &cur) != 0 ||
+            (cur.segment == loc.segment && cur.offset == loc.offset)) {
+            return rc;
+        }
+    }
+    return -2;
+}
+
+static int recv_response_header(int fd, char **out_buf, size_t *out_len, size_t *header_len, char *err, size_t errsz) {
+    return recv_header(fd, out_buf, out_len, header_len, err, errsz);
+}
+
+static int ensure_cache_dir(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            return 0;
+        }
+        return -1;
+    }
+    if (mkdir(path, 0755) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int join_path(char *out, size_t out_sz, const char *dir, const char *name, const char *suffix) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+    size_t need = dir_len + 1 + name_len + suffix_len + 1;
+    if (need > out_sz) {
+        return -1;
+    }
+
+    size_t pos = 0;
+    memcpy(out + pos, dir, dir_len);
+    pos += dir_len;
+    if (pos == 0 || out[pos - 1] != '/') {
+        out[pos++] = '/';
+    }
+    memcpy(out + pos, name, name_len);
+    pos += name_len;
+    memcpy(out + pos, suffix, suffix_len);
+    pos += suffix_len;
+    out[pos] = '\0';
+    return 0;
+}
+
+/* Объект кладётся в корень, которому его ключ принадлежит на кольце. */
+static int build_cache_paths(const char *url, char *cache_path, size_t cache_sz, char *key_out, size_t key_sz) {
+    cache_key_for_url(url, key_out, key_sz);
+    cache_root_t *root = cache_roots_pick(cache_roots, cache_key_hash(key_out));
+    return cache_root_path(root, key_out, ".cache", cache_path, cache_sz);
+}
+
+/*
+ * Разрешает конфликт при загрузке журнала: для ключа есть и запись в
+ * сегменте, и файл. Остаётся более новая версия.
+ */
+static int cache_resolve_conflict(uint64_t hash, const cache_meta_t *meta, void *arg) {
+    cache_root_t *root = (cache_root_t *)arg;
+    cache_meta_t slab_meta;
+    cache_loc_t slab_loc;
+    if (cache_index_get(root->index, hash, &slab_meta, NULL, &slab_loc) != 0 || slab_loc.segment < 0) {
+        return 1;
+    }
+    if (slab_meta.stored_at >= meta->stored_at) {
+        return 0;
+    }
+    slab_store_delete(root->slab, hash, &slab_loc);
+    return 1;
+}
+
+/*
+ * Переход со старого формата: когда журнала ещё нет, индекс один раз
+ * заполняется по файлам .meta, после чего пишется снимок. Сами .meta, тела
+ * без метаданных и временные файлы убирает вытеснитель в фоне.
+ */
+static size_t cache_index_load(cache_root_t *root) {
+    DIR *dir = opendir(root->dir);
+    if (!dir) {
+        return 0;
+    }
+    size_t loaded = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (strlen(name) != 16 + 5 || strcmp(name + 16, ".meta") != 0) {
+            continue;
+        }
+        char key[32];
+        memcpy(key, name, 16);
+        key[16] = '\0';
+
+        char path[PATH_MAX];
+        char cache_path[PATH_MAX];
+        cache_meta_t meta;
+        struct stat st;
+        if (join_path(path, sizeof(path), root->dir, key, ".meta") != 0 ||
+            cache_root_path(root, key, ".cache", cache_path, sizeof(cache_path)) != 0 ||
+            cache_meta_read(path, &meta) != 0 || stat(cache_path, &st) != 0) {
+            continue;
+        }
+        uint64_t hash = cache_key_hash(key);
+        cache_loc_t loc;
+        if (cache_index_locate(root->index, hash, &loc) == 0 && !cache_resolve_conflict(hash, &meta, root)) {
+            continue;
+        }
+        if (cache_index_put(root->index, hash, &meta, st.st_size, NULL) == 0) {
+            loaded++;
+        }
+    }
+    closedir(dir);
+    return loaded;
+}
+
+static int cache_is_fresh(const cache_meta_t *meta, time_t now) {
+    if (meta->must_revalidate) {
+        return 0;
+    }
+    if (meta->expires == 0) {
+        return 0;
+    }
+    return now < meta->expires;
+}
+
+/*
+ * Устаревший объект ещё можно отдать, если с истечения срока прошло меньше
+ * window секунд (stale-while-revalidate или stale-if-error). must-revalidate
+ * и no-cache запрещают это.
+ */
+static int cache_stale_usable(const cache_meta_t *meta, time_t now, int window) {
+    return !meta->must_revalidate && meta->expires != 0 && window > 0 && now < meta->expires + window;
+}
+
+/* Свежий объект в последних prefetch_percent процентах срока жизни обновляется заранее. */
+static int cache_wants_prefetch(const proxy_config_t *cfg, const cache_meta_t *meta, time_t now) {
+    time_t lifetime = meta->expires - meta->validated_at;
+    return cfg->prefetch_percent > 0 && lifetime > 0 &&
+           (long long)(meta->expires - now) * 100 <= (long long)lifetime * cfg->prefetch_percent;
+}
+
+/* Объект пропал с диска: запись убирается из индекса, если её не успели заменить. */
+static void cache_drop_missing(const char *key, const char *cache_path, const cache_meta_t *meta) {
+    cache_root_t *root = root_for(cache_path);
+    uint64_t hash = cache_key_hash(key);
+    cache_loc_t loc;
+    if (cache_index_evict(root->index, hash, meta->stored_at, 0, NULL, &loc) != 0) {
+        return;
+    }
+    if (loc.segment >= 0) {
+        slab_store_delete(root->slab, hash, &loc);
+    } else {
+        cache_journal_del(root->journal, hash);
+    }
+}
+
+static void schedule_refresh(const proxy_config_t *cfg, const http_request_t *req, const char *url,
+                             const char *key, const char *cache_path, const cache_meta_t *meta);
+
+static void cache_count_hit(unsigned long long bytes) {
+    timing_outcome(OUTCOME_HIT);
+    __atomic_add_fetch(&cache_stats.hits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache_stats.hit_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Отдаёт объект из кэша, если он свежий или ещё в окне stale-while-revalidate.
+ * Устаревший объект и объект, срок которого скоро истечёт, обновляются в фоне,
+ * так что клиент не ждёт сервера.
+ */
+static int try_serve_cache(const proxy_config_t *cfg, const http_request_t *req, const char *url,
+                           const char *key, const char *cache_path, cache_meta_t *meta, int *has_meta,
+                           client_t *cl) {
+    cache_index_t *index = root_for(cache_path)->index;
+    time_t now = time(NULL);
+    hot_object_t *obj = hot_cache_get(hot_cache, key, meta);
+    if (obj && strcmp(obj->url, url) != 0) {
+        hot_cache_release(hot_cache, obj);
+        log_msg(cfg, "DEBUG", "Под хешем лежит объект другого ключа: %s", url);
+        return 0;
+    }
+    if (obj) {
+        *has_meta = 1;
+        int fresh = cache_is_fresh(meta, now);
+        int stale = !fresh && cache_stale_usable(meta, now, meta->stale_while_revalidate);
+        if (fresh || stale) {
+            log_msg(cfg, "INFO", fresh ? "Кэш-попадание (память): %s" : "Устаревший объект из памяти: %s",
+                    cache_path);
+            send_hot_response(cl, obj);
+            cache_index_touch(index, cache_key_hash(key));
+            cache_count_hit(obj->head_len + obj->body_len);
+        }
+        hot_cache_release(hot_cache, obj);
+        if (stale || (fresh && cache_wants_prefetch(cfg, meta, now))) {
+            schedule_refresh(cfg, req, url, key, cache_path, meta);
+        }
+        return fresh || stale;
+    }
+
+    off_t size = 0;
+    cache_loc_t loc;
+    *has_meta = cache_index_get(index, cache_key_hash(key), meta, &size, &loc) == 0;
+    if (!*has_meta) {
+        return 0;
+    }
+
+    int fresh = cache_is_fresh(meta, now);
+    int stale = !fresh && cache_stale_usable(meta, now, meta->stale_while_revalidate);
+    if (!fresh && !stale) {
+        /* Валидаторы уйдут в условный запрос, поэтому они должны быть от этого же объекта. */
+        *has_meta = disk_key_matches(cache_path, &loc, size, meta, url);
+        return 0;
+    }
+    int rc = serve_cached_object(cl, key, url, cache_path, meta, size, &loc);
+    if (rc == -2) {
+        rc = serve_indexed(cl, key, url, cache_path);
+    }
+    if (rc == -4) {
+        log_msg(cfg, "DEBUG", "Под хешем лежит объект другого ключа: %s", url);
+        *has_meta = 0;
+        return 0;
+    }
+    if (rc == -2 || rc == -3) {
+        log_msg(cfg, "ERROR", "Файл кэша пропал: %s", cache_path);
+        cache_drop_missing(key, cache_path, meta);
+        *has_meta = 0;
+        return 0;
+    }
+    log_msg(cfg, "INFO", fresh ? "Кэш-попадание: %s" : "Устаревший объект: %s", cache_path);
+    cache_count_hit((unsigned long long)size);
+    if (stale || cache_wants_prefetch(cfg, meta, now)) {
+        schedule_refresh(cfg, req, url, key, cache_path, meta);
+    }
+    return 1;
+}
+
+/*
+ * Без max-age и Expires срок свежести оценивается эвристически (RFC 9111,
+ * 4.2.2): HEURISTIC_PERCENT от возраста документа по Last-Modified, но не
+ * больше HEURISTIC_MAX_AGE.
+ */
+static void update_meta_from_response(cache_meta_t *meta, const http_response_info_t *info) {
+    time_t now = time(NULL);
+    meta->validated_at = now;
+
+    if (info->has_last_modified) {
+        copy_str(meta->last_modified, sizeof(meta->last_modified), info->last_modified);
+    }
+    if (info->has_etag) {
+        copy_str(meta->etag, sizeof(meta->etag), info->etag);
+    }
+
+    time_t modified = 0;
+    if (info->has_max_age) {
+        meta->expires = now + info->max_age;
+    } else if (info->has_expires) {
+        meta->expires = info->expires;
+    } else if (meta->last_modified[0] && parse_http_date(meta->last_modified, &modified) == 0 &&
+               modified < now) {
+        time_t age = (now - modified) * HEURISTIC_PERCENT / 100;
+        meta->expires = now + (age < HEURISTIC_MAX_AGE ? age : HEURISTIC_MAX_AGE);
+    }
+
+    meta->must_revalidate = info->must_revalidate || info->no_cache;
+    if (info->has_stale_while_revalidate) {
+        meta->stale_while_revalidate = info->stale_while_revalidate;
+    }
+    if (info->has_stale_if_error) {
+        meta->stale_if_error = info->stale_if_error;
+    }
+}
+
+/*
+ * Каналы для передачи тела без копирования: main — от сервера к клиенту,
+ * tee — копия для файла кэша. У каждого обработчика свои, создаются при
+ * первой передаче; после ошибки в канале могли остаться данные, поэтому
+ * он пересоздаётся.
+ */
+typedef struct {
+    int main_r;
+    int main_w;
+    int tee_r;
+    int tee_w;
+    size_t cap;
+    int ready;
+} relay_pipes_t;
+
+static __thread relay_pipes_t relay_pipes;
+
+static void relay_pipes_reset(void) {
+    relay_pipes_t *rp = &relay_pipes;
+    if (rp->ready) {
+        close(rp->main_r);
+        close(rp->main_w);
+        close(rp->tee_r);
+        close(rp->tee_w);
+    }
+    memset(rp, 0, sizeof(*rp));
+}
+
+static relay_pipes_t *relay_pipes_get(void) {
+    relay_pipes_t *rp = &relay_pipes;
+    if (rp->ready) {
+        return rp;
+    }
+    int m[2];
+    int t[2];
+    if (pipe2(m, O_CLOEXEC) != 0) {
+        return NULL;
+    }
+    if (pipe2(t, O_CLOEXEC) != 0) {
+        close(m[0]);
+        close(m[1]);
+        return NULL;
+    }
+    fcntl(m[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    fcntl(t[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    int cap_m = fcntl(m[1], F_GETPIPE_SZ);
+    int cap_t = fcntl(t[1], F_GETPIPE_SZ);
+    rp->main_r = m[0];
+    rp->main_w = m[1];
+    rp->tee_r = t[0];
+    rp->tee_w = t[1];
+    rp->cap = (size_t)(cap_m > 0 && cap_m < cap_t ? cap_m : cap_t);
+    rp->ready = 1;
+    if (cap_m <= 0 || cap_t <= 0) {
+        relay_pipes_reset();
+        return NULL;
+    }
+    return rp;
+}
+
+static int splice_all(int from, int to, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+enum {
+    UPSTREAM_ERR_CONNECT = -1,
+    UPSTREAM_ERR_SEND = -2,
+    UPSTREAM_ERR_RECV = -3,
+    UPSTREAM_ERR_BODY = -4,
+    UPSTREAM_ERR_TOO_LARGE = -5,
+    UPSTREAM_ERR_TIMEOUT = -6,
+    UPSTREAM_ERR_CLIENT_TIMEOUT = -7
+};
+
+static long long max_body_bytes(const proxy_config_t *cfg) {
+    return cfg->max_body_mb * 1024LL * 1024LL;
+}
+
+/*
+ * Передаёт тело запроса от клиента в out_fd по мере поступления, порциями не
+ * больше канала; при out_fd < 0 тело только вычитывается. Запись на сервер
+ * блокирующая, поэтому медленный сервер сдерживает чтение у клиента, и память
+ * не зависит от размера тела. chunked-тело передаётся как chunked. limit —
+ * предел размера тела (0 — без ограничения); для Content-Length он проверен
+ * заранее, здесь важен для chunked. Каждое чтение у клиента ограничено
+ * SO_RCVTIMEO (-client_idle); истёкший таймаут даёт UPSTREAM_ERR_CLIENT_TIMEOUT.
+ */
+static int send_request_body(client_t *cl, const http_request_t *req, int out_fd, long long limit) {
+    if (!req->chunked && req->content_length == 0) {
+        return 0;
+    }
+    if (req->expect_continue && cl->http11 &&
+        send_all(cl->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) != 0) {
+        return UPSTREAM_ERR_BODY;
+    }
+
+    body_reader_t br;
+    request_body_init(&br, cl->conn, req);
+    char buf[IO_BUF_SIZE];
+    long long total = 0;
+    int rc = 0;
+    int pipes_dirty = 0;
+    while (1) {
+        relay_pipes_t *rp = out_fd >= 0 ? relay_pipes_get() : NULL;
+        int spliced = 0;
+        errno = 0;
+        ssize_t n = body_read(&br, buf, sizeof(buf), rp ? rp->main_w : -1, rp ? rp->cap : 0, &spliced);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            rc = UPSTREAM_ERR_CLIENT_TIMEOUT;
+            break;
+        }
+        if (n <= 0) {
+            rc = n < 0 ? UPSTREAM_ERR_BODY : 0;
+            break;
+        }
+        total += n;
+        if (limit > 0 && total > limit) {
+            rc = UPSTREAM_ERR_TOO_LARGE;
+            pipes_dirty = spliced;
+            break;
+        }
+        if (out_fd < 0) {
+            continue;
+        }
+        char size_line[32];
+        int line_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t)n);
+        if ((req->chunked && send_all(out_fd, size_line, (size_t)line_len) != 0) ||
+            (spliced ? splice_all(rp->main_r, out_fd, (size_t)n) : send_all(out_fd, buf, (size_t)n)) != 0 ||
+            (req->chunked && send_all(out_fd, "\r\n", 2) != 0)) {
+            rc = UPSTREAM_ERR_SEND;
+            pipes_dirty = spliced;
+            break;
+        }
+    }
+    if (pipes_dirty) {
+        relay_pipes_reset();
+    }
+    if (rc == 0 && req->chunked && out_fd >= 0 && send_all(out_fd, "0\r\n\r\n", 5) != 0) {
+        rc = UPSTREAM_ERR_SEND;
+    }
+    if (rc == 0 && request_body_finish(&br, cl->conn) != 0) {
+        rc = UPSTREAM_ERR_BODY;
+    }
+    return rc;
+}
+
+/*
+ * Отправляет запрос на сервер и читает заголовки ответа. GET сначала
+ * пробует соединение из пула; если сервер успел его закрыть, запрос
+ * повторяется один раз на новом соединении. POST всегда идёт по новому
+ * соединению, чтобы не повторять неидемпотентный запрос; его тело читается
+ * у body_from вслед за заголовками. Заголовков ответа сервер ждёт не дольше
+ * first_byte_timeout, дальше каждое чтение и запись ограничены read_timeout.
+ */
+static int upstream_roundtrip(const proxy_config_t *cfg, const http_request_t *req, client_t *body_from,
+                              const char *forward_req, size_t forward_len, int *out_fd, char **resp_buf,
+                              size_t *resp_len, size_t *header_len, char *err, size_t errsz) {
+    int allow_pooled = strcasecmp(req->method, "GET") == 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int fd = -1;
+        int reused = 0;
+        if (allow_pooled && attempt == 0) {
+            fd = upstream_pool_acquire(upstream_pool, req->host, req->port);
+            reused = fd >= 0;
+        }
+        if (fd < 0) {
+            fd = connect_to_host(cfg, req->host, req->port, err, errsz);
+            if (fd < 0) {
+                return fd == CONNECT_TIMEOUT ? UPSTREAM_ERR_TIMEOUT : UPSTREAM_ERR_CONNECT;
+            }
+        }
+        set_socket_timeout(fd, SO_SNDTIMEO, cfg->read_timeout);
+        set_socket_timeout(fd, SO_RCVTIMEO, cfg->first_byte_timeout);
+
+        int rc = 0;
+        int hrc;
+        long long started = timing_begin();
+        if (send_all(fd, forward_req, forward_len) != 0) {
+            snprintf(err, errsz, "ошибка отправки запроса: %s", strerror(errno));
+            rc = UPSTREAM_ERR_SEND;
+        } else if (body_from && (rc = send_request_body(body_from, req, fd, max_body_bytes(cfg))) != 0) {
+            snprintf(err, errsz, "тело запроса не передано");
+        } else if ((hrc = recv_response_header(fd, resp_buf, resp_len, header_len, err, errsz)) != 0) {
+            rc = hrc == -2 ? UPSTREAM_ERR_TIMEOUT : UPSTREAM_ERR_RECV;
+        }
+        timing_end(TIMING_TTFB, started);
+        if (rc == 0) {
+            set_socket_timeout(fd, SO_RCVTIMEO, cfg->read_timeout);
+            *out_fd = fd;
+            return 0;
+        }
+        close(fd);
+        /* Сервер, который не ответил вовремя, второй раз не ждут. */
+        if (!reused || rc == UPSTREAM_ERR_TIMEOUT) {
+            return rc;
+        }
+    }
+    return UPSTREAM_ERR_RECV;
+}
+
+static void report_upstream_error(client_t *cl, const proxy_config_t *cfg, int rc, const char *err) {
+    switch (rc) {
+    case UPSTREAM_ERR_CONNECT:
+        log_msg(cfg, "ERROR", "%s", err);
+        send_error_response(cl, 502, "Bad Gateway", "Не удалось подключиться к серверу\n");
+        break;
+    case UPSTREAM_ERR_SEND:
+        log_msg(cfg, "ERROR", "Ошибка отправки запроса на сервер: %s", err);
+        send_error_response(cl, 502, "Bad Gateway", "Ошибка отправки запроса\n");
+        break;
+    case UPSTREAM_ERR_BODY:
+        log_msg(cfg, "ERROR", "Ошибка чтения тела запроса: %s", err);
+        send_error_response(cl, 400, "Bad Request", "Ошибка чтения тела запроса\n");
+        break;
+    case UPSTREAM_ERR_TIMEOUT:
+        log_msg(cfg, "ERROR", "%s", err);
+        send_error_response(cl, 504, "Gateway Timeout", "Сервер не ответил вовремя\n");
+        break;
+    case UPSTREAM_ERR_CLIENT_TIMEOUT:
+        log_msg(cfg, "ERROR", "Клиент не прислал тело запроса за %d с", cfg->client_idle_timeout);
+        send_error_response(cl, 408, "Request Timeout", "Тело запроса не получено вовремя\n");
+        break;
+    case UPSTREAM_ERR_TOO_LARGE:
+        log_msg(cfg, "ERROR", "Тело запроса больше %lld МБ", cfg->max_body_mb);
+        send_error_response(cl, 413, "Payload Too Large", "Слишком большое тело запроса\n");
+        break;
+    default:
+        log_msg(cfg, "ERROR", "Ошибка чтения ответа: %s", err);
+        send_error_response(cl, 502, "Bad Gateway", "Ошибка чтения ответа\n");
+        break;
+    }
+}
+
+/* Соединение возвращается в пул, только если ответ прочитан ровно до конца. */
+static void finish_upstream(const http_request_t *req, int server_fd, const http_response_info_t *info,
+                            const body_reader_t *br) {
+    if (body_reader_reusable(br) && response_keeps_alive(info)) {
+        upstream_pool_release(upstream_pool, req->host, req->port, server_fd);
+    } else {
+        close(server_fd);
+    }
+}
+
+/* Копия тела для уровня в памяти; копирование бросается, как только объект перерос лимит. */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t limit;
+    int active;
+} body_copy_t;
+
+static void body_copy_add(body_copy_t *copy, const char *data, size_t n) {
+    if (!copy->active) {
+        return;
+    }
+    if (copy->len + n > copy->limit ||
+        append_mem(&copy->buf, &copy->len, &copy->cap, data, n) != 0) {
+        free(copy->buf);
+        copy->buf = NULL;
+        copy->active = 0;
+    }
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Порция тела уже лежит в канале main. Для кэша она дублируется в tee
+ * (tee не потребляет данные) и уходит в файл, затем main отдаётся клиенту.
+ */
+static int relay_spliced(relay_pipes_t *rp, client_t *cl, int cache_fd, int *cache_failed, size_t len) {
+    if (cache_fd >= 0 && !*cache_failed) {
+        long long started = timing_begin();
+        ssize_t t;
+        do {
+            t = tee(rp->main_r, rp->tee_w, len, 0);
+        } while (t < 0 && errno == EINTR);
+        if (t != (ssize_t)len || splice_all(rp->tee_r, cache_fd, len) != 0) {
+            *cache_failed = 1;
+        }
+        timing_end(TIMING_CACHE_WRITE, started);
+    }
+
+    long long started = timing_begin();
+    int rc = 0;
+    if (cl->chunked) {
+        char size_line[32];
+        int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+        rc = send_all(cl->fd, size_line, (size_t)n);
+    }
+    if (rc == 0) {
+        rc = splice_all(rp->main_r, cl->fd, len);
+    }
+    if (rc == 0 && cl->chunked) {
+        rc = send_all(cl->fd, "\r\n", 2);
+    }
+    timing_end(TIMING_CLIENT_SEND, started);
+    return rc == 0 ? 0 : -2;
+}
+
+/*
+ * Куда, кроме клиента, пишется тело: файл кэша, копия для памяти и сегмента и
+ * клиенты, ожидающие ту же загрузку (им сообщается, сколько уже записано).
+ */
+typedef struct {
+    int fd;
+    int failed;
+    off_t written;
+    body_copy_t copy;
+    inflight_t *flight;
+    cache_root_t *root;
+} cache_sink_t;
+
+static void sink_wrote(cache_sink_t *sink, size_t n) {
+    sink->written += (off_t)n;
+    inflight_progress(sink->flight, sink->written);
+}
+
+/* 0 — тело передано целиком, -1 — ошибка на стороне сервера, -2 — клиент отключился. */
+static int relay_body(body_reader_t *br, client_t *cl, cache_sink_t *sink) {
+    char buf[IO_BUF_SIZE];
+    int rc = 0;
+    int pipes_dirty = 0;
+    int scratch_failed = 1;
+    int cache_fd = sink ? sink->fd : -1;
+    int *cache_failed = sink ? &sink->failed : &scratch_failed;
+    body_copy_t *copy = sink ? &sink->copy : NULL;
+    while (1) {
+        /*
+         * Пока тело может попасть в память или в сегмент, его нужно видеть
+         * целиком; вырезку диапазона тоже делает client_send_body.
+         */
+        relay_pipes_t *rp = (copy && copy->active) || cl->partial ? NULL : relay_pipes_get();
+        int spliced = 0;
+        ssize_t n = body_read(br, buf, sizeof(buf), rp ? rp->main_w : -1, rp ? rp->cap : 0, &spliced);
+        if (n <= 0) {
+            rc = n < 0 ? -1 : 0;
+            break;
+        }
+        if (spliced) {
+            int had_failed = *cache_failed;
+            rc = relay_spliced(rp, cl, cache_fd, cache_failed, (size_t)n);
+            if (*cache_failed && !had_failed) {
+                pipes_dirty = 1;
+            } else if (cache_fd >= 0 && !*cache_failed) {
+                sink_wrote(sink, (size_t)n);
+            }
+            if (rc != 0) {
+                pipes_dirty = 1;
+                break;
+            }
+            continue;
+        }
+        if (client_send_body(cl, buf, (size_t)n) != 0) {
+            rc = -2;
+            break;
+        }
+        if (cache_fd >= 0 && !*cache_failed) {
+            long long timed = timing_begin();
+            long long started = cache_root_io_begin(cache_roots, sink->root);
+            int failed = write_all(cache_fd, buf, (size_t)n) != 0;
+            cache_root_io_end(cache_roots, sink->root, started, 0);
+            timing_end(TIMING_CACHE_WRITE, timed);
+            if (failed) {
+                *cache_failed = 1;
+            } else {
+                sink_wrote(sink, (size_t)n);
+            }
+        }
+        if (copy) {
+            body_copy_add(copy, buf, (size_t)n);
+        }
+    }
+    if (pipes_dirty || rc == -1) {
+        relay_pipes_reset();
+    }
+    return rc;
+}
+
+/*
+ * Клиент, которого кормят из файла, а не прямо из сокета сервера: в файл
+ * записано stored байт тела, клиенту из них нужны байты начиная с base
+ * (не больше limit, -1 — все); ready из них уже записано, sent отдано. Для
+ * chunked клиента каждая порция до chunk_end обрамляется строками из frame.
+ * В файле подкачки (punch) отданное место освобождается дырами.
+ */
+typedef struct {
+    int fd;
+    int active;
+    int punch;
+    off_t base;
+    off_t skip;
+    off_t limit;
+    off_t stored;
+    off_t ready;
+    off_t sent;
+    off_t chunk_end;
+    off_t punched;
+    char frame[32];
+    size_t frame_len;
+    size_t frame_off;
+} client_feed_t;
+
+#define SPILL_PUNCH_STEP (1024 * 1024)
+
+static long long spill_limit_bytes(const proxy_config_t *cfg) {
+    return cfg->spill_mb * 1024LL * 1024LL;
+}
+
+/* Подкачка идёт в первый корень кэша, который сейчас в работе. */
+static const char *spill_dir(void) {
+    time_t now = time(NULL);
+    for (int i = 0; i < cache_roots->count; i++) {
+        if (cache_root_usable(&cache_roots->roots[i], now)) {
+            return cache_roots->roots[i].dir;
+        }
+    }
+    return cache_roots->roots[0].dir;
+}
+
+/*
+ * Источник для клиента: временный файл кэша (path) или безымянный файл
+ * подкачки в каталоге кэша, если ответ не кэшируется. Клиента /dev/null
+ * (фоновое обновление) кормить незачем.
+ */
+static int feed_open(client_feed_t *feed, const proxy_config_t *cfg, client_t *cl, const char *path, off_t base) {
+    if (cl->fd == discard_fd || (!path && cfg->spill_mb <= 0)) {
+        return -1;
+    }
+    memset(feed, 0, sizeof(*feed));
+    if (path) {
+        feed->fd = open(path, O_RDONLY | O_CLOEXEC);
+    } else {
+        feed->fd = open(spill_dir(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        feed->punch = 1;
+    }
+    if (feed->fd < 0) {
+        return -1;
+    }
+    if (set_client_nonblocking(cl->fd, 1) != 0) {
+        close(feed->fd);
+        return -1;
+    }
+    feed->skip = cl->partial ? (off_t)cl->skip : 0;
+    feed->limit = cl->partial ? (off_t)cl->left : -1;
+    feed->base = base + feed->skip;
+    feed->active = 1;
+    return 0;
+}
+
+static void feed_stored(client_feed_t *feed, off_t n) {
+    feed->stored += n;
+    off_t ready = feed->stored > feed->skip ? feed->stored - feed->skip : 0;
+    feed->ready = feed->limit >= 0 && ready > feed->limit ? feed->limit : ready;
+}
+
+static int feed_behind(const client_feed_t *feed) {
+    return feed->active && (feed->frame_off < feed->frame_len || feed->sent < feed->ready);
+}
+
+static void feed_frame(client_feed_t *feed, const char *fmt, long long n) {
+    feed->frame_len = (size_t)snprintf(feed->frame, sizeof(feed->frame), fmt, n);
+    feed->frame_off = 0;
+}
+
+/* Отдаёт клиенту всё, что уже записано, пока сокет принимает. -1 — клиент отключился. */
+static int feed_pump(client_feed_t *feed, client_t *cl) {
+    long long started = timing_begin();
+    while (feed->active) {
+        ssize_t n;
+        if (feed->frame_off < feed->frame_len) {
+            n = write(cl->fd, feed->frame + feed->frame_off, feed->frame_len - feed->frame_off);
+            if (n > 0) {
+                feed->frame_off += (size_t)n;
+                continue;
+            }
+        } else if (feed->sent < feed->chunk_end) {
+            off_t off = feed->base + feed->sent;
+            n = sendfile(cl->fd, feed->fd, &off, (size_t)(feed->chunk_end - feed->sent));
+            if (n > 0) {
+                feed->sent += n;
+                if (feed->sent == feed->chunk_end && cl->chunked) {
+                    feed_frame(feed, "\r\n", 0);
+                }
+                continue;
+            }
+        } else if (feed->sent < feed->ready) {
+            feed->chunk_end = feed->ready;
+            if (cl->chunked) {
+                feed_frame(feed, "%llx\r\n", (long long)(feed->ready - feed->sent));
+            }
+            continue;
+        } else {
+            break;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        feed->active = 0;
+        timing_end(TIMING_CLIENT_SEND, started);
+        return -1;
     }
-    return now < meta->expires;
+    timing_end(TIMING_CLIENT_SEND, started);
+    if (feed->punch && feed->base + feed->sent - feed->punched >= SPILL_PUNCH_STEP) {
+        off_t upto = (feed->base + feed->sent) & ~(off_t)(SPILL_PUNCH_STEP - 1);
+        if (fallocate(feed->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, feed->punched, upto - feed->punched) == 0) {
+            feed->punched = upto;
+        } else {
+            feed->punch = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Тело читается с сервера с его скоростью и пишется в store_fd (файл кэша
+ * или подкачки), а клиент догоняет из файла неблокирующим sendfile между
+ * чтениями. Медленный клиент держит только файл, а не соединение с
+ * сервером. Чтение ждёт клиента лишь тогда, когда тот отстал на limit байт
+ * (0 — без предела). Если клиент отключился, объект для кэша дочитывается до
+ * конца, а подкачка бросается сразу.
+ * 0 — тело прочитано, -1 — ошибка сервера или записи, -2 — клиент отключился.
+ */
+static int relay_decoupled(body_reader_t *br, client_t *cl, client_feed_t *feed, int store_fd,
+                           cache_sink_t *sink, long long limit, int timeout_sec) {
+    char buf[IO_BUF_SIZE];
+    body_copy_t *copy = sink ? &sink->copy : NULL;
+    int timeout_ms = timeout_sec > 0 ? timeout_sec * 1000 : -1;
+    int client_gone = 0;
+    int rc = 0;
+    int pipes_dirty = 0;
+    while (1) {
+        if (feed_behind(feed)) {
+            int full = limit > 0 && feed->ready - feed->sent >= limit;
+            /* Тело известной длины, прочитанное до конца, сервера уже не ждёт. */
+            int buffered = br->pending_len > 0 || br->raw_pos < br->raw_len ||
+                           (br->mode == BODY_LENGTH && br->remaining == 0);
+            if (full || !buffered) {
+                struct pollfd pfd[2] = {{cl->fd, POLLOUT, 0}, {br->fd, POLLIN, 0}};
+                int r = poll(pfd, full ? 1 : 2, timeout_ms);
+                if (r < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (r <= 0) {
+                    /* Молчит сервер — ошибка сервера; не читает клиент — он бросается. */
+                    rc = full ? -2 : -1;
+                    break;
+                }
+                if (pfd[0].revents && feed_pump(feed, cl) != 0) {
+                    client_gone = 1;
+                    if (!sink) {
+                        rc = -2;
+                        break;
+                    }
+                }
+                if (full || !pfd[1].revents) {
+                    continue;
+                }
+            }
+        }
+
+        relay_pipes_t *rp = (copy && copy->active) ? NULL : relay_pipes_get();
+        int spliced = 0;
+        ssize_t n = body_read(br, buf, sizeof(buf), rp ? rp->main_w : -1, rp ? rp->cap : 0, &spliced);
+        if (n <= 0) {
+            rc = n < 0 ? -1 : 0;
+            break;
+        }
+        long long timed = sink ? timing_begin() : 0;
+        long long started = sink ? cache_root_io_begin(cache_roots, sink->root) : 0;
+        int failed = spliced ? splice_all(rp->main_r, store_fd, (size_t)n) != 0
+                             : write_all(store_fd, buf, (size_t)n) != 0;
+        if (sink) {
+            cache_root_io_end(cache_roots, sink->root, started, 0);
+            timing_end(TIMING_CACHE_WRITE, timed);
+        }
+        if (failed) {
+            pipes_dirty = spliced;
+            if (sink) {
+                sink->failed = 1;
+            }
+            rc = -1;
+            break;
+        }
+        if (!spliced && copy) {
+            body_copy_add(copy, buf, (size_t)n);
+        }
+        if (sink) {
+            sink_wrote(sink, (size_t)n);
+        }
+        feed_stored(feed, n);
+        if (feed->active && feed_pump(feed, cl) != 0) {
+            client_gone = 1;
+            if (!sink) {
+                rc = -2;
+                break;
+            }
+        }
+    }
+    if (pipes_dirty || rc == -1) {
+        relay_pipes_reset();
+    }
+    return rc != 0 ? rc : (client_gone ? -2 : 0);
+}
+
+/*
+ * Тело у прокси целиком: клиент дочитывает остаток из файла. Если он отстал,
+ * остаток вместе с файлом уходит циклу событий, а обработчик свободен. Иначе
+ * (или если отдать не удалось) остаток отдаётся здесь же, и каждое ожидание
+ * клиента ограничено timeout_sec; клиент, который за это время ничего не
+ * забрал, бросается.
+ */
+static int feed_finish(client_feed_t *feed, client_t *cl, int timeout_sec) {
+    if (feed_behind(feed)) {
+        conn_feed_t plan;
+        conn_feed_init(&plan, feed->fd);
+        if (conn_feed_bytes(&plan, feed->frame + feed->frame_off, feed->frame_len - feed->frame_off) == 0 &&
+            conn_feed_file(&plan, feed->base + feed->sent, feed->chunk_end - feed->sent) == 0 &&
+            (feed->sent == feed->chunk_end || !cl->chunked || conn_feed_bytes(&plan, "\r\n", 2) == 0) &&
+            client_feed_range(cl, &plan, feed->base + feed->chunk_end, feed->ready - feed->chunk_end) == 0 &&
+            client_hand_off(cl, &plan) == 0) {
+            return 0;
+        }
+    }
+    int timeout_ms = timeout_sec > 0 ? timeout_sec * 1000 : -1;
+    int rc = feed->active ? 0 : -1;
+    while (rc == 0 && feed_behind(feed)) {
+        struct pollfd pfd = {cl->fd, POLLOUT, 0};
+        int r = poll(&pfd, 1, timeout_ms);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0 || feed_pump(feed, cl) != 0) {
+            rc = -1;
+        }
+    }
+    set_client_nonblocking(cl->fd, 0);
+    if (rc == 0 && client_end_body(cl) != 0) {
+        rc = -1;
+    }
+    close(feed->fd);
+    return rc;
+}
+
+/*
+ * Сохраняет загруженный объект и возвращает 0, если он попал в кэш. Небольшой
+ * объект, тело которого целиком есть в памяти, дописывается в сегмент, иначе
+ * временный файл становится <hash>.cache. Прежняя версия убирается из того
+ * места, где она лежала.
+ */
+static int cache_commit(const proxy_config_t *cfg, const char *key, const char *cache_path,
+                        const http_response_info_t *info, const char *tmp_path, int have_file,
+                        const char *stored_header, size_t stored_header_len, const body_copy_t *copy,
+                        off_t body_written, cache_meta_t *meta) {
+    /*
+     * На время замены объект пропадает из индекса: читатели получают
+     * промах и присоединяются к этой же загрузке, а не читают новый файл
+     * со старыми метаданными.
+     */
+    cache_root_t *root = root_for(cache_path);
+    uint64_t hash = cache_key_hash(key);
+    cache_loc_t old;
+    int had_old = cache_index_locate(root->index, hash, &old) == 0;
+    cache_index_remove(root->index, hash);
+    hot_cache_remove(hot_cache, key);
+    if (had_old && old.segment < 0) {
+        cache_journal_del(root->journal, hash);
+    }
+
+    memset(meta, 0, sizeof(*meta));
+    meta->stored_at = time(NULL);
+    meta->header_len = stored_header_len;
+    update_meta_from_response(meta, info);
+
+    int stored = 0;
+    int in_file = 0;
+    if (copy->active && slab_store_fits(root->slab, stored_header_len + copy->len)) {
+        struct iovec iov[2] = {{(void *)stored_header, stored_header_len}, {copy->buf, copy->len}};
+        cache_loc_t loc;
+        if (slab_store_put(root->slab, hash, meta, iov, 2, &loc) == 0) {
+            cache_index_put(root->index, hash, meta, (off_t)(stored_header_len + copy->len), &loc);
+            stored = 1;
+        } else {
+            log_msg(cfg, "ERROR", "Не удалось записать объект в сегмент: %s", cache_path);
+        }
+        if (have_file) {
+            unlink(tmp_path);
+        }
+    } else if (have_file) {
+        long long started = cache_root_io_begin(cache_roots, root);
+        int renamed = rename(tmp_path, cache_path) == 0;
+        cache_root_io_end(cache_roots, root, started, !renamed);
+        if (!renamed) {
+            log_msg(cfg, "ERROR", "Не удалось сохранить кэш: %s", cache_path);
+            unlink(tmp_path);
+        } else {
+            off_t size = (off_t)stored_header_len + body_written;
+            cache_index_put(root->index, hash, meta, size, NULL);
+            if (cache_journal_put(root->journal, hash, meta, size) != 0) {
+                log_msg(cfg, "ERROR", "Не удалось записать метаданные в журнал: %s", cache_path);
+            }
+            stored = 1;
+            in_file = 1;
+        }
+    }
+
+    if (had_old && old.segment >= 0) {
+        if (stored && !in_file) {
+            slab_store_forget(root->slab, &old);
+        } else {
+            slab_store_delete(root->slab, hash, &old);
+        }
+    } else if (had_old && !in_file) {
+        unlink(cache_path);
+    }
+    if (stored) {
+        __atomic_add_fetch(&cache_stats.writes, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cache_stats.written_bytes, (unsigned long long)stored_header_len +
+                           (unsigned long long)(copy->active ? (off_t)copy->len : body_written), __ATOMIC_RELAXED);
+        cache_evictor_poke(root->evictor);
+    }
+    return stored ? 0 : -1;
+}
+
+/*
+ * Новый объект пишется на диск, пока в кэше есть место или если его
+ * запрашивают чаще, чем объект, который он вытеснит (TinyLFU). Новая версия
+ * объекта, который уже лежит в кэше, допускается всегда.
+ */
+static int cache_admit(const proxy_config_t *cfg, const char *key, const char *cache_path, int cached) {
+    static __thread uint64_t sample_seq;
+    cache_root_t *root = root_for(cache_path);
+    if (!cache_admission || cached || !cache_evictor_pressure(root->evictor)) {
+        return 1;
+    }
+    uint64_t hash = cache_key_hash(key);
+    uint64_t victim;
+    if (cache_index_sample(root->index, hash ^ (++sample_seq * 0x9e3779b97f4a7c15ULL), ADMISSION_VICTIM_SAMPLES,
+                           &victim) != 0 ||
+        cache_admission_admit(cache_admission, hash, victim)) {
+        return 1;
+    }
+    log_msg(cfg, "DEBUG", "Объект не допущен в кэш: запрашивается реже вытесняемого");
+    return 0;
+}
+
+/* Раз в CACHE_REPORT_INTERVAL секунд один из обработчиков пишет счётчики кэша в лог. */
+static void cache_stats_report(const proxy_config_t *cfg) {
+    time_t now = time(NULL);
+    time_t next = __atomic_load_n(&cache_stats.next_report, __ATOMIC_RELAXED);
+    if (now < next || !__atomic_compare_exchange_n(&cache_stats.next_report, &next, now + CACHE_REPORT_INTERVAL, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+        next == 0) {
+        return;
+    }
+    unsigned long long lookups = __atomic_load_n(&cache_stats.lookups, __ATOMIC_RELAXED);
+    unsigned long long hits = __atomic_load_n(&cache_stats.hits, __ATOMIC_RELAXED);
+    unsigned long long hit_bytes = __atomic_load_n(&cache_stats.hit_bytes, __ATOMIC_RELAXED);
+    unsigned long long writes = __atomic_load_n(&cache_stats.writes, __ATOMIC_RELAXED);
+    unsigned long long written = __atomic_load_n(&cache_stats.written_bytes, __ATOMIC_RELAXED);
+    log_msg(cfg, "INFO",
+            "Кэш: запросов %llu, попаданий %.1f%%, записано объектов %llu (%.1f МБ), записи на байт попаданий %.2f, "
+            "допуск: принято %llu, отклонено %llu",
+            lookups, lookups ? 100.0 * (double)hits / (double)lookups : 0.0, writes, (double)written / 1048576.0,
+            hit_bytes ? (double)written / (double)hit_bytes : 0.0, cache_admission ? cache_admission->admitted : 0ULL,
+            cache_admission ? cache_admission->rejected : 0ULL);
+    for (int i = 0; i < cache_roots->count; i++) {
+        cache_root_t *root = &cache_roots->roots[i];
+        log_msg(cfg, "INFO",
+                "Диск %s: %.1f МБ, объектов %zu, очередь %d (макс. %d), операций %llu, ошибок %llu, медленных %llu, "
+                "выводов из работы %llu%s",
+                root->dir, (double)cache_index_bytes(root->index) / 1048576.0, cache_index_count(root->index),
+                __atomic_load_n(&root->pending, __ATOMIC_RELAXED), __atomic_load_n(&root->max_pending, __ATOMIC_RELAXED),
+                __atomic_load_n(&root->ops, __ATOMIC_RELAXED), __atomic_load_n(&root->errors, __ATOMIC_RELAXED),
+                __atomic_load_n(&root->slow, __ATOMIC_RELAXED), __atomic_load_n(&root->outages, __ATOMIC_RELAXED),
+                cache_root_usable(root, now) ? "" : ", выведен из работы");
+    }
+    for (int i = 0; peers && i < peers->count; i++) {
+        peer_t *peer = &peers->peers[i];
+        log_msg(cfg, "INFO", "Сосед %s: %s, загрузок %llu, ошибок %llu, дайджест обновлён %llu раз, без изменений %llu",
+                peer->name, __atomic_load_n(&peer->up, __ATOMIC_RELAXED) ? "в работе" : "недоступен",
+                __atomic_load_n(&peer->fetches, __ATOMIC_RELAXED), __atomic_load_n(&peer->failures, __ATOMIC_RELAXED),
+                __atomic_load_n(&peer->digest_updates, __ATOMIC_RELAXED),
+                __atomic_load_n(&peer->digest_unchanged, __ATOMIC_RELAXED));
+    }
+}
+
+/* Дайджест для соседей: ключи из индексов всех корней кэша. */
+static void digest_visit(const cache_index_entry_t *entry, void *arg) {
+    peer_digest_add((peer_digest_t *)arg, entry->hash);
+}
+
+static int peers_collect(peer_digest_t *digest, void *arg) {
+    (void)arg;
+    size_t keys = 0;
+    for (int i = 0; i < cache_roots->count; i++) {
+        keys += cache_index_count(cache_roots->roots[i].index);
+    }
+    if (peer_digest_init(digest, keys) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < cache_roots->count; i++) {
+        cache_index_foreach(cache_roots->roots[i].index, digest_visit, digest);
+    }
+    return 0;
+}
+
+static void peer_changed(const peer_t *peer, int up, void *arg) {
+    const proxy_config_t *cfg = (const proxy_config_t *)arg;
+    log_msg(cfg, "INFO", up ? "Сосед %s в работе" : "Сосед %s выпал из кластера", peer->name);
+}
+
+/* Вызывается из cache_roots, когда корень выводится из работы. */
+static void cache_root_down(const cache_root_t *root, int reason, void *arg) {
+    const proxy_config_t *cfg = (const proxy_config_t *)arg;
+    const char *why = reason == CACHE_ROOT_FAILED ? "ошибка ввода-вывода"
+                      : reason == CACHE_ROOT_SLOW ? "медленная операция"
+                                                  : "переполнена очередь";
+    log_msg(cfg, "ERROR", "Диск кэша %s выведен из работы на %d с: %s", root->dir, CACHE_ROOT_RETRY, why);
+}
+
+/*
+ * Передаёт ответ клиенту и сохраняет его в кэш. Соединение с сервером
+ * освобождается, как только тело прочитано, даже если клиент ещё его
+ * получает.
+ */
+static int forward_and_cache(body_reader_t *br, client_t *cl, const proxy_config_t *cfg,
+                             const http_request_t *req, const char *url, const char *key, const char *cache_path,
+                             const http_response_info_t *info, const char *header_buf,
+                             size_t header_len, int allow_cache, inflight_t *flight) {
+    FILE *cache_file = NULL;
+    char tmp_path[PATH_MAX];
+    tmp_path[0] = '\0';
+    char *stored_header = NULL;
+    size_t stored_header_len = 0;
+    long long body_length = info->has_content_length && !info->chunked ? info->content_length : -1;
+    cache_root_t *root = allow_cache ? root_for(cache_path) : NULL;
+
+    /* Объект известного размера, который поместится в сегмент, собирается в памяти без временного файла. */
+    int to_slab = 0;
+    if (allow_cache) {
+        char *key_line = NULL;
+        if (asprintf(&key_line, "%s: %s\r\n", CACHE_KEY_HEADER, url) < 0 ||
+            build_client_response_header(header_buf, header_len, info->chunked, key_line,
+                                         &stored_header, &stored_header_len) != 0) {
+            free(key_line);
+            allow_cache = 0;
+        } else {
+            free(key_line);
+            to_slab = body_length >= 0 &&
+                      slab_store_fits(root->slab, stored_header_len + (unsigned long long)body_length);
+        }
+    }
+
+    if (allow_cache && !to_slab) {
+        char suffix[64];
+        int sn = snprintf(suffix, sizeof(suffix), ".tmp.%ld.%lu", (long)getpid(), (unsigned long)pthread_self());
+        if (sn < 0 || (size_t)sn >= sizeof(suffix)) {
+            allow_cache = 0;
+        } else if (strlen(cache_path) + (size_t)sn + 1 > sizeof(tmp_path)) {
+            allow_cache = 0;
+        } else {
+            size_t base_len = strlen(cache_path);
+            memcpy(tmp_path, cache_path, base_len);
+            memcpy(tmp_path + base_len, suffix, (size_t)sn);
+            tmp_path[base_len + (size_t)sn] = '\0';
+        }
+
+        if (allow_cache) {
+            long long timed = timing_begin();
+            long long started = cache_root_io_begin(cache_roots, root);
+            cache_file = fopen(tmp_path, "wb");
+            cache_root_io_end(cache_roots, root, started, !cache_file);
+            timing_end(TIMING_CACHE_WRITE, timed);
+            if (!cache_file) {
+                log_msg(cfg, "ERROR", "Не удалось открыть файл кэша: %s", tmp_path);
+                allow_cache = 0;
+            }
+        }
+    }
+    if (!cache_file && !to_slab) {
+        inflight_finish(inflight_table, flight, FLIGHT_UNCACHEABLE);
+    }
+
+    /* Диапазон вырезается из целого ответа, только если известна длина тела. */
+    char framing[128];
+    client_choose_framing(cl, info, framing, sizeof(framing));
+    if (cl->range && info->status_code == 200 && body_length >= 0) {
+        client_plan_range(cl, info->has_etag ? info->etag : "", info->has_last_modified ? info->last_modified : "",
+                          body_length);
+    }
+
+    char *client_header = NULL;
+    size_t client_header_len = 0;
+    long long started = timing_begin();
+    if ((cl->partial ? build_range_header(cl, header_buf, header_len, body_length, &client_header, &client_header_len)
+                     : build_client_response_header(header_buf, header_len, info->chunked, framing,
+                                                    &client_header, &client_header_len)) != 0 ||
+        send_all(cl->fd, client_header, client_header_len) != 0) {
+        timing_end(TIMING_CLIENT_SEND, started);
+        free(client_header);
+        free(stored_header);
+        if (cache_file) {
+            fclose(cache_file);
+            unlink(tmp_path);
+        }
+        close(br->fd);
+        return -1;
+    }
+    free(client_header);
+    timing_end(TIMING_CLIENT_SEND, started);
+
+    cache_sink_t sink;
+    memset(&sink, 0, sizeof(sink));
+    sink.fd = -1;
+    body_copy_t *copy = &sink.copy;
+    started = timing_begin();
+    if (cache_file &&
+        (fwrite(stored_header, 1, stored_header_len, cache_file) != stored_header_len ||
+         fflush(cache_file) != 0 ||
+         inflight_publish_header(flight, tmp_path, stored_header, stored_header_len, body_length) != 0)) {
+        fclose(cache_file);
+        unlink(tmp_path);
+        cache_file = NULL;
+    }
+    if (cache_file) {
+        timing_end(TIMING_CACHE_WRITE, started);
+    }
+    if (to_slab && inflight_publish_header(flight, "", stored_header, stored_header_len, body_length) != 0) {
+        to_slab = 0;
+    }
+    if (cache_file || to_slab) {
+        sink.fd = cache_file ? fileno(cache_file) : -1;
+        sink.root = root;
+        sink.flight = flight;
+        /* Тело копируется в память, пока объект может попасть в кэш в памяти или в сегмент. */
+        size_t keep = hot_cache_fits(hot_cache, stored_header_len) ? hot_cache->max_object : 0;
+        if (slab_store_fits(root->slab, stored_header_len) && root->slab->max_object > keep) {
+            keep = root->slab->max_object;
+        }
+        copy->active = keep > 0;
+        copy->limit = copy->active ? keep - stored_header_len : 0;
+        if (body_length >= 0 && (unsigned long long)body_length > copy->limit) {
+            copy->active = 0;
+        }
+    }
+
+    /*
+     * Тело, которое идёт в файл кэша или не кэшируется вовсе, читается с
+     * сервера отдельно от клиента; небольшой объект для сегмента целиком
+     * уходит в буфер сокета клиента и передаётся напрямую.
+     */
+    client_feed_t feed;
+    int decoupled = !to_slab && feed_open(&feed, cfg, cl, cache_file ? tmp_path : NULL,
+                                          cache_file ? (off_t)stored_header_len : 0) == 0;
+    int rc;
+    started = timing_begin();
+    if (decoupled) {
+        rc = relay_decoupled(br, cl, &feed, cache_file ? sink.fd : feed.fd, cache_file ? &sink : NULL,
+                             cache_file ? 0 : spill_limit_bytes(cfg), cfg->read_timeout);
+    } else {
+        rc = relay_body(br, cl, &sink);
+        if (rc == 0) {
+            rc = client_end_body(cl) == 0 ? 0 : -2;
+        }
+    }
+    timing_end(TIMING_TRANSFER, started);
+    __atomic_add_fetch(&cache_stats.miss_bytes, (unsigned long long)header_len + (unsigned long long)br->received,
+                       __ATOMIC_RELAXED);
+    finish_upstream(req, br->fd, info, br);
+
+    /* Клиент ушёл, но объект дочитан целиком: он всё равно сохраняется. */
+    int client_gone = rc == -2;
+    if (client_gone && decoupled && cache_file) {
+        rc = 0;
+    }
+    if (rc != 0) {
+        if (rc == -1 && sink.failed) {
+            log_msg(cfg, "ERROR", "Ошибка записи в файл кэша: %s", tmp_path);
+            cache_root_error(cache_roots, root);
+        } else if (rc == -1) {
+            log_msg(cfg, "ERROR", "Ответ сервера оборван, объект не кэшируется");
+        }
+        if (decoupled) {
+            set_client_nonblocking(cl->fd, 0);
+            close(feed.fd);
+        }
+        if (cache_file) {
+            fclose(cache_file);
+            unlink(tmp_path);
+        }
+        free(stored_header);
+        free(copy->buf);
+        return -1;
+    }
+
+    if (cache_file && sink.failed) {
+        log_msg(cfg, "ERROR", "Ошибка записи в файл кэша: %s", tmp_path);
+        cache_root_error(cache_roots, root);
+        fclose(cache_file);
+        unlink(tmp_path);
+        cache_file = NULL;
+    }
+
+    if (cache_file || (to_slab && copy->active)) {
+        int have_file = cache_file != NULL;
+        if (cache_file) {
+            fclose(cache_file);
+        }
+        cache_meta_t meta;
+        started = timing_begin();
+        int committed = cache_commit(cfg, key, cache_path, info, tmp_path, have_file, stored_header,
+                                     stored_header_len, copy, sink.written, &meta) == 0;
+        timing_end(TIMING_CACHE_WRITE, started);
+        if (committed) {
+            inflight_finish(inflight_table, flight, FLIGHT_DONE);
+            if (copy->active) {
+                hot_cache_release(hot_cache, hot_admit(key, url, &meta, stored_header, stored_header_len,
+                                                       copy->buf ? copy->buf : "", copy->len));
+            }
+        }
+    }
+
+    free(stored_header);
+    free(copy->buf);
+    if (decoupled && feed_finish(&feed, cl, cfg->read_timeout) != 0) {
+        client_gone = 1;
+    }
+    return client_gone ? -1 : 0;
+}
+
+/*
+ * Сохраняет новые метаданные после 304. У объекта в сегменте они лежат в
+ * заголовке записи, поэтому запись дописывается заново и старая становится
+ * мусором.
+ */
+static void cache_store_meta(const char *key, const char *cache_path, const cache_meta_t *meta) {
+    cache_root_t *root = root_for(cache_path);
+    uint64_t hash = cache_key_hash(key);
+    cache_meta_t old;
+    off_t size = 0;
+    cache_loc_t loc;
+    if (cache_index_get(root->index, hash, &old, &size, &loc) != 0) {
+        return;
+    }
+    if (loc.segment < 0) {
+        if (cache_index_update_meta(root->index, hash, meta) == 0) {
+            cache_journal_put(root->journal, hash, meta, size);
+        }
+        return;
+    }
+
+    disk_object_t disk;
+    if (disk_object_open(root, NULL, &loc, size, &disk) == 0) {
+        char *buf = (char *)malloc((size_t)size + 1);
+        cache_loc_t fresh;
+        if (buf && disk_object_read(&disk, buf, (size_t)size, 0) == 0) {
+            struct iovec iov = {buf, (size_t)size};
+            if (slab_store_put(root->slab, hash, meta, &iov, 1, &fresh) == 0) {
+                if (cache_index_relocate(root->index, hash, &loc, &fresh) == 0) {
+                    slab_store_forget(root->slab, &loc);
+                } else {
+                    slab_store_forget(root->slab, &fresh);
+                }
+            }
+        }
+        free(buf);
+        disk_object_close(&disk);
+    }
+    cache_index_update_meta(root->index, hash, meta);
+}
+
+/* Загрузка завершилась и объект лежит в кэше: отдаётся оттуда. */
+static int serve_after_flight(client_t *cl, const char *key, const char *url, const char *cache_path) {
+    int rc = serve_indexed(cl, key, url, cache_path);
+    return rc == -2 || rc == -3 || rc == -4 ? 1 : 0;
+}
+
+/*
+ * Запрос совпал с уже идущей загрузкой того же URL: тело читается из
+ * временного файла ведущего по мере того, как тот его пишет. 0 — ответ
+ * отдан, 1 — загружать придётся самому (ответ не кэшируется или ведущий
+ * не смог начать запись).
+ */
+static int follow_flight(client_t *cl, const proxy_config_t *cfg, inflight_t *f,
+                         const char *key, const char *url, const char *cache_path) {
+    flight_state_t state = inflight_wait_header(f);
+    if (state == FLIGHT_DONE || state == FLIGHT_REVALIDATED || state == FLIGHT_STALE) {
+        return serve_after_flight(cl, key, url, cache_path);
+    }
+    if (state == FLIGHT_UPSTREAM_ERROR) {
+        send_error_response(cl, 502, "Bad Gateway", "Не удалось получить ответ сервера\n");
+        return 0;
+    }
+    if (state != FLIGHT_FETCHING) {
+        return 1;
+    }
+
+    /* Заголовки опубликованы, поля ниже больше не меняются. Чужой ключ с тем же хешем загружается сам. */
+    if (!stored_key_matches(f->stored_header, f->stored_header_len, url)) {
+        return 1;
+    }
+    int fd = open(f->tmp_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        off_t written;
+        state = inflight_wait_data(f, (off_t)LLONG_MAX, &written);
+        return state == FLIGHT_DONE ? serve_after_flight(cl, key, url, cache_path) : 1;
+    }
+
+    char framing[128];
+    cl->chunked = 0;
+    if (f->body_length >= 0) {
+        snprintf(framing, sizeof(framing), "Content-Length: %lld\r\nConnection: %s\r\n",
+                 f->body_length, cl->keep_alive ? "keep-alive" : "close");
+    } else if (cl->keep_alive && cl->http11) {
+        cl->chunked = 1;
+        snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\nConnection: keep-alive\r\n");
+    } else {
+        cl->keep_alive = 0;
+        snprintf(framing, sizeof(framing), "Connection: close\r\n");
+    }
+
+    /* Валидаторов ведущего здесь нет: с If-Range отдаётся целый объект. */
+    if (cl->range && f->body_length >= 0) {
+        client_plan_range(cl, "", "", f->body_length);
+    }
+
+    char *client_header = NULL;
+    size_t client_header_len = 0;
+    long long started = timing_begin();
+    if ((cl->partial ? build_range_header(cl, f->stored_header, f->stored_header_len, f->body_length,
+                                          &client_header, &client_header_len)
+                     : build_client_response_header(f->stored_header, f->stored_header_len, 1, framing,
+                                                    &client_header, &client_header_len)) != 0 ||
+        send_all(cl->fd, client_header, client_header_len) != 0) {
+        timing_end(TIMING_CLIENT_SEND, started);
+        free(client_header);
+        close(fd);
+        cl->keep_alive = 0;
+        return 0;
+    }
+    free(client_header);
+    timing_end(TIMING_CLIENT_SEND, started);
+    log_msg(cfg, "DEBUG", "Отдача из идущей загрузки: %s", cache_path);
+
+    /* Клиенту нужны байты тела с skip, не больше limit (-1 — все); sent из них отдано. */
+    off_t base = (off_t)f->stored_header_len;
+    off_t skip = cl->partial ? (off_t)cl->skip : 0;
+    off_t limit = cl->partial ? (off_t)cl->left : -1;
+    off_t sent = 0;
+    while (1) {
+        off_t written;
+        state = inflight_wait_data(f, skip + sent, &written);
+        off_t avail = written > skip ? written - skip : 0;
+        if (limit >= 0 && avail > limit) {
+            avail = limit;
+        }
+        /* Тело в файле целиком: остаток, если клиент не успевает, отдаёт цикл событий. */
+        if (state == FLIGHT_DONE || (limit >= 0 && avail == limit)) {
+            if (client_send_rest(cl, fd, base + skip + sent, base + skip + avail) != 0) {
+                break;
+            }
+            close(fd);
+            return 0;
+        }
+        if (avail > sent) {
+            size_t len = (size_t)(avail - sent);
+            started = timing_begin();
+            if (cl->chunked) {
+                char size_line[32];
+                int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+                if (send_all(cl->fd, size_line, (size_t)n) != 0) {
+                    break;
+                }
+            }
+            off_t off = base + skip + sent;
+            off_t end = base + skip + avail;
+            while (off < end) {
+                ssize_t n = sendfile(cl->fd, fd, &off, (size_t)(end - off));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+            }
+            int failed = off < end || (cl->chunked && send_all(cl->fd, "\r\n", 2) != 0);
+            timing_end(TIMING_CLIENT_SEND, started);
+            if (failed) {
+                break;
+            }
+            sent = avail;
+            continue;
+        }
+        break;
+    }
+    close(fd);
+    cl->keep_alive = 0;
+    return 0;
+}
+
+/*
+ * stale-if-error: сервер недоступен или ответил 5xx, а объект ещё в окне
+ * stale_if_error. Ожидающие ту же загрузку тоже получают его из кэша.
+ */
+static int serve_stale_on_error(client_t *cl, const proxy_config_t *cfg, const char *url, const char *key,
+                                const char *cache_path, const cache_meta_t *meta, int has_meta,
+                                inflight_t *flight) {
+    if (!has_meta || !cache_stale_usable(meta, time(NULL), meta->stale_if_error)) {
+        return -1;
+    }
+    inflight_finish(inflight_table, flight, FLIGHT_STALE);
+    if (cl->fd == discard_fd) {
+        log_msg(cfg, "INFO", "Фоновое обновление не удалось, остаётся прежний объект: %s", url);
+        return 0;
+    }
+    int rc = serve_indexed(cl, key, url, cache_path);
+    if (rc == -2 || rc == -3 || rc == -4) {
+        return -1;
+    }
+    log_msg(cfg, "INFO", "Сервер недоступен, отдан устаревший объект: %s", url);
+    timing_outcome(OUTCOME_HIT);
+    return 0;
+}
+
+/*
+ * Сосед, у которого стоит взять объект при промахе: владелец URL среди
+ * работающих узлов или, если владелец этот прокси, сосед, в дайджесте
+ * которого объект есть. Запрос, пришедший от соседа, к соседям больше не
+ * идёт: узлы могут по-разному видеть кластер, и он ходил бы по кругу.
+ */
+static peer_t *peer_for_request(const http_request_t *req, const char *key) {
+    if (!peers || find_header_value(req, PEER_HEADER)) {
+        return NULL;
+    }
+    char base[4096];
+    if (normalize_url(req, base, sizeof(base)) != 0) {
+        return NULL;
+    }
+    peer_t *peer = peers_owner(peers, fnv1a_hash(base));
+    return peer ? peer : peers_holder(peers, cache_key_hash(key));
+}
+
+/*
+ * Запрос к соседу идёт тем же путём, что и к серверу, через пул постоянных
+ * соединений, только целью служит абсолютный URL. via — копия запроса с
+ * адресом соседа, по ней соединение потом вернётся в пул. Ответ 5xx соседа
+ * не принимается, и сервер спрашивает сам прокси.
+ */
+static int peer_roundtrip(const proxy_config_t *cfg, const http_request_t *req, peer_t *peer,
+                          const char *cond_headers, int keep_range, http_request_t *via, int *out_fd,
+                          char **resp_buf, size_t *resp_len, size_t *header_len) {
+    char target[4200];
+    char headers[1024];
+    snprintf(target, sizeof(target), "http://%s:%d%s", req->host, req->port, req->path);
+    snprintf(headers, sizeof(headers), "%s%s: %s\r\n", cond_headers, PEER_HEADER, cfg->peer_name);
+    char *forward_req = NULL;
+    size_t forward_len = 0;
+    if (build_forward_request(req, target, headers, keep_range, &forward_req, &forward_len) != 0) {
+        return -1;
+    }
+    *via = *req;
+    snprintf(via->host, sizeof(via->host), "%s", peer->host);
+    via->port = peer->port;
+    char err[512];
+    int rc = upstream_roundtrip(cfg, via, NULL, forward_req, forward_len, out_fd, resp_buf, resp_len, header_len,
+                                err, sizeof(err));
+    free(forward_req);
+    if (rc != 0) {
+        log_msg(cfg, "ERROR", "Сосед %s недоступен: %s", peer->name, err);
+        peers_failed(peers, peer);
+        return -1;
+    }
+    http_response_info_t info;
+    if (parse_response_info(*resp_buf, *header_len, &info) != 0 || info.status_code >= 500) {
+        log_msg(cfg, "DEBUG", "Сосед %s ответил ошибкой, запрос идёт к серверу", peer->name);
+        free(*resp_buf);
+        *resp_buf = NULL;
+        close(*out_fd);
+        return -1;
+    }
+    __atomic_add_fetch(&peer->fetches, 1, __ATOMIC_RELAXED);
+    return 0;
 }
 
-static int try_serve_cache(const proxy_config_t *cfg, const char *cache_path, const char *meta_path,
-                           cache_meta_t *meta, int *has_meta, int client_fd) {
-    struct stat st_cache;
-    struct stat st_meta;
+static int fetch_from_upstream(client_t *cl, const http_request_t *req, const proxy_config_t *cfg,
+                               const char *url, const char *key, int cache_ready,
+                               const char *cache_path,
+                               cache_meta_t *meta_in, int has_meta, inflight_t *flight) {
+    cache_meta_t meta = *meta_in;
+    char cond_headers[512];
+    cond_headers[0] = '\0';
+    if (cache_ready && has_meta) {
+        if (meta.last_modified[0]) {
+            snprintf(cond_headers + strlen(cond_headers),
+                     sizeof(cond_headers) - strlen(cond_headers),
+                     "If-Modified-Since: %s\r\n", meta.last_modified);
+        }
+        if (meta.etag[0]) {
+            snprintf(cond_headers + strlen(cond_headers),
+                     sizeof(cond_headers) - strlen(cond_headers),
+                     "If-None-Match: %s\r\n", meta.etag);
+        }
+    }
 
-    pthread_mutex_lock(&cache_mutex);
-    int cache_ok = (stat(cache_path, &st_cache) == 0);
-    int meta_ok = (stat(meta_path, &st_meta) == 0);
-    if (cache_ok && meta_ok && cache_meta_read(meta_path, meta) == 0) {
-        *has_meta = 1;
+    char err[512];
+    int server_fd = -1;
+    char *resp_buf = NULL;
+    size_t resp_len = 0;
+    size_t header_len = 0;
+    int rc = 0;
+    /* upstream — куда ушёл запрос: к серверу или к соседу; по нему соединение вернётся в пул. */
+    http_request_t via;
+    const http_request_t *upstream = req;
+    peer_t *peer = cache_ready ? peer_for_request(req, key) : NULL;
+    if (peer && peer_roundtrip(cfg, req, peer, cond_headers, cl->pass_range, &via, &server_fd, &resp_buf,
+                               &resp_len, &header_len) == 0) {
+        log_msg(cfg, "INFO", "Загрузка у соседа %s: %s", peer->name, url);
+        upstream = &via;
     } else {
-        *has_meta = 0;
+        char *forward_req = NULL;
+        size_t forward_len = 0;
+        if (build_forward_request(req, NULL, cond_headers, cl->pass_range, &forward_req, &forward_len) != 0) {
+            send_error_response(cl, 500, "Internal Server Error", "Ошибка формирования запроса\n");
+            return -1;
+        }
+        rc = upstream_roundtrip(cfg, req, NULL, forward_req, forward_len, &server_fd, &resp_buf, &resp_len,
+                                &header_len, err, sizeof(err));
+        free(forward_req);
+    }
+    if (rc != 0) {
+        if (serve_stale_on_error(cl, cfg, url, key, cache_path, &meta, cache_ready && has_meta, flight) == 0) {
+            log_msg(cfg, "ERROR", "%s", err);
+            return 0;
+        }
+        inflight_finish(inflight_table, flight, FLIGHT_UPSTREAM_ERROR);
+        report_upstream_error(cl, cfg, rc, err);
+        return -1;
     }
-    pthread_mutex_unlock(&cache_mutex);
 
-    if (!cache_ok || !meta_ok || !*has_meta) {
+    http_response_info_t info;
+    int parsed = parse_response_info(resp_buf, header_len, &info) == 0;
+    int server_error = parsed && (info.status_code == 500 || info.status_code == 502 ||
+                                  info.status_code == 503 || info.status_code == 504);
+    if ((!parsed || server_error) &&
+        serve_stale_on_error(cl, cfg, url, key, cache_path, &meta, cache_ready && has_meta, flight) == 0) {
+        free(resp_buf);
+        close(server_fd);
         return 0;
     }
-
-    time_t now = time(NULL);
-    if (cache_is_fresh(meta, now)) {
-        log_msg(cfg, "INFO", "Кэш-попадание: %s", cache_path);
-        send_file(client_fd, cache_path);
-        return 1;
+    if (!parsed) {
+        free(resp_buf);
+        close(server_fd);
+        inflight_finish(inflight_table, flight, FLIGHT_UPSTREAM_ERROR);
+        send_error_response(cl, 502, "Bad Gateway", "Некорректный ответ сервера\n");
+        return -1;
     }
 
-    return 0;
-}
+    body_reader_t br;
+    body_reader_init(&br, server_fd, &info, resp_buf + header_len, resp_len - header_len);
 
-static void update_meta_from_response(cache_meta_t *meta, const http_response_info_t *info) {
-    time_t now = time(NULL);
-    if (info->has_max_age) {
-        meta->expires = now + info->max_age;
-    } else if (info->has_expires) {
-        meta->expires = info->expires;
-    } else if (meta->expires == 0) {
-        meta->expires = 0;
+    if (info.status_code == 304 && cache_ready && has_meta) {
+        log_msg(cfg, "INFO", "Кэш обновлён (304 Not Modified): %s", url);
+        timing_outcome(OUTCOME_REVALIDATED);
+        update_meta_from_response(&meta, &info);
+        cache_store_meta(key, cache_path, &meta);
+        hot_cache_update_meta(hot_cache, key, &meta);
+        inflight_finish(inflight_table, flight, FLIGHT_REVALIDATED);
+
+        int served = cl->fd == discard_fd ? 0 : serve_indexed(cl, key, url, cache_path);
+        if (served == -2 || served == -3 || served == -4) {
+            send_error_response(cl, 502, "Bad Gateway", "Объект кэша недоступен\n");
+        }
+        br.done = 1;
+        finish_upstream(upstream, server_fd, &info, &br);
+        free(resp_buf);
+        return 0;
     }
 
-    meta->must_revalidate = info->must_revalidate || info->no_cache;
+    /*
+     * Ответ с Vary хранится под ключом варианта. Если имена заголовков стали
+     * известны только сейчас, ключ пересчитывается, а ожидающие этой загрузки
+     * идут к серверу сами: им может быть нужен другой вариант.
+     */
+    char variant_url[4096];
+    char variant_key[32];
+    char variant_path[PATH_MAX];
+    if (cache_ready && info.status_code == 200 && info.has_vary && !info.no_store) {
+        char names[VARY_NAMES_MAX];
+        if (vary_names(info.vary, names, sizeof(names)) != 0 ||
+            cache_url_for_request(req, names, variant_url, sizeof(variant_url)) != 0 ||
+            build_cache_paths(variant_url, variant_path, sizeof(variant_path), variant_key,
+                              sizeof(variant_key)) != 0) {
+            info.no_store = 1;
+        } else if (strcmp(variant_url, url) != 0) {
+            log_msg(cfg, "DEBUG", "Вариант по Vary: %s", variant_url);
+            inflight_finish(inflight_table, flight, FLIGHT_UNCACHEABLE);
+            flight = NULL;
+            url = variant_url;
+            key = variant_key;
+            cache_path = variant_path;
+            has_meta = 0;
+        }
+    }
 
-    if (info->has_last_modified) {
-        copy_str(meta->last_modified, sizeof(meta->last_modified), info->last_modified);
+    int allow_cache = (cache_ready && info.status_code == 200 && !info.no_store);
+    if (!allow_cache) {
+        log_msg(cfg, "DEBUG", "Ответ не кэшируется (код=%d)", info.status_code);
+    } else if (!cache_admit(cfg, key, cache_path, has_meta)) {
+        allow_cache = 0;
     }
-    if (info->has_etag) {
-        copy_str(meta->etag, sizeof(meta->etag), info->etag);
+
+    if (forward_and_cache(&br, cl, cfg, upstream, url, key, cache_path, &info,
+                          resp_buf, header_len, allow_cache, flight) != 0) {
+        timing_outcome(OUTCOME_ERROR);
+        cl->keep_alive = 0;
     }
+    free(resp_buf);
+    return 0;
 }
 
-static int forward_and_cache(int server_fd, int client_fd, const proxy_config_t *cfg,
-                             const char *cache_path, const char *meta_path,
-                             const http_response_info_t *info, const char *header_buf,
-                             size_t total_len, size_t header_len, int allow_cache) {
-    FILE *cache_file = NULL;
-    char tmp_path[PATH_MAX];
+/*
+ * Фоновое обновление объекта. Ответ идёт тем же путём, что и для клиента,
+ * только «клиент» — /dev/null: объект сохраняется в кэш, а клиенты,
+ * пришедшие за ним во время загрузки, ждут её как обычно.
+ */
+typedef struct {
+    work_item_t item;
+    const proxy_config_t *cfg;
+    inflight_t *flight;
+    cache_meta_t meta;
+    char url[4096];
+    char key[32];
+    char cache_path[PATH_MAX];
+    http_request_t req;
+} refresh_job_t;
+
+static void refresh_run(work_item_t *item) {
+    refresh_job_t *job = container_of(item, refresh_job_t, item);
+    client_t cl;
+    memset(&cl, 0, sizeof(cl));
+    cl.fd = discard_fd;
+    cl.http11 = 1;
+    log_msg(job->cfg, "DEBUG", "Фоновое обновление: %s", job->url);
+    fetch_from_upstream(&cl, &job->req, job->cfg, job->url, job->key, 1, job->cache_path, &job->meta, 1,
+                        job->flight);
+    inflight_finish(inflight_table, job->flight, FLIGHT_FAILED);
+    inflight_leave(inflight_table, job->flight);
+    request_free(&job->req);
+    free(job);
+}
 
-    if (allow_cache) {
-        char suffix[64];
-        int sn = snprintf(suffix, sizeof(suffix), ".tmp.%ld.%lu", (long)getpid(), (unsigned long)pthread_self());
-        if (sn < 0 || (size_t)sn >= sizeof(suffix)) {
-            allow_cache = 0;
-        } else if (strlen(cache_path) + (size_t)sn + 1 > sizeof(tmp_path)) {
-            allow_cache = 0;
-        } else {
-            size_t base_len = strlen(cache_path);
-            memcpy(tmp_path, cache_path, base_len);
-            memcpy(tmp_path + base_len, suffix, (size_t)sn);
-            tmp_path[base_len + (size_t)sn] = '\0';
-        }
+/* Если за этим URL уже кто-то пошёл (клиент или другое обновление), второе не ставится. */
+static void schedule_refresh(const proxy_config_t *cfg, const http_request_t *req, const char *url,
+                             const char *key, const char *cache_path, const cache_meta_t *meta) {
+    if (!refresh_pool) {
+        return;
+    }
+    int leader = 0;
+    inflight_t *flight = inflight_join(inflight_table, key, &leader);
+    if (!flight) {
+        return;
+    }
+    if (!leader) {
+        inflight_leave(inflight_table, flight);
+        return;
+    }
+    refresh_job_t *job = (refresh_job_t *)malloc(sizeof(refresh_job_t));
+    if (job && request_clone(&job->req, req) != 0) {
+        free(job);
+        job = NULL;
+    }
+    if (!job) {
+        inflight_finish(inflight_table, flight, FLIGHT_FAILED);
+        inflight_leave(inflight_table, flight);
+        return;
+    }
+    job->item.fn = refresh_run;
+    job->cfg = cfg;
+    job->flight = flight;
+    job->meta = *meta;
+    copy_str(job->url, sizeof(job->url), url);
+    copy_str(job->key, sizeof(job->key), key);
+    copy_str(job->cache_path, sizeof(job->cache_path), cache_path);
+    job->req.content_length = 0;
+    job->req.chunked = 0;
+    job->req.expect_continue = 0;
+    work_pool_submit(refresh_pool, &job->item);
+}
 
-        if (allow_cache) {
-            cache_file = fopen(tmp_path, "wb");
-            if (!cache_file) {
-                log_msg(cfg, "ERROR", "Не удалось открыть файл кэша: %s", tmp_path);
-                allow_cache = 0;
-            }
+/* Content-Range: bytes first-last/total или bytes * /total (first = last = -1). */
+static int parse_content_range(const char *value, size_t len, long long *first, long long *last, long long *total) {
+    char buf[128];
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    if (strncasecmp(buf, "bytes ", 6) != 0) {
+        return -1;
+    }
+    const char *p = buf + 6;
+    char *endp = NULL;
+    *first = -1;
+    *last = -1;
+    if (*p == '*') {
+        p++;
+    } else {
+        *first = strtoll(p, &endp, 10);
+        if (endp == p || *endp != '-') {
+            return -1;
+        }
+        p = endp + 1;
+        *last = strtoll(p, &endp, 10);
+        if (endp == p || *last < *first) {
+            return -1;
         }
+        p = endp;
     }
+    if (*p != '/') {
+        return -1;
+    }
+    *total = strtoll(p + 1, &endp, 10);
+    return endp == p + 1 || *endp != '\0' || *total < 0 ? -1 : 0;
+}
 
-    if (send_all(client_fd, header_buf, header_len) != 0) {
-        if (cache_file) {
-            fclose(cache_file);
-            unlink(tmp_path);
+static int find_content_range(const char *head, size_t head_len, long long *first, long long *last,
+                              long long *total) {
+    const char *p = head;
+    const char *end = head + head_len;
+    const char *status;
+    size_t status_len;
+    if (http_first_line(&p, end, &status, &status_len) != 0) {
+        return -1;
+    }
+    http_field_t f;
+    while (http_next_field(&p, end, &f) > 0) {
+        if (http_field_is(&f, "Content-Range")) {
+            return parse_content_range(f.value, f.value_len, first, last, total);
         }
+    }
+    return -1;
+}
+
+/* Кусок объекта в кэше: тело куска — байты first..first+len-1 объекта размером total. */
+typedef struct {
+    long long index;
+    disk_object_t disk;
+    cache_meta_t meta;
+    char *head;
+    long long first;
+    long long len;
+    long long total;
+    int open;
+} slice_t;
+
+static void slice_close(slice_t *sl) {
+    if (sl->open) {
+        disk_object_close(&sl->disk);
+        free(sl->head);
+        sl->head = NULL;
+        sl->open = 0;
+    }
+}
+
+/*
+ * Загружает кусок запросом с Range и сохраняет ответ 206 в кэш как отдельный
+ * объект. 1 — сервер ответил не 206 (диапазоны не поддерживает), -2 — 416,
+ * тогда в total размер объекта.
+ */
+static int fetch_slice(const proxy_config_t *cfg, const http_request_t *req, const char *url, const char *key,
+                       const char *cache_path, long long first, long long last, inflight_t *flight,
+                       long long *total) {
+    char range[96];
+    snprintf(range, sizeof(range), "Range: bytes=%lld-%lld\r\n", first, last);
+    char *forward_req = NULL;
+    size_t forward_len = 0;
+    if (build_forward_request(req, NULL, range, 0, &forward_req, &forward_len) != 0) {
         return -1;
     }
 
-    if (cache_file) {
-        fwrite(header_buf, 1, header_len, cache_file);
+    char err[512];
+    int server_fd = -1;
+    char *resp_buf = NULL;
+    size_t resp_len = 0;
+    size_t header_len = 0;
+    int rc = upstream_roundtrip(cfg, req, NULL, forward_req, forward_len, &server_fd, &resp_buf, &resp_len,
+                                &header_len, err, sizeof(err));
+    free(forward_req);
+    if (rc != 0) {
+        log_msg(cfg, "ERROR", "%s", err);
+        return -1;
     }
 
-    size_t body_len = total_len > header_len ? total_len - header_len : 0;
-    if (body_len > 0) {
-        if (send_all(client_fd, header_buf + header_len, body_len) != 0) {
-            if (cache_file) {
-                fclose(cache_file);
-                unlink(tmp_path);
-            }
-            return -1;
-        }
-        if (cache_file) {
-            fwrite(header_buf + header_len, 1, body_len, cache_file);
+    http_response_info_t info;
+    if (parse_response_info(resp_buf, header_len, &info) != 0 || info.status_code != 206) {
+        long long a;
+        long long b;
+        rc = 1;
+        if (info.status_code == 416 && find_content_range(resp_buf, header_len, &a, &b, total) == 0) {
+            rc = -2;
         }
+        free(resp_buf);
+        close(server_fd);
+        return rc;
     }
 
-    char buf[IO_BUF_SIZE];
-    ssize_t n;
-    while ((n = recv(server_fd, buf, sizeof(buf), 0)) > 0) {
-        if (send_all(client_fd, buf, (size_t)n) != 0) {
-            if (cache_file) {
-                fclose(cache_file);
-                unlink(tmp_path);
+    body_reader_t br;
+    body_reader_init(&br, server_fd, &info, resp_buf + header_len, resp_len - header_len);
+    client_t discard;
+    memset(&discard, 0, sizeof(discard));
+    discard.fd = discard_fd;
+    discard.http11 = 1;
+    forward_and_cache(&br, &discard, cfg, req, url, key, cache_path, &info, resp_buf, header_len,
+                      !info.no_store && cache_admit(cfg, key, cache_path, 0), flight);
+    free(resp_buf);
+    return 0;
+}
+
+/*
+ * Открывает кусок index из кэша, при промахе загружая его (одновременные
+ * промахи по одному куску ждут одну загрузку). 0 — кусок открыт, 1 — кусков
+ * не получится, -2 — диапазон за концом объекта.
+ */
+static int slice_open(const proxy_config_t *cfg, const http_request_t *req, const char *url, long long index,
+                      long long slice_size, slice_t *sl) {
+    char slice_url[4200];
+    char cache_path[PATH_MAX];
+    char key[32];
+    snprintf(slice_url, sizeof(slice_url), "%s#slice=%lld", url, index);
+    if (build_cache_paths(slice_url, cache_path, sizeof(cache_path), key, sizeof(key)) != 0) {
+        return 1;
+    }
+    cache_root_t *root = root_for(cache_path);
+    uint64_t hash = cache_key_hash(key);
+    cache_admission_record(cache_admission, hash);
+    memset(sl, 0, sizeof(*sl));
+    for (int attempt = 0; attempt < 2; attempt++) {
+        off_t size = 0;
+        cache_loc_t loc;
+        if (cache_index_get(root->index, hash, &sl->meta, &size, &loc) == 0 &&
+            cache_is_fresh(&sl->meta, time(NULL)) && sl->meta.header_len > 0 &&
+            disk_object_open(root, cache_path, &loc, size, &sl->disk) == 0) {
+            long long last;
+            sl->head = (char *)malloc(sl->meta.header_len + 1);
+            if (sl->head && disk_object_read(&sl->disk, sl->head, sl->meta.header_len, 0) == 0 &&
+                stored_key_matches(sl->head, sl->meta.header_len, slice_url) &&
+                find_content_range(sl->head, sl->meta.header_len, &sl->first, &last, &sl->total) == 0 &&
+                sl->first >= 0 && last - sl->first + 1 == (long long)size - (long long)sl->meta.header_len) {
+                sl->index = index;
+                sl->len = last - sl->first + 1;
+                sl->open = 1;
+                cache_index_touch(root->index, hash);
+                return 0;
             }
-            return -1;
+            free(sl->head);
+            sl->head = NULL;
+            disk_object_close(&sl->disk);
         }
-        if (cache_file) {
-            fwrite(buf, 1, (size_t)n, cache_file);
+        if (attempt > 0) {
+            break;
         }
-    }
 
-    if (cache_file) {
-        fclose(cache_file);
-        if (rename(tmp_path, cache_path) != 0) {
-            log_msg(cfg, "ERROR", "Не удалось сохранить кэш: %s", cache_path);
-            unlink(tmp_path);
+        int leader = 0;
+        inflight_t *flight = inflight_join(inflight_table, key, &leader);
+        if (!flight) {
+            return 1;
+        }
+        int rc = 0;
+        if (leader) {
+            log_msg(cfg, "DEBUG", "Загрузка куска %lld: %s", index, url);
+            rc = fetch_slice(cfg, req, slice_url, key, cache_path, index * slice_size, (index + 1) * slice_size - 1, flight,
+                             &sl->total);
+            inflight_finish(inflight_table, flight, FLIGHT_FAILED);
         } else {
-            cache_meta_t meta;
-            memset(&meta, 0, sizeof(meta));
-            meta.stored_at = time(NULL);
-            update_meta_from_response(&meta, info);
-
-            pthread_mutex_lock(&cache_mutex);
-            cache_meta_write(meta_path, &meta);
-            pthread_mutex_unlock(&cache_mutex);
+            off_t written;
+            inflight_wait_data(flight, (off_t)LLONG_MAX, &written);
         }
+        inflight_leave(inflight_table, flight);
+        if (rc != 0) {
+            return rc == -2 ? -2 : 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Диапазон из кусков по -slice МБ: каждый кусок загружается с сервера
+ * отдельным запросом Range и кэшируется как отдельный объект, поэтому
+ * перемотка большого файла не тянет его целиком. 1 — кусками не вышло
+ * (сервер не поддерживает диапазоны или не совпал If-Range), запрос идёт
+ * обычным путём.
+ */
+static int serve_slices(client_t *cl, const http_request_t *req, const proxy_config_t *cfg, const char *url) {
+    long long slice_size = cfg->slice_mb * 1024LL * 1024LL;
+    const byte_range_t *r = cl->range;
+    slice_t sl;
+    int rc = slice_open(cfg, req, url, r->first >= 0 ? r->first / slice_size : 0, slice_size, &sl);
+    if (rc == -2) {
+        cl->partial = 416;
+    } else if (rc != 0) {
+        return 1;
+    } else if (!client_plan_range(cl, sl.meta.etag, sl.meta.last_modified, sl.total)) {
+        slice_close(&sl);
+        return 1;
     }
 
+    char *head = NULL;
+    size_t head_len = 0;
+    long long total = sl.total;
+    if (build_range_header(cl, sl.head ? sl.head : "", sl.open ? sl.meta.header_len : 0, total,
+                           &head, &head_len) != 0 ||
+        send_all(cl->fd, head, head_len) != 0) {
+        free(head);
+        slice_close(&sl);
+        cl->keep_alive = 0;
+        return 0;
+    }
+    free(head);
+    if (cl->partial == 416) {
+        slice_close(&sl);
+        return 0;
+    }
+    log_msg(cfg, "INFO", "Диапазон %lld-%lld из кусков: %s", cl->skip, cl->skip + cl->left - 1, url);
+
+    char etag[sizeof(sl.meta.etag)];
+    copy_str(etag, sizeof(etag), sl.meta.etag);
+    long long pos = cl->skip;
+    long long end = cl->skip + cl->left;
+    while (pos < end) {
+        long long index = pos / slice_size;
+        if (!sl.open || sl.index != index) {
+            slice_close(&sl);
+            /* Объект сменился между кусками: отданное уже не склеить. */
+            if (slice_open(cfg, req, url, index, slice_size, &sl) != 0 || sl.total != total ||
+                strcmp(sl.meta.etag, etag) != 0) {
+                break;
+            }
+        }
+        long long in_slice = pos - sl.first;
+        long long n = sl.len - in_slice < end - pos ? sl.len - in_slice : end - pos;
+        if (in_slice < 0 || n <= 0) {
+            break;
+        }
+        off_t off = sl.disk.base + (off_t)sl.meta.header_len + (off_t)in_slice;
+        off_t stop = off + (off_t)n;
+        /* Последний кусок диапазона — конец тела: медленному клиенту его отдаёт цикл событий. */
+        if (pos + n == end) {
+            if (client_send_rest(cl, sl.disk.fd, off, stop) == 0) {
+                pos = end;
+            }
+            break;
+        }
+        long long started = timing_begin();
+        while (off < stop) {
+            ssize_t sent = sendfile(cl->fd, sl.disk.fd, &off, (size_t)(stop - off));
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                break;
+            }
+        }
+        timing_end(TIMING_CLIENT_SEND, started);
+        if (off < stop) {
+            break;
+        }
+        pos += n;
+    }
+    slice_close(&sl);
+    if (pos < end) {
+        cl->keep_alive = 0;
+    }
     return 0;
 }
 
-static int handle_get_request(int client_fd, const http_request_t *req, const proxy_config_t *cfg) {
+static int handle_get_request(client_t *cl, const http_request_t *req, const proxy_config_t *cfg) {
+    /* url — полный ключ объекта: нормализованный URL и значения заголовков из Vary. */
     char url[4096];
-    snprintf(url, sizeof(url), "http://%s:%d%s", req->host, req->port, req->path);
-
     char cache_path[PATH_MAX];
-    char meta_path[PATH_MAX];
     char key[32];
-    int cache_ready = build_cache_paths(cfg, url, cache_path, sizeof(cache_path), meta_path, sizeof(meta_path), key, sizeof(key)) == 0;
+    int cache_ready = cache_url_for_request(req, NULL, url, sizeof(url)) == 0 &&
+                      build_cache_paths(url, cache_path, sizeof(cache_path), key, sizeof(key)) == 0;
+    if (!cache_ready) {
+        snprintf(url, sizeof(url), "http://%s:%d%s", req->host, req->port, req->path);
+    }
 
     cache_meta_t meta;
+    memset(&meta, 0, sizeof(meta));
     int has_meta = 0;
 
+    byte_range_t range;
+    const char *range_value = find_header_value(req, "Range");
+    if (range_value && parse_range(range_value, &range) == 0) {
+        range.if_range = find_header_value(req, "If-Range");
+        cl->range = &range;
+    }
+
     if (cache_ready) {
-        if (try_serve_cache(cfg, cache_path, meta_path, &meta, &has_meta, client_fd)) {
+        cache_admission_record(cache_admission, cache_key_hash(key));
+        __atomic_add_fetch(&cache_stats.lookups, 1, __ATOMIC_RELAXED);
+        cache_stats_report(cfg);
+        if (try_serve_cache(cfg, req, url, key, cache_path, &meta, &has_meta, cl)) {
             return 0;
         }
     } else {
@@ -1082,209 +4484,739 @@ static int handle_get_request(int client_fd, const http_request_t *req, const pr
 
     log_msg(cfg, "INFO", "Кэш-промах: %s", url);
 
-    char cond_headers[512];
-    cond_headers[0] = '\0';
-    if (cache_ready && has_meta) {
-        if (meta.last_modified[0]) {
-            snprintf(cond_headers + strlen(cond_headers),
-                     sizeof(cond_headers) - strlen(cond_headers),
-                     "If-Modified-Since: %s\r\n", meta.last_modified);
-        }
-        if (meta.etag[0]) {
-            snprintf(cond_headers + strlen(cond_headers),
-                     sizeof(cond_headers) - strlen(cond_headers),
-                     "If-None-Match: %s\r\n", meta.etag);
+    if (cl->range && cache_ready && cfg->slice_mb > 0 && serve_slices(cl, req, cfg, url) == 0) {
+        return 0;
+    }
+    /*
+     * Диапазон с начала объекта (так начинают проигрыватели) загружает объект
+     * целиком в кэш, а клиент получает свою вырезку по мере загрузки.
+     * Перемотка в незакэшированный объект передаётся серверу как есть, без
+     * загрузки всего, что до неё.
+     */
+    if (cl->range && range.first != 0) {
+        cl->pass_range = 1;
+        log_msg(cfg, "DEBUG", "Диапазон передаётся серверу: %s", url);
+        return fetch_from_upstream(cl, req, cfg, url, key, cache_ready, cache_path, &meta, has_meta, NULL);
+    }
+
+    /* К серверу за одним URL идёт только первый промах, остальные ждут его загрузку. */
+    inflight_t *flight = NULL;
+    if (cache_ready) {
+        int leader = 0;
+        flight = inflight_join(inflight_table, key, &leader);
+        if (flight && !leader) {
+            log_msg(cfg, "INFO", "Ожидание идущей загрузки: %s", url);
+            int rc = follow_flight(cl, cfg, flight, key, url, cache_path);
+            inflight_leave(inflight_table, flight);
+            if (rc == 0) {
+                return 0;
+            }
+            flight = NULL;
         }
     }
 
+    int rc = fetch_from_upstream(cl, req, cfg, url, key, cache_ready, cache_path,
+                                 &meta, has_meta, flight);
+    inflight_finish(inflight_table, flight, FLIGHT_FAILED);
+    inflight_leave(inflight_table, flight);
+    return rc;
+}
+
+static int handle_post_request(client_t *cl, const http_request_t *req, const proxy_config_t *cfg) {
     char *forward_req = NULL;
     size_t forward_len = 0;
-    if (build_forward_request(req, cond_headers, &forward_req, &forward_len) != 0) {
-        send_simple_response(client_fd, 500, "Internal Server Error", "Ошибка формирования запроса\n");
+    if (build_forward_request(req, NULL, NULL, 1, &forward_req, &forward_len) != 0) {
+        send_error_response(cl, 500, "Internal Server Error", "Ошибка формирования запроса\n");
         return -1;
     }
 
-    char err[256];
-    int server_fd = connect_to_host(req->host, req->port, err, sizeof(err));
-    if (server_fd < 0) {
-        log_msg(cfg, "ERROR", "%s", err);
-        send_simple_response(client_fd, 502, "Bad Gateway", "Не удалось подключиться к серверу\n");
-        free(forward_req);
+    char err[512];
+    int server_fd = -1;
+    char *resp_buf = NULL;
+    size_t resp_len = 0;
+    size_t header_len = 0;
+    int rc = upstream_roundtrip(cfg, req, cl, forward_req, forward_len, &server_fd, &resp_buf,
+                                &resp_len, &header_len, err, sizeof(err));
+    free(forward_req);
+    if (rc != 0) {
+        report_upstream_error(cl, cfg, rc, err);
         return -1;
     }
 
-    if (send_all(server_fd, forward_req, forward_len) != 0) {
-        log_msg(cfg, "ERROR", "Ошибка отправки запроса на сервер");
-        send_simple_response(client_fd, 502, "Bad Gateway", "Ошибка отправки запроса\n");
-        free(forward_req);
+    http_response_info_t info;
+    if (parse_response_info(resp_buf, header_len, &info) != 0) {
+        free(resp_buf);
         close(server_fd);
+        send_error_response(cl, 502, "Bad Gateway", "Некорректный ответ сервера\n");
         return -1;
     }
-    free(forward_req);
 
-    char *resp_buf = NULL;
-    size_t resp_len = 0;
-    size_t header_len = 0;
-    if (recv_response_header(server_fd, &resp_buf, &resp_len, &header_len, err, sizeof(err)) != 0) {
-        log_msg(cfg, "ERROR", "Ошибка чтения ответа: %s", err);
-        send_simple_response(client_fd, 502, "Bad Gateway", "Ошибка чтения ответа\n");
+    body_reader_t br;
+    body_reader_init(&br, server_fd, &info, resp_buf + header_len, resp_len - header_len);
+
+    char framing[128];
+    client_choose_framing(cl, &info, framing, sizeof(framing));
+
+    char *client_header = NULL;
+    size_t client_header_len = 0;
+    if (build_client_response_header(resp_buf, header_len, info.chunked, framing,
+                                     &client_header, &client_header_len) != 0 ||
+        send_all(cl->fd, client_header, client_header_len) != 0) {
+        free(client_header);
+        free(resp_buf);
         close(server_fd);
+        cl->keep_alive = 0;
         return -1;
     }
+    free(client_header);
+
+    client_feed_t feed;
+    if (feed_open(&feed, cfg, cl, NULL, 0) == 0) {
+        int rc = relay_decoupled(&br, cl, &feed, feed.fd, NULL, spill_limit_bytes(cfg), cfg->read_timeout);
+        finish_upstream(req, server_fd, &info, &br);
+        if (rc != 0) {
+            set_client_nonblocking(cl->fd, 0);
+            close(feed.fd);
+            cl->keep_alive = 0;
+            timing_outcome(OUTCOME_ERROR);
+        } else if (feed_finish(&feed, cl, cfg->read_timeout) != 0) {
+            cl->keep_alive = 0;
+            timing_outcome(OUTCOME_ERROR);
+        }
+    } else {
+        if (relay_body(&br, cl, NULL) != 0 || client_end_body(cl) != 0) {
+            cl->keep_alive = 0;
+            timing_outcome(OUTCOME_ERROR);
+        }
+        finish_upstream(req, server_fd, &info, &br);
+    }
+    free(resp_buf);
+    return 0;
+}
 
-    http_response_info_t info;
-    if (parse_response_info(resp_buf, header_len, &info) != 0) {
-        free(resp_buf);
+static int tunnel_port_allowed(const proxy_config_t *cfg, int port) {
+    if (strcmp(cfg->tunnel_ports, "all") == 0) {
+        return 1;
+    }
+    const char *p = cfg->tunnel_ports;
+    while (*p) {
+        char *endp = NULL;
+        long n = strtol(p, &endp, 10);
+        if (endp == p) {
+            return 0;
+        }
+        if (n == port) {
+            return 1;
+        }
+        p = *endp == ',' ? endp + 1 : endp;
+    }
+    return 0;
+}
+
+/*
+ * CONNECT: подключается к серверу, отвечает 200 и отдаёт соединение циклу
+ * событий как туннель. Возвращает 1, если соединение стало туннелем.
+ */
+static int handle_connect_request(client_t *cl, const http_request_t *req, const proxy_config_t *cfg) {
+    if (!tunnel_port_allowed(cfg, req->port)) {
+        log_msg(cfg, "ERROR", "CONNECT на запрещённый порт: %s:%d", req->host, req->port);
+        send_error_response(cl, 403, "Forbidden", "Туннель на этот порт запрещён\n");
+        return 0;
+    }
+
+    char err[256];
+    int server_fd = connect_to_host(cfg, req->host, req->port, err, sizeof(err));
+    if (server_fd < 0) {
+        report_upstream_error(cl, cfg, server_fd == CONNECT_TIMEOUT ? UPSTREAM_ERR_TIMEOUT : UPSTREAM_ERR_CONNECT,
+                              err);
+        return 0;
+    }
+
+    static const char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    if (send_all(cl->fd, established, sizeof(established) - 1) != 0) {
+        close(server_fd);
+        return 0;
+    }
+    if (conn_tunnel(cl->conn, server_fd, req->url) != 0) {
+        log_msg(cfg, "ERROR", "Не удалось открыть туннель: %s", req->url);
         close(server_fd);
-        send_simple_response(client_fd, 502, "Bad Gateway", "Некорректный ответ сервера\n");
-        return -1;
+        return 0;
     }
+    log_msg(cfg, "INFO", "Туннель открыт: %s", req->url);
+    return 1;
+}
 
-    if (info.status_code == 304 && cache_ready && has_meta) {
-        log_msg(cfg, "INFO", "Кэш обновлён (304 Not Modified): %s", url);
-        update_meta_from_response(&meta, &info);
-        pthread_mutex_lock(&cache_mutex);
-        cache_meta_write(meta_path, &meta);
-        pthread_mutex_unlock(&cache_mutex);
+static int host_is(const char *host, const char *name, size_t name_len) {
+    return strlen(host) == name_len && strncasecmp(host, name, name_len) == 0;
+}
 
-        send_file(client_fd, cache_path);
-        free(resp_buf);
-        close(server_fd);
+/*
+ * Цель запроса — сам прокси: порт, на который пришло соединение, и адрес,
+ * на который оно пришло, localhost, имя машины или хост из -peer_name.
+ */
+static int is_self_target(const client_t *cl, const http_request_t *req, const proxy_config_t *cfg) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    char local[INET_ADDRSTRLEN];
+    if (getsockname(cl->fd, (struct sockaddr *)&addr, &addr_len) != 0 || addr.sin_family != AF_INET ||
+        req->port != ntohs(addr.sin_port) || !inet_ntop(AF_INET, &addr.sin_addr, local, sizeof(local))) {
         return 0;
     }
-
-    int allow_cache = (cache_ready && info.status_code == 200 && !info.no_store);
-    if (!allow_cache) {
-        log_msg(cfg, "DEBUG", "Ответ не кэшируется (код=%d)", info.status_code);
+    if (host_is(req->host, local, strlen(local)) || host_is(req->host, "localhost", 9)) {
+        return 1;
     }
+    char hostname[256];
+    if (gethostname(hostname, sizeof(hostname)) == 0 && host_is(req->host, hostname, strnlen(hostname, sizeof(hostname)))) {
+        return 1;
+    }
+    const char *colon = strrchr(cfg->peer_name, ':');
+    return colon && host_is(req->host, cfg->peer_name, (size_t)(colon - cfg->peer_name));
+}
 
-    forward_and_cache(server_fd, client_fd, cfg, cache_path, meta_path, &info,
-                      resp_buf, resp_len, header_len, allow_cache);
-
-    free(resp_buf);
-    close(server_fd);
-    return 0;
+/*
+ * Запрос к самому прокси, а не к серверу: путь path, а хост из Host или из
+ * абсолютного URL указывает на прокси. Тот же путь на любом другом сервере
+ * проксируется как обычно.
+ */
+static int is_internal_request(const client_t *cl, const http_request_t *req, const proxy_config_t *cfg,
+                               const char *path) {
+    return strcmp(req->path, path) == 0 && is_self_target(cl, req, cfg);
 }
 
-static int handle_post_request(int client_fd, const http_request_t *req, const proxy_config_t *cfg) {
-    char *forward_req = NULL;
-    size_t forward_len = 0;
-    if (build_forward_request(req, NULL, &forward_req, &forward_len) != 0) {
-        send_simple_response(client_fd, 500, "Internal Server Error", "Ошибка формирования запроса\n");
-        return -1;
+/* Дайджест своего кэша для соседа; If-None-Match с тем же ETag даёт 304 без тела. */
+static void handle_peer_digest(client_t *cl, const http_request_t *req, const proxy_config_t *cfg) {
+    char *body = NULL;
+    size_t len = 0;
+    char etag[32];
+    if (!peers || peers_local_digest(peers, &body, &len, etag, sizeof(etag)) != 0) {
+        send_error_response(cl, 404, "Not Found", "Дайджест недоступен\n");
+        return;
     }
-
-    char err[256];
-    int server_fd = connect_to_host(req->host, req->port, err, sizeof(err));
-    if (server_fd < 0) {
-        log_msg(cfg, "ERROR", "%s", err);
-        send_simple_response(client_fd, 502, "Bad Gateway", "Не удалось подключиться к серверу\n");
-        free(forward_req);
-        return -1;
+    const char *inm = find_header_value(req, "If-None-Match");
+    int same = inm && strcmp(inm, etag) == 0;
+    char header[256];
+    int n = same ? snprintf(header, sizeof(header), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nConnection: %s\r\n\r\n",
+                            etag, cl->keep_alive ? "keep-alive" : "close")
+                 : snprintf(header, sizeof(header),
+                            "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n"
+                            "ETag: %s\r\nConnection: %s\r\n\r\n",
+                            len, etag, cl->keep_alive ? "keep-alive" : "close");
+    struct iovec iov[2] = {{header, (size_t)n}, {body, same ? 0 : len}};
+    if (send_iov(cl->fd, iov, 2) != 0) {
+        cl->keep_alive = 0;
     }
+    const char *from = find_header_value(req, PEER_HEADER);
+    log_msg(cfg, "DEBUG", same ? "Дайджест не изменился: %s" : "Дайджест отдан: %s", from ? from : "?");
+    free(body);
+}
 
-    if (send_all(server_fd, forward_req, forward_len) != 0) {
-        log_msg(cfg, "ERROR", "Ошибка отправки запроса POST");
-        send_simple_response(client_fd, 502, "Bad Gateway", "Ошибка отправки запроса\n");
-        free(forward_req);
-        close(server_fd);
-        return -1;
-    }
-    free(forward_req);
+static void prom_head(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
 
-    if (req->body_len > 0) {
-        if (send_all(server_fd, req->body, req->body_len) != 0) {
-            log_msg(cfg, "ERROR", "Ошибка отправки тела POST");
-            send_simple_response(client_fd, 502, "Bad Gateway", "Ошибка отправки тела запроса\n");
-            close(server_fd);
-            return -1;
+/* Значение метки: обратная косая черта, кавычка и перевод строки экранируются. */
+static void prom_label(FILE *out, const char *value) {
+    for (const char *c = value; *c; c++) {
+        if (*c == '\\' || *c == '"') {
+            fputc('\\', out);
+            fputc(*c, out);
+        } else if (*c == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*c, out);
         }
     }
+}
 
-    char *resp_buf = NULL;
-    size_t resp_len = 0;
-    size_t header_len = 0;
-    if (recv_response_header(server_fd, &resp_buf, &resp_len, &header_len, err, sizeof(err)) != 0) {
-        log_msg(cfg, "ERROR", "Ошибка чтения ответа: %s", err);
-        send_simple_response(client_fd, 502, "Bad Gateway", "Ошибка чтения ответа\n");
-        close(server_fd);
-        return -1;
-    }
+static void prom_labeled(FILE *out, const char *name, const char *label, const char *value, double number) {
+    fprintf(out, "%s{%s=\"", name, label);
+    prom_label(out, value);
+    fprintf(out, "\"} %.17g\n", number);
+}
 
-    if (send_all(client_fd, resp_buf, header_len) != 0) {
-        free(resp_buf);
-        close(server_fd);
-        return -1;
+/*
+ * Состояние прокси в текстовом формате Prometheus: доли попаданий, объём
+ * кэша по дискам и в памяти, идущие запросы и загрузки, соседи и гистограммы
+ * этапов запроса. Счётчики читаются без блокировок, поэтому значения разных
+ * строк могут разойтись на запросы, которые идут прямо сейчас.
+ */
+static void handle_proxy_status(client_t *cl) {
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) {
+        send_error_response(cl, 500, "Internal Server Error", "Не удалось собрать состояние\n");
+        return;
+    }
+    unsigned long long lookups = __atomic_load_n(&cache_stats.lookups, __ATOMIC_RELAXED);
+    unsigned long long hits = __atomic_load_n(&cache_stats.hits, __ATOMIC_RELAXED);
+    unsigned long long hit_bytes = __atomic_load_n(&cache_stats.hit_bytes, __ATOMIC_RELAXED);
+    unsigned long long miss_bytes = __atomic_load_n(&cache_stats.miss_bytes, __ATOMIC_RELAXED);
+    prom_head(out, "proxy_requests_in_flight", "gauge", "Запросы, которые обрабатываются сейчас.");
+    fprintf(out, "proxy_requests_in_flight %d\n", __atomic_load_n(&cache_stats.active, __ATOMIC_RELAXED));
+    prom_head(out, "proxy_client_connections", "gauge", "Открытые соединения с клиентами, включая туннели.");
+    fprintf(out, "proxy_client_connections %zu\n", event_loops_conn_count());
+    prom_head(out, "proxy_worker_queue", "gauge", "Запросы с полученными заголовками, которые ждут свободного обработчика.");
+    fprintf(out, "proxy_worker_queue %zu\n", work_pool_queued(worker_pool));
+    prom_head(out, "proxy_cache_lookups_total", "counter", "Поиски в кэше.");
+    fprintf(out, "proxy_cache_lookups_total %llu\n", lookups);
+    prom_head(out, "proxy_cache_hits_total", "counter", "Ответы из кэша без обращения к серверу.");
+    fprintf(out, "proxy_cache_hits_total %llu\n", hits);
+    prom_head(out, "proxy_cache_hit_bytes_total", "counter", "Байты, отданные из кэша.");
+    fprintf(out, "proxy_cache_hit_bytes_total %llu\n", hit_bytes);
+    prom_head(out, "proxy_cache_miss_bytes_total", "counter", "Байты ответов, полученных с сервера или от соседа.");
+    fprintf(out, "proxy_cache_miss_bytes_total %llu\n", miss_bytes);
+    prom_head(out, "proxy_cache_hit_ratio", "gauge", "Доля попаданий среди поисков в кэше.");
+    fprintf(out, "proxy_cache_hit_ratio %.6f\n", lookups ? (double)hits / (double)lookups : 0.0);
+    prom_head(out, "proxy_cache_byte_hit_ratio", "gauge", "Доля байтов из кэша среди всех отданных.");
+    fprintf(out, "proxy_cache_byte_hit_ratio %.6f\n",
+            hit_bytes + miss_bytes ? (double)hit_bytes / (double)(hit_bytes + miss_bytes) : 0.0);
+    prom_head(out, "proxy_cache_writes_total", "counter", "Объекты, записанные в кэш.");
+    fprintf(out, "proxy_cache_writes_total %llu\n", __atomic_load_n(&cache_stats.writes, __ATOMIC_RELAXED));
+    prom_head(out, "proxy_cache_written_bytes_total", "counter", "Байты, записанные в кэш.");
+    fprintf(out, "proxy_cache_written_bytes_total %llu\n",
+            __atomic_load_n(&cache_stats.written_bytes, __ATOMIC_RELAXED));
+    if (cache_admission) {
+        prom_head(out, "proxy_cache_admission_total", "counter", "Решения допуска новых объектов в кэш.");
+        fprintf(out, "proxy_cache_admission_total{decision=\"admitted\"} %llu\n",
+                __atomic_load_n(&cache_admission->admitted, __ATOMIC_RELAXED));
+        fprintf(out, "proxy_cache_admission_total{decision=\"rejected\"} %llu\n",
+                __atomic_load_n(&cache_admission->rejected, __ATOMIC_RELAXED));
     }
 
-    size_t body_len = resp_len > header_len ? resp_len - header_len : 0;
-    if (body_len > 0) {
-        if (send_all(client_fd, resp_buf + header_len, body_len) != 0) {
-            free(resp_buf);
-            close(server_fd);
-            return -1;
-        }
+    time_t now = time(NULL);
+    prom_head(out, "proxy_cache_bytes", "gauge", "Объём объектов в каталоге кэша.");
+    for (int i = 0; i < cache_roots->count; i++) {
+        prom_labeled(out, "proxy_cache_bytes", "root", cache_roots->roots[i].dir,
+                     (double)cache_index_bytes(cache_roots->roots[i].index));
+    }
+    prom_head(out, "proxy_cache_objects", "gauge", "Объекты в каталоге кэша.");
+    for (int i = 0; i < cache_roots->count; i++) {
+        prom_labeled(out, "proxy_cache_objects", "root", cache_roots->roots[i].dir,
+                     (double)cache_index_count(cache_roots->roots[i].index));
+    }
+    prom_head(out, "proxy_cache_root_up", "gauge", "1, если каталог кэша в работе.");
+    for (int i = 0; i < cache_roots->count; i++) {
+        prom_labeled(out, "proxy_cache_root_up", "root", cache_roots->roots[i].dir,
+                     cache_root_usable(&cache_roots->roots[i], now));
+    }
+    prom_head(out, "proxy_cache_disk_pending", "gauge", "Дисковые операции каталога, которые идут сейчас.");
+    for (int i = 0; i < cache_roots->count; i++) {
+        prom_labeled(out, "proxy_cache_disk_pending", "root", cache_roots->roots[i].dir,
+                     __atomic_load_n(&cache_roots->roots[i].pending, __ATOMIC_RELAXED));
     }
 
-    char buf[IO_BUF_SIZE];
-    ssize_t n;
-    while ((n = recv(server_fd, buf, sizeof(buf), 0)) > 0) {
-        if (send_all(client_fd, buf, (size_t)n) != 0) {
-            break;
+    size_t hot_bytes = 0;
+    size_t hot_count = 0;
+    for (int i = 0; hot_cache && i < HOT_CACHE_SHARDS; i++) {
+        hot_bytes += __atomic_load_n(&hot_cache->shards[i].bytes, __ATOMIC_RELAXED);
+        hot_count += __atomic_load_n(&hot_cache->shards[i].count, __ATOMIC_RELAXED);
+    }
+    prom_head(out, "proxy_memory_cache_bytes", "gauge", "Объём кэша в памяти.");
+    fprintf(out, "proxy_memory_cache_bytes %zu\n", hot_bytes);
+    prom_head(out, "proxy_memory_cache_objects", "gauge", "Объекты в кэше в памяти.");
+    fprintf(out, "proxy_memory_cache_objects %zu\n", hot_count);
+    prom_head(out, "proxy_cache_fetches_in_flight", "gauge", "Загрузки объектов, которые идут сейчас.");
+    fprintf(out, "proxy_cache_fetches_in_flight %zu\n", __atomic_load_n(&inflight_table->active, __ATOMIC_RELAXED));
+    prom_head(out, "proxy_cache_collapsed_total", "counter", "Промахи, присоединившиеся к уже идущей загрузке.");
+    fprintf(out, "proxy_cache_collapsed_total %llu\n", __atomic_load_n(&inflight_table->followers, __ATOMIC_RELAXED));
+
+    if (peers) {
+        prom_head(out, "proxy_peer_up", "gauge", "1, если сосед в работе.");
+        for (int i = 0; i < peers->count; i++) {
+            prom_labeled(out, "proxy_peer_up", "peer", peers->peers[i].name,
+                         __atomic_load_n(&peers->peers[i].up, __ATOMIC_RELAXED));
         }
+        prom_head(out, "proxy_peer_fetches_total", "counter", "Объекты, загруженные у соседа.");
+        for (int i = 0; i < peers->count; i++) {
+            prom_labeled(out, "proxy_peer_fetches_total", "peer", peers->peers[i].name,
+                         (double)__atomic_load_n(&peers->peers[i].fetches, __ATOMIC_RELAXED));
+        }
+        prom_head(out, "proxy_peer_failures_total", "counter", "Неудачные загрузки у соседа.");
+        for (int i = 0; i < peers->count; i++) {
+            prom_labeled(out, "proxy_peer_failures_total", "peer", peers->peers[i].name,
+                         (double)__atomic_load_n(&peers->peers[i].failures, __ATOMIC_RELAXED));
+        }
+    }
+    metrics_write(&metrics, out);
+    if (fclose(out) != 0) {
+        free(body);
+        send_error_response(cl, 500, "Internal Server Error", "Не удалось собрать состояние\n");
+        return;
     }
 
-    free(resp_buf);
-    close(server_fd);
-    return 0;
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                     "Content-Length: %zu\r\nCache-Control: no-store\r\nConnection: %s\r\n\r\n",
+                     len, cl->keep_alive ? "keep-alive" : "close");
+    struct iovec iov[2] = {{header, (size_t)n}, {body, len}};
+    if (send_iov(cl->fd, iov, 2) != 0) {
+        cl->keep_alive = 0;
+    }
+    free(body);
 }
 
-static void *client_thread(void *arg) {
-    client_ctx_t *ctx = (client_ctx_t *)arg;
-    int fd = ctx->client_fd;
-    proxy_config_t *cfg = ctx->config;
-
+static int serve_request(conn_t *conn, const proxy_config_t *cfg) {
     http_request_t req;
     char err[256];
-    if (read_request(fd, &req, err, sizeof(err)) != 0) {
+    if (read_request(conn, &req, err, sizeof(err)) != 0) {
         log_msg(cfg, "ERROR", "Ошибка запроса: %s", err);
-        send_simple_response(fd, 400, "Bad Request", "Некорректный запрос\n");
-        close(fd);
-        free(ctx);
-        return NULL;
+        timing_outcome(OUTCOME_ERROR);
+        send_simple_response(conn->fd, 400, "Bad Request", "Некорректный запрос\n");
+        request_free(&req);
+        return 0;
     }
 
-    if (strcasecmp(req.method, "GET") == 0) {
-        handle_get_request(fd, &req, cfg);
+    client_t cl;
+    cl.fd = conn->fd;
+    cl.http11 = strcasecmp(req.version, "HTTP/1.1") == 0;
+    cl.keep_alive = client_wants_keep_alive(&req);
+    cl.chunked = 0;
+    cl.conn = conn;
+    cl.range = NULL;
+    cl.pass_range = 0;
+    cl.partial = 0;
+    cl.handed_off = 0;
+
+    /* Тело сверх лимита не читается вовсе: ответ 413, соединение закрывается. */
+    long long limit = max_body_bytes(cfg);
+    if (limit > 0 && req.content_length > limit) {
+        log_msg(cfg, "ERROR", "Тело запроса больше %lld МБ: %lld байт", cfg->max_body_mb, req.content_length);
+        send_error_response(&cl, 413, "Payload Too Large", "Слишком большое тело запроса\n");
+        request_free(&req);
+        return 0;
+    }
+    /* Тело не-POST запроса серверу не передаётся, но вычитывается, чтобы не сбить keep-alive. */
+    if (strcasecmp(req.method, "POST") != 0) {
+        int rc = send_request_body(&cl, &req, -1, limit);
+        if (rc != 0) {
+            report_upstream_error(&cl, cfg, rc, "тело запроса не прочитано");
+            request_free(&req);
+            return 0;
+        }
+    }
+
+    if (strcasecmp(req.method, "CONNECT") == 0) {
+        int tunneled = handle_connect_request(&cl, &req, cfg);
+        request_free(&req);
+        return tunneled ? -1 : 0;
+    }
+    /* Служебные запросы в метрики не попадают. */
+    if (strcasecmp(req.method, "GET") == 0 && is_internal_request(&cl, &req, cfg, PEER_DIGEST_PATH)) {
+        req_timing = NULL;
+        handle_peer_digest(&cl, &req, cfg);
+    } else if (strcasecmp(req.method, "GET") == 0 && is_internal_request(&cl, &req, cfg, PROXY_STATUS_PATH)) {
+        req_timing = NULL;
+        handle_proxy_status(&cl);
+    } else if (strcasecmp(req.method, "GET") == 0) {
+        handle_get_request(&cl, &req, cfg);
     } else if (strcasecmp(req.method, "POST") == 0) {
         log_msg(cfg, "INFO", "POST запрос: %s%s", req.host, req.path);
-        handle_post_request(fd, &req, cfg);
+        if (handle_post_request(&cl, &req, cfg) != 0) {
+            timing_outcome(OUTCOME_ERROR);
+        }
     } else {
-        send_simple_response(fd, 501, "Not Implemented", "Поддерживаются только GET и POST\n");
+        send_error_response(&cl, 501, "Not Implemented", "Поддерживаются только GET, POST и CONNECT\n");
     }
 
-    if (req.body) {
-        free(req.body);
+    request_free(&req);
+    return cl.handed_off ? -1 : cl.keep_alive;
+}
+
+/*
+ * Один запрос соединения. Замер идёт с начала разбора, поэтому ошибки
+ * разбора, POST и установка туннеля CONNECT попадают в метрики наравне с GET.
+ */
+static int handle_one_request(conn_t *conn, const proxy_config_t *cfg) {
+    req_timing_t timing;
+    req_timing_start(&timing);
+    req_timing = &timing;
+    __atomic_add_fetch(&cache_stats.active, 1, __ATOMIC_RELAXED);
+    int keep_alive = serve_request(conn, cfg);
+    __atomic_sub_fetch(&cache_stats.active, 1, __ATOMIC_RELAXED);
+    if (req_timing) {
+        metrics_record(&metrics, &timing);
     }
+    req_timing = NULL;
+    return keep_alive;
+}
 
-    close(fd);
-    free(ctx);
-    return NULL;
+/*
+ * Обрабатывает запросы соединения подряд, пока в буфере есть следующий
+ * (pipelining); затем возвращает keep-alive соединение в цикл событий.
+ * Соединение, ставшее туннелем или отдачей остатка тела, уже принадлежит
+ * циклу.
+ */
+static void handle_client_conn(conn_t *conn, void *arg) {
+    proxy_config_t *cfg = (proxy_config_t *)arg;
+    int keep_alive;
+    do {
+        keep_alive = handle_one_request(conn, cfg);
+    } while (keep_alive > 0 && conn_next_request(conn));
+
+    if (keep_alive < 0) {
+        return;
+    }
+    if (keep_alive) {
+        conn_release(conn);
+    } else {
+        conn_close(conn);
+    }
+}
+
+static void log_tunnel_done(const tunnel_stats_t *stats, void *arg) {
+    const proxy_config_t *cfg = (const proxy_config_t *)arg;
+    log_msg(cfg, "INFO", "Туннель закрыт%s: %s, клиент → сервер %llu байт, сервер → клиент %llu байт, %ld с",
+            stats->timed_out ? " по простою" : "", stats->target, stats->client_bytes, stats->server_bytes,
+            (long)(time(NULL) - stats->started));
+}
+
+static void raise_fd_limit(const proxy_config_t *cfg) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return;
+    }
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            return;
+        }
+    }
+    log_msg(cfg, "DEBUG", "Лимит файловых дескрипторов: %llu", (unsigned long long)rl.rlim_cur);
+}
+
+/* -cache_dir путь[:МБ]; без размера корень получает -cache_size. */
+static int parse_cache_dir(const char *arg, proxy_config_t *cfg) {
+    int n = cfg->cache_dir_count;
+    size_t len = strlen(arg);
+    long long mb = 0;
+    const char *colon = strrchr(arg, ':');
+    if (colon && colon[1] != '\0' && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+        mb = atoll(colon + 1);
+        len = (size_t)(colon - arg);
+        if (mb <= 0) {
+            return -1;
+        }
+    }
+    if (n >= CACHE_ROOTS_MAX || len == 0 || len >= sizeof(cfg->cache_dirs[n])) {
+        return -1;
+    }
+    memcpy(cfg->cache_dirs[n], arg, len);
+    cfg->cache_dirs[n][len] = '\0';
+    for (int i = 0; i < n; i++) {
+        if (strcmp(cfg->cache_dirs[i], cfg->cache_dirs[n]) == 0) {
+            return -1;
+        }
+    }
+    cfg->cache_dir_mb[n] = mb;
+    cfg->cache_dir_count++;
+    return 0;
 }
 
 int main(int argc, char **argv) {
     int port = 0;
     proxy_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
     cfg.debug = 0;
-    snprintf(cfg.cache_dir, sizeof(cfg.cache_dir), "./cache");
+    cfg.loop_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cfg.loop_threads <= 0) {
+        cfg.loop_threads = 1;
+    }
+    cfg.worker_threads = DEFAULT_WORKERS;
+    cfg.upstream_max_idle = DEFAULT_UPSTREAM_MAX_IDLE;
+    cfg.upstream_idle_timeout = DEFAULT_UPSTREAM_IDLE_TIMEOUT;
+    cfg.client_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT;
+    cfg.dns_threads = DEFAULT_DNS_THREADS;
+    cfg.dns_ttl = DEFAULT_DNS_TTL;
+    cfg.connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    cfg.first_byte_timeout = DEFAULT_FIRST_BYTE_TIMEOUT;
+    cfg.read_timeout = DEFAULT_READ_TIMEOUT;
+    cfg.mem_cache_mb = DEFAULT_MEM_CACHE_MB;
+    cfg.mem_object_kb = DEFAULT_MEM_OBJECT_KB;
+    cfg.cache_size_mb = DEFAULT_CACHE_SIZE_MB;
+    cfg.cache_objects = DEFAULT_CACHE_OBJECTS;
+    cfg.slab_object_kb = DEFAULT_SLAB_OBJECT_KB;
+    cfg.refresh_threads = DEFAULT_REFRESH_THREADS;
+    cfg.prefetch_percent = DEFAULT_PREFETCH_PERCENT;
+    cfg.max_body_mb = DEFAULT_MAX_BODY_MB;
+    cfg.spill_mb = DEFAULT_SPILL_MB;
+    cfg.tunnel_idle_timeout = DEFAULT_TUNNEL_IDLE;
+    snprintf(cfg.tunnel_ports, sizeof(cfg.tunnel_ports), "%s", DEFAULT_TUNNEL_PORTS);
+    cfg.slice_mb = DEFAULT_SLICE_MB;
+    cfg.admission = DEFAULT_ADMISSION;
+    cfg.disk_slow_ms = DEFAULT_DISK_SLOW_MS;
+    cfg.disk_queue = DEFAULT_DISK_QUEUE;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-cache_dir") == 0) {
+            if (i + 1 >= argc || parse_cache_dir(argv[i + 1], &cfg) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-loops") == 0 || strcmp(argv[i], "-workers") == 0) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            int n = atoi(argv[i + 1]);
+            if (n <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "-loops") == 0) {
+                cfg.loop_threads = n;
+            } else {
+                cfg.worker_threads = n;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-upstream_max") == 0 || strcmp(argv[i], "-upstream_idle") == 0) {
             if (i + 1 >= argc) {
                 usage(argv[0]);
                 return 1;
             }
-            snprintf(cfg.cache_dir, sizeof(cfg.cache_dir), "%s", argv[++i]);
+            int n = atoi(argv[i + 1]);
+            if (n < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "-upstream_max") == 0) {
+                cfg.upstream_max_idle = n;
+            } else {
+                cfg.upstream_idle_timeout = n;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-client_idle") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.client_idle_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-dns_threads") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.dns_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-dns_ttl") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.dns_ttl = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-connect_timeout") == 0 || strcmp(argv[i], "-first_byte_timeout") == 0 ||
+                   strcmp(argv[i], "-read_timeout") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            int n = atoi(argv[i + 1]);
+            if (strcmp(argv[i], "-connect_timeout") == 0) {
+                cfg.connect_timeout = n;
+            } else if (strcmp(argv[i], "-first_byte_timeout") == 0) {
+                cfg.first_byte_timeout = n;
+            } else {
+                cfg.read_timeout = n;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-mem_cache") == 0 || strcmp(argv[i], "-mem_object") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "-mem_cache") == 0) {
+                cfg.mem_cache_mb = atoi(argv[i + 1]);
+            } else {
+                cfg.mem_object_kb = atoi(argv[i + 1]);
+            }
+            i++;
+        } else if (strcmp(argv[i], "-cache_size") == 0 || strcmp(argv[i], "-cache_objects") == 0) {
+            if (i + 1 >= argc || atoll(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "-cache_size") == 0) {
+                cfg.cache_size_mb = atoll(argv[i + 1]);
+            } else {
+                cfg.cache_objects = atoll(argv[i + 1]);
+            }
+            i++;
+        } else if (strcmp(argv[i], "-slab_object") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.slab_object_kb = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-refresh_threads") == 0 || strcmp(argv[i], "-prefetch") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "-refresh_threads") == 0) {
+                cfg.refresh_threads = atoi(argv[i + 1]);
+            } else {
+                cfg.prefetch_percent = atoi(argv[i + 1]);
+            }
+            i++;
+        } else if (strcmp(argv[i], "-max_body") == 0) {
+            if (i + 1 >= argc || atoll(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.max_body_mb = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "-spill") == 0) {
+            if (i + 1 >= argc || atoll(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.spill_mb = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "-tunnel_idle") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.tunnel_idle_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-tunnel_ports") == 0) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            snprintf(cfg.tunnel_ports, sizeof(cfg.tunnel_ports), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-slice") == 0) {
+            if (i + 1 >= argc || atoll(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.slice_mb = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "-admission") == 0) {
+            if (i + 1 >= argc || (strcmp(argv[i + 1], "tinylfu") != 0 && strcmp(argv[i + 1], "all") != 0)) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.admission = strcmp(argv[++i], "tinylfu") == 0;
+        } else if (strcmp(argv[i], "-peers") == 0 || strcmp(argv[i], "-peer_name") == 0) {
+            if (i + 1 >= argc || strlen(argv[i + 1]) >= PEER_NAME_MAX ||
+                (strcmp(argv[i], "-peers") == 0 && strlen(argv[i + 1]) >= sizeof(cfg.peers))) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "-peers") == 0) {
+                snprintf(cfg.peers, sizeof(cfg.peers), "%s", argv[++i]);
+            } else {
+                snprintf(cfg.peer_name, sizeof(cfg.peer_name), "%s", argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-disk_slow") == 0 || strcmp(argv[i], "-disk_queue") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "-disk_slow") == 0) {
+                cfg.disk_slow_ms = atoi(argv[i + 1]);
+            } else {
+                cfg.disk_queue = atoi(argv[i + 1]);
+            }
+            i++;
         } else if (strcmp(argv[i], "-d") == 0) {
             cfg.debug = 1;
         } else if (port == 0) {
@@ -1300,10 +5232,25 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    if (ensure_cache_dir(cfg.cache_dir) != 0) {
-        fprintf(stderr, "Не удалось создать каталог кэша: %s\n", cfg.cache_dir);
-        return 1;
+    if (cfg.cache_dir_count == 0) {
+        snprintf(cfg.cache_dirs[0], sizeof(cfg.cache_dirs[0]), "./cache");
+        cfg.cache_dir_count = 1;
     }
+    long long root_bytes[CACHE_ROOTS_MAX];
+    long long total_bytes = 0;
+    int migrated[CACHE_ROOTS_MAX];
+    for (int i = 0; i < cfg.cache_dir_count; i++) {
+        migrated[i] = ensure_cache_dir(cfg.cache_dirs[i]) == 0 ? cache_root_prepare(cfg.cache_dirs[i]) : -1;
+        if (migrated[i] < 0) {
+            fprintf(stderr, "Не удалось создать каталог кэша: %s\n", cfg.cache_dirs[i]);
+            return 1;
+        }
+        root_bytes[i] = (cfg.cache_dir_mb[i] > 0 ? cfg.cache_dir_mb[i] : cfg.cache_size_mb) * 1024 * 1024;
+        total_bytes += root_bytes[i];
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit(&cfg);
 
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) {
@@ -1326,44 +5273,210 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    if (listen(listen_fd, 64) != 0) {
+    if (listen(listen_fd, SOMAXCONN) != 0) {
         perror("listen");
         close(listen_fd);
         return 1;
     }
 
     log_msg(&cfg, "INFO", "HTTP Proxy запущен на порту %d", port);
-    log_msg(&cfg, "INFO", "Каталог кэша: %s", cfg.cache_dir);
 
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            if (errno == EINTR) {
-                continue;
+    upstream_pool = upstream_pool_create(cfg.upstream_max_idle, cfg.upstream_idle_timeout);
+    if (!upstream_pool) {
+        fprintf(stderr, "Не удалось создать пул соединений с серверами\n");
+        close(listen_fd);
+        return 1;
+    }
+
+    cache_roots = cache_roots_create(cfg.cache_dir_count, cfg.cache_dirs, root_bytes, cfg.disk_slow_ms,
+                                     cfg.disk_queue, cache_root_down, &cfg);
+    if (!cache_roots) {
+        fprintf(stderr, "Не удалось создать кольцо корней кэша\n");
+        close(listen_fd);
+        return 1;
+    }
+    for (int i = 0; i < cache_roots->count; i++) {
+        cache_root_t *root = &cache_roots->roots[i];
+        root->index = cache_index_create();
+        if (!root->index) {
+            fprintf(stderr, "Не удалось создать индекс кэша\n");
+            close(listen_fd);
+            return 1;
+        }
+        root->slab = slab_store_open(root->dir, root->index, (size_t)cfg.slab_object_kb * 1024);
+        if (!root->slab) {
+            fprintf(stderr, "Не удалось открыть сегменты кэша: %s\n", root->dir);
+            close(listen_fd);
+            return 1;
+        }
+        size_t in_segments = cache_index_count(root->index);
+        root->journal = cache_journal_open(root->dir, root->index, cache_resolve_conflict, root);
+        if (!root->journal) {
+            fprintf(stderr, "Не удалось открыть журнал метаданных кэша: %s\n", root->dir);
+            close(listen_fd);
+            return 1;
+        }
+        size_t in_files = root->journal->loaded;
+        if (root->journal->fresh) {
+            in_files = cache_index_load(root);
+            if (in_files > 0 && cache_journal_checkpoint(root->journal) != 0) {
+                log_msg(&cfg, "ERROR", "Не удалось записать снимок индекса кэша: %s", root->dir);
             }
-            perror("accept");
-            break;
         }
+        log_msg(&cfg, "INFO", "Каталог кэша: %s, %lld МБ, объектов: %zu (в сегментах: %zu, сегментов: %zu)",
+                root->dir, root->max_bytes / (1024 * 1024), in_files + in_segments, in_segments,
+                slab_store_count(root->slab));
+        if (migrated[i] > 0) {
+            log_msg(&cfg, "INFO", "Файлов перенесено в подкаталоги: %d", migrated[i]);
+        }
+    }
 
-        client_ctx_t *ctx = (client_ctx_t *)malloc(sizeof(client_ctx_t));
-        if (!ctx) {
-            close(client_fd);
-            continue;
+    /* Имена из Vary общие для всех корней и хранятся в первом. */
+    vary_table = vary_table_open(cache_roots->roots[0].dir);
+    if (!vary_table) {
+        fprintf(stderr, "Не удалось создать таблицу Vary\n");
+        close(listen_fd);
+        return 1;
+    }
+    if (vary_table->loaded > 0) {
+        log_msg(&cfg, "INFO", "URL с Vary: %zu", vary_table->loaded);
+    }
+
+    dns_cache = dns_cache_create(cfg.dns_threads, cfg.dns_ttl);
+    if (!dns_cache) {
+        fprintf(stderr, "Не удалось создать кэш DNS\n");
+        close(listen_fd);
+        return 1;
+    }
+    addr_health = addr_health_create();
+    if (!addr_health) {
+        fprintf(stderr, "Не удалось создать таблицу недоступных адресов\n");
+        close(listen_fd);
+        return 1;
+    }
+
+    hot_cache = hot_cache_create((size_t)cfg.mem_cache_mb * 1024 * 1024, (size_t)cfg.mem_object_kb * 1024);
+    if (!hot_cache) {
+        fprintf(stderr, "Не удалось создать кэш в памяти\n");
+        close(listen_fd);
+        return 1;
+    }
+
+    /* Лимит числа объектов делится между корнями пропорционально их объёму. */
+    for (int i = 0; i < cache_roots->count; i++) {
+        cache_root_t *root = &cache_roots->roots[i];
+        if (cfg.cache_objects > 0) {
+            root->max_objects = total_bytes > 0 ? (cfg.cache_objects * (root->max_bytes / 1024) +
+                                                   total_bytes / 1024 - 1) / (total_bytes / 1024)
+                                                : (cfg.cache_objects + cache_roots->count - 1) / cache_roots->count;
+        }
+        root->evictor = cache_evictor_create(root->index, hot_cache, root->slab, root->journal, root->dir,
+                                             root->max_bytes, root->max_objects);
+        if (!root->evictor) {
+            fprintf(stderr, "Не удалось запустить вытеснение кэша: %s\n", root->dir);
+            close(listen_fd);
+            return 1;
+        }
+    }
+    log_msg(&cfg, "INFO", "Лимит кэша: %lld МБ, %lld объектов (0 — без ограничения), дисков: %d",
+            total_bytes / (1024 * 1024), cfg.cache_objects, cache_roots->count);
+
+    /* Без лимитов кэш никогда не вытесняет, и допускать есть всех. */
+    if (cfg.admission && (total_bytes > 0 || cfg.cache_objects > 0)) {
+        long long expected = total_bytes / ADMISSION_AVG_OBJECT;
+        if (cfg.cache_objects > 0 && (expected == 0 || cfg.cache_objects < expected)) {
+            expected = cfg.cache_objects;
         }
-        ctx->client_fd = client_fd;
-        ctx->config = &cfg;
+        cache_admission = cache_admission_create((size_t)expected);
+        if (!cache_admission) {
+            fprintf(stderr, "Не удалось создать счётчики допуска в кэш\n");
+            close(listen_fd);
+            return 1;
+        }
+        log_msg(&cfg, "INFO", "Допуск в кэш: TinyLFU, счётчиков в строке: %zu", cache_admission->width);
+    }
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, client_thread, ctx) != 0) {
-            close(client_fd);
-            free(ctx);
-            continue;
+    inflight_table = inflight_table_create();
+    if (!inflight_table) {
+        fprintf(stderr, "Не удалось создать таблицу загрузок\n");
+        close(listen_fd);
+        return 1;
+    }
+
+    /* Имя по умолчанию годится для нескольких прокси на одной машине. */
+    if (cfg.peers[0]) {
+        if (!cfg.peer_name[0]) {
+            snprintf(cfg.peer_name, sizeof(cfg.peer_name), "127.0.0.1:%d", port);
         }
-        pthread_detach(tid);
+        peers = peers_create(cfg.peer_name, cfg.peers, peers_collect, peer_changed, &cfg);
+        if (!peers) {
+            fprintf(stderr, "Не удалось запустить режим соседей: %s\n", cfg.peers);
+            close(listen_fd);
+            return 1;
+        }
+        log_msg(&cfg, "INFO", "Режим соседей: %s, соседей: %d", cfg.peer_name, peers->count);
+    }
+
+    /* Клиент /dev/null у фонового обновления и у загрузки кусков. */
+    discard_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (discard_fd < 0) {
+        fprintf(stderr, "Не удалось открыть /dev/null\n");
+        close(listen_fd);
+        return 1;
+    }
+    /* Без потоков обновления устаревший объект проверяется синхронно, как раньше. */
+    if (cfg.refresh_threads > 0) {
+        refresh_pool = work_pool_create(cfg.refresh_threads);
+        if (!refresh_pool) {
+            fprintf(stderr, "Не удалось создать пул фонового обновления\n");
+            close(listen_fd);
+            return 1;
+        }
+    }
+
+    worker_pool = work_pool_create(cfg.worker_threads);
+    if (!worker_pool) {
+        fprintf(stderr, "Не удалось создать пул обработчиков\n");
+        close(listen_fd);
+        return 1;
     }
 
+    event_loop_config_t loop_cfg;
+    memset(&loop_cfg, 0, sizeof(loop_cfg));
+    loop_cfg.listen_fd = listen_fd;
+    loop_cfg.loop_count = cfg.loop_threads;
+    loop_cfg.idle_timeout = cfg.client_idle_timeout;
+    loop_cfg.tunnel_idle_timeout = cfg.tunnel_idle_timeout;
+    loop_cfg.client_recv_timeout = cfg.client_idle_timeout;
+    loop_cfg.client_send_timeout = cfg.read_timeout;
+    loop_cfg.max_header_size = MAX_HEADER_SIZE;
+    loop_cfg.pool = worker_pool;
+    loop_cfg.handler = handle_client_conn;
+    loop_cfg.handler_arg = &cfg;
+    loop_cfg.tunnel_done = log_tunnel_done;
+
+    if (event_loops_start(&loop_cfg) != 0) {
+        fprintf(stderr, "Не удалось запустить циклы событий: %s\n", strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+    log_msg(&cfg, "INFO", "Циклов событий: %d, обработчиков: %d", cfg.loop_threads, cfg.worker_threads);
+    log_msg(&cfg, "INFO", "Таймауты сервера: подключение %d с, первый байт %d с, чтение %d с",
+            cfg.connect_timeout, cfg.first_byte_timeout, cfg.read_timeout);
+
+    event_loops_wait();
+
+    work_pool_destroy(worker_pool);
+    work_pool_destroy(refresh_pool);
+    upstream_pool_destroy(upstream_pool);
+    dns_cache_destroy(dns_cache);
+    addr_health_destroy(addr_health);
+    peers_destroy(peers);
+    vary_table_close(vary_table);
+    cache_roots_destroy(cache_roots);
+    cache_admission_destroy(cache_admission);
+    hot_cache_destroy(hot_cache);
+    inflight_table_destroy(inflight_table);
     close(listen_fd);
     return 0;
 }
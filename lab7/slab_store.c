@@ -0,0 +1,787 @@
+#define _GNU_SOURCE
+#include "slab_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLAB_MAX_IOV 6
+
+typedef struct {
+    uint32_t magic;
+    uint32_t segment;
+    uint64_t count;
+} slab_index_header_t;
+
+typedef struct {
+    off_t offset;
+    slab_record_t header;
+} slab_index_entry_t;
+
+/* Победители по ключам при загрузке: запись с наибольшим seq. */
+typedef struct {
+    uint64_t hash;
+    uint64_t seq;
+    cache_loc_t loc;
+    uint32_t type;
+    int used;
+} load_slot_t;
+
+typedef struct {
+    load_slot_t *slots;
+    size_t cap;
+    size_t count;
+} load_map_t;
+
+static size_t record_length(size_t data_len) {
+    return (sizeof(slab_record_t) + data_len + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+}
+
+static uint32_t checksum_update(uint32_t h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void segment_path(const slab_store_t *store, uint32_t id, const char *suffix, char *out, size_t out_sz) {
+    snprintf(out, out_sz, "%s/%08x%s", store->dir, id, suffix);
+}
+
+static void segment_unref(slab_segment_t *seg) {
+    if (__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(seg->fd);
+        free(seg->entries);
+        free(seg);
+    }
+}
+
+static int entries_push(slab_segment_t *seg, const slab_entry_t *e) {
+    if (seg->count == seg->cap) {
+        size_t new_cap = seg->cap ? seg->cap * 2 : 256;
+        slab_entry_t *ne = (slab_entry_t *)realloc(seg->entries, new_cap * sizeof(*ne));
+        if (!ne) {
+            return -1;
+        }
+        seg->entries = ne;
+        seg->cap = new_cap;
+    }
+    seg->entries[seg->count++] = *e;
+    return 0;
+}
+
+static slab_segment_t *segment_open(slab_store_t *store, uint32_t id, int create) {
+    char path[PATH_MAX + 32];
+    segment_path(store, id, ".seg", path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (create && posix_fallocate(fd, 0, SLAB_SEGMENT_SIZE) != 0) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    slab_segment_t *seg = (slab_segment_t *)calloc(1, sizeof(slab_segment_t));
+    if (!seg) {
+        close(fd);
+        if (create) {
+            unlink(path);
+        }
+        return NULL;
+    }
+    seg->id = id;
+    seg->fd = fd;
+    seg->refs = 1;
+    return seg;
+}
+
+/* Ссылку таблицы держит сам сегмент с refs = 1 после segment_open. */
+static int table_insert(slab_store_t *store, slab_segment_t *seg) {
+    pthread_rwlock_wrlock(&store->table_lock);
+    slab_segment_t **slot = &store->slots[seg->id % SLAB_SLOTS];
+    if (*slot) {
+        pthread_rwlock_unlock(&store->table_lock);
+        return -1;
+    }
+    *slot = seg;
+    if (store->newest) {
+        store->newest->next = seg;
+    } else {
+        store->oldest = seg;
+    }
+    store->newest = seg;
+    pthread_rwlock_unlock(&store->table_lock);
+    return 0;
+}
+
+static void table_remove(slab_store_t *store, slab_segment_t *seg) {
+    pthread_rwlock_wrlock(&store->table_lock);
+    store->slots[seg->id % SLAB_SLOTS] = NULL;
+    slab_segment_t *prev = NULL;
+    for (slab_segment_t *s = store->oldest; s; prev = s, s = s->next) {
+        if (s == seg) {
+            if (prev) {
+                prev->next = seg->next;
+            } else {
+                store->oldest = seg->next;
+            }
+            if (store->newest == seg) {
+                store->newest = prev;
+            }
+            break;
+        }
+    }
+    seg->next = NULL;
+    pthread_rwlock_unlock(&store->table_lock);
+}
+
+static int pwrite_iov(int fd, struct iovec *iov, int count, off_t off) {
+    while (count > 0) {
+        ssize_t n = pwritev(fd, iov, count, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += n;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+static void gc_wake(slab_store_t *store) {
+    pthread_mutex_lock(&store->gc_mutex);
+    pthread_cond_signal(&store->gc_wake);
+    pthread_mutex_unlock(&store->gc_mutex);
+}
+
+/*
+ * Место под запись резервируется под append_mutex, а сама запись идёт через
+ * pwritev без блокировки, так что обработчики пишут в сегмент параллельно.
+ * keep_seq = 1 при переносе записи сборщиком: порядок версий не меняется.
+ */
+static int append_record(slab_store_t *store, slab_record_t *rec, const struct iovec *data, int datacnt,
+                         int keep_seq, cache_loc_t *loc) {
+    size_t len = record_length(rec->data_len);
+    if (len > SLAB_SEGMENT_SIZE || datacnt > SLAB_MAX_IOV) {
+        return -1;
+    }
+
+    int sealed = 0;
+    pthread_mutex_lock(&store->append_mutex);
+    slab_segment_t *seg = store->active;
+    if (!seg || seg->used + (off_t)len > SLAB_SEGMENT_SIZE) {
+        if (seg) {
+            seg->sealed = 1;
+            sealed = 1;
+        }
+        store->active = NULL;
+        seg = segment_open(store, store->next_id, 1);
+        if (seg && table_insert(store, seg) != 0) {
+            char path[PATH_MAX + 32];
+            segment_path(store, seg->id, ".seg", path, sizeof(path));
+            unlink(path);
+            segment_unref(seg);
+            seg = NULL;
+        }
+        if (!seg) {
+            pthread_mutex_unlock(&store->append_mutex);
+            return -1;
+        }
+        store->next_id++;
+        store->active = seg;
+    }
+    if (!keep_seq) {
+        rec->seq = ++store->seq;
+    }
+    slab_entry_t entry = {rec->hash, rec->seq, seg->used, (uint32_t)len, rec->type};
+    if (entries_push(seg, &entry) != 0) {
+        pthread_mutex_unlock(&store->append_mutex);
+        return -1;
+    }
+    off_t off = seg->used;
+    seg->used += (off_t)len;
+    seg->writers++;
+    __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&store->append_mutex);
+    if (sealed) {
+        gc_wake(store);
+    }
+
+    static const char pad[SLAB_ALIGN];
+    struct iovec iov[SLAB_MAX_IOV + 2];
+    int cnt = 0;
+    iov[cnt].iov_base = rec;
+    iov[cnt++].iov_len = sizeof(*rec);
+    for (int i = 0; i < datacnt; i++) {
+        if (data[i].iov_len > 0) {
+            iov[cnt++] = data[i];
+        }
+    }
+    size_t tail = len - sizeof(*rec) - rec->data_len;
+    if (tail > 0) {
+        iov[cnt].iov_base = (void *)pad;
+        iov[cnt++].iov_len = tail;
+    }
+    int rc = pwrite_iov(seg->fd, iov, cnt, off);
+
+    pthread_mutex_lock(&store->append_mutex);
+    seg->writers--;
+    pthread_mutex_unlock(&store->append_mutex);
+    if (rc == 0 && rec->type == SLAB_PUT) {
+        __atomic_add_fetch(&seg->live, (long long)len, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&store->appended, 1, __ATOMIC_RELAXED);
+    }
+    if (loc) {
+        loc->segment = (int)seg->id;
+        loc->length = (uint32_t)len;
+        loc->offset = off;
+    }
+    segment_unref(seg);
+    return rc;
+}
+
+int slab_store_fits(const slab_store_t *store, size_t size) {
+    return store && store->max_object > 0 && size <= store->max_object;
+}
+
+/* Записывает объект, собранный из iov (заголовки и тело), и возвращает его место. */
+int slab_store_put(slab_store_t *store, uint64_t hash, const cache_meta_t *meta,
+                   const struct iovec *iov, int iovcnt, cache_loc_t *loc) {
+    size_t data_len = 0;
+    uint32_t sum = 2166136261u;
+    for (int i = 0; i < iovcnt; i++) {
+        data_len += iov[i].iov_len;
+        sum = checksum_update(sum, iov[i].iov_base, iov[i].iov_len);
+    }
+    if (!slab_store_fits(store, data_len)) {
+        return -1;
+    }
+    slab_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = SLAB_RECORD_MAGIC;
+    rec.type = SLAB_PUT;
+    rec.hash = hash;
+    rec.data_len = (uint32_t)data_len;
+    rec.checksum = sum;
+    rec.meta = *meta;
+    return append_record(store, &rec, iov, iovcnt, 0, loc);
+}
+
+slab_segment_t *slab_store_acquire(slab_store_t *store, const cache_loc_t *loc) {
+    if (!store || loc->segment < 0) {
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&store->table_lock);
+    slab_segment_t *seg = store->slots[(uint32_t)loc->segment % SLAB_SLOTS];
+    if (seg && seg->id == (uint32_t)loc->segment) {
+        __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+    } else {
+        seg = NULL;
+    }
+    pthread_rwlock_unlock(&store->table_lock);
+    return seg;
+}
+
+void slab_store_release(slab_store_t *store, slab_segment_t *seg) {
+    (void)store;
+    if (seg) {
+        segment_unref(seg);
+    }
+}
+
+off_t slab_data_offset(const cache_loc_t *loc) {
+    return loc->offset + (off_t)sizeof(slab_record_t);
+}
+
+/* Запись заменена более новой: её место становится мусором. */
+void slab_store_forget(slab_store_t *store, const cache_loc_t *loc) {
+    slab_segment_t *seg = slab_store_acquire(store, loc);
+    if (seg) {
+        __atomic_sub_fetch(&seg->live, (long long)loc->length, __ATOMIC_RELAXED);
+        slab_store_release(store, seg);
+    }
+}
+
+/* Объект удалён из кэша: надгробие не даст старой записи ожить при загрузке. */
+int slab_store_delete(slab_store_t *store, uint64_t hash, const cache_loc_t *loc) {
+    slab_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = SLAB_RECORD_MAGIC;
+    rec.type = SLAB_DEL;
+    rec.hash = hash;
+    rec.checksum = 2166136261u;
+    int rc = append_record(store, &rec, NULL, 0, 0, NULL);
+    slab_store_forget(store, loc);
+    return rc;
+}
+
+size_t slab_store_count(slab_store_t *store) {
+    size_t n = 0;
+    pthread_rwlock_rdlock(&store->table_lock);
+    for (slab_segment_t *s = store->oldest; s; s = s->next) {
+        n++;
+    }
+    pthread_rwlock_unlock(&store->table_lock);
+    return n;
+}
+
+/* Файл .idx: заголовки всех записей закрытого сегмента с их смещениями. */
+static int write_index(slab_store_t *store, slab_segment_t *seg) {
+    size_t size = sizeof(slab_index_header_t) + seg->count * sizeof(slab_index_entry_t);
+    char *buf = (char *)malloc(size);
+    if (!buf) {
+        return -1;
+    }
+    slab_index_header_t *hdr = (slab_index_header_t *)buf;
+    hdr->magic = SLAB_INDEX_MAGIC;
+    hdr->segment = seg->id;
+    hdr->count = seg->count;
+    slab_index_entry_t *out = (slab_index_entry_t *)(hdr + 1);
+    for (size_t i = 0; i < seg->count; i++) {
+        out[i].offset = seg->entries[i].offset;
+        if (pread(seg->fd, &out[i].header, sizeof(out[i].header), seg->entries[i].offset) !=
+            (ssize_t)sizeof(out[i].header)) {
+            free(buf);
+            return -1;
+        }
+    }
+
+    char tmp[PATH_MAX + 32];
+    char path[PATH_MAX + 32];
+    segment_path(store, seg->id, ".idx.tmp", tmp, sizeof(tmp));
+    segment_path(store, seg->id, ".idx", path, sizeof(path));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int rc = -1;
+    if (fd >= 0) {
+        struct iovec iov = {buf, size};
+        rc = pwrite_iov(fd, &iov, 1, 0);
+        close(fd);
+        if (rc == 0) {
+            rc = rename(tmp, path);
+        }
+        if (rc != 0) {
+            unlink(tmp);
+        }
+    }
+    free(buf);
+    return rc;
+}
+
+/* Закрытые сегменты без .idx, в которые уже никто не дописывает. */
+static void write_pending_indexes(slab_store_t *store) {
+    slab_segment_t *todo[64];
+    int n = 0;
+    pthread_mutex_lock(&store->append_mutex);
+    pthread_rwlock_rdlock(&store->table_lock);
+    for (slab_segment_t *s = store->oldest; s && n < 64; s = s->next) {
+        if (s->sealed && !s->indexed && s->writers == 0) {
+            __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+            todo[n++] = s;
+        }
+    }
+    pthread_rwlock_unlock(&store->table_lock);
+    pthread_mutex_unlock(&store->append_mutex);
+
+    for (int i = 0; i < n; i++) {
+        if (write_index(store, todo[i]) == 0) {
+            todo[i]->indexed = 1;
+        }
+        segment_unref(todo[i]);
+    }
+}
+
+/*
+ * Самый старый закрытый сегмент, если доля мусора в закрытых сегментах выше
+ * порога. Берётся именно самый старый: тогда надгробия в нём больше не нужны,
+ * ведь более старых версий нигде не осталось.
+ */
+static slab_segment_t *gc_victim(slab_store_t *store) {
+    long long used = 0;
+    long long live = 0;
+    slab_segment_t *victim = NULL;
+    pthread_mutex_lock(&store->append_mutex);
+    pthread_rwlock_rdlock(&store->table_lock);
+    for (slab_segment_t *s = store->oldest; s; s = s->next) {
+        if (!s->sealed) {
+            continue;
+        }
+        used += s->used;
+        live += __atomic_load_n(&s->live, __ATOMIC_RELAXED);
+    }
+    slab_segment_t *oldest = store->oldest;
+    if (oldest && oldest->sealed && oldest->writers == 0 && used > 0 &&
+        (used - live) * 100 > (long long)SLAB_GC_PERCENT * used) {
+        __atomic_add_fetch(&oldest->refs, 1, __ATOMIC_RELAXED);
+        victim = oldest;
+    }
+    pthread_rwlock_unlock(&store->table_lock);
+    pthread_mutex_unlock(&store->append_mutex);
+    return victim;
+}
+
+/*
+ * Живые записи (на которые указывает индекс) дописываются в активный сегмент
+ * и индекс переключается на новое место; если объект успели заменить или
+ * удалить, копия сразу становится мусором. Читатель, получивший старое место,
+ * не сможет взять удалённый сегмент и перечитает индекс.
+ */
+static int compact_segment(slab_store_t *store, slab_segment_t *seg) {
+    int aborted = 0;
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    for (size_t i = 0; i < seg->count && !__atomic_load_n(&store->stop, __ATOMIC_RELAXED); i++) {
+        const slab_entry_t *e = &seg->entries[i];
+        if (e->type != SLAB_PUT) {
+            continue;
+        }
+        cache_loc_t from = {(int)seg->id, e->length, e->offset};
+        cache_loc_t cur;
+        if (cache_index_locate(store->index, e->hash, &cur) != 0 ||
+            cur.segment != from.segment || cur.offset != from.offset) {
+            continue;
+        }
+        if (e->length > buf_cap) {
+            char *nb = (char *)realloc(buf, e->length);
+            if (!nb) {
+                aborted = 1;
+                break;
+            }
+            buf = nb;
+            buf_cap = e->length;
+        }
+        if (pread(seg->fd, buf, e->length, e->offset) != (ssize_t)e->length) {
+            continue;
+        }
+        slab_record_t rec;
+        memcpy(&rec, buf, sizeof(rec));
+        if (rec.magic != SLAB_RECORD_MAGIC || rec.hash != e->hash) {
+            continue;
+        }
+        struct iovec iov = {buf + sizeof(rec), rec.data_len};
+        cache_loc_t to;
+        if (append_record(store, &rec, &iov, 1, 1, &to) != 0) {
+            aborted = 1;
+            break;
+        }
+        if (cache_index_relocate(store->index, e->hash, &from, &to) != 0) {
+            slab_store_forget(store, &to);
+        } else {
+            __atomic_add_fetch(&store->compacted, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buf);
+
+    if (aborted || __atomic_load_n(&store->stop, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    table_remove(store, seg);
+    char path[PATH_MAX + 32];
+    segment_path(store, seg->id, ".idx", path, sizeof(path));
+    unlink(path);
+    segment_path(store, seg->id, ".seg", path, sizeof(path));
+    unlink(path);
+    store->segments_freed++;
+    segment_unref(seg);
+    return 0;
+}
+
+static void *gc_main(void *arg) {
+    slab_store_t *store = (slab_store_t *)arg;
+    pthread_mutex_lock(&store->gc_mutex);
+    while (!store->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SLAB_GC_INTERVAL;
+        pthread_cond_timedwait(&store->gc_wake, &store->gc_mutex, &deadline);
+        if (store->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&store->gc_mutex);
+
+        write_pending_indexes(store);
+        slab_segment_t *victim;
+        while (!__atomic_load_n(&store->stop, __ATOMIC_RELAXED) && (victim = gc_victim(store)) != NULL) {
+            int rc = compact_segment(store, victim);
+            segment_unref(victim);
+            if (rc != 0) {
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&store->gc_mutex);
+    }
+    pthread_mutex_unlock(&store->gc_mutex);
+    return NULL;
+}
+
+static load_slot_t *map_slot(load_map_t *map, uint64_t hash) {
+    if ((map->count + 1) * 2 > map->cap) {
+        size_t new_cap = map->cap ? map->cap * 2 : 4096;
+        load_slot_t *ns = (load_slot_t *)calloc(new_cap, sizeof(*ns));
+        if (!ns) {
+            return NULL;
+        }
+        for (size_t i = 0; i < map->cap; i++) {
+            if (map->slots[i].used) {
+                size_t j = (size_t)map->slots[i].hash & (new_cap - 1);
+                while (ns[j].used) {
+                    j = (j + 1) & (new_cap - 1);
+                }
+                ns[j] = map->slots[i];
+            }
+        }
+        free(map->slots);
+        map->slots = ns;
+        map->cap = new_cap;
+    }
+    size_t j = (size_t)hash & (map->cap - 1);
+    while (map->slots[j].used && map->slots[j].hash != hash) {
+        j = (j + 1) & (map->cap - 1);
+    }
+    return &map->slots[j];
+}
+
+/* Применяет запись при загрузке; более старые версии ключа становятся мусором. */
+static void load_record(slab_store_t *store, load_map_t *map, slab_segment_t *seg,
+                        const slab_record_t *rec, off_t offset) {
+    uint32_t len = (uint32_t)record_length(rec->data_len);
+    slab_entry_t entry = {rec->hash, rec->seq, offset, len, rec->type};
+    if (entries_push(seg, &entry) != 0) {
+        return;
+    }
+    if (rec->seq > store->seq) {
+        store->seq = rec->seq;
+    }
+    load_slot_t *m = map_slot(map, rec->hash);
+    if (!m || (m->used && m->seq > rec->seq)) {
+        return;
+    }
+    if (m->used && m->type == SLAB_PUT) {
+        slab_segment_t *prev = store->slots[(uint32_t)m->loc.segment % SLAB_SLOTS];
+        if (prev) {
+            prev->live -= m->loc.length;
+        }
+    }
+    if (!m->used) {
+        map->count++;
+    }
+    m->used = 1;
+    m->hash = rec->hash;
+    m->seq = rec->seq;
+    m->type = rec->type;
+    m->loc.segment = (int)seg->id;
+    m->loc.length = len;
+    m->loc.offset = offset;
+    if (rec->type == SLAB_PUT) {
+        seg->live += len;
+        cache_index_put(store->index, rec->hash, &rec->meta, (off_t)rec->data_len, &m->loc);
+    } else {
+        cache_index_remove(store->index, rec->hash);
+    }
+}
+
+static int load_from_index(slab_store_t *store, load_map_t *map, slab_segment_t *seg) {
+    char path[PATH_MAX + 32];
+    segment_path(store, seg->id, ".idx", path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    slab_index_header_t hdr;
+    if (fstat(fd, &st) != 0 || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != SLAB_INDEX_MAGIC || hdr.segment != seg->id ||
+        (off_t)(sizeof(hdr) + hdr.count * sizeof(slab_index_entry_t)) != st.st_size) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)hdr.count * sizeof(slab_index_entry_t);
+    slab_index_entry_t *entries = (slab_index_entry_t *)malloc(size ? size : 1);
+    if (!entries || pread(fd, entries, size, sizeof(hdr)) != (ssize_t)size) {
+        free(entries);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    for (uint64_t i = 0; i < hdr.count; i++) {
+        const slab_record_t *rec = &entries[i].header;
+        if (rec->magic != SLAB_RECORD_MAGIC) {
+            continue;
+        }
+        load_record(store, map, seg, rec, entries[i].offset);
+        off_t end = entries[i].offset + (off_t)record_length(rec->data_len);
+        if (end > seg->used) {
+            seg->used = end;
+        }
+    }
+    free(entries);
+    seg->indexed = 1;
+    return 0;
+}
+
+/* Сегмент без .idx (был активным при остановке) читается подряд до первой неполной записи. */
+static void load_by_scan(slab_store_t *store, load_map_t *map, slab_segment_t *seg) {
+    char *data = NULL;
+    off_t off = 0;
+    while (off + (off_t)sizeof(slab_record_t) <= SLAB_SEGMENT_SIZE) {
+        slab_record_t rec;
+        if (pread(seg->fd, &rec, sizeof(rec), off) != (ssize_t)sizeof(rec) ||
+            rec.magic != SLAB_RECORD_MAGIC || (rec.type != SLAB_PUT && rec.type != SLAB_DEL) ||
+            off + (off_t)record_length(rec.data_len) > SLAB_SEGMENT_SIZE) {
+            break;
+        }
+        char *nd = (char *)realloc(data, rec.data_len ? rec.data_len : 1);
+        if (!nd) {
+            break;
+        }
+        data = nd;
+        if (pread(seg->fd, data, rec.data_len, off + (off_t)sizeof(rec)) != (ssize_t)rec.data_len ||
+            checksum_update(2166136261u, data, rec.data_len) != rec.checksum) {
+            break;
+        }
+        load_record(store, map, seg, &rec, off);
+        off += (off_t)record_length(rec.data_len);
+    }
+    free(data);
+    seg->used = off;
+}
+
+static int id_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Сегменты читаются по возрастанию номера. Последний сегмент без .idx
+ * продолжает дописываться, остальные считаются закрытыми.
+ */
+static void load_segments(slab_store_t *store) {
+    DIR *dir = opendir(store->dir);
+    if (!dir) {
+        return;
+    }
+    uint32_t *ids = NULL;
+    size_t n = 0;
+    size_t cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        char path[PATH_MAX + 32];
+        if (strstr(name, ".tmp")) {
+            snprintf(path, sizeof(path), "%s/%s", store->dir, name);
+            unlink(path);
+            continue;
+        }
+        if (strlen(name) != 12 || strcmp(name + 8, ".seg") != 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            uint32_t *ni = (uint32_t *)realloc(ids, cap * sizeof(*ni));
+            if (!ni) {
+                break;
+            }
+            ids = ni;
+        }
+        ids[n++] = (uint32_t)strtoul(name, NULL, 16);
+    }
+    closedir(dir);
+    if (n > 0) {
+        qsort(ids, n, sizeof(*ids), id_cmp);
+    }
+
+    load_map_t map;
+    memset(&map, 0, sizeof(map));
+    slab_segment_t *last = NULL;
+    for (size_t i = 0; i < n; i++) {
+        slab_segment_t *seg = segment_open(store, ids[i], 0);
+        if (!seg) {
+            continue;
+        }
+        if (table_insert(store, seg) != 0) {
+            segment_unref(seg);
+            continue;
+        }
+        if (load_from_index(store, &map, seg) != 0) {
+            load_by_scan(store, &map, seg);
+        }
+        seg->sealed = 1;
+        store->next_id = seg->id + 1;
+        last = seg;
+    }
+    if (last && !last->indexed && last->used < SLAB_SEGMENT_SIZE) {
+        last->sealed = 0;
+        store->active = last;
+    }
+    free(map.slots);
+    free(ids);
+}
+
+slab_store_t *slab_store_open(const char *cache_dir, cache_index_t *index, size_t max_object) {
+    slab_store_t *store = (slab_store_t *)calloc(1, sizeof(slab_store_t));
+    if (!store) {
+        return NULL;
+    }
+    int n = snprintf(store->dir, sizeof(store->dir), "%s/slab", cache_dir);
+    if (n < 0 || (size_t)n >= sizeof(store->dir) || (mkdir(store->dir, 0755) != 0 && errno != EEXIST)) {
+        free(store);
+        return NULL;
+    }
+    store->index = index;
+    store->max_object = max_object;
+    pthread_mutex_init(&store->append_mutex, NULL);
+    pthread_rwlock_init(&store->table_lock, NULL);
+    pthread_mutex_init(&store->gc_mutex, NULL);
+    pthread_cond_init(&store->gc_wake, NULL);
+    load_segments(store);
+    if (pthread_create(&store->gc_thread, NULL, gc_main, store) != 0) {
+        store->gc_thread = 0;
+        slab_store_close(store);
+        return NULL;
+    }
+    return store;
+}
+
+void slab_store_close(slab_store_t *store) {
+    if (!store) {
+        return;
+    }
+    if (store->gc_thread) {
+        pthread_mutex_lock(&store->gc_mutex);
+        __atomic_store_n(&store->stop, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&store->gc_wake);
+        pthread_mutex_unlock(&store->gc_mutex);
+        pthread_join(store->gc_thread, NULL);
+    }
+    slab_segment_t *s = store->oldest;
+    while (s) {
+        slab_segment_t *next = s->next;
+        segment_unref(s);
+        s = next;
+    }
+    pthread_mutex_destroy(&store->append_mutex);
+    pthread_rwlock_destroy(&store->table_lock);
+    pthread_mutex_destroy(&store->gc_mutex);
+    pthread_cond_destroy(&store->gc_wake);
+    free(store);
+}
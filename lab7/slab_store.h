@@ -0,0 +1,112 @@
+#ifndef SLAB_STORE_H
+#define SLAB_STORE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "cache_index.h"
+
+#define SLAB_SEGMENT_SIZE (32 * 1024 * 1024)
+#define SLAB_SLOTS 1024
+#define SLAB_ALIGN 16
+#define SLAB_GC_PERCENT 40
+#define SLAB_GC_INTERVAL 5
+#define SLAB_RECORD_MAGIC 0x424c5332u
+#define SLAB_INDEX_MAGIC 0x58444932u
+
+enum {
+    SLAB_PUT = 1,
+    SLAB_DEL = 2
+};
+
+/*
+ * Заголовок записи в сегменте. За ним идут data_len байт объекта (заголовки
+ * ответа и тело, как в файле .cache) и выравнивание до SLAB_ALIGN. seq растёт
+ * с каждой записью: при загрузке по ключу побеждает запись с наибольшим seq,
+ * а SLAB_DEL (без данных) скрывает более старые.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t hash;
+    uint64_t seq;
+    uint32_t data_len;
+    uint32_t checksum;
+    cache_meta_t meta;
+} slab_record_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t seq;
+    off_t offset;
+    uint32_t length;
+    uint32_t type;
+} slab_entry_t;
+
+/*
+ * Сегмент — заранее выделенный файл, куда записи только дописываются. Пока
+ * сегмент активен, список записей меняется под append_mutex хранилища; после
+ * закрытия (sealed) он неизменен. Ссылки держат читатели и таблица слотов;
+ * файл закрывается с последней ссылкой.
+ */
+typedef struct slab_segment {
+    uint32_t id;
+    int fd;
+    off_t used;
+    long long live;
+    int writers;
+    int sealed;
+    int indexed;
+    int refs;
+    slab_entry_t *entries;
+    size_t count;
+    size_t cap;
+    struct slab_segment *next;
+} slab_segment_t;
+
+/*
+ * Журнальное хранилище небольших объектов: вместо пары файлов на объект
+ * записи дописываются в общие сегменты по SLAB_SEGMENT_SIZE. У закрытого
+ * сегмента есть файл .idx с заголовками всех записей, поэтому при запуске
+ * читаются только они. Фоновый поток пишет .idx и, когда мусора в закрытых
+ * сегментах больше SLAB_GC_PERCENT, переносит живые записи самого старого
+ * сегмента в активный и удаляет его.
+ */
+typedef struct {
+    char dir[PATH_MAX];
+    cache_index_t *index;
+    size_t max_object;
+    uint64_t seq;
+    uint32_t next_id;
+    slab_segment_t *active;
+    slab_segment_t *slots[SLAB_SLOTS];
+    slab_segment_t *oldest;
+    slab_segment_t *newest;
+    pthread_mutex_t append_mutex;
+    pthread_rwlock_t table_lock;
+    pthread_mutex_t gc_mutex;
+    pthread_cond_t gc_wake;
+    pthread_t gc_thread;
+    int stop;
+    unsigned long long appended;
+    unsigned long long compacted;
+    unsigned long long segments_freed;
+} slab_store_t;
+
+slab_store_t *slab_store_open(const char *cache_dir, cache_index_t *index, size_t max_object);
+int slab_store_fits(const slab_store_t *store, size_t size);
+int slab_store_put(slab_store_t *store, uint64_t hash, const cache_meta_t *meta,
+                   const struct iovec *iov, int iovcnt, cache_loc_t *loc);
+void slab_store_forget(slab_store_t *store, const cache_loc_t *loc);
+int slab_store_delete(slab_store_t *store, uint64_t hash, const cache_loc_t *loc);
+slab_segment_t *slab_store_acquire(slab_store_t *store, const cache_loc_t *loc);
+void slab_store_release(slab_store_t *store, slab_segment_t *seg);
+off_t slab_data_offset(const cache_loc_t *loc);
+size_t slab_store_count(slab_store_t *store);
+void slab_store_close(slab_store_t *store);
+
+#endif
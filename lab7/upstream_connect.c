@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include "upstream_connect.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+addr_health_t *addr_health_create(void) {
+    addr_health_t *health = (addr_health_t *)calloc(1, sizeof(addr_health_t));
+    if (!health) {
+        return NULL;
+    }
+    pthread_mutex_init(&health->mutex, NULL);
+    return health;
+}
+
+void addr_health_destroy(addr_health_t *health) {
+    if (!health) {
+        return;
+    }
+    for (int b = 0; b < ADDR_HEALTH_BUCKETS; b++) {
+        addr_failure_t *f = health->buckets[b];
+        while (f) {
+            addr_failure_t *next = f->next;
+            free(f);
+            f = next;
+        }
+    }
+    pthread_mutex_destroy(&health->mutex);
+    free(health);
+}
+
+static unsigned bucket_of(const struct sockaddr_storage *sa, socklen_t len) {
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)sa;
+    for (socklen_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h % ADDR_HEALTH_BUCKETS;
+}
+
+static int is_dead(addr_health_t *health, const struct sockaddr_storage *sa, socklen_t len, time_t now) {
+    if (!health) {
+        return 0;
+    }
+    int dead = 0;
+    pthread_mutex_lock(&health->mutex);
+    for (addr_failure_t *f = health->buckets[bucket_of(sa, len)]; f; f = f->next) {
+        if (f->len == len && memcmp(&f->addr, sa, len) == 0) {
+            dead = f->dead_until > now;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&health->mutex);
+    return dead;
+}
+
+/* Попутно из корзины выбрасываются записи, срок которых давно прошёл. */
+static void mark_failed(addr_health_t *health, const struct sockaddr_storage *sa, socklen_t len) {
+    if (!health) {
+        return;
+    }
+    time_t now = time(NULL);
+    pthread_mutex_lock(&health->mutex);
+    addr_failure_t **pp = &health->buckets[bucket_of(sa, len)];
+    addr_failure_t *found = NULL;
+    while (*pp) {
+        addr_failure_t *f = *pp;
+        if (f->len == len && memcmp(&f->addr, sa, len) == 0) {
+            found = f;
+            pp = &f->next;
+        } else if (now - f->dead_until > ADDR_HEALTH_MAX_BACKOFF) {
+            *pp = f->next;
+            free(f);
+            health->count--;
+        } else {
+            pp = &f->next;
+        }
+    }
+    if (!found && health->count < ADDR_HEALTH_MAX) {
+        found = (addr_failure_t *)calloc(1, sizeof(addr_failure_t));
+        if (found) {
+            memcpy(&found->addr, sa, len);
+            found->len = len;
+            unsigned b = bucket_of(sa, len);
+            found->next = health->buckets[b];
+            health->buckets[b] = found;
+            health->count++;
+        }
+    }
+    if (found) {
+        long backoff = ADDR_HEALTH_BACKOFF;
+        for (int i = 0; i < found->failures && backoff < ADDR_HEALTH_MAX_BACKOFF; i++) {
+            backoff *= 2;
+        }
+        if (backoff > ADDR_HEALTH_MAX_BACKOFF) {
+            backoff = ADDR_HEALTH_MAX_BACKOFF;
+        }
+        found->failures++;
+        found->dead_until = now + backoff;
+    }
+    pthread_mutex_unlock(&health->mutex);
+}
+
+static void mark_alive(addr_health_t *health, const struct sockaddr_storage *sa, socklen_t len) {
+    if (!health) {
+        return;
+    }
+    pthread_mutex_lock(&health->mutex);
+    for (addr_failure_t **pp = &health->buckets[bucket_of(sa, len)]; *pp; pp = &(*pp)->next) {
+        addr_failure_t *f = *pp;
+        if (f->len == len && memcmp(&f->addr, sa, len) == 0) {
+            *pp = f->next;
+            free(f);
+            health->count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&health->mutex);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Порядок попыток: семейства чередуются, начиная с IPv6 (RFC 8305), а
+ * адреса, недавно не отвечавшие, уходят в конец — к ним обращаются, только
+ * если живые не подключились.
+ */
+static int order_addrs(addr_health_t *health, const dns_addrs_t *addrs, int port,
+                       struct sockaddr_storage *out, socklen_t *lens) {
+    struct sockaddr_storage v6[DNS_MAX_ADDRS];
+    struct sockaddr_storage v4[DNS_MAX_ADDRS];
+    socklen_t v6_len[DNS_MAX_ADDRS];
+    socklen_t v4_len[DNS_MAX_ADDRS];
+    int n6 = 0;
+    int n4 = 0;
+    for (int i = 0; i < addrs->count; i++) {
+        struct sockaddr_storage sa = addrs->addrs[i];
+        if (sa.ss_family == AF_INET6) {
+            ((struct sockaddr_in6 *)&sa)->sin6_port = htons((uint16_t)port);
+            v6[n6] = sa;
+            v6_len[n6++] = addrs->lens[i];
+        } else {
+            ((struct sockaddr_in *)&sa)->sin_port = htons((uint16_t)port);
+            v4[n4] = sa;
+            v4_len[n4++] = addrs->lens[i];
+        }
+    }
+
+    struct sockaddr_storage mixed[DNS_MAX_ADDRS];
+    socklen_t mixed_len[DNS_MAX_ADDRS];
+    int n = 0;
+    for (int i = 0; i < n6 || i < n4; i++) {
+        if (i < n6) {
+            mixed[n] = v6[i];
+            mixed_len[n++] = v6_len[i];
+        }
+        if (i < n4) {
+            mixed[n] = v4[i];
+            mixed_len[n++] = v4_len[i];
+        }
+    }
+
+    time_t now = time(NULL);
+    int dead[DNS_MAX_ADDRS];
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        dead[i] = is_dead(health, &mixed[i], mixed_len[i], now);
+        if (!dead[i]) {
+            out[count] = mixed[i];
+            lens[count++] = mixed_len[i];
+        }
+    }
+    if (health && count < n) {
+        __atomic_add_fetch(&health->skipped, (unsigned long long)(n - count), __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < n; i++) {
+        if (dead[i]) {
+            out[count] = mixed[i];
+            lens[count++] = mixed_len[i];
+        }
+    }
+    return count;
+}
+
+static int connect_error(int fd) {
+    int so_error = 0;
+    socklen_t len = sizeof(so_error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len) != 0) {
+        return errno;
+    }
+    return so_error;
+}
+
+/*
+ * Подключение в духе Happy Eyeballs: неблокирующие connect к адресам по
+ * очереди, следующая попытка стартует, если предыдущая не ответила за
+ * CONNECT_ATTEMPT_DELAY_MS или сразу после её ошибки; побеждает первое
+ * установленное соединение, остальные закрываются. Весь перебор ограничен
+ * timeout_ms (0 — без ограничения). Возвращает блокирующий сокет,
+ * CONNECT_FAILED или CONNECT_TIMEOUT; errno — причина последней неудачи.
+ */
+int upstream_connect(addr_health_t *health, const dns_addrs_t *addrs, int port, int timeout_ms) {
+    struct sockaddr_storage order[DNS_MAX_ADDRS];
+    socklen_t lens[DNS_MAX_ADDRS];
+    int n = order_addrs(health, addrs, port, order, lens);
+
+    struct pollfd pfd[DNS_MAX_ADDRS];
+    int which[DNS_MAX_ADDRS];
+    int active = 0;
+    int next = 0;
+    int winner = -1;
+    int last_error = EHOSTUNREACH;
+    long long start = now_ms();
+    long long deadline = timeout_ms > 0 ? start + timeout_ms : 0;
+    long long next_start = start;
+
+    while (winner < 0) {
+        long long now = now_ms();
+        if (next < n && (active == 0 || now >= next_start)) {
+            int i = next++;
+            int fd = socket(order[i].ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                last_error = errno;
+                continue;
+            }
+            if (connect(fd, (struct sockaddr *)&order[i], lens[i]) == 0) {
+                pfd[active].fd = fd;
+                which[active] = i;
+                winner = active++;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                last_error = errno;
+                close(fd);
+                mark_failed(health, &order[i], lens[i]);
+                continue;
+            }
+            pfd[active].fd = fd;
+            pfd[active].events = POLLOUT;
+            pfd[active].revents = 0;
+            which[active++] = i;
+            next_start = now + CONNECT_ATTEMPT_DELAY_MS;
+            continue;
+        }
+        if (active == 0) {
+            break;
+        }
+        if (deadline && now >= deadline) {
+            last_error = ETIMEDOUT;
+            break;
+        }
+
+        long long wait = deadline ? deadline - now : -1;
+        if (next < n && (wait < 0 || next_start - now < wait)) {
+            wait = next_start - now;
+        }
+        int rc = poll(pfd, (nfds_t)active, (int)wait);
+        if (rc < 0 && errno != EINTR) {
+            last_error = errno;
+            break;
+        }
+        for (int k = 0; rc > 0 && k < active; k++) {
+            if (pfd[k].revents == 0) {
+                continue;
+            }
+            int e = connect_error(pfd[k].fd);
+            if (e == 0) {
+                winner = k;
+                break;
+            }
+            /* Ошибка освобождает место: следующий адрес пробуется сразу. */
+            last_error = e;
+            close(pfd[k].fd);
+            mark_failed(health, &order[which[k]], lens[which[k]]);
+            pfd[k] = pfd[active - 1];
+            which[k] = which[active - 1];
+            active--;
+            k--;
+            next_start = now_ms();
+        }
+    }
+
+    int fd = -1;
+    for (int k = 0; k < active; k++) {
+        if (k == winner) {
+            fd = pfd[k].fd;
+            mark_alive(health, &order[which[k]], lens[which[k]]);
+            continue;
+        }
+        close(pfd[k].fd);
+        /*
+         * Адрес, начатый раньше победителя и обогнанный им, тоже считается
+         * неудачным: иначе каждое подключение ждало бы его лишние
+         * CONNECT_ATTEMPT_DELAY_MS. Начатые позже просто не успели.
+         */
+        if (winner < 0 || which[k] < which[winner]) {
+            mark_failed(health, &order[which[k]], lens[which[k]]);
+        }
+    }
+    if (fd < 0) {
+        errno = last_error;
+        return last_error == ETIMEDOUT ? CONNECT_TIMEOUT : CONNECT_FAILED;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+        close(fd);
+        return CONNECT_FAILED;
+    }
+    return fd;
+}
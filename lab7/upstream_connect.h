@@ -0,0 +1,47 @@
+#ifndef UPSTREAM_CONNECT_H
+#define UPSTREAM_CONNECT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "dns_cache.h"
+
+#define ADDR_HEALTH_BUCKETS 256
+#define ADDR_HEALTH_MAX 4096
+#define ADDR_HEALTH_BACKOFF 10
+#define ADDR_HEALTH_MAX_BACKOFF 300
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+enum {
+    CONNECT_FAILED = -1,
+    CONNECT_TIMEOUT = -2
+};
+
+/*
+ * Адрес (с портом), к которому не удалось подключиться. До dead_until он
+ * пропускается; каждая следующая неудача подряд удваивает срок, удачное
+ * подключение запись удаляет.
+ */
+typedef struct addr_failure {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int failures;
+    time_t dead_until;
+    struct addr_failure *next;
+} addr_failure_t;
+
+typedef struct {
+    addr_failure_t *buckets[ADDR_HEALTH_BUCKETS];
+    size_t count;
+    unsigned long long skipped;
+    pthread_mutex_t mutex;
+} addr_health_t;
+
+addr_health_t *addr_health_create(void);
+void addr_health_destroy(addr_health_t *health);
+
+int upstream_connect(addr_health_t *health, const dns_addrs_t *addrs, int port, int timeout_ms);
+
+#endif
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "upstream_pool.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void origin_key(const char *host, int port, char *out, size_t out_sz) {
+    size_t i = 0;
+    for (; host[i] && i + 1 < out_sz; i++) {
+        out[i] = (char)tolower((unsigned char)host[i]);
+    }
+    out[i] = '\0';
+    snprintf(out + i, out_sz - i, ":%d", port);
+}
+
+static unsigned bucket_of(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const char *p = key; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h % UPSTREAM_POOL_BUCKETS;
+}
+
+static upstream_origin_t **origin_slot(upstream_pool_t *pool, const char *key) {
+    upstream_origin_t **pp = &pool->buckets[bucket_of(key)];
+    while (*pp && strcmp((*pp)->key, key) != 0) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+static void drop_if_empty(upstream_origin_t **pp) {
+    upstream_origin_t *o = *pp;
+    if (!o->idle) {
+        *pp = o->next;
+        free(o);
+    }
+}
+
+/*
+ * Простаивающее соединение исправно, если сервер его не закрыл и не прислал
+ * ничего лишнего: recv с MSG_PEEK должен вернуть EAGAIN.
+ */
+static int idle_is_healthy(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void sweep_expired(upstream_pool_t *pool, time_t now) {
+    for (int b = 0; b < UPSTREAM_POOL_BUCKETS; b++) {
+        upstream_origin_t **op = &pool->buckets[b];
+        while (*op) {
+            upstream_origin_t *o = *op;
+            upstream_idle_t **pp = &o->idle;
+            while (*pp) {
+                upstream_idle_t *it = *pp;
+                if (now - it->idle_since >= pool->idle_timeout) {
+                    *pp = it->next;
+                    close(it->fd);
+                    free(it);
+                    o->idle_count--;
+                } else {
+                    pp = &it->next;
+                }
+            }
+            drop_if_empty(op);
+            if (*op == o) {
+                op = &o->next;
+            }
+        }
+    }
+}
+
+static void *sweeper_main(void *arg) {
+    upstream_pool_t *pool = (upstream_pool_t *)arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&pool->wake, &pool->mutex, &deadline);
+        if (!pool->stop) {
+            sweep_expired(pool, time(NULL));
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+upstream_pool_t *upstream_pool_create(int max_idle_per_host, int idle_timeout) {
+    upstream_pool_t *pool = (upstream_pool_t *)calloc(1, sizeof(upstream_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->max_idle_per_host = max_idle_per_host;
+    pool->idle_timeout = idle_timeout;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    if (max_idle_per_host > 0) {
+        if (pthread_create(&pool->sweeper, NULL, sweeper_main, pool) != 0) {
+            pthread_cond_destroy(&pool->wake);
+            pthread_mutex_destroy(&pool->mutex);
+            free(pool);
+            return NULL;
+        }
+        pool->sweeping = 1;
+    }
+    return pool;
+}
+
+int upstream_pool_acquire(upstream_pool_t *pool, const char *host, int port) {
+    if (!pool || pool->max_idle_per_host <= 0) {
+        return -1;
+    }
+    char key[300];
+    origin_key(host, port, key, sizeof(key));
+
+    pthread_mutex_lock(&pool->mutex);
+    upstream_origin_t **op = origin_slot(pool, key);
+    upstream_origin_t *o = *op;
+    int fd = -1;
+    while (o && o->idle) {
+        upstream_idle_t *it = o->idle;
+        o->idle = it->next;
+        o->idle_count--;
+        int candidate = it->fd;
+        free(it);
+        if (idle_is_healthy(candidate)) {
+            fd = candidate;
+            pool->reused++;
+            break;
+        }
+        close(candidate);
+    }
+    if (o) {
+        drop_if_empty(op);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return fd;
+}
+
+void upstream_pool_release(upstream_pool_t *pool, const char *host, int port, int fd) {
+    if (!pool || pool->max_idle_per_host <= 0) {
+        close(fd);
+        return;
+    }
+    char key[300];
+    origin_key(host, port, key, sizeof(key));
+
+    upstream_idle_t *it = (upstream_idle_t *)malloc(sizeof(upstream_idle_t));
+    if (!it) {
+        close(fd);
+        return;
+    }
+    it->fd = fd;
+    it->idle_since = time(NULL);
+
+    pthread_mutex_lock(&pool->mutex);
+    upstream_origin_t **op = origin_slot(pool, key);
+    if (!*op) {
+        *op = (upstream_origin_t *)calloc(1, sizeof(upstream_origin_t));
+        if (*op) {
+            snprintf((*op)->key, sizeof((*op)->key), "%s", key);
+        }
+    }
+    upstream_origin_t *o = *op;
+    if (!o || o->idle_count >= pool->max_idle_per_host) {
+        pthread_mutex_unlock(&pool->mutex);
+        close(fd);
+        free(it);
+        return;
+    }
+    /* LIFO: повторно берётся самое «свежее» соединение. */
+    it->next = o->idle;
+    o->idle = it;
+    o->idle_count++;
+    pool->parked++;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void upstream_pool_destroy(upstream_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    if (pool->sweeping) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->stop = 1;
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->mutex);
+        pthread_join(pool->sweeper, NULL);
+    }
+    for (int b = 0; b < UPSTREAM_POOL_BUCKETS; b++) {
+        upstream_origin_t *o = pool->buckets[b];
+        while (o) {
+            upstream_origin_t *next = o->next;
+            upstream_idle_t *it = o->idle;
+            while (it) {
+                upstream_idle_t *inext = it->next;
+                close(it->fd);
+                free(it);
+                it = inext;
+            }
+            free(o);
+            o = next;
+        }
+    }
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
@@ -0,0 +1,46 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#define UPSTREAM_POOL_BUCKETS 256
+
+typedef struct upstream_idle {
+    int fd;
+    time_t idle_since;
+    struct upstream_idle *next;
+} upstream_idle_t;
+
+typedef struct upstream_origin {
+    char key[300];
+    upstream_idle_t *idle;
+    int idle_count;
+    struct upstream_origin *next;
+} upstream_origin_t;
+
+/*
+ * В таблице только серверы, у которых есть простаивающие соединения: сервер,
+ * чей список опустел, удаляется. Просроченные соединения закрывает отдельный
+ * поток раз в секунду, а не тот, кто берёт соединение.
+ */
+typedef struct {
+    upstream_origin_t *buckets[UPSTREAM_POOL_BUCKETS];
+    int max_idle_per_host;
+    int idle_timeout;
+    unsigned long long reused;
+    unsigned long long parked;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_t sweeper;
+    int sweeping;
+    int stop;
+} upstream_pool_t;
+
+upstream_pool_t *upstream_pool_create(int max_idle_per_host, int idle_timeout);
+int upstream_pool_acquire(upstream_pool_t *pool, const char *host, int port);
+void upstream_pool_release(upstream_pool_t *pool, const char *host, int port, int fd);
+void upstream_pool_destroy(upstream_pool_t *pool);
+
+#endif
@@ -0,0 +1,139 @@
+#include "vary_table.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} vary_map_header_t;
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void load_map(vary_table_t *table) {
+    int fd = open(table->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    vary_map_header_t hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) || hdr.magic != VARY_MAP_MAGIC ||
+        hdr.version != VARY_MAP_VERSION) {
+        close(fd);
+        return;
+    }
+    /* Оборванная последняя запись (сбой во время write) просто не читается. */
+    vary_slot_t rec;
+    while (read(fd, &rec, sizeof(rec)) == (ssize_t)sizeof(rec)) {
+        rec.names[VARY_NAMES_MAX - 1] = '\0';
+        table->slots[rec.hash % VARY_SLOTS] = rec;
+    }
+    close(fd);
+}
+
+/* Файл пишется заново по таблице во временный файл и заменяет прежний переименованием. */
+static void rewrite_map(vary_table_t *table) {
+    if (table->fd >= 0) {
+        close(table->fd);
+        table->fd = -1;
+    }
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", table->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    vary_map_header_t hdr = {VARY_MAP_MAGIC, VARY_MAP_VERSION};
+    int rc = write_all(fd, &hdr, sizeof(hdr));
+    for (int i = 0; rc == 0 && i < VARY_SLOTS; i++) {
+        if (table->slots[i].names[0]) {
+            rc = write_all(fd, &table->slots[i], sizeof(table->slots[i]));
+        }
+    }
+    close(fd);
+    if (rc != 0 || rename(tmp, table->path) != 0) {
+        unlink(tmp);
+        return;
+    }
+    table->fd = open(table->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    table->appended = 0;
+}
+
+/* cache_dir — каталог, в котором лежит vary.map; без файла таблица работает только в памяти. */
+vary_table_t *vary_table_open(const char *cache_dir) {
+    vary_table_t *table = (vary_table_t *)calloc(1, sizeof(vary_table_t));
+    if (!table) {
+        return NULL;
+    }
+    table->fd = -1;
+    pthread_mutex_init(&table->mutex, NULL);
+    if (cache_dir) {
+        snprintf(table->path, sizeof(table->path), "%s/vary.map", cache_dir);
+        load_map(table);
+        for (int i = 0; i < VARY_SLOTS; i++) {
+            table->loaded += table->slots[i].names[0] != '\0';
+        }
+        rewrite_map(table);
+    }
+    return table;
+}
+
+int vary_table_lookup(vary_table_t *table, uint64_t hash, char *names, size_t names_sz) {
+    vary_slot_t *slot = &table->slots[hash % VARY_SLOTS];
+    pthread_mutex_lock(&table->mutex);
+    int found = slot->hash == hash && slot->names[0];
+    if (found) {
+        snprintf(names, names_sz, "%s", slot->names);
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return found;
+}
+
+/* В файл попадают только изменения: повтор того же Vary по URL ничего не пишет. */
+void vary_table_remember(vary_table_t *table, uint64_t hash, const char *names) {
+    vary_slot_t *slot = &table->slots[hash % VARY_SLOTS];
+    pthread_mutex_lock(&table->mutex);
+    if (slot->hash == hash && strcmp(slot->names, names) == 0) {
+        pthread_mutex_unlock(&table->mutex);
+        return;
+    }
+    slot->hash = hash;
+    memset(slot->names, 0, sizeof(slot->names));
+    snprintf(slot->names, sizeof(slot->names), "%s", names);
+    if (table->fd >= 0) {
+        if (table->appended >= VARY_SLOTS) {
+            rewrite_map(table);
+        } else if (write_all(table->fd, slot, sizeof(*slot)) == 0) {
+            table->appended++;
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+}
+
+void vary_table_close(vary_table_t *table) {
+    if (!table) {
+        return;
+    }
+    if (table->fd >= 0) {
+        close(table->fd);
+    }
+    pthread_mutex_destroy(&table->mutex);
+    free(table);
+}
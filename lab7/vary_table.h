@@ -0,0 +1,43 @@
+#ifndef VARY_TABLE_H
+#define VARY_TABLE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VARY_SLOTS 16384
+#define VARY_NAMES_MAX 128
+#define VARY_MAP_MAGIC 0x59524156u
+#define VARY_MAP_VERSION 1
+
+/* Запись таблицы и файла vary.map: хеш URL и имена заголовков из Vary через запятую. */
+typedef struct {
+    uint64_t hash;
+    char names[VARY_NAMES_MAX];
+} vary_slot_t;
+
+/*
+ * Какие заголовки перечислял Vary последний ответ по URL. Таблица в памяти
+ * с прямой адресацией по хешу URL: при коллизии запись вытесняется, и
+ * следующий запрос один раз промахивается и узнаёт Vary из ответа заново.
+ * Изменения дописываются в vary.map в каталоге кэша и читаются при запуске,
+ * поэтому после перезапуска варианты находятся без обращения к серверу.
+ * Когда в файле набирается больше записей, чем ячеек в таблице, он
+ * переписывается по таблице.
+ */
+typedef struct {
+    vary_slot_t slots[VARY_SLOTS];
+    char path[PATH_MAX];
+    int fd;
+    size_t appended;
+    size_t loaded;
+    pthread_mutex_t mutex;
+} vary_table_t;
+
+vary_table_t *vary_table_open(const char *cache_dir);
+int vary_table_lookup(vary_table_t *table, uint64_t hash, char *names, size_t names_sz);
+void vary_table_remember(vary_table_t *table, uint64_t hash, const char *names);
+void vary_table_close(vary_table_t *table);
+
+#endif
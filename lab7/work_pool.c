@@ -0,0 +1,99 @@
+#include "work_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void *worker_main(void *arg) {
+    work_pool_t *pool = (work_pool_t *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->head && !pool->shutdown) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+        if (!pool->head) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        work_item_t *item = pool->head;
+        pool->head = item->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        pool->queued--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        item->next = NULL;
+        item->fn(item);
+    }
+    return NULL;
+}
+
+work_pool_t *work_pool_create(int thread_count) {
+    if (thread_count <= 0) {
+        return NULL;
+    }
+
+    work_pool_t *pool = (work_pool_t *)calloc(1, sizeof(work_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+
+    pool->threads = (pthread_t *)calloc((size_t)thread_count, sizeof(pthread_t));
+    if (!pool->threads) {
+        work_pool_destroy(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            work_pool_destroy(pool);
+            return NULL;
+        }
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+void work_pool_submit(work_pool_t *pool, work_item_t *item) {
+    item->next = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail) {
+        pool->tail->next = item;
+    } else {
+        pool->head = item;
+    }
+    pool->tail = item;
+    pool->queued++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+size_t work_pool_queued(work_pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    size_t n = pool->queued;
+    pthread_mutex_unlock(&pool->mutex);
+    return n;
+}
+
+void work_pool_destroy(work_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->not_empty);
+    free(pool);
+}
@@ -0,0 +1,35 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Задача пула встраивается в объект-владелец (intrusive), поэтому постановка
+ * в очередь не требует выделения памяти. Владелец получает себя обратно через
+ * container_of в функции fn.
+ */
+typedef struct work_item {
+    void (*fn)(struct work_item *item);
+    struct work_item *next;
+} work_item_t;
+
+typedef struct {
+    pthread_t *threads;
+    int thread_count;
+    work_item_t *head;
+    work_item_t *tail;
+    size_t queued;
+    int shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+} work_pool_t;
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+work_pool_t *work_pool_create(int thread_count);
+void work_pool_submit(work_pool_t *pool, work_item_t *item);
+size_t work_pool_queued(work_pool_t *pool);
+void work_pool_destroy(work_pool_t *pool);
+
+#endif